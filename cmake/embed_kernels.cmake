@@ -0,0 +1,21 @@
+# Write a C++ source with the text of every kernel in KERNEL_DIR, so the
+# library does not depend on the working directory to find its kernels
+#   cmake -DKERNEL_DIR=<dir> -DOUTPUT=<file> -P embed_kernels.cmake
+file(GLOB KERNEL_FILES "${KERNEL_DIR}/*.cl")
+list(SORT KERNEL_FILES)
+
+set (CONTENT "// Generated by cmake/embed_kernels.cmake; do not edit\n\n#include \"embedded_kernels.h\"\n\n\nstatic const EmbeddedKernel embedded_kernels[] = {\n")
+foreach (KERNEL_FILE ${KERNEL_FILES})
+	get_filename_component(KERNEL_NAME "${KERNEL_FILE}" NAME)
+	file(READ "${KERNEL_FILE}" KERNEL_SOURCE)
+	string(APPEND CONTENT "\t{ \"${KERNEL_NAME}\", R\"MFFT_KERNEL(${KERNEL_SOURCE})MFFT_KERNEL\" },\n")
+endforeach ()
+string(APPEND CONTENT "\t{ nullptr, nullptr }\n};\n\n\nconst char* getEmbeddedKernelSource(const std::string& file_name)\n{\n\tfor (const EmbeddedKernel* kernel = embedded_kernels; kernel->file_name; ++kernel)\n\t{\n\t\tif (file_name == kernel->file_name) return kernel->source;\n\t}\n\treturn nullptr;\n}\n")
+
+# Keep the timestamp of an unchanged file so the library is not rebuilt
+if (EXISTS "${OUTPUT}")
+	file(READ "${OUTPUT}" OLD_CONTENT)
+endif ()
+if (NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+	file(WRITE "${OUTPUT}" "${CONTENT}")
+endif ()
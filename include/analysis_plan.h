@@ -0,0 +1,195 @@
+#ifndef _ANALYSIS_PLAN_H_
+#define _ANALYSIS_PLAN_H_
+
+#include "note_precision.h"
+#include "opencl_context.h"
+#include "opencl_mem.h"
+
+#include <future>
+#include <memory>
+#include <stddef.h>
+
+
+/*! Number of workitems of the scan_counts kernel */
+#define EVENTS_SCAN_SIZE 256
+
+
+/*! Kernels of an analysis */
+enum AnalysisKernel
+{
+	ANALYSIS_KERNEL_FFT = 0,
+	ANALYSIS_KERNEL_FFT_PCM16,
+	ANALYSIS_KERNEL_GATHER_NOTES,
+	ANALYSIS_KERNEL_ACCUMULATE_NOTES,
+	ANALYSIS_KERNEL_PACK_NOTES,
+	ANALYSIS_KERNEL_MARK_EVENTS,
+	ANALYSIS_KERNEL_COUNT_EVENTS,
+	ANALYSIS_KERNEL_SCAN_COUNTS,
+	ANALYSIS_KERNEL_WRITE_EVENTS,
+	N_ANALYSIS_KERNELS
+};
+
+
+/*! Configuration of a musical FFT which determines everything an analysis
+ *  needs besides the signal itself
+ */
+struct AnalysisPlanKey
+{
+	float data_rate;
+	float base_note_freq;
+	size_t samples_per_chunk;
+	NotePrecision note_precision;
+
+	bool operator==(const AnalysisPlanKey& other) const
+	{
+		return data_rate == other.data_rate && base_note_freq == other.base_note_freq && samples_per_chunk == other.samples_per_chunk && note_precision == other.note_precision;
+	}
+};
+
+
+/*! Immutable set of compiled kernels, lookup tables and derived sizes for one
+ *  configuration of the musical FFT
+ *
+ *  Plans are created through get(), which keeps the most recently used plans
+ *  of the process in a cache, so every MusicalFFT with the same configuration
+ *  shares one plan; the cache is safe to use from several threads
+ *
+ *  The plan holds the built programs; kernel objects carry their arguments,
+ *  so every user creates its own with createKernel()
+ */
+class AnalysisPlan
+{
+public:
+	~AnalysisPlan();
+
+	/*! Find the plan of a configuration in the cache or create it; the
+	 *  kernels compile without the lock of the cache, and callers that need
+	 *  a plan that is building wait for that build
+	 *    @param ctx: context in which the kernels and tables are created
+	 *    @param key: configuration of the analysis
+	 */
+	static std::shared_ptr<const AnalysisPlan> get(OpenCLContext* ctx, const AnalysisPlanKey& key);
+
+	/*! Find or create the plan of a configuration on a background thread, so
+	 *  its kernels compile while the caller does other work; the future
+	 *  rethrows errors of the build
+	 */
+	static std::shared_future<std::shared_ptr<const AnalysisPlan> > prepare(OpenCLContext* ctx, const AnalysisPlanKey& key);
+
+	/*! Set the number of plans kept in the cache; the least recently used
+	 *  plans are dropped first, but stay alive while they are in use
+	 */
+	static void setCacheCapacity(const size_t capacity);
+
+	/*! Drop every plan from the cache */
+	static void clearCache();
+
+	/*! Number of plans in the cache */
+	static size_t getCacheSize();
+
+	/*! Round a buffer size up to its size class; sizes within a class share a
+	 *  buffer, so inputs of slightly different lengths do not reallocate, and
+	 *  a class is at most 25% larger than the size
+	 */
+	static size_t getSizeClass(const size_t size);
+
+	/*! Bytes of local memory a workgroup of the musical_fft kernels needs
+	 *    @param fft_radix: radix of the butterfly passes
+	 *    @param samples_per_chunk_window: see getSamplesPerChunkWindow()
+	 *    @param pcm16: whether the 16-bit samples of a channel are staged too
+	 */
+	static size_t getFftLocalMemorySize(const uint32_t fft_radix, const size_t samples_per_chunk_window, const bool pcm16);
+
+	/*! Choose the radix of the musical_fft kernels: FFT_RADIX if both kernels
+	 *  fit into the local memory, else radix 2, which needs one FFT buffer
+	 *  instead of two; throws if not even the radix-2 kernel of floats fits,
+	 *  the kernel of 16-bit samples may still not fit at radix 2
+	 *    @param local_memory_size: bytes of local memory of the devices
+	 */
+	static uint32_t chooseFftRadix(const size_t samples_per_chunk_window, const size_t local_memory_size);
+
+	/*! Whether the plan of a configuration can analyze 16-bit samples, i.e.
+	 *  whether the musical_fft_pcm16 kernel fits into the local memory of the
+	 *  devices; answered without building the plan
+	 */
+	static bool supportsPcm16(OpenCLContext* ctx, const AnalysisPlanKey& key);
+
+	const AnalysisPlanKey& getKey() const
+	{
+		return key;
+	}
+
+	/*! Number of samples of the wavelength of the lowest note */
+	float getSamplesPerBaseNote() const
+	{
+		return samples_per_base_note;
+	}
+
+	/*! Number of samples each chunk copies to local memory */
+	size_t getSamplesPerChunkWindow() const
+	{
+		return samples_per_chunk_window;
+	}
+
+	/*! Radix the musical_fft kernels were built with; the workgroups have
+	 *  FFT_SIZE / radix workitems
+	 */
+	uint32_t getFftRadix() const
+	{
+		return fft_radix;
+	}
+
+	/*! Whether the musical_fft_pcm16 kernel was built; it is left out if it
+	 *  does not fit into the local memory of the devices, see supportsPcm16()
+	 */
+	bool hasPcm16Kernel() const
+	{
+		return pcm16_supported;
+	}
+
+	/*! Number of chunks that can be analyzed in a signal; 0 if the signal is
+	 *  too short for a single chunk
+	 */
+	size_t getNumChunks(const size_t n_signal) const;
+
+	/*! Set the lookup tables as the arguments of the musical_fft kernels
+	 *    @param note_table_index: argument index of the table of notes
+	 *    @param twiddle_table_index: argument index of the table of twiddle
+	 *                                factors
+	 */
+	void setTablesAsKernelArguments(cl_kernel kernel, const uint32_t note_table_index, const uint32_t twiddle_table_index) const;
+
+	/*! Create a kernel object of the plan for the exclusive use of the caller,
+	 *  who releases it with clReleaseKernel
+	 */
+	cl_kernel createKernel(const AnalysisKernel kernel) const;
+
+protected:
+	AnalysisPlan(OpenCLContext* ctx, const AnalysisPlanKey& key);
+
+	AnalysisPlan(const AnalysisPlan&) = delete;
+	AnalysisPlan& operator=(const AnalysisPlan&) = delete;
+
+	/*! Smallest local memory of the devices of a context, in bytes */
+	static size_t getLocalMemorySize(OpenCLContext* ctx);
+
+protected:
+	OpenCLContext* ctx;
+	AnalysisPlanKey key;
+
+	float samples_per_base_note;
+	size_t samples_per_chunk_window;
+	uint32_t fft_radix;
+	bool pcm16_supported;
+
+	// Per note: the spacing of the interpolated samples and the offset added
+	// to them; the twiddle factors of the largest FFT stage
+	OpenCLWriteOnlyMemory* note_table_mem;
+	OpenCLWriteOnlyMemory* twiddle_table_mem;
+
+	// Program of each kernel; kernels of the same source share a program
+	cl_program programs[N_ANALYSIS_KERNELS];
+};
+
+
+#endif
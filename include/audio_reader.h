@@ -0,0 +1,73 @@
+#ifndef _AUDIO_READER_H_
+#define _AUDIO_READER_H_
+
+#include <math.h>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Reads the samples of an audio file in order, channel by channel */
+class AudioReader
+{
+public:
+	virtual ~AudioReader() {}
+
+	/*! Open a WAV or FLAC file, recognized by its contents */
+	static std::unique_ptr<AudioReader> open(const std::string& fname);
+
+	virtual float getSampleRate() const = 0;
+
+	virtual float getNumChannels() const = 0;
+
+	virtual size_t getNumSamplesRemaining() const = 0;
+
+	/*! Resolution of the samples in the file; readRawSamples() is exact for
+	 *  at most 16 bits
+	 */
+	virtual uint32_t getBitsPerSample() const = 0;
+
+	size_t readSeconds(const float seconds, const std::vector<float*> outputs)
+	{
+		return readSamples((size_t)floor(seconds * getSampleRate()), outputs);
+	}
+
+	/*! Read samples as floats in [-1, 1)
+	 *    @param outputs: a buffer of n_samples per channel
+	 *    @return number of samples read per channel
+	 */
+	virtual size_t readSamples(const size_t n_samples, const std::vector<float*> outputs) = 0;
+
+	/*! Read samples as 16-bit integers
+	 *    @param output: buffer for n_samples * getNumChannels() interleaved
+	 *                   16-bit samples
+	 *    @return number of samples read per channel
+	 */
+	virtual size_t readRawSamples(const size_t n_samples, int16_t* output) = 0;
+
+	/*! Read a weighted mix of the channels as floats, converted and mixed in
+	 *  one pass where the reader supports it
+	 *    @param weights: weight of each channel
+	 *    @param output: a buffer of n_samples
+	 *    @return number of samples read
+	 */
+	virtual size_t readMixedSamples(const size_t n_samples, const std::vector<float>& weights, float* output);
+
+	/*! Weighted sum of channels of n_samples each */
+	static void mixChannels(const size_t n_samples, const std::vector<float*>& inputs, const std::vector<float>& weights, float* output);
+
+	size_t skipSeconds(const float seconds)
+	{
+		return skipSamples((size_t)floor(seconds * getSampleRate()));
+	}
+
+	/*! Move ahead without reading
+	 *    @return number of samples skipped per channel
+	 */
+	virtual size_t skipSamples(const size_t n_samples) = 0;
+};
+
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _DECIMATOR_H_
+#define _DECIMATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+/*! Polyphase decimation of interleaved 16-bit PCM by an integer factor
+ *
+ *  Each output sample is a dot product of the anti-aliasing filter with the
+ *  input history, computed only for every factor-th input sample and
+ *  vectorized along the filter taps; converting the input to floats happens
+ *  in the same pass that deinterleaves it into the filter history
+ *
+ *  The filter is linear-phase and its delay is compensated, so output sample
+ *  j corresponds to input sample j * factor; the output of a stream has
+ *  ceil(n_input / factor) samples once flush() is called
+ */
+class Decimator
+{
+public:
+	/*! @param factor: decimation factor
+	 *  @param n_channels: number of interleaved channels in the input
+	 */
+	Decimator(const size_t factor, const size_t n_channels);
+
+	/*! Choose the largest decimation factor that keeps every analyzed note
+	 *  below the passband edge of the filter, divides the sample rate and
+	 *  divides the spacing of chunks
+	 *    @param sample_rate: sample rate of the input
+	 *    @param base_note_freq: frequency of the lowest analyzed note
+	 *    @param samples_per_chunk: spacing between chunks at the input rate
+	 */
+	static size_t chooseFactor(const uint32_t sample_rate, const float base_note_freq, const size_t samples_per_chunk);
+
+	size_t getFactor() const
+	{
+		return factor;
+	}
+
+	/*! Convert, filter and decimate interleaved frames
+	 *    @param input: n_frames * n_channels interleaved samples
+	 *    @param outputs: one buffer per channel with room for
+	 *                    getMaxOutputSamples(n_frames) samples
+	 *    @return number of samples written to each output
+	 */
+	size_t process(const int16_t* input, const size_t n_frames, const std::vector<float*>& outputs);
+
+	/*! Number of frames before the start of a stream that the filter reads;
+	 *  see prime()
+	 */
+	size_t getNumPrimingFrames() const
+	{
+		return delay + taps.size() - (2 * delay + 1);
+	}
+
+	/*! Fill the filter history with the frames that precede the stream, so a
+	 *  stream that starts partway through a recording produces the same
+	 *  samples as one that reads the recording from its beginning; must be
+	 *  called before process()
+	 *    @param input: n_frames * n_channels interleaved samples; at most
+	 *                  getNumPrimingFrames() frames, with zeros before them
+	 */
+	void prime(const int16_t* input, const size_t n_frames);
+
+	/*! Produce the remaining samples at the end of the stream */
+	size_t flush(const std::vector<float*>& outputs);
+
+	/*! Upper bound for the number of samples produced by process() or flush() */
+	size_t getMaxOutputSamples(const size_t n_frames) const;
+
+protected:
+	/*! Compute all outputs for which the history is complete */
+	size_t filter(const std::vector<float*>& outputs);
+
+protected:
+	size_t factor;
+	size_t n_channels;
+
+	// Reversed filter coefficients, padded at the front to a multiple of the
+	// SIMD width
+	std::vector<float> taps;
+	size_t delay;
+
+	// Filter input of each channel; next_start is the history index of the
+	// first sample of the next output's dot product
+	std::vector<std::vector<float> > history;
+	size_t next_start;
+};
+
+
+#endif
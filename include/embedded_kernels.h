@@ -0,0 +1,23 @@
+#ifndef _EMBEDDED_KERNELS_H_
+#define _EMBEDDED_KERNELS_H_
+
+#include <string>
+
+
+/*! Source of a kernel compiled into the library */
+struct EmbeddedKernel
+{
+	const char* file_name;
+	const char* source;
+};
+
+
+/*! Source of a file of kernels/ as it was at build time
+ *    @param file_name: name of the file without its directory, e.g.
+ *                      "musical_fft.cl"
+ *    @return nullptr if the file was not embedded
+ */
+const char* getEmbeddedKernelSource(const std::string& file_name);
+
+
+#endif
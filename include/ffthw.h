@@ -1,22 +1,63 @@
-#ifndef _FFTSW_H_
-#define _FFTSW_H_
+#ifndef _FFTHW_H_
+#define _FFTHW_H_
 
+#include "analysis_plan.h"
+#include "note_event.h"
+#include "note_layout.h"
+#include "note_precision.h"
 #include "opencl_context.h"
 #include "opencl_mem.h"
 
 #include <math.h>
 #include <iostream>
+#include <memory>
 #include <string.h>
 #include <vector>
 
 #define N_STAGES 10
 #define FFT_SIZE (1 << N_STAGES)
+#define N_NOTES_PER_CHUNK (12 * (N_STAGES - 1))
 
+// Radix of the butterfly passes of the musical_fft kernel; radix 4 keeps four
+// points per workitem in registers and needs a quarter of the barriers, but
+// requires an even number of stages
+#ifndef FFT_RADIX
+#define FFT_RADIX 4
+#endif
+#if FFT_RADIX != 2 && (FFT_RADIX != 4 || N_STAGES % 2 != 0)
+#error "FFT_RADIX must be 2, or 4 with an even N_STAGES"
+#endif
 
+
+/*! Part of the complete output of a musical FFT */
+struct SpectrumRange
+{
+	size_t chunk_begin;
+	size_t n_chunks;
+	size_t note_begin;
+	size_t n_notes;
+	size_t overtone_begin;
+	size_t n_overtones;
+};
+
+
+/*! Musical FFT of signals and the notes derived from it
+ *
+ *  An instance is used by one thread at a time; it launches its work on its
+ *  own command queue with its own kernel objects, so instances on different
+ *  threads can keep a device busy concurrently; the plans of configurations
+ *  are shared between all instances
+ */
 class MusicalFFT
 {
 public:
-	MusicalFFT(OpenCLContext* ctx);
+	/*! @param ctx: context whose device runs the analysis
+	 *  @param out_of_order: whether to use an out-of-order queue; all work is
+	 *                       ordered with events either way
+	 *  @param device_index: index of the device (or CPU partition) in the
+	 *                       context
+	 */
+	MusicalFFT(OpenCLContext* ctx, const bool out_of_order = false, const size_t device_index = 0);
 
 	~MusicalFFT();
 
@@ -30,23 +71,278 @@ public:
 	 */
 	size_t runFFT(const float data_rate, const size_t n_signal, const float* signal, const size_t samples_per_chunk, const float base_note_freq);
 
+	/*! Run a musical FFT on raw interleaved 16-bit samples, which are
+	 *  uploaded as they are and converted on the device, so half as many
+	 *  bytes are transferred as for floats
+	 *    @param n_frames: number of samples per channel
+	 *    @param samples: n_frames * n_channels interleaved samples
+	 *    @param channel_weights: weight of each channel in the analyzed mix;
+	 *                            samples are scaled to [-1, 1) before
+	 *                            weighting, like the floats of an AudioReader
+	 */
+	size_t runFFT(const float data_rate, const size_t n_frames, const int16_t* samples, const size_t n_channels, const float* channel_weights, const size_t samples_per_chunk, const float base_note_freq);
+
+	/*! Append samples to the signal history of a channel on the device; only
+	 *  the new samples are transferred, the history is kept in a ring buffer
+	 *  that grows when needed
+	 *    @param channel: index of the channel; histories are independent
+	 */
+	void appendSignal(const size_t channel, const size_t n_samples, const float* samples);
+
+	/*! Append raw interleaved 16-bit frames to the raw signal history, which
+	 *  keeps all channels in one ring buffer; only the new frames are
+	 *  transferred, without a conversion on the host
+	 *    @param n_channels: samples per frame; the same for every call until
+	 *                       resetHistory()
+	 */
+	void appendRawSignal(const size_t n_frames, const int16_t* samples, const size_t n_channels);
+
+	/*! Run a musical FFT on a mix of the channels of the raw signal history
+	 *    @param channel_weights: weight of each channel, as for runFFT()
+	 *    @param consume: whether to drop the analyzed frames from the
+	 *                    history like runFFTOnHistory(); several mixes of the
+	 *                    same frames are analyzed by consuming only with the
+	 *                    last one
+	 */
+	size_t runFFTOnRawHistory(const float* channel_weights, const float data_rate, const size_t samples_per_chunk, const float base_note_freq, const bool consume = true);
+
+	/*! Whether raw 16-bit samples can be analyzed with a configuration; the
+	 *  kernel that stages them may not fit into the local memory of the
+	 *  device for a low note at a high rate, the samples are then converted
+	 *  to floats on the host; does not wait for the plan to be built
+	 */
+	bool supportsRawSignal(const float data_rate, const size_t samples_per_chunk, const float base_note_freq);
+
+	/*! Number of frames in the raw signal history */
+	size_t getRawHistorySize() const
+	{
+		return raw_history.n_samples;
+	}
+
+	/*! Run a musical FFT on the signal history of a channel, like runFFT();
+	 *  the samples before the first chunk that was not analyzed are dropped
+	 *  from the history, so the next call continues where this one ended
+	 */
+	size_t runFFTOnHistory(const size_t channel, const float data_rate, const size_t samples_per_chunk, const float base_note_freq);
+
+	/*! Number of samples in the signal history of a channel */
+	size_t getHistorySize(const size_t channel) const
+	{
+		return channel < histories.size() ? histories[channel].n_samples : 0;
+	}
+
+	/*! Drop the signal history of every channel and the raw history */
+	void resetHistory();
+
 	const float* readComplete(size_t* n_chunks, size_t* n_overtones_per_note);
 
+	/*! Transfer the complete output of the last FFT straight into a buffer
+	 *  of the caller
+	 *    @param n_output: number of floats in the output; at least
+	 *                     getNumChunks() * 12 * FFT_SIZE / 2
+	 */
+	bool readCompleteTo(float* output, const size_t n_output);
+
+	/*! Transfer only a range of chunks, notes and overtones of the complete
+	 *  output of the last FFT into a buffer of the caller
+	 *    @param range: chunks in [0, getNumChunks()), notes in [0, 12) and
+	 *                  overtones in [0, FFT_SIZE / 2)
+	 *    @param n_output: number of floats in the output
+	 *    @param note_pitch: floats between the notes of a chunk in the
+	 *                       output; 0 for range.n_overtones
+	 *    @param chunk_pitch: floats between the chunks in the output; 0 for
+	 *                        range.n_notes * note_pitch
+	 */
+	bool readCompleteRangeTo(const SpectrumRange& range, float* output, const size_t n_output, size_t note_pitch = 0, size_t chunk_pitch = 0);
+
+	/*! Gather the power of each note from the last FFT; the values are
+	 *  widened to 32-bit floats on the host if a narrower note precision is
+	 *  selected
+	 */
 	const float* readNotes(size_t* n_chunks, size_t* n_notes);
 
+	/*! Gather the power of each note from the last FFT (or the accumulated
+	 *  notes, if accumulateNotes() was called) in the selected note precision;
+	 *  the conversion happens on the device, so only the narrow values are
+	 *  transferred
+	 *    @return n_chunks * n_notes values of getNotePrecisionSize() bytes in
+	 *            the selected layout
+	 */
+	const uint8_t* readNotesPacked(size_t* n_chunks, size_t* n_notes);
+
+	/*! Like readNotesPacked(), but transfer the notes straight into a buffer
+	 *  of the caller
+	 *    @param n_output: size of the output in bytes; at least getNumChunks()
+	 *                     * N_NOTES_PER_CHUNK * getNotePrecisionSize()
+	 */
+	bool readNotesPackedTo(uint8_t* output, const size_t n_output);
+
+	/*! Add the power of each note from the last FFT, multiplied by weight, to
+	 *  a device-side running sum; the sum is consumed by the next call to
+	 *  readNotes() or readNotesPacked()
+	 */
+	void accumulateNotes(const float weight);
+
+	/*! Detect note on/off events in the notes of the last FFT (or the
+	 *  accumulated notes) on the device; only the compacted list of events is
+	 *  transferred to the host
+	 *    @param thresholds: parameters of the detection
+	 *    @param n_events: output for the number of events
+	 *    @return events ordered by chunk and note; chunk indices count from the
+	 *            first chunk since construction or resetNoteEvents()
+	 */
+	const NoteEvent* readNoteEvents(const NoteEventThresholds& thresholds, size_t* n_events);
+
+	/*! Forget the state of all notes and restart chunk indices of events */
+	void resetNoteEvents();
+
+	/*! Copy the state of the event detection of every note, which carries
+	 *  over from one call of readNoteEvents() to the next
+	 *    @param output: N_NOTES_PER_CHUNK * 2 floats
+	 */
+	void readNoteEventState(float* output);
+
+	/*! Continue the event detection of another instance from its state
+	 *    @param state: N_NOTES_PER_CHUNK * 2 floats from readNoteEventState()
+	 *    @param chunk_offset: index of the next chunk in the events
+	 */
+	void writeNoteEventState(const float* state, const size_t chunk_offset);
+
+	/*! Start building the plan of a configuration on a background thread, so
+	 *  the first runFFT() with it does not wait for the kernels to compile;
+	 *  the signal can be read or decoded in the meantime; the plan is for the
+	 *  current note precision, and errors of its build are thrown by the
+	 *  first runFFT() with the configuration
+	 */
+	void warmUp(const float data_rate, const size_t samples_per_chunk, const float base_note_freq);
+
+	/*! Select the format in which notes are produced by readNotesPacked() */
+	void setNotePrecision(const NotePrecision precision);
+
+	NotePrecision getNotePrecision() const
+	{
+		return note_precision;
+	}
+
+	/*! Select the arrangement in which readNotes() and readNotesPacked()
+	 *  produce the notes of the chunks of the last FFT; the layout is applied
+	 *  on the device, so no transpose is needed on the host
+	 */
+	void setNoteLayout(const NoteLayout layout)
+	{
+		note_layout = layout;
+	}
+
+	NoteLayout getNoteLayout() const
+	{
+		return note_layout;
+	}
+
+	/*! Number of chunks of the last FFT */
+	size_t getNumChunks() const
+	{
+		return n_chunks;
+	}
+
 protected:
+	/*! Signal history in a ring buffer on the device; samples of one channel
+	 *  or interleaved frames of all channels
+	 */
+	struct SignalHistory
+	{
+		OpenCLWriteOnlyMemory* mem;
+		size_t capacity;
+		size_t start;
+		size_t n_samples;
+	};
+
 	static void waitForEvent(cl_event* event);
 
+	/*! Execute a one-dimensional kernel and wait for completion
+	 *    @param n_workitems: global work size
+	 *    @param workgroup_size: local work size; 0 lets the runtime choose
+	 */
+	void runKernel(cl_kernel kernel, const size_t n_workitems, const size_t workgroup_size = 0);
+
+	/*! Convert the notes of the last FFT (or the accumulated notes) into the
+	 *  output buffer on the device
+	 *    @return size of the notes in bytes; 0 if there is no FFT
+	 */
+	size_t convertNotes();
+
+	/*! Run the musical_fft kernel on a ring buffer of samples, or the
+	 *  musical_fft_pcm16 kernel on a ring buffer of interleaved 16-bit frames
+	 *    @param signal_start: index of the first sample in the ring buffer
+	 *    @param n_signal: number of samples from the first sample on
+	 *    @param ring_size: number of samples in the ring buffer
+	 *    @param channel_weights: weight of each of n_channels channels of 16-
+	 *                            bit frames; nullptr for a signal of floats
+	 */
+	size_t launchFFT(OpenCLWriteOnlyMemory* signal_mem, const size_t signal_start, const size_t n_signal, const size_t ring_size, const size_t samples_per_chunk, const float* channel_weights = nullptr, const size_t n_channels = 1);
+
+	/*! Append frames of frame_size bytes to a ring buffer on the device */
+	void appendToHistory(SignalHistory& history, const size_t n_frames, const uint8_t* frames, const size_t frame_size);
+
+	/*! Drop the analyzed frames from the beginning of a history */
+	void consumeHistory(SignalHistory& history, const size_t n_new_chunks, const size_t samples_per_chunk);
+
+	/*! Create the state of the event detection with every note inactive
+	 *  unless it exists
+	 */
+	void prepareEventState();
+
+	/*! Switch to the shared plan of a configuration unless it is in use */
+	void selectPlan(const AnalysisPlanKey& key);
+
+	/*! Kernel object of this instance from the current plan */
+	cl_kernel getKernel(const AnalysisKernel kernel);
+
+	void releaseKernels();
+
 protected:
 	OpenCLContext* ctx;
+	OpenCLDevice* device;
+	cl_command_queue cmdq;
+
+	// Programs, tables and sizes of the current configuration; kernel objects
+	// are created from the plan for this instance only
+	std::shared_ptr<const AnalysisPlan> plan;
+	cl_kernel kernels[N_ANALYSIS_KERNELS];
+
+	// Plan being built by warmUp(); taken by the first selectPlan() of its
+	// configuration
+	AnalysisPlanKey warm_up_key;
+	std::shared_future<std::shared_ptr<const AnalysisPlan> > warm_up_plan;
 
-	cl_kernel fft_kernel;
 	cl_event fft_kernel_done;
 	OpenCLWriteOnlyMemory* fft_input_mem;
 	OpenCLReadOnlyMemory* fft_output_mem;
+	std::vector<SignalHistory> histories;
+
+	// Interleaved 16-bit input of the last raw FFT, the raw signal history
+	// with its number of channels, and the channel weights of the last raw
+	// FFT
+	OpenCLWriteOnlyMemory* fft_raw_input_mem;
+	SignalHistory raw_history;
+	size_t raw_history_channels;
+	OpenCLWriteOnlyMemory* channel_weights_mem;
 
-	cl_kernel notes_kernel;
 	OpenCLReadOnlyMemory* notes_output_mem;
+	OpenCLKernelMemory* notes_accumulator_mem;
+	bool notes_accumulated;
+
+	NotePrecision note_precision;
+	NoteLayout note_layout;
+	std::vector<float> widened_notes;
+
+	OpenCLReadWriteMemory* event_state_mem;
+	OpenCLKernelMemory* event_flags_mem;
+	OpenCLKernelMemory* event_counts_mem;
+	OpenCLKernelMemory* event_offsets_mem;
+	OpenCLReadOnlyMemory* event_count_mem;
+	OpenCLReadOnlyMemory* event_list_mem;
+	size_t event_chunk_offset;
+	std::vector<NoteEvent> events;
 
 	size_t n_chunks;
 };
@@ -2,6 +2,8 @@
 #define _FFTSW_H_
 
 #include <complex>
+#include <stddef.h>
+#include <stdint.h>
 
 
 /*! Complex numbers */
@@ -16,6 +18,22 @@ typedef std::complex<float> complex_t;
 void fft_sw(const float* data, const uint32_t n_samples, complex_t* output);
 
 
+/*! Compute the Fourier Transforms of many signals of the same size at once
+ *
+ *  Signals are stored as structure of arrays, so the same sample of
+ *  consecutive signals lies in consecutive elements, and each SIMD lane runs
+ *  the butterflies of another signal. Blocks of two SIMD vectors of signals,
+ *  8 with SSE, are split among threads. Every signal gets the same coefficients as from fft_sw
+ *    @param data: sample i of signal s in data[i * n_signals + s]
+ *    @param n_samples: a power of 2; the number of samples of each signal
+ *    @param n_signals: number of signals
+ *    @param output: coefficient k of signal s in output[k * n_signals + s],
+ *                   for n_samples / 2 coefficients
+ *    @param n_threads: 0 to use one thread per hardware thread
+ */
+void fft_sw_batch(const float* data, const uint32_t n_samples, const size_t n_signals, complex_t* output, const size_t n_threads = 0);
+
+
 /*! Compute the Fourier Transform of a signal using a naive DFT implementation
  *    @param data: raw data in the time domain
  *    @param n_samples: a power of 2; the number of elements in data
@@ -0,0 +1,149 @@
+#ifndef _FLAC_H_
+#define _FLAC_H_
+
+#include "audio_reader.h"
+
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Entry of a seek table: the first sample of a frame and the offset of the
+ *  frame from the first frame of the file
+ */
+struct FlacSeekPoint
+{
+	uint64_t sample;
+	uint64_t offset;
+};
+
+
+/*! FLAC file decoded without external libraries
+ *
+ *  Compressed data is read in large blocks; the frames of a block are located
+ *  by their headers and checksums and then decoded on several threads at
+ *  once. Skipping jumps through the seek table if the file has one and only
+ *  parses the headers of the frames it passes otherwise
+ *
+ *  Samples of up to 24 bits are supported
+ */
+class FlacFile : public AudioReader
+{
+public:
+	/*! @param n_threads: number of threads that decode frames; 0 uses one per
+	 *                    hardware thread
+	 */
+	FlacFile(const std::string& fname, const size_t n_threads = 0);
+
+	float getSampleRate() const override
+	{
+		return (float)sample_rate;
+	}
+
+	float getNumChannels() const override
+	{
+		return n_channels;
+	}
+
+	/*! Samples per channel left to read; if the file does not state its
+	 *  length, only the samples that are already decoded
+	 */
+	size_t getNumSamplesRemaining() const override;
+
+	uint32_t getBitsPerSample() const override
+	{
+		return bits_per_sample;
+	}
+
+	size_t getNumSeekPoints() const
+	{
+		return seek_points.size();
+	}
+
+	size_t readSamples(const size_t n_samples, const std::vector<float*> outputs) override;
+
+	/*! Convert and mix the decoded channels in one pass */
+	size_t readMixedSamples(const size_t n_samples, const std::vector<float>& weights, float* output) override;
+
+	/*! Read samples scaled to 16 bits
+	 *    @param output: buffer for n_samples * getNumChannels() interleaved
+	 *                   16-bit samples
+	 *    @return number of samples read per channel
+	 */
+	size_t readRawSamples(const size_t n_samples, int16_t* output) override;
+
+	size_t skipSamples(const size_t n_samples) override;
+
+protected:
+	/*! Frame located in the compressed data */
+	struct Frame
+	{
+		size_t offset;
+		size_t size;
+		size_t header_size;
+		uint64_t first_sample;
+		uint32_t block_size;
+		uint32_t channel_assignment;
+		uint32_t bits_per_sample;
+	};
+
+	/*! Parse the header of a frame that starts at an offset of the compressed
+	 *  data
+	 *    @param first_sample: sample at which the frame must start
+	 *    @return false if there is no complete, valid header at the offset
+	 */
+	bool parseFrameHeader(const size_t offset, const uint64_t first_sample, Frame* frame) const;
+
+	/*! Read compressed data until the next frames are complete and decode
+	 *  them; frames that end before the position are located but not decoded
+	 *    @return false at the end of the file
+	 */
+	bool decodeNextFrames();
+
+	/*! Decode a located frame
+	 *    @param outputs: a buffer of frame.block_size samples per channel
+	 */
+	void decodeFrame(const Frame& frame, int32_t* const* outputs) const;
+
+	/*! Jump to the last seek point at or before a sample if it lies beyond
+	 *  the located frames
+	 */
+	void seek(const uint64_t sample);
+
+	/*! Sample after the last decoded sample */
+	uint64_t getDecodedEnd() const
+	{
+		return decoded_first_sample + (decoded.empty() ? 0 : decoded[0].size());
+	}
+
+protected:
+	uint32_t sample_rate;
+	uint32_t n_channels;
+	uint32_t bits_per_sample;
+	uint32_t max_block_size;
+
+	// 0 if the length is unknown
+	uint64_t n_total_samples;
+
+	std::vector<FlacSeekPoint> seek_points;
+	size_t n_threads;
+
+	std::ifstream ist;
+	uint64_t first_frame_offset;
+	bool end_of_file;
+
+	// Compressed data from the start of the first frame not located yet
+	std::vector<uint8_t> compressed;
+	uint64_t compressed_first_sample;
+
+	// Samples per channel of the last decoded frames
+	std::vector<std::vector<int32_t> > decoded;
+	uint64_t decoded_first_sample;
+
+	// Next sample to read
+	uint64_t position;
+};
+
+
+#endif
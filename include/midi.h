@@ -1,35 +1,110 @@
 #ifndef _MIDI_H_
 #define _MIDI_H_
 
-#include <fstream>
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
 
 
+/*! Standard MIDI file of format 0, 1 or 2
+ *
+ *  All tracks are merged into a single list of note messages ordered by time;
+ *  the tracks of a format 2 file are independent sequences and are placed one
+ *  after another; tempo changes of all tracks form a tempo map which converts
+ *  ticks to seconds
+ */
 class MidiFile
 {
 public:
+	struct NoteMessage
+	{
+		uint64_t abs_time;
+		uint8_t note;
+		bool is_note_on;
+		uint8_t velocity;
+		uint8_t channel;
+		uint16_t track;
+	};
+
+	/*! Segment of the tempo map starting at a tick */
+	struct TempoSegment
+	{
+		uint64_t abs_time;
+		double seconds;
+		double seconds_per_tick;
+	};
+
+public:
+	/*! Parse a file; the file is memory-mapped while it is parsed */
 	MidiFile(const std::string& fname);
 
-protected:
-	uint8_t read8();
-	uint16_t read16be();
-	uint32_t read32be();
-	uint32_t readVarInt();
+	/*! Parse a file that is already in memory */
+	MidiFile(const uint8_t* data, const size_t size);
 
-protected:
-	std::ifstream ist;
-	int64_t data_bytes_remaining;
+	/*! Note messages ordered by time */
+	const std::vector<NoteMessage>& getMessages() const
+	{
+		return msgs;
+	}
 
-	struct NoteMessage
+	const std::vector<TempoSegment>& getTempoMap() const
+	{
+		return tempo_map;
+	}
+
+	uint16_t getFormat() const
+	{
+		return format;
+	}
+
+	uint16_t getNumTracks() const
+	{
+		return n_tracks;
+	}
+
+	uint16_t getDivision() const
+	{
+		return division;
+	}
+
+	/*! Convert an absolute time in ticks to seconds using the tempo map */
+	double ticksToSeconds(const uint64_t ticks) const;
+
+protected:
+	struct TempoChange
 	{
 		uint64_t abs_time;
-		uint8_t note;
-		bool is_note_on;
+		uint32_t microseconds_per_beat;
 	};
+
+	void parse(const uint8_t* data, const size_t size);
+
+	/*! Parse the events of a track
+	 *    @param time_offset: absolute time of the beginning of the track
+	 *    @param track_msgs: output for the note messages, ordered by time
+	 *    @param tempos: output for tempo changes
+	 *    @return absolute time of the end of the track
+	 */
+	uint64_t parseTrack(const uint8_t* begin, const uint8_t* end, const uint16_t track_index, const uint64_t time_offset, std::vector<NoteMessage>& track_msgs, std::vector<TempoChange>& tempos);
+
+	/*! Merge the ordered messages of all tracks */
+	void mergeTracks(const std::vector<std::vector<NoteMessage> >& track_msgs);
+
+	void buildTempoMap(std::vector<TempoChange>& tempos);
+
+	static uint8_t read8(const uint8_t*& ptr, const uint8_t* end);
+	static uint16_t read16be(const uint8_t*& ptr, const uint8_t* end);
+	static uint32_t read32be(const uint8_t*& ptr, const uint8_t* end);
+	static uint32_t readVarInt(const uint8_t*& ptr, const uint8_t* end);
+
+protected:
+	uint16_t format;
+	uint16_t n_tracks;
+	uint16_t division;
 	std::vector<NoteMessage> msgs;
+	std::vector<TempoSegment> tempo_map;
 };
 
 
-#endif
\ No newline at end of file
+#endif
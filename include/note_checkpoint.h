@@ -0,0 +1,115 @@
+#ifndef _NOTE_CHECKPOINT_H_
+#define _NOTE_CHECKPOINT_H_
+
+#include "note_sink.h"
+
+#include <fstream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Keeps the progress of an analysis in a file, so an analysis that stops
+ *  partway through continues from its last checkpoint instead of starting
+ *  over
+ *
+ *  As a sink, it passes every block on to the sink of the analysis and
+ *  appends it to the file; commit() marks the blocks so far as complete,
+ *  along with the state that the analysis carries over to the next chunks.
+ *  Every commit ends with a checksum, so blocks after the last complete
+ *  commit, such as those of a process that was killed while writing, are
+ *  dropped when the file is opened again
+ *
+ *  The file starts with a key that describes the input and the configuration
+ *  of the analysis; a file with another key is started over. Everything is in
+ *  the byte order of the host
+ */
+class NoteCheckpoint : public NoteSink
+{
+public:
+	/*! @param fname: file of the checkpoint; created if it does not exist
+	 *  @param key: description of the input and configuration
+	 *  @param sink: sink of the analysis
+	 *  @param n_chunks_per_commit: chunks between commits; 0 to commit after
+	 *                              every block
+	 */
+	NoteCheckpoint(const std::string& fname, const std::string& key, NoteSink& sink, const size_t n_chunks_per_commit = 0);
+
+	/*! Identify the contents of a file for a key: its size and a checksum
+	 *  of its first and last FILE_IDENTITY_BLOCK_SIZE bytes, which cover the
+	 *  header and the first and last blocks of the data without reading the
+	 *  whole file
+	 */
+	static std::string getFileIdentity(const std::string& fname);
+
+	NoteLayout getPreferredLayout() const override
+	{
+		return sink.getPreferredLayout();
+	}
+
+	/*! Begin the stream of the sink and pass it the committed blocks of the
+	 *  file, if the file has the same key; the analysis continues after
+	 *  getNumChunksComplete() chunks
+	 */
+	void begin(const NoteStreamInfo& info) override;
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override;
+
+	void writeEvents(const NoteEvent* events, const size_t n_events) override;
+
+	void end() override;
+
+	/*! Number of chunks of the last commit */
+	size_t getNumChunksComplete() const
+	{
+		return n_chunks_complete;
+	}
+
+	/*! State of the analysis at the last commit */
+	const std::vector<float>& getState() const
+	{
+		return state;
+	}
+
+	/*! Whether enough chunks have been analyzed since the last commit */
+	bool isCommitDue(const size_t n_chunks) const
+	{
+		return n_chunks > n_chunks_complete && n_chunks - n_chunks_complete >= n_chunks_per_commit;
+	}
+
+	/*! Mark the blocks written so far as complete
+	 *    @param n_chunks: number of chunks analyzed so far
+	 *    @param state: state of the analysis to continue after them
+	 */
+	void commit(const size_t n_chunks, const std::vector<float>& state);
+
+protected:
+	/*! Read the file and pass its committed blocks to the sink
+	 *    @param file_key: key of the stream and the analysis
+	 *    @return size of the file up to the end of the last commit; 0 if the
+	 *            file does not exist or has another key
+	 */
+	uint64_t restore(const std::string& file_key);
+
+	/*! Append data to the file and to the checksum of the next commit */
+	void write(const void* data, const size_t size);
+
+	void writeBlockHeader(const uint32_t type, const uint32_t count, const uint64_t first_chunk_index);
+
+protected:
+	std::string fname;
+	std::string key;
+	NoteSink& sink;
+	size_t n_chunks_per_commit;
+
+	std::ofstream ost;
+	size_t note_row_size;
+	uint64_t checksum;
+
+	size_t n_chunks_complete;
+	std::vector<float> state;
+};
+
+
+#endif
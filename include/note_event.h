@@ -0,0 +1,35 @@
+#ifndef _NOTE_EVENT_H_
+#define _NOTE_EVENT_H_
+
+#include <stdint.h>
+
+
+/*! Note on/off event detected on the device; the layout matches the uint4
+ *  elements written by the write_events kernel
+ */
+struct NoteEvent
+{
+	uint32_t chunk_index;
+	uint32_t note;
+	uint32_t is_note_on;
+	float power;
+};
+
+
+/*! Parameters of the event detection
+ *
+ *  An inactive note turns on when its power reaches on_threshold and an active
+ *  note turns off when its power falls below off_threshold; using a lower
+ *  off_threshold adds hysteresis; while a note is active, a rise in power by
+ *  at least onset_ratio from one chunk to the next is reported as a new onset
+ *  (0 disables onset detection)
+ */
+struct NoteEventThresholds
+{
+	float on_threshold;
+	float off_threshold;
+	float onset_ratio;
+};
+
+
+#endif
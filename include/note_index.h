@@ -0,0 +1,256 @@
+#ifndef _NOTE_INDEX_H_
+#define _NOTE_INDEX_H_
+
+#include "note_profile.h"
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Vectors that describe a chunk of a profile in a NoteIndex */
+enum NoteIndexFeature
+{
+	// 12 pitch classes with the octaves of every note added up, starting at C
+	NOTE_INDEX_CHROMA = 0,
+
+	// Every note of the chunk; all profiles must have the same notes
+	NOTE_INDEX_NOTES
+};
+
+
+/*! Search strategies of a NoteIndex */
+enum NoteIndexMode
+{
+	// Compare the query with every vector
+	NOTE_INDEX_BRUTE_FORCE = 0,
+
+	// Compare with the vectors that share a bucket of random hyperplanes with
+	// the query in any table, or a bucket one hyperplane away
+	NOTE_INDEX_LSH,
+
+	// Compare with the vectors of the clusters closest to the query
+	NOTE_INDEX_IVF
+};
+
+
+struct NoteIndexParams
+{
+	NoteIndexFeature feature;
+
+	// Consecutive chunks concatenated into each vector, so sequences rather
+	// than single chunks are matched, and chunks between the first chunks of
+	// consecutive vectors
+	size_t shingle_size;
+	size_t shingle_step;
+
+	NoteIndexMode mode;
+
+	// Number of hash tables and hyperplanes per table of NOTE_INDEX_LSH; at
+	// most 32 hyperplanes
+	size_t n_lsh_tables;
+	size_t n_lsh_bits;
+
+	// Number of clusters of NOTE_INDEX_IVF, clusters searched per query and
+	// k-means iterations of the build
+	size_t n_ivf_lists;
+	size_t n_ivf_probes;
+	size_t n_ivf_iterations;
+
+	// Threads of the build and of batch queries; 0 to use one per hardware
+	// thread
+	size_t n_threads;
+
+	static NoteIndexParams getDefault();
+};
+
+
+/*! Vector of an index: a shingle that starts at a chunk of a profile */
+struct NoteIndexEntry
+{
+	uint32_t profile_id;
+	uint32_t chunk_index;
+};
+
+
+/*! Result of a search with the cosine similarity to the query */
+struct NoteIndexMatch
+{
+	uint32_t profile_id;
+	uint32_t chunk_index;
+	float similarity;
+};
+
+
+/*! Searchable collection of the chunks of many note profiles
+ *
+ *  Every vector is a shingle of consecutive chunks whose notes are normalized
+ *  chunk by chunk, so loud passages do not outweigh quiet ones, and then as a
+ *  whole; the dot product of two vectors is their cosine similarity. Vectors
+ *  are padded to a multiple of SIMD_MAX_WIDTH, so every comparison runs on
+ *  whole SIMD vectors and saved indices can be opened by any build
+ *
+ *  Profiles are added, then build() prepares the search structures of the
+ *  mode. A saved index is memory-mapped by open() and searched in place
+ *  without being read into memory
+ */
+class NoteIndex
+{
+public:
+	NoteIndex(const NoteIndexParams& params = NoteIndexParams::getDefault());
+
+	~NoteIndex();
+
+	NoteIndex(const NoteIndex&) = delete;
+	NoteIndex& operator=(const NoteIndex&) = delete;
+
+	/*! Map an index written by save(); the mapped index cannot be modified */
+	static std::unique_ptr<NoteIndex> open(const std::string& fname);
+
+	const NoteIndexParams& getParams() const
+	{
+		return params;
+	}
+
+	/*! Number of values of a vector without padding */
+	size_t getDimension() const
+	{
+		return dimension;
+	}
+
+	size_t getNumVectors() const
+	{
+		return n_vectors;
+	}
+
+	size_t getNumProfiles() const
+	{
+		return n_profiles;
+	}
+
+	bool isBuilt() const
+	{
+		return built;
+	}
+
+	/*! Number of clusters of the last build of NOTE_INDEX_IVF; n_ivf_lists
+	 *  of the parameters, or the number of vectors if there are fewer
+	 */
+	size_t getNumLists() const
+	{
+		return n_lists;
+	}
+
+	const NoteIndexEntry* getEntryByIndex(const size_t index) const
+	{
+		if (index >= n_vectors) return nullptr;
+		else return entries + index;
+	}
+
+	/*! Add the shingles of a profile; invalidates a previous build()
+	 *    @return id of the profile in the matches
+	 */
+	uint32_t addProfile(const NoteProfile& profile);
+
+	/*! Compute the vector of the shingle that starts at a chunk, for a query
+	 *    @param output: getPaddedDimension() values
+	 *    @return false if the shingle does not fit into the profile
+	 */
+	bool getFeatureVector(const NoteProfile& profile, const size_t chunk_index, float* output) const;
+
+	/*! Number of values of a vector with padding */
+	size_t getPaddedDimension() const
+	{
+		return stride;
+	}
+
+	/*! Prepare the hash tables or clusters of the mode on several threads */
+	void build();
+
+	/*! Find the vectors most similar to a query, most similar first
+	 *    @param query: getPaddedDimension() values of a normalized vector
+	 */
+	std::vector<NoteIndexMatch> search(const float* query, const size_t n_matches) const;
+
+	/*! Search for many queries at once, on several threads
+	 *    @param queries: n_queries vectors of getPaddedDimension() values
+	 */
+	std::vector<std::vector<NoteIndexMatch> > searchBatch(const float* queries, const size_t n_queries, const size_t n_matches) const;
+
+	/*! Write the vectors and search structures to a file in the byte order
+	 *  of the host
+	 */
+	void save(const std::string& fname) const;
+
+protected:
+	/*! Point the arrays at the storage of this index */
+	void updateViews();
+
+	/*! Sign bits of the hyperplanes of a table for a vector */
+	uint32_t getLshKey(const size_t table, const float* vector) const;
+
+	void buildLsh();
+
+	void buildIvf();
+
+	/*! Whether the ids of the hash tables and lists are vectors of the index
+	 *  and the offsets of the lists increase up to the number of vectors;
+	 *  checked once for a mapped file, which may be corrupted
+	 */
+	bool hasValidIds() const;
+
+	/*! Vectors of the index that the mode compares with a query; every
+	 *  vector if there is no build
+	 */
+	void getCandidates(const float* query, std::vector<uint32_t>* candidates) const;
+
+	/*! Search with the brute force part split among threads */
+	std::vector<NoteIndexMatch> searchWithThreads(const float* query, const size_t n_matches, const size_t n_threads) const;
+
+	/*! Number of threads for an amount of work */
+	size_t getNumThreads(const size_t n_items) const;
+
+protected:
+	NoteIndexParams params;
+	size_t dimension;
+	size_t stride;
+	size_t n_vectors;
+	size_t n_profiles;
+	bool built;
+	size_t n_lists;
+
+	// Storage of an index that is not mapped
+	std::vector<float> vector_storage;
+	std::vector<NoteIndexEntry> entry_storage;
+	std::vector<float> hyperplane_storage;
+	std::vector<uint32_t> lsh_key_storage;
+	std::vector<uint32_t> lsh_id_storage;
+	std::vector<float> centroid_storage;
+	std::vector<uint64_t> list_offset_storage;
+	std::vector<uint32_t> list_id_storage;
+
+	// Arrays of the index, in the owned storage or in a mapped file:
+	// n_vectors rows of stride values and their entries
+	const float* vectors;
+	const NoteIndexEntry* entries;
+
+	// Per table, n_lsh_bits hyperplanes of stride values and the keys of all
+	// vectors sorted with the ids of the vectors
+	const float* hyperplanes;
+	const uint32_t* lsh_keys;
+	const uint32_t* lsh_ids;
+
+	// n_lists centroids and the vectors of each list, at offsets into
+	// list_ids
+	const float* centroids;
+	const uint64_t* list_offsets;
+	const uint32_t* list_ids;
+
+	void* mapping;
+	size_t mapping_size;
+};
+
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _NOTE_LAYOUT_H_
+#define _NOTE_LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*! Number of chunks in a tile of NOTE_LAYOUT_TILED */
+#define NOTE_TILE_CHUNKS 16
+
+
+/*! Arrangements of the notes of consecutive chunks in memory */
+enum NoteLayout
+{
+	// (chunk, note): the notes of a chunk are contiguous
+	NOTE_LAYOUT_CHUNK_MAJOR = 0,
+
+	// (note, chunk): the time series of a note is contiguous
+	NOTE_LAYOUT_NOTE_MAJOR,
+
+	// (tile, note, chunk in tile): note-major within tiles of NOTE_TILE_CHUNKS
+	// chunks, so a tile of every note fits in cache; the last tile may hold
+	// fewer chunks
+	NOTE_LAYOUT_TILED
+};
+
+
+/*! Index of a note value in an array of notes; matches the layouts written by
+ *  the gather_notes kernel
+ *    @param n_chunks: number of chunks in the array
+ *    @param n_notes: number of notes per chunk
+ */
+inline size_t getNoteLayoutIndex(const NoteLayout layout, const size_t n_chunks, const size_t n_notes, const size_t chunk, const size_t note)
+{
+	if (layout == NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		return note * n_chunks + chunk;
+	}
+	else if (layout == NOTE_LAYOUT_TILED)
+	{
+		const size_t tile_begin = chunk - chunk % NOTE_TILE_CHUNKS;
+		const size_t tile_size = n_chunks - tile_begin < NOTE_TILE_CHUNKS ? n_chunks - tile_begin : NOTE_TILE_CHUNKS;
+		return tile_begin * n_notes + note * tile_size + chunk - tile_begin;
+	}
+	return chunk * n_notes + note;
+}
+
+
+/*! Copy an array of notes into another layout
+ *    @param value_size: number of bytes of a note value
+ */
+void convertNoteLayout(const uint8_t* src, const NoteLayout src_layout, uint8_t* dst, const NoteLayout dst_layout, const size_t n_chunks, const size_t n_notes, const size_t value_size);
+
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _NOTE_PRECISION_H_
+#define _NOTE_PRECISION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*! Range of the logarithmic 8-bit note encoding; code 0 is silence and code c
+ *  represents LOG8_DB_MIN + (c - 1) * LOG8_DB_STEP decibels of power
+ */
+#define LOG8_DB_MIN -120.0f
+#define LOG8_DB_STEP 0.5f
+
+
+/*! Storage formats for note power values */
+enum NotePrecision
+{
+	NOTE_PRECISION_FLOAT32 = 0,
+	NOTE_PRECISION_FLOAT16,
+	NOTE_PRECISION_LOG8
+};
+
+
+/*! Number of bytes used to store a single note value */
+size_t getNotePrecisionSize(const NotePrecision precision);
+
+
+/*! Convert between 32-bit floats and IEEE 754 half precision values */
+float halfToFloat(const uint16_t value);
+uint16_t floatToHalf(const float value);
+
+
+/*! Convert between power values and the logarithmic 8-bit encoding; the
+ *  conversion matches the one performed by the gather_notes kernel
+ */
+float log8ToFloat(const uint8_t value);
+uint8_t floatToLog8(const float value);
+
+
+/*! Widen an array of stored note values to 32-bit floats
+ *    @param src: note values stored with the given precision
+ *    @param n_notes: number of note values in src
+ *    @param precision: format of src
+ *    @param dst: output buffer with n_notes elements
+ */
+void widenNotes(const uint8_t* src, const size_t n_notes, const NotePrecision precision, float* dst);
+
+
+/*! Narrow an array of 32-bit float note values to the given precision
+ *    @param src: note values as 32-bit floats
+ *    @param n_notes: number of note values in src
+ *    @param precision: format of dst
+ *    @param dst: output buffer with n_notes * getNotePrecisionSize() bytes
+ */
+void narrowNotes(const float* src, const size_t n_notes, const NotePrecision precision, uint8_t* dst);
+
+
+#endif
@@ -1,19 +1,145 @@
 #ifndef _NOTE_PROFILE_H_
 #define _NOTE_PROFILE_H_
 
+#include "note_event.h"
+#include "note_precision.h"
+#include "note_pyramid.h"
+#include "note_sink.h"
+
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 
-class NoteProfile
+/*! Notes of a recording kept in memory; as a NoteSink, it stores every block
+ *  of a stream
+ */
+class NoteProfile : public NoteSink
 {
 public:
-	NoteProfile(const int32_t base_note_id);
-
-	~NoteProfile();
+	/*! Create an empty profile
+	 *    @param base_note_id: MIDI note number of the lowest note to analyze
+	 *    @param precision: format in which note powers are computed and stored
+	 */
+	NoteProfile(const int32_t base_note_id, const NotePrecision precision = NOTE_PRECISION_FLOAT32);
 
+	/*! Analyze a WAV or FLAC file */
 	void fromWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk);
 
+	/*! Detect note on/off events in a WAV or FLAC file on the device; only the events
+	 *  are transferred and stored, the notes of each chunk are not
+	 *    @param thresholds: parameters of the event detection
+	 */
+	void eventsFromWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk, const NoteEventThresholds& thresholds);
+
+	/*! Analyze a WAV or FLAC file block by block and pass each block to a sink as
+	 *  soon as it is finished, so memory use does not grow with the length of
+	 *  the file; the profile itself is not modified
+	 *    @param sink: receives the stream; may be this profile
+	 *    @param thresholds: if given, only note events and timestamps are
+	 *                       passed to the sink; otherwise all notes are
+	 */
+	void streamWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk, NoteSink& sink, const NoteEventThresholds* thresholds = nullptr) const;
+
+	/*! Load a profile from a file written by a NoteFileSink; with a pyramid,
+	 *  one saved next to the file is loaded instead of built again unless it
+	 *  does not cover the notes of the file
+	 */
+	void fromFile(const std::string& fname);
+
+	void begin(const NoteStreamInfo& info) override;
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override;
+
+	void writeEvents(const NoteEvent* events, const size_t n_events) override;
+
+	/*! Decimate the signal to the lowest sample rate that still covers every
+	 *  analyzed note before it is transferred to the device; timestamps and
+	 *  the chunk spacing of the profile are then in terms of the decimated
+	 *  sample rate
+	 */
+	void setResampling(const bool enable)
+	{
+		resampling = enable;
+	}
+
+	/*! Mix the channels of a file into one signal while it is read, so one
+	 *  channel is transferred and transformed instead of every channel; the
+	 *  notes are those of the mix, which is quieter than the average of the
+	 *  channels where they are out of phase
+	 *    @param weights: weight of each channel; empty to average the channels
+	 */
+	void setDownmix(const bool enable, const std::vector<float>& weights = std::vector<float>())
+	{
+		downmix = enable;
+		downmix_weights = weights;
+	}
+
+	/*! Build a NotePyramid of the notes as they arrive, for range queries
+	 *  that do not scan every chunk; takes effect with the next stream
+	 */
+	void setPyramid(const bool enable)
+	{
+		pyramid_enabled = enable;
+	}
+
+	/*! Pyramid of the notes; nullptr if it is not enabled */
+	const NotePyramid* getPyramid() const
+	{
+		return pyramid_enabled ? &pyramid : nullptr;
+	}
+
+	/*! Analyze a file in this many segments at the same time, each with its
+	 *  own reader and command queue; the segments overlap by the window of a
+	 *  chunk, so the result is identical to a serial analysis
+	 *
+	 *  Segments after the first are kept in memory until the segments before
+	 *  them are passed to the sink; event detection and resampling carry
+	 *  state from one block to the next and always run serially
+	 *    @param n_segments: 1 to analyze serially; 0 to use a segment per
+	 *                       hardware thread
+	 */
+	void setNumSegments(const size_t n_segments)
+	{
+		n_segments_requested = n_segments;
+	}
+
+	/*! Keep the progress of analyses in a NoteCheckpoint file; an analysis
+	 *  of the same file with the same configuration that was interrupted
+	 *  continues after the last checkpoint, and passes the notes of the
+	 *  chunks before it from the file to the sink, so the stream is identical
+	 *  to one without interruption. Analyses with a checkpoint run serially
+	 *    @param fname: file of the checkpoint; empty to disable
+	 *    @param n_chunks_per_checkpoint: chunks between checkpoints; 0 for a
+	 *                                    checkpoint after every block
+	 */
+	void setCheckpoint(const std::string& fname, const size_t n_chunks_per_checkpoint = 0)
+	{
+		checkpoint_fname = fname;
+		this->n_chunks_per_checkpoint = n_chunks_per_checkpoint;
+	}
+
+	/*! Store the notes chunk-major, with the notes of a chunk contiguous, or
+	 *  note-major, with the time series of a note contiguous; the analysis
+	 *  produces the layout on the device
+	 */
+	void setNoteLayout(const NoteLayout layout);
+
+	NoteLayout getNoteLayout() const
+	{
+		return layout;
+	}
+
+	NoteLayout getPreferredLayout() const override
+	{
+		return layout;
+	}
+
+	int32_t getBaseNoteId() const
+	{
+		return base_note_id;
+	}
+
 	uint64_t getSamplesPerSecond() const
 	{
 		return n_samples_per_second;
@@ -31,30 +157,101 @@ public:
 
 	size_t getNumChunks() const
 	{
-		return n_chunks;
+		return timestamps.size();
+	}
+
+	NotePrecision getNotePrecision() const
+	{
+		return precision;
+	}
+
+	/*! Sample index of the beginning of each chunk */
+	const uint64_t* getTimestamps() const
+	{
+		return timestamps.data();
 	}
 
 	uint64_t getTimestampByIndex(const size_t index) const
 	{
-		if (!timestamps || index > n_chunks) return 0;
+		if (index >= timestamps.size()) return 0;
 		else return timestamps[index];
 	}
 
+	/*! Notes of a chunk; only available if notes are stored as 32-bit floats */
 	const float* getNotesByIndex(const size_t index) const
 	{
-		if (!notes || index > n_chunks) return nullptr;
-		else return notes + index * n_notes_per_chunk;
+		if (precision != NOTE_PRECISION_FLOAT32) return nullptr;
+		return reinterpret_cast<const float*>(getPackedNotesByIndex(index));
 	}
 
+	/*! Notes of a chunk in the stored precision; only available in the
+	 *  chunk-major layout
+	 */
+	const uint8_t* getPackedNotesByIndex(const size_t index) const
+	{
+		if (notes.empty() || index >= timestamps.size()) return nullptr;
+		else return notes.data() + index * n_notes_per_chunk * getNotePrecisionSize(precision);
+	}
+
+	/*! Power of a note in every chunk; only available in the note-major layout
+	 *  if notes are stored as 32-bit floats
+	 */
+	const float* getNoteSeries(const size_t note) const
+	{
+		if (precision != NOTE_PRECISION_FLOAT32) return nullptr;
+		return reinterpret_cast<const float*>(getPackedNoteSeries(note));
+	}
+
+	/*! Power of a note in every chunk in the stored precision; only available
+	 *  in the note-major layout
+	 */
+	const uint8_t* getPackedNoteSeries(const size_t note) const
+	{
+		if (note >= note_series.size() || note_series[note].empty()) return nullptr;
+		else return note_series[note].data();
+	}
+
+	size_t getNumEvents() const
+	{
+		return events.size();
+	}
+
+	const NoteEvent* getEventByIndex(const size_t index) const
+	{
+		if (index >= events.size()) return nullptr;
+		else return &events[index];
+	}
+
+	/*! Power of a single note of a chunk, widened to a 32-bit float */
+	float getNote(const size_t index, const size_t note) const;
+
+	/*! Widen the notes of a chunk to 32-bit floats
+	 *    @param output: buffer with getNotesPerChunk() elements
+	 *    @return false if the index is out of range
+	 */
+	bool readNotesByIndex(const size_t index, float* output) const;
 
 protected:
-	uint64_t* timestamps;
+	std::vector<uint64_t> timestamps;
 	uint64_t n_samples_per_second;
-	float* notes;
+	std::vector<uint8_t> notes;
+	std::vector<std::vector<uint8_t> > note_series;
+	std::vector<uint8_t> converted_notes;
+	NotePrecision precision;
+	NoteLayout layout;
+	NoteLayout stream_layout;
 	size_t n_notes_per_chunk;
-	size_t n_chunks;
 	size_t n_samples_per_chunk;
 	int32_t base_note_id;
+	bool resampling;
+	bool downmix;
+	std::vector<float> downmix_weights;
+	size_t n_segments_requested;
+	std::string checkpoint_fname;
+	size_t n_chunks_per_checkpoint;
+	std::vector<NoteEvent> events;
+	bool pyramid_enabled;
+	NotePyramid pyramid;
 };
 
 
@@ -0,0 +1,131 @@
+#ifndef _NOTE_PYRAMID_H_
+#define _NOTE_PYRAMID_H_
+
+#include "note_sink.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Multi-resolution summary of the notes of a stream for queries over time
+ *  ranges of long profiles
+ *
+ *  Level 0 holds the notes of every chunk as 32-bit floats; level l holds the
+ *  maximum and sum of every note over aligned spans of 2^l chunks, added as
+ *  soon as the last chunk of a span arrives. Prefix sums over all chunks give
+ *  the sum over any range from two rows, and the maximum over a range takes
+ *  O(log n) spans. As a NoteSink, a pyramid is built while a stream passes
+ */
+class NotePyramid : public NoteSink
+{
+public:
+	NotePyramid();
+
+	/*! Name of the file saved next to a note file */
+	static std::string getFileName(const std::string& note_fname)
+	{
+		return note_fname + ".pyramid";
+	}
+
+	void begin(const NoteStreamInfo& info) override;
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override;
+
+	void writeEvents(const NoteEvent*, const size_t) override {}
+
+	/*! Remove every chunk and set the number of notes of a chunk */
+	void clear(const size_t n_notes_per_chunk);
+
+	/*! Add the notes of the next chunk
+	 *    @param notes: n_notes_per_chunk powers
+	 */
+	void appendChunk(const float* notes);
+
+	size_t getNotesPerChunk() const
+	{
+		return n_notes_per_chunk;
+	}
+
+	size_t getNumChunks() const
+	{
+		return n_chunks;
+	}
+
+	/*! Number of levels including the chunks themselves */
+	size_t getNumLevels() const
+	{
+		return max_levels.size();
+	}
+
+	/*! Number of complete spans of 2^level chunks */
+	size_t getNumSpans(const size_t level) const
+	{
+		return level < max_levels.size() ? n_chunks >> level : 0;
+	}
+
+	/*! Maximum of every note over a span; nullptr if there is no such span */
+	const float* getSpanMax(const size_t level, const size_t index) const
+	{
+		if (index >= getNumSpans(level)) return nullptr;
+		else return max_levels[level].data() + index * n_notes_per_chunk;
+	}
+
+	/*! Sum of every note over a span; nullptr if there is no such span */
+	const float* getSpanSum(const size_t level, const size_t index) const
+	{
+		if (index >= getNumSpans(level)) return nullptr;
+		else if (level == 0) return max_levels[0].data() + index * n_notes_per_chunk;
+		else return sum_levels[level].data() + index * n_notes_per_chunk;
+	}
+
+	/*! Sum of every note over the chunks [first, last); costs two rows of
+	 *  prefix sums regardless of the length of the range
+	 *    @param output: n_notes_per_chunk values
+	 */
+	void getRangeSum(const size_t first, const size_t last, float* output) const;
+
+	/*! Mean of every note over the chunks [first, last) */
+	void getRangeMean(const size_t first, const size_t last, float* output) const;
+
+	/*! Maximum of every note over the chunks [first, last), taken from the
+	 *  largest aligned spans that fit into the range
+	 */
+	void getRangeMax(const size_t first, const size_t last, float* output) const;
+
+	/*! Write the pyramid to a file in the byte order of the host */
+	void save(const std::string& fname) const;
+
+	/*! Read a pyramid written by save() */
+	void load(const std::string& fname);
+
+protected:
+	/*! Combine the last two spans of a level into a span of the next level */
+	void mergeSpans(const size_t level);
+
+	/*! Check that [first, last) is a range of chunks */
+	void checkRange(const size_t first, const size_t last) const;
+
+protected:
+	size_t n_notes_per_chunk;
+	size_t n_chunks;
+
+	// Per level, n_chunks >> level rows of n_notes_per_chunk values; level 0
+	// of the maxima holds the chunks and is also the sum of level 0
+	std::vector<std::vector<float> > max_levels;
+	std::vector<std::vector<float> > sum_levels;
+
+	// Sum of every note over the first i chunks in row i; doubles, so long
+	// profiles do not lose the powers of quiet ranges
+	std::vector<double> prefix_sums;
+
+	// Format of the stream passed to the sink
+	NotePrecision stream_precision;
+	NoteLayout stream_layout;
+	std::vector<uint8_t> converted_notes;
+	std::vector<float> widened_notes;
+};
+
+
+#endif
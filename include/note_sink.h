@@ -0,0 +1,147 @@
+#ifndef _NOTE_SINK_H_
+#define _NOTE_SINK_H_
+
+#include "note_event.h"
+#include "note_layout.h"
+#include "note_precision.h"
+
+#include <fstream>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+/*! Description of a stream of notes, passed to a sink before any notes */
+struct NoteStreamInfo
+{
+	int32_t base_note_id;
+	NotePrecision precision;
+	NoteLayout layout;
+	size_t n_notes_per_chunk;
+	uint64_t n_samples_per_second;
+	size_t n_samples_per_chunk;
+
+	// Estimate of the total number of chunks; 0 if unknown
+	size_t n_chunks_hint;
+};
+
+
+/*! Receives the finished notes of an analysis block by block
+ *
+ *  A stream consists of begin(), any number of writeNotes() and
+ *  writeEvents() calls with consecutive chunks, and end(); the arrays passed
+ *  to a sink are only valid during the call
+ */
+class NoteSink
+{
+public:
+	virtual ~NoteSink() {}
+
+	/*! Layout in which the sink receives the notes of each block; an analysis
+	 *  produces it on the device
+	 */
+	virtual NoteLayout getPreferredLayout() const
+	{
+		return NOTE_LAYOUT_CHUNK_MAJOR;
+	}
+
+	virtual void begin(const NoteStreamInfo& info) = 0;
+
+	/*! Receive the notes of consecutive chunks
+	 *    @param first_chunk_index: index of the first chunk in the stream
+	 *    @param timestamps: sample index of each chunk
+	 *    @param notes: n_chunks * n_notes_per_chunk values in the precision
+	 *                  and layout of the stream, where the layout applies to
+	 *                  the chunks of this block; nullptr if only events are
+	 *                  detected
+	 */
+	virtual void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) = 0;
+
+	/*! Receive note events ordered by chunk and note */
+	virtual void writeEvents(const NoteEvent* events, const size_t n_events) = 0;
+
+	/*! Called after the last block of the stream */
+	virtual void end() {}
+};
+
+
+class NotePyramid;
+
+
+/*! Appends every block to a file as soon as it arrives; the file can be read
+ *  back with replay() or NoteProfile::fromFile()
+ *
+ *  The file starts with a header of the stream followed by blocks of notes or
+ *  events, all in the byte order of the host
+ */
+class NoteFileSink : public NoteSink
+{
+public:
+	NoteFileSink(const std::string& fname);
+
+	~NoteFileSink();
+
+	/*! Build a NotePyramid of the stream and save it next to the file at the
+	 *  end of the stream; a pyramid left by an earlier file of the same name
+	 *  is removed when a stream begins
+	 */
+	void setPyramid(const bool enable);
+
+	void begin(const NoteStreamInfo& info) override;
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override;
+
+	void writeEvents(const NoteEvent* events, const size_t n_events) override;
+
+	void end() override;
+
+	/*! Read a file written by a NoteFileSink and pass its stream to a sink
+	 *  block by block, in the layout in which it was written
+	 */
+	static void replay(const std::string& fname, NoteSink& sink);
+
+protected:
+	void writeBlockHeader(const uint32_t type, const uint32_t count, const uint64_t first_chunk_index);
+
+protected:
+	std::string fname;
+	std::ofstream ost;
+	size_t note_row_size;
+	NotePyramid* pyramid;
+};
+
+
+/*! Passes every block to functions of the caller */
+class NoteCallbackSink : public NoteSink
+{
+public:
+	typedef std::function<void(const NoteStreamInfo& info, const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)> NotesCallback;
+	typedef std::function<void(const NoteStreamInfo& info, const NoteEvent* events, const size_t n_events)> EventsCallback;
+
+	/*! @param on_notes: called for each block of notes; may be empty
+	 *  @param on_events: called for each block of events; may be empty
+	 *  @param layout: layout in which on_notes receives the notes
+	 */
+	NoteCallbackSink(const NotesCallback& on_notes, const EventsCallback& on_events = EventsCallback(), const NoteLayout layout = NOTE_LAYOUT_CHUNK_MAJOR);
+
+	NoteLayout getPreferredLayout() const override
+	{
+		return layout;
+	}
+
+	void begin(const NoteStreamInfo& info) override;
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override;
+
+	void writeEvents(const NoteEvent* events, const size_t n_events) override;
+
+protected:
+	NotesCallback on_notes;
+	EventsCallback on_events;
+	NoteLayout layout;
+	NoteStreamInfo info;
+};
+
+
+#endif
@@ -3,6 +3,10 @@
 
 #include <CL/cl.h>
 
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -16,33 +20,127 @@ class OpenCLContext;
 void checkError(const cl_int err, const char* message);
 
 
+/*! Ways to split a CPU device into sub-devices */
+enum DevicePartition
+{
+	DEVICE_PARTITION_NONE = 0,
+
+	// One sub-device per NUMA node
+	DEVICE_PARTITION_NUMA,
+
+	// Sub-devices of partition_units compute units each
+	DEVICE_PARTITION_CORES
+};
+
+
+/*! Policy by which a context chooses its platform and devices
+ *
+ *  Among the platforms and devices whose names contain the given substrings,
+ *  the context uses every device of the first type in the order GPU,
+ *  accelerator, CPU that is allowed and present on a platform; all devices
+ *  come from that one platform
+ */
+struct DeviceSelection
+{
+	// Substrings of the platform and device names; empty matches any name
+	std::string platform_name;
+	std::string device_name;
+
+	// Allowed device types
+	cl_device_type device_type;
+
+	// Partition of CPU devices; other devices are used whole
+	DevicePartition partition;
+	cl_uint partition_units;
+
+	/*! GPUs if there are any, otherwise any other device, unpartitioned */
+	static DeviceSelection getDefault();
+
+	/*! Parse a selection from strings; empty strings keep the default
+	 *    @param device_type: "gpu", "cpu", "accelerator" or "all"
+	 *    @param partition: "none", "numa" or "cores:N"
+	 */
+	static DeviceSelection parse(const std::string& platform_name, const std::string& device_name, const std::string& device_type, const std::string& partition);
+
+	/*! Parse the environment variables MUSICALFFT_PLATFORM,
+	 *  MUSICALFFT_DEVICE, MUSICALFFT_DEVICE_TYPE and MUSICALFFT_PARTITION
+	 */
+	static DeviceSelection fromEnvironment();
+};
+
+
+/*! Threading model
+ *
+ *  OpenCLContext and OpenCLDevice may be used from any thread: the program
+ *  registry and the pool of command queues are guarded by mutexes
+ *
+ *  Every other object (memory objects, kernels handed out by createKernel()
+ *  and MusicalFFT) belongs to one thread at a time; a thread that launches
+ *  work takes its own command queue from acquireCommandQueue(), so threads
+ *  never share a queue or set arguments of the same kernel object
+ */
 class OpenCLDevice
 {
 	friend class OpenCLMemory;
 
 public:
-	OpenCLDevice(const cl_device_id device_id, cl_context ctx);
+	/*! @param is_sub_device: whether the device was created by partitioning
+	 *                        and is released with the object
+	 */
+	OpenCLDevice(const cl_device_id device_id, cl_context ctx, const bool is_sub_device = false);
 
 	~OpenCLDevice();
 
 	uint32_t getLocalMemorySize();
 	uint32_t getMaxWorkGroupSize();
 	uint32_t getMaxComputeUnits();
+	std::string getName() const;
+	cl_device_type getType() const;
+
+	bool isSubDevice() const
+	{
+		return is_sub_device;
+	}
 
+	/*! Default in-order queue of the device; only for single-threaded use */
 	cl_command_queue getCommandQueue() const
 	{
 		return cmdq;
 	}
 
+	/*! Take a queue of the device for the exclusive use of the caller; idle
+	 *  queues are reused and new queues are created on demand
+	 *    @param out_of_order: whether commands of the queue may execute out
+	 *                         of order; the caller orders them with events
+	 */
+	cl_command_queue acquireCommandQueue(const bool out_of_order = false);
+
+	/*! Give a queue taken with acquireCommandQueue() back to the pool after
+	 *  its commands completed
+	 */
+	void returnCommandQueue(cl_command_queue queue);
+
 	cl_context getContext() const
 	{
 		return ctx;
 	}
 
+protected:
+	struct PooledQueue
+	{
+		cl_command_queue queue;
+		bool out_of_order;
+		bool in_use;
+	};
+
 protected:
 	cl_context ctx;
 	cl_device_id device;
+	bool is_sub_device;
 	cl_command_queue cmdq;
+
+	std::vector<PooledQueue> queue_pool;
+	std::mutex queue_pool_mutex;
 };
 
 
@@ -51,28 +149,91 @@ class OpenCLContext
 	friend class OpenCLDevice;
 
 protected:
-	/*! Create an OpenCL context with a GPU */
-	OpenCLContext();
+	/*! Create an OpenCL context with the devices of a selection */
+	OpenCLContext(const DeviceSelection& selection);
 
 	/*! Destructor */
 	~OpenCLContext();
 
 public:
-	static OpenCLContext* getInstance()
-	{
-		static OpenCLContext instance;
-		return &instance;
-	}
+	/*! Context of the process; its devices are chosen by the selection set
+	 *  with setDeviceSelection(), or else by the environment
+	 */
+	static OpenCLContext* getInstance();
+
+	/*! Choose the devices of the context of the process; only possible before
+	 *  the first call to getInstance()
+	 */
+	static void setDeviceSelection(const DeviceSelection& selection);
 
+	/*! Create a kernel from a source file (or its cached binary); if neither
+	 *  exists, the source of a file of the same name embedded in the library
+	 *  is used
+	 *
+	 *  Programs are built once per source and compiler options and kept for
+	 *  the lifetime of the context; every call hands out a new kernel object
+	 *  which the caller releases with clReleaseKernel
+	 */
 	cl_kernel createKernel(const std::string& kernel_name, const std::string& file_name, const std::string& compiler_options);
 
+	/*! Create a kernel from the source of a file of kernels/ embedded in the
+	 *  library at build time, independent of the working directory
+	 *    @param file_name: name of the file, e.g. "musical_fft.cl"
+	 */
+	cl_kernel createEmbeddedKernel(const std::string& kernel_name, const std::string& file_name, const std::string& compiler_options);
+
+	/*! Number of programs built so far */
+	size_t getNumPrograms() const;
+
+	/*! Release all programs; kernels created from them remain valid */
+	void releasePrograms();
+
 	std::vector<OpenCLDevice*> getDevices() const
 	{
 		return devices;
 	}
 
+	size_t getNumDevices() const
+	{
+		return devices.size();
+	}
+
+	/*! Device by index; with sub-devices, every partition is a device */
+	OpenCLDevice* getDevice(const size_t index) const;
+
 
 protected:
+	/*! Identity of a built program */
+	struct ProgramKey
+	{
+		bool is_binary;
+		std::string content;
+		std::string compiler_options;
+
+		bool operator<(const ProgramKey& other) const
+		{
+			if (is_binary != other.is_binary) return is_binary < other.is_binary;
+			if (compiler_options != other.compiler_options) return compiler_options < other.compiler_options;
+			return content < other.content;
+		}
+	};
+
+	/*! Program of the registry, which may still be building */
+	struct ProgramEntry
+	{
+		uint64_t build_id;
+		std::shared_future<cl_program> program;
+	};
+
+	/*! Find a program in the registry or build it; the registry is only
+	 *  locked to look up and insert the entry, so programs build in parallel
+	 *  and a caller that needs a program that is building waits for it
+	 */
+	cl_program getProgram(const ProgramKey& key);
+
+	/*! Create and build a program outside the registry */
+	cl_program buildProgram(const ProgramKey& key);
+
 	cl_kernel compileKernelFromSource(const std::string& kernel_name, const std::string& file_path, const std::string& compiler_options);
 
 	/*! Will not work in a general sense since there is no reliable way to
@@ -80,11 +241,21 @@ protected:
 	 */
 	cl_kernel loadKernelFromBinary(const std::string& kernel_name, const std::string& file_path);
 
+	/*! Split a CPU device as selected; returns the device itself if it is not
+	 *  partitioned
+	 *    @param is_partitioned: output for whether sub-devices were created
+	 */
+	static std::vector<cl_device_id> partitionDevice(cl_device_id device, const DeviceSelection& selection, bool* is_partitioned);
+
 protected:
 	cl_context ctx;
 	std::vector<OpenCLDevice*> devices;
 	cl_uint n_devices;
 	cl_device_id* device_ids;
+
+	std::map<ProgramKey, ProgramEntry> programs;
+	uint64_t n_program_builds;
+	mutable std::mutex programs_mutex;
 };
 
 
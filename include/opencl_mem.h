@@ -9,6 +9,7 @@ class OpenCLKernelMemory
 public:
 	OpenCLKernelMemory(OpenCLDevice* device, const size_t size, const cl_mem_flags flags) :
 		device(device),
+		queue(device->getCommandQueue()),
 		device_buffer(nullptr),
 		size(size),
 		flags(flags)
@@ -44,13 +45,52 @@ public:
 		checkError(err, "clSetKernelArg");
 	}
 
+	void fillZero()
+	{
+		// Check whether the device buffer has been initialized
+		allocateDeviceMemory();
+
+		// Wait for the fill, since an out-of-order queue would not order it
+		// before the following commands
+		const cl_uchar pattern = 0;
+		cl_event fill_done;
+		cl_int err = clEnqueueFillBuffer(queue, device_buffer, &pattern, sizeof(pattern), 0, size, 0, nullptr, &fill_done);
+		checkError(err, "clEnqueueFillBuffer");
+		err = clWaitForEvents(1, &fill_done);
+		checkError(err, "clWaitForEvents");
+		clReleaseEvent(fill_done);
+	}
+
+	/*! Copy bytes of this buffer into another buffer on the device and wait
+	 *  for the copy
+	 */
+	void copyTo(OpenCLKernelMemory* dst, const size_t src_offset, const size_t dst_offset, const size_t n_bytes)
+	{
+		allocateDeviceMemory();
+		dst->allocateDeviceMemory();
+
+		cl_event copy_done;
+		cl_int err = clEnqueueCopyBuffer(queue, device_buffer, dst->device_buffer, src_offset, dst_offset, n_bytes, 0, nullptr, &copy_done);
+		checkError(err, "clEnqueueCopyBuffer");
+		err = clWaitForEvents(1, &copy_done);
+		checkError(err, "clWaitForEvents");
+		clReleaseEvent(copy_done);
+	}
+
 	size_t getSize() const
 	{
 		return size;
 	}
 
+	/*! Issue transfers on a queue other than the default queue of the device */
+	void setCommandQueue(cl_command_queue queue)
+	{
+		this->queue = queue;
+	}
+
 protected:
 	OpenCLDevice* device;
+	cl_command_queue queue;
 	cl_mem device_buffer;
 	size_t size;
 	cl_mem_flags flags;
@@ -104,17 +144,42 @@ public:
 		// Copy memory from device to host and return the internal buffer
 		size_t read_size = n_dst < size ? n_dst : size;
 		if (n_read) *n_read = read_size;
-		cl_int err = clEnqueueReadBuffer(device->getCommandQueue(), device_buffer, CL_TRUE, 0, read_size, dst, 0, nullptr, nullptr);
+		cl_int err = clEnqueueReadBuffer(queue, device_buffer, CL_TRUE, 0, read_size, dst, 0, nullptr, nullptr);
 		checkError(err, "clEnqueueReadBuffer");
 		return true;
 	}
 
+	/*! Copy a three-dimensional box of the device buffer to the host, as
+	 *  clEnqueueReadBufferRect; offsets, pitches and the width of the region
+	 *  are in bytes
+	 *    @param origin: offset of the box in the buffer
+	 *    @param region: width, rows and slices of the box
+	 *    @param row_pitch, slice_pitch: layout of the buffer
+	 *    @param dst_row_pitch, dst_slice_pitch: layout of the output
+	 */
+	bool readRectTo(uint8_t* dst, const size_t origin[3], const size_t region[3], const size_t row_pitch, const size_t slice_pitch, const size_t dst_row_pitch, const size_t dst_slice_pitch)
+	{
+		// If the device buffer is not yet created, do nothing
+		if (!device_buffer) return false;
+
+		const size_t dst_origin[] = { 0, 0, 0 };
+		cl_int err = clEnqueueReadBufferRect(queue, device_buffer, CL_TRUE, origin, dst_origin, region, row_pitch, slice_pitch, dst_row_pitch, dst_slice_pitch, dst, 0, nullptr, nullptr);
+		checkError(err, "clEnqueueReadBufferRect");
+		return true;
+	}
+
 	const uint8_t* read(size_t* n_read)
+	{
+		return read(size, n_read);
+	}
+
+	const uint8_t* read(const size_t n_bytes, size_t* n_read)
 	{
 		// Check that host memory is allocated
 		allocateHostMemory();
-		
-		return readTo(host_buffer, size, n_read) ? host_buffer : nullptr;
+
+		// Only the beginning of the buffer is transferred
+		return readTo(host_buffer, n_bytes, n_read) ? host_buffer : nullptr;
 	}
 };
 
@@ -139,9 +204,22 @@ public:
 		if (!src) return false;
 
 		// Copy memory from host to device
-		size_t write_size = n_src > size ? n_src : size;
+		size_t write_size = n_src < size ? n_src : size;
 		if (n_write) *n_write = write_size;
-		cl_int err = clEnqueueWriteBuffer(device->getCommandQueue(), device_buffer, CL_TRUE, 0, write_size, src, 0, nullptr, nullptr);
+		cl_int err = clEnqueueWriteBuffer(queue, device_buffer, CL_TRUE, 0, write_size, src, 0, nullptr, nullptr);
+		checkError(err, "clEnqueueWriteBuffer");
+		return true;
+	}
+
+	/*! Copy memory from the host into a range of the device buffer
+	 *    @param offset: offset in the device buffer in bytes
+	 */
+	bool writeFromAt(const size_t offset, const uint8_t* src, const size_t n_src)
+	{
+		if (!src || offset + n_src > size) return false;
+
+		allocateDeviceMemory();
+		cl_int err = clEnqueueWriteBuffer(queue, device_buffer, CL_TRUE, offset, n_src, src, 0, nullptr, nullptr);
 		checkError(err, "clEnqueueWriteBuffer");
 		return true;
 	}
@@ -0,0 +1,118 @@
+#ifndef _PIANO_ROLL_H_
+#define _PIANO_ROLL_H_
+
+#include "midi.h"
+#include "note_profile.h"
+
+#include <stdint.h>
+#include <vector>
+
+
+/*! Rasterized representation of the notes of a MIDI file; each frame holds a
+ *  flag for every note that is sounding at the time of the frame, with the
+ *  same note indexing as a NoteProfile (note i is MIDI note base_note_id + i)
+ */
+class PianoRoll
+{
+public:
+	/*! Rasterize a MIDI file at the timestamps of a note profile */
+	PianoRoll(const MidiFile& midi, const NoteProfile& profile);
+
+	/*! Rasterize a MIDI file at uniformly spaced frames
+	 *    @param base_note_id: MIDI note number of the first note
+	 *    @param n_notes_per_frame: number of notes in each frame
+	 *    @param first_frame_seconds: time of the first frame
+	 *    @param seconds_per_frame: time between consecutive frames
+	 *    @param n_frames: number of frames
+	 */
+	PianoRoll(const MidiFile& midi, const int32_t base_note_id, const size_t n_notes_per_frame, const double first_frame_seconds, const double seconds_per_frame, const size_t n_frames);
+
+	int32_t getBaseNoteId() const
+	{
+		return base_note_id;
+	}
+
+	size_t getNotesPerFrame() const
+	{
+		return n_notes_per_frame;
+	}
+
+	size_t getNumFrames() const
+	{
+		return n_frames;
+	}
+
+	/*! Flags (0 or 1) of all notes in a frame */
+	const uint8_t* getFrameByIndex(const size_t index) const
+	{
+		if (index >= n_frames) return nullptr;
+		else return roll.data() + index * n_notes_per_frame;
+	}
+
+	bool isActive(const size_t index, const size_t note) const
+	{
+		if (index >= n_frames || note >= n_notes_per_frame) return false;
+		else return roll[index * n_notes_per_frame + note] != 0;
+	}
+
+protected:
+	void rasterize(const MidiFile& midi, const double first_frame_seconds, const double seconds_per_frame);
+
+	/*! Index of the first frame at or after a point in time */
+	size_t getFrameAtTime(const double seconds, const double first_frame_seconds, const double seconds_per_frame) const;
+
+protected:
+	int32_t base_note_id;
+	size_t n_notes_per_frame;
+	size_t n_frames;
+	std::vector<uint8_t> roll;
+};
+
+
+/*! Frame-level comparison of detected notes against a reference */
+struct TranscriptionScore
+{
+	uint64_t true_positives;
+	uint64_t false_positives;
+	uint64_t false_negatives;
+
+	double getPrecision() const
+	{
+		uint64_t n_detected = true_positives + false_positives;
+		return n_detected ? (double)true_positives / n_detected : 0;
+	}
+
+	double getRecall() const
+	{
+		uint64_t n_reference = true_positives + false_negatives;
+		return n_reference ? (double)true_positives / n_reference : 0;
+	}
+
+	double getF1() const
+	{
+		uint64_t denominator = 2 * true_positives + false_positives + false_negatives;
+		return denominator ? 2.0 * true_positives / denominator : 0;
+	}
+};
+
+
+/*! Score note detections against a reference for several thresholds at once;
+ *  a note counts as detected in a frame when its power exceeds the threshold
+ *    @param notes: note powers organized as (frame, note)
+ *    @param roll: reference flags organized like notes
+ *    @param n_frames: number of frames
+ *    @param n_notes_per_frame: number of notes in each frame
+ *    @param thresholds: detection thresholds to evaluate
+ *    @param n_threads: number of threads; 0 uses all hardware threads
+ *    @return one score per threshold
+ */
+std::vector<TranscriptionScore> scoreTranscription(const float* notes, const uint8_t* roll, const size_t n_frames, const size_t n_notes_per_frame, const std::vector<float>& thresholds, const size_t n_threads = 0);
+
+
+/*! Score the notes of a profile against a piano roll rasterized from it; notes
+ *  stored with reduced precision are widened frame by frame
+ */
+std::vector<TranscriptionScore> scoreTranscription(const NoteProfile& profile, const PianoRoll& roll, const std::vector<float>& thresholds, const size_t n_threads = 0);
+
+
+#endif
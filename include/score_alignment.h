@@ -0,0 +1,82 @@
+#ifndef _SCORE_ALIGNMENT_H_
+#define _SCORE_ALIGNMENT_H_
+
+#include "midi.h"
+#include "note_profile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+/*! Constraints on the warping path of an alignment */
+enum AlignmentConstraint
+{
+	// Cells within a radius of the straight line from the first to the last
+	// pair of frames
+	ALIGNMENT_SAKOE_CHIBA = 0,
+
+	// Cells within a radius of the path of both sequences at half the frame
+	// rate, aligned the same way down to a few frames
+	ALIGNMENT_MULTI_SCALE
+};
+
+
+struct AlignmentParams
+{
+	AlignmentConstraint constraint;
+
+	// Frames on either side of the line or coarse path
+	size_t radius;
+
+	// Spacing of the frames of the score; 0 to use the chunk spacing of the
+	// profile
+	double seconds_per_frame;
+
+	static AlignmentParams getDefault();
+};
+
+
+/*! Pair of frames on a warping path */
+struct AlignmentStep
+{
+	uint32_t score_frame;
+	uint32_t profile_chunk;
+};
+
+
+/*! Align two sequences of feature vectors by dynamic time warping within a
+ *  band, with the cosine distance of the vectors as the cost of a cell
+ *
+ *  Cells are computed along anti-diagonals, whose cells are independent, so
+ *  the recurrence runs on whole SIMD vectors. Only the last two anti-diagonals
+ *  of accumulated costs are kept, plus a byte per cell of the band for the
+ *  backtrack, so memory grows with the area of the band rather than with the
+ *  product of the lengths
+ *    @param score: n_score vectors of n_dims values
+ *    @param profile: n_profile vectors of n_dims values
+ *    @param cost: if given, receives the accumulated cost of the path
+ *    @return path from the first to the last pair of frames
+ */
+std::vector<AlignmentStep> alignSequences(const float* score, const size_t n_score, const float* profile, const size_t n_profile, const size_t n_dims, const AlignmentParams& params, float* cost = nullptr);
+
+
+/*! Warping path between the frames of a score and the chunks of a profile */
+struct ScoreAlignment
+{
+	double seconds_per_frame;
+	std::vector<AlignmentStep> path;
+	float cost;
+
+	/*! First chunk of the profile aligned with a time of the score */
+	size_t getProfileChunk(const double score_seconds) const;
+};
+
+
+/*! Align a MIDI score with a performance; both are compared as chroma
+ *  vectors, with the powers of the profile compressed to magnitudes
+ */
+ScoreAlignment alignScore(const MidiFile& midi, const NoteProfile& profile, const AlignmentParams& params = AlignmentParams::getDefault());
+
+
+#endif
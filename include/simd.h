@@ -0,0 +1,134 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*! Portable SIMD vectors based on the GCC/Clang vector extensions, as wide
+ *  as the registers of the instructions enabled for the target (enable
+ *  MUSICALFFT_NATIVE in CMake to build for the host CPU); wider vectors would
+ *  be passed in memory by the helpers and change their ABI
+ */
+#if defined(__AVX512F__)
+#define SIMD_WIDTH 16
+#elif defined(__AVX__)
+#define SIMD_WIDTH 8
+#else
+#define SIMD_WIDTH 4
+#endif
+
+/*! Width of the widest vectors of any build; data that is saved to files is
+ *  padded to it, so the files can be read by every build
+ */
+#define SIMD_MAX_WIDTH 16
+
+typedef float simd_float __attribute__((vector_size(SIMD_WIDTH * sizeof(float))));
+typedef int32_t simd_int __attribute__((vector_size(SIMD_WIDTH * sizeof(int32_t))));
+
+
+/*! Load SIMD_WIDTH consecutive elements from unaligned memory */
+static inline simd_float simdLoad(const float* src)
+{
+	simd_float output;
+	memcpy(&output, src, sizeof(output));
+	return output;
+}
+
+
+static inline simd_int simdLoad(const int32_t* src)
+{
+	simd_int output;
+	memcpy(&output, src, sizeof(output));
+	return output;
+}
+
+
+/*! Load SIMD_WIDTH elements that lie stride elements apart, such as one
+ *  channel of interleaved samples, and convert them to floats
+ */
+static inline simd_float simdLoadStrided(const int16_t* src, const size_t stride)
+{
+	simd_float output;
+	for (int i = 0; i < SIMD_WIDTH; ++i)
+	{
+		output[i] = src[i * stride];
+	}
+	return output;
+}
+
+
+/*! Store SIMD_WIDTH consecutive elements to unaligned memory */
+static inline void simdStore(float* dst, const simd_float value)
+{
+	memcpy(dst, &value, sizeof(value));
+}
+
+
+static inline void simdStore(int32_t* dst, const simd_int value)
+{
+	memcpy(dst, &value, sizeof(value));
+}
+
+
+/*! Vector with every element set to value */
+static inline simd_float simdBroadcast(const float value)
+{
+	simd_float output = {};
+	return output + value;
+}
+
+
+static inline simd_int simdBroadcast(const int32_t value)
+{
+	simd_int output = {};
+	return output + value;
+}
+
+
+/*! Element-wise minimum and maximum */
+static inline simd_float simdMin(const simd_float a, const simd_float b)
+{
+	return a < b ? a : b;
+}
+
+
+static inline simd_float simdMax(const simd_float a, const simd_float b)
+{
+	return a > b ? a : b;
+}
+
+
+/*! Sum of all elements */
+static inline float simdSum(const simd_float value)
+{
+	float output = 0;
+	for (int i = 0; i < SIMD_WIDTH; ++i)
+	{
+		output += value[i];
+	}
+	return output;
+}
+
+
+static inline int64_t simdSum(const simd_int value)
+{
+	int64_t output = 0;
+	for (int i = 0; i < SIMD_WIDTH; ++i)
+	{
+		output += value[i];
+	}
+	return output;
+}
+
+
+/*! Round a number of elements up to a multiple of SIMD_WIDTH or of another
+ *  multiple of it
+ */
+static inline size_t simdPadded(const size_t n, const size_t width = SIMD_WIDTH)
+{
+	return (n + width - 1) / width * width;
+}
+
+
+#endif
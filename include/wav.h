@@ -1,41 +1,59 @@
 #ifndef _WAV_H_
 #define _WAV_H_
 
+#include "audio_reader.h"
+
 #include <fstream>
 #include <stdint.h>
 #include <string>
 #include <vector>
 
 
-class WavFile
+class WavFile : public AudioReader
 {
 public:
 	WavFile(const std::string& fname);
 
 	~WavFile();
 
-	float getSampleRate() const
+	float getSampleRate() const override
 	{
 		return (float)sample_rate;
 	}
 
-	float getNumChannels() const
+	float getNumChannels() const override
 	{
 		return n_channels;
 	}
 
-	size_t getNumSamplesRemaining() const
+	size_t getNumSamplesRemaining() const override
 	{
 		return data_bytes_remaining / block_align;
 	}
 
-	size_t readSeconds(const float seconds, const std::vector<float*> outputs);
+	uint32_t getBitsPerSample() const override
+	{
+		return sample_size * 8;
+	}
+
+	size_t readSamples(const size_t n_samples, const std::vector<float*> outputs) override;
 
-	size_t readSamples(const size_t n_samples, const std::vector<float*> outputs);
+	/*! Convert and mix the interleaved samples in one pass, without
+	 *  deinterleaving them first
+	 */
+	size_t readMixedSamples(const size_t n_samples, const std::vector<float>& weights, float* output) override;
 
-	size_t skipSeconds(const float seconds);
+	/*! Read samples without conversion
+	 *    @param output: buffer for n_samples * getNumChannels() interleaved
+	 *                   16-bit samples
+	 *    @return number of samples read per channel
+	 */
+	size_t readRawSamples(const size_t n_samples, int16_t* output) override;
 
-	size_t skipSamples(const size_t samples);
+	/*! Move ahead without reading
+	 *    @return number of samples skipped per channel
+	 */
+	size_t skipSamples(const size_t samples) override;
 
 protected:
 	uint16_t read16();
@@ -1,19 +1,138 @@
 #define FFT_SIZE (1 << N_STAGES)
+#define N_OCTAVES (N_STAGES - 1)
+#define N_NOTES (12 * N_OCTAVES)
 
 
-__kernel void gather_notes(__read_only __global float* fft_output, __write_only __global float* notes_output)
+// Storage format of the note output
+#if defined(NOTES_FLOAT16)
+typedef half note_t;
+#elif defined(NOTES_LOG8)
+typedef uchar note_t;
+#else
+typedef float note_t;
+#endif
+
+
+/*! Index of the power of a note within the output of musical_fft
+ *
+ *    @param chunk_id: index of the chunk
+ *    @param note_index: index of the note within the chunk (12 * octave + note)
+ */
+unsigned int fft_output_index(unsigned int chunk_id, unsigned int note_index)
+{
+	unsigned int note_id = note_index % 12;
+	unsigned int octave = note_index / 12;
+	return 6 * FFT_SIZE * chunk_id + note_id * FFT_SIZE / 2 + (1 << octave);
+}
+
+
+// Layouts of the note output; see NoteLayout
+#define NOTE_LAYOUT_CHUNK_MAJOR 0
+#define NOTE_LAYOUT_NOTE_MAJOR 1
+#define NOTE_LAYOUT_TILED 2
+#define NOTE_TILE_CHUNKS 16
+
+
+/*! Index of a note within the note output
+ *
+ *    @param layout: arrangement of the output
+ *    @param n_chunks: number of chunks in the output
+ *    @param chunk_id: index of the chunk
+ *    @param note_index: index of the note within the chunk (12 * octave + note)
+ */
+unsigned int note_layout_index(unsigned int layout, unsigned int n_chunks, unsigned int chunk_id, unsigned int note_index)
+{
+	if (layout == NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		return note_index * n_chunks + chunk_id;
+	}
+	else if (layout == NOTE_LAYOUT_TILED)
+	{
+		unsigned int tile_begin = chunk_id - chunk_id % NOTE_TILE_CHUNKS;
+		unsigned int tile_size = min(n_chunks - tile_begin, (unsigned int)NOTE_TILE_CHUNKS);
+		return tile_begin * N_NOTES + note_index * tile_size + chunk_id - tile_begin;
+	}
+	return chunk_id * N_NOTES + note_index;
+}
+
+
+/*! Convert a power value to the storage format and write it to the output
+ *
+ *    @param power: power of the note
+ *    @param index: index of the note in the output
+ *    @param notes_output: output buffer
+ */
+void store_note(float power, unsigned int index, __global note_t* notes_output)
+{
+	#if defined(NOTES_FLOAT16)
+	vstore_half(power, index, notes_output);
+	#elif defined(NOTES_LOG8)
+	float code = (10 * log10(power) - LOG8_DB_MIN) / LOG8_DB_STEP + 1;
+	notes_output[index] = (power > 0 && code >= 1) ? convert_uchar_sat_rte(code) : 0;
+	#else
+	notes_output[index] = power;
+	#endif
+}
+
+
+/*! Gather the power of each note from the output of musical_fft
+ *
+ *    @param fft_output: output of musical_fft
+ *    @param notes_output: memory for the result organized as a 2D array with
+ *                         the axes (chunk, 12 * octave + note) in the given
+ *                         layout
+ *    @param layout: arrangement of the output
+ *    @param n_chunks: number of chunks
+ */
+__kernel void gather_notes(__read_only __global float* fft_output, __write_only __global note_t* notes_output, unsigned int layout, unsigned int n_chunks)
 {
-	// Each workitem is responsible for a chunk
+	// Each workitem is responsible for a chunk; in the note-major layouts,
+	// neighboring workitems write neighboring values
 	unsigned int j = get_global_id(0);
 
-	unsigned int input_offset = 6 * FFT_SIZE * j;
-	unsigned int output_offset = 12 * N_STAGES * j;
+	for (unsigned int i = 0; i < N_NOTES; ++i)
+	{
+		store_note(fft_output[fft_output_index(j, i)], note_layout_index(layout, n_chunks, j, i), notes_output);
+	}
+}
+
+
+/*! Add the weighted power of each note to a running sum; used to average
+ *  multiple channels before the result is converted to the storage format
+ *
+ *    @param fft_output: output of musical_fft
+ *    @param weight: factor applied to each power value
+ *    @param reset: whether to discard the previous contents of the sum
+ *    @param accumulator: running sum organized like the output of gather_notes
+ */
+__kernel void accumulate_notes(__read_only __global float* fft_output, float weight, unsigned int reset, __global float* accumulator)
+{
+	unsigned int j = get_global_id(0);
+	unsigned int output_offset = N_NOTES * j;
+
+	for (unsigned int i = 0; i < N_NOTES; ++i)
+	{
+		float previous = reset ? 0 : accumulator[output_offset + i];
+		accumulator[output_offset + i] = previous + weight * fft_output[fft_output_index(j, i)];
+	}
+}
+
+
+/*! Convert a running sum created by accumulate_notes to the storage format
+ *
+ *    @param accumulator: running sum of note powers in the chunk-major layout
+ *    @param notes_output: memory for the result, organized like the output of
+ *                         gather_notes
+ *    @param layout: arrangement of the output
+ *    @param n_chunks: number of chunks
+ */
+__kernel void pack_notes(__read_only __global float* accumulator, __write_only __global note_t* notes_output, unsigned int layout, unsigned int n_chunks)
+{
+	unsigned int j = get_global_id(0);
+	unsigned int output_offset = N_NOTES * j;
 
-	for (unsigned int note_id = 0; note_id < 12; ++note_id)
+	for (unsigned int i = 0; i < N_NOTES; ++i)
 	{
-		for (unsigned int octave = 0; octave < N_STAGES - 1; ++octave)
-		{
-			notes_output[output_offset + note_id + 12 * octave] = fft_output[input_offset + note_id * FFT_SIZE / 2 + (1 << octave)];
-		}
+		store_note(accumulator[output_offset + i], note_layout_index(layout, n_chunks, j, i), notes_output);
 	}
-}
\ No newline at end of file
+}
@@ -1,18 +1,6 @@
 #define FFT_SIZE (1 << N_STAGES)
 
 
-/*! Compute a complex root of unity; the output are the rectangular coordinates
- *  of the polar coordinates with the given angle and radius of 1
- *
- *    @param angle: angle of the polar form of the exponential
- */
-float2 cexp(float angle)
-{
-	float2 output = (float2)(cos(angle), sin(angle));
-	return output;
-}
-
-
 /*! Multiply two complex numbers
  *
  *    @param c1: first complex number
@@ -27,6 +15,73 @@ float2 cmult(float2 c1, float2 c2)
 }
 
 
+// Each workitem computes radix-2 butterflies on two points or radix-4
+// butterflies on four points
+#ifndef FFT_RADIX
+#define FFT_RADIX 2
+#endif
+#define WORKGROUP_SIZE (FFT_SIZE / FFT_RADIX)
+#define POINTS_PER_WORKITEM FFT_RADIX
+
+
+#if FFT_RADIX == 4
+#if N_STAGES % 2 != 0
+#error "Radix-4 passes need an even number of stages"
+#endif
+
+/*! Index into local memory with one padding element per 16, so the strided
+ *  accesses of the early passes do not all fall into the same banks
+ */
+#define PAD(i) ((i) + ((i) >> 4))
+#define PADDED_FFT_SIZE PAD(FFT_SIZE)
+
+
+/*! Root of unity exp(2*pi*i*m / FFT_SIZE) for m in [0, FFT_SIZE) from a table
+ *  of the first half
+ */
+float2 twiddle(__constant float2* twiddles, unsigned int m)
+{
+	return m < FFT_SIZE / 2 ? twiddles[m] : -twiddles[m - FFT_SIZE / 2];
+}
+
+
+/*! One radix-4 pass of a Stockham FFT
+ *
+ *  The input consists of sub-transforms of n_sub points; workitem j combines
+ *  point k = j % n_sub of four of them into point k of a sub-transform of
+ *  4 * n_sub points, so the output is sorted without a bit reversal
+ *
+ *    @param src: input of the pass, padded with PAD()
+ *    @param dst: output of the pass, padded with PAD()
+ *    @param j: index of the workitem in [0, FFT_SIZE / 4)
+ *    @param n_sub: size of the input sub-transforms, a power of 4
+ *    @param twiddles: see musical_fft
+ */
+void radix4Pass(__local float2* src, __local float2* dst, unsigned int j, unsigned int n_sub, __constant float2* twiddles)
+{
+	unsigned int k = j & (n_sub - 1);
+	unsigned int stride = FFT_SIZE / (4 * n_sub);
+
+	float2 u0 = src[PAD(j)];
+	float2 u1 = cmult(src[PAD(j + FFT_SIZE / 4)], twiddle(twiddles, k * stride));
+	float2 u2 = cmult(src[PAD(j + FFT_SIZE / 2)], twiddle(twiddles, 2 * k * stride));
+	float2 u3 = cmult(src[PAD(j + 3 * FFT_SIZE / 4)], twiddle(twiddles, 3 * k * stride));
+
+	// Four-point transform with the same sign as the twiddle factors
+	float2 v0 = u0 + u2;
+	float2 v1 = u0 - u2;
+	float2 v2 = u1 + u3;
+	float2 v3 = (float2)(u3.s1 - u1.s1, u1.s0 - u3.s0);
+
+	unsigned int out_index = ((j - k) << 2) + k;
+	dst[PAD(out_index)] = v0 + v2;
+	dst[PAD(out_index + n_sub)] = v1 + v3;
+	dst[PAD(out_index + 2 * n_sub)] = v0 - v2;
+	dst[PAD(out_index + 3 * n_sub)] = v1 - v3;
+}
+#endif
+
+
 /*! Perform a specialized sequence of FFT's on a musical signal
  *
  *  The signal is a series of N samples in the time domain; each workgroup
@@ -53,12 +108,36 @@ float2 cmult(float2 c1, float2 c2)
  *    @param signal_chunk: local memory of variable length for buffering chunks
  *    @param output: memory for the final result organized as a 3D array with
  *                   the following axes: (chunk, note, overtone)
+ *    @param note_table: for each note, the number of samples per FFT slot and
+ *                       the offset added to the interpolated samples
+ *    @param twiddles: complex roots of unity exp(2*pi*i*k / FFT_SIZE) for k
+ *                     in [0, FFT_SIZE / 2)
+ *    @param signal_start: index of the first sample of the signal, which is a
+ *                         ring buffer
+ *    @param ring_size: number of samples in the ring buffer
+ *
+ *  With SIGNAL_PCM16, musical_fft_pcm16 takes the signal as interleaved
+ *  16-bit frames, so raw samples are uploaded without a conversion on the
+ *  host; signal_start and ring_size count frames, and the staging step
+ *  deinterleaves the channels and mixes them into the local window
+ *
+ *    @param n_channels: number of samples per frame
+ *    @param channel_weights: weight of each channel, including the scale
+ *                            of the 16-bit samples; channels with a weight of
+ *                            0 are not read
+ *    @param raw_chunk: local memory for the samples of one channel of the
+ *                      window
  */
-__kernel void musical_fft(__read_only __global float* signal, unsigned int samples_per_chunk, float samples_per_base_note, __local float* signal_chunk, __write_only __global float* output)
+#ifdef SIGNAL_PCM16
+__kernel void musical_fft_pcm16(__read_only __global short* signal, unsigned int samples_per_chunk, float samples_per_base_note, __local float* signal_chunk, __write_only __global float* output, __constant float2* note_table, __constant float2* twiddles, unsigned int signal_start, unsigned int ring_size, unsigned int n_channels, __constant float* channel_weights, __local short* raw_chunk)
+#else
+__kernel void musical_fft(__read_only __global float* signal, unsigned int samples_per_chunk, float samples_per_base_note, __local float* signal_chunk, __write_only __global float* output, __constant float2* note_table, __constant float2* twiddles, unsigned int signal_start, unsigned int ring_size)
+#endif
 {
 	// Determine which portion of the signal to use
 	unsigned int chunk_id = get_group_id(0);
-	unsigned int begin_index = chunk_id * samples_per_chunk;
+	unsigned int begin_index = (signal_start + chunk_id * samples_per_chunk) % ring_size;
+	unsigned int window_size = (unsigned int)floor(samples_per_base_note + 2);
 
 	// Determine which portion of the output to use
 	event_t output_copy;
@@ -69,30 +148,105 @@ __kernel void musical_fft(__read_only __global float* signal, unsigned int sampl
 
 	// Local memory for performing the FFT
 	event_t chunk_copy;
+	#if FFT_RADIX == 4
+	__local float2 fft_mem_a[PADDED_FFT_SIZE];
+	__local float2 fft_mem_b[PADDED_FFT_SIZE];
+	#else
 	__local float2 fft_mem[FFT_SIZE];
+	#endif
 
 	// Local memory for storing the output of the FFT
 	__local float fft_output[FFT_SIZE / 2];
 
-	// Cache the relevant portion of the signal into local memory
-	chunk_copy = async_work_group_copy(signal_chunk, signal + begin_index, (unsigned int)floor(samples_per_base_note + 2), 0);
-	wait_group_events(1, &chunk_copy);
+	#ifdef SIGNAL_PCM16
+	// Mix the channels of the window into local memory; each channel is
+	// gathered from the interleaved frames by a strided copy and converted
+	// by the workitems, and a window that wraps around the end of the ring
+	// is read by the workitems directly
+	for (unsigned int i = j; i < window_size; i += WORKGROUP_SIZE)
+	{
+		signal_chunk[i] = 0;
+	}
+	for (unsigned int channel = 0; channel < n_channels; ++channel)
+	{
+		float weight = channel_weights[channel];
+		if (weight == 0) continue;
+		if (begin_index + window_size <= ring_size)
+		{
+			chunk_copy = async_work_group_strided_copy(raw_chunk, signal + begin_index * n_channels + channel, window_size, n_channels, 0);
+			wait_group_events(1, &chunk_copy);
+			for (unsigned int i = j; i < window_size; i += WORKGROUP_SIZE)
+			{
+				signal_chunk[i] += weight * raw_chunk[i];
+			}
+
+			// The next channel overwrites the raw samples
+			work_group_barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		else
+		{
+			for (unsigned int i = j; i < window_size; i += WORKGROUP_SIZE)
+			{
+				signal_chunk[i] += weight * signal[((begin_index + i) % ring_size) * n_channels + channel];
+			}
+		}
+	}
+	work_group_barrier(CLK_LOCAL_MEM_FENCE);
+	#else
+	// Cache the relevant portion of the signal into local memory; a window
+	// that wraps around the end of the ring is copied by the workitems
+	if (begin_index + window_size <= ring_size)
+	{
+		chunk_copy = async_work_group_copy(signal_chunk, signal + begin_index, window_size, 0);
+		wait_group_events(1, &chunk_copy);
+	}
+	else
+	{
+		for (unsigned int i = j; i < window_size; i += WORKGROUP_SIZE)
+		{
+			signal_chunk[i] = signal[(begin_index + i) % ring_size];
+		}
+		work_group_barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	#endif
 
 	for (unsigned int note_id = 0; note_id < 12; ++note_id)
 	{
-		float samples_per_fft_slot = (samples_per_base_note / pow(2, (float)note_id / 12)) / FFT_SIZE;
-		float note_offset = samples_per_fft_slot * samples_per_chunk / 2;
-		for (unsigned int i = 0; i < 2; ++i)
+		float samples_per_fft_slot = note_table[note_id].s0;
+		float note_offset = note_table[note_id].s1;
+		for (unsigned int i = 0; i < POINTS_PER_WORKITEM; ++i)
 		{
-			float rel_pos = (2 * j + i) * samples_per_fft_slot;
+			float rel_pos = (POINTS_PER_WORKITEM * j + i) * samples_per_fft_slot;
 			float weight_hi = rel_pos - floor(rel_pos);
 			float weight_lo = 1 - weight_hi;
-			fft_mem[j * 2 + i] = (float2)(weight_lo * signal_chunk[(unsigned int)floor(rel_pos)] + weight_hi * signal_chunk[(unsigned int)ceil(rel_pos)] + note_offset, 0);
+			float2 point = (float2)(weight_lo * signal_chunk[(unsigned int)floor(rel_pos)] + weight_hi * signal_chunk[(unsigned int)ceil(rel_pos)] + note_offset, 0);
+			#if FFT_RADIX == 4
+			fft_mem_a[PAD(POINTS_PER_WORKITEM * j + i)] = point;
+			#else
+			fft_mem[POINTS_PER_WORKITEM * j + i] = point;
+			#endif
 		}
 
 		// Synchronize before performing FFT
 		work_group_barrier(CLK_LOCAL_MEM_FENCE);
 
+		#if FFT_RADIX == 4
+		// Radix-4 Stockham passes; every workitem keeps the four points of its
+		// butterfly in registers and the passes alternate between the two
+		// buffers, so each pass needs a single barrier
+		__local float2* src = fft_mem_a;
+		__local float2* dst = fft_mem_b;
+		for (unsigned int n_sub = 1; n_sub < FFT_SIZE; n_sub <<= 2)
+		{
+			radix4Pass(src, dst, j, n_sub, twiddles);
+			work_group_barrier(CLK_LOCAL_MEM_FENCE);
+
+			__local float2* tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+		#define FFT_RESULT(i) src[PAD(i)]
+		#else
 		// Perform the FFT algorithm
 		for (unsigned int stage = 0; stage < N_STAGES; ++stage)
 		{
@@ -104,7 +258,7 @@ __kernel void musical_fft(__read_only __global float* signal, unsigned int sampl
 			unsigned int u = j / n_pairs;
 
 			float2 even = fft_mem[(u << stage) + k];
-			float2 odd = cmult(fft_mem[((u + n_universes) << stage) + k], cexp(k * 2*M_PI_F / (1 << (stage + 1))));
+			float2 odd = cmult(fft_mem[((u + n_universes) << stage) + k], twiddles[k << exp_spacing]);
 
 			work_group_barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -113,25 +267,33 @@ __kernel void musical_fft(__read_only __global float* signal, unsigned int sampl
 
 			work_group_barrier(CLK_LOCAL_MEM_FENCE);
 		}
-
-		// Transfer results to output buffer and synchronize before copying
-		// Output is in decibels
-		#ifdef OUTPUT_DECIBELS
-		fft_output[j] = 20 * log10(length(fft_mem[j]) / FFT_SIZE);
-		#else
-		#ifdef OUTPUT_POWER
-		float amplitude = length(fft_mem[j]) / FFT_SIZE;
-		fft_output[j] = amplitude * amplitude;
-		#endif
+		#define FFT_RESULT(i) fft_mem[i]
 		#endif
-		work_group_barrier(CLK_LOCAL_MEM_FENCE);
-
 
+		// The previous note may still be copied out of the output buffer
 		if (note_id != 0)
 		{
 			wait_group_events(1, &output_copy);
 		}
+
+		// Transfer results to output buffer and synchronize before copying
+		// Output is in decibels
+		for (unsigned int i = j; i < FFT_SIZE / 2; i += WORKGROUP_SIZE)
+		{
+			#ifdef OUTPUT_DECIBELS
+			fft_output[i] = 20 * log10(length(FFT_RESULT(i)) / FFT_SIZE);
+			#else
+			#ifdef OUTPUT_POWER
+			float amplitude = length(FFT_RESULT(i)) / FFT_SIZE;
+			fft_output[i] = amplitude * amplitude;
+			#endif
+			#endif
+		}
+		#undef FFT_RESULT
+		work_group_barrier(CLK_LOCAL_MEM_FENCE);
+
 		unsigned int small_output_offset = note_id * FFT_SIZE / 2;
 		output_copy = async_work_group_copy(output + big_output_offset + small_output_offset, fft_output, FFT_SIZE / 2, 0);
 	}
-}
\ No newline at end of file
+	wait_group_events(1, &output_copy);
+}
@@ -0,0 +1,142 @@
+#define N_OCTAVES (N_STAGES - 1)
+#define N_NOTES (12 * N_OCTAVES)
+
+
+/*! Mark note on/off events with hysteresis; each workitem is responsible for
+ *  one note and walks through the chunks in order
+ *
+ *  The state of each note (whether it is active, and its power in the last
+ *  chunk) is carried over between calls so events are continuous across
+ *  blocks of chunks
+ *
+ *    @param notes: note powers organized as (chunk, 12 * octave + note)
+ *    @param n_chunks: number of chunks in notes
+ *    @param on_threshold: power at which an inactive note turns on
+ *    @param off_threshold: power below which an active note turns off
+ *    @param onset_ratio: rise in power that marks a new onset of an active
+ *                        note; 0 disables onset detection
+ *    @param note_state: (active, previous power) of each note
+ *    @param flags: output organized like notes; 0 for no event, 1 for note on
+ *                  and 2 for note off
+ */
+__kernel void mark_events(__read_only __global float* notes, unsigned int n_chunks, float on_threshold, float off_threshold, float onset_ratio, __global float2* note_state, __write_only __global uchar* flags)
+{
+	unsigned int note = get_global_id(0);
+
+	float2 state = note_state[note];
+	bool active = state.s0 != 0;
+	float previous = state.s1;
+
+	for (unsigned int chunk_id = 0; chunk_id < n_chunks; ++chunk_id)
+	{
+		float power = notes[chunk_id * N_NOTES + note];
+		uchar flag = 0;
+		if (!active)
+		{
+			if (power >= on_threshold)
+			{
+				active = true;
+				flag = 1;
+			}
+		}
+		else if (power < off_threshold)
+		{
+			active = false;
+			flag = 2;
+		}
+		else if (onset_ratio > 0 && previous > 0 && power >= onset_ratio * previous)
+		{
+			flag = 1;
+		}
+		flags[chunk_id * N_NOTES + note] = flag;
+		previous = power;
+	}
+
+	note_state[note] = (float2)(active ? 1 : 0, previous);
+}
+
+
+/*! Count the events of each chunk
+ *
+ *    @param flags: output of mark_events
+ *    @param counts: number of events in each chunk
+ */
+__kernel void count_events(__read_only __global uchar* flags, __write_only __global uint* counts)
+{
+	unsigned int chunk_id = get_global_id(0);
+
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < N_NOTES; ++i)
+	{
+		count += flags[chunk_id * N_NOTES + i] != 0;
+	}
+	counts[chunk_id] = count;
+}
+
+
+/*! Exclusive prefix sum of the event counts; executed by a single workgroup
+ *  of SCAN_SIZE workitems which sweeps over the counts in tiles
+ *
+ *    @param counts: output of count_events
+ *    @param n_chunks: number of elements in counts
+ *    @param offsets: index of the first event of each chunk
+ *    @param n_events: total number of events
+ */
+__kernel void scan_counts(__read_only __global uint* counts, unsigned int n_chunks, __write_only __global uint* offsets, __write_only __global uint* n_events)
+{
+	__local uint scan[SCAN_SIZE];
+	unsigned int j = get_local_id(0);
+	unsigned int carry = 0;
+
+	for (unsigned int base = 0; base < n_chunks; base += SCAN_SIZE)
+	{
+		unsigned int value = base + j < n_chunks ? counts[base + j] : 0;
+		scan[j] = value;
+		work_group_barrier(CLK_LOCAL_MEM_FENCE);
+
+		// Inclusive scan of the tile
+		for (unsigned int stride = 1; stride < SCAN_SIZE; stride <<= 1)
+		{
+			unsigned int addend = j >= stride ? scan[j - stride] : 0;
+			work_group_barrier(CLK_LOCAL_MEM_FENCE);
+			scan[j] += addend;
+			work_group_barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		if (base + j < n_chunks)
+		{
+			offsets[base + j] = carry + scan[j] - value;
+		}
+		carry += scan[SCAN_SIZE - 1];
+		work_group_barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (j == 0)
+	{
+		*n_events = carry;
+	}
+}
+
+
+/*! Compact the marked events into a dense list
+ *
+ *    @param notes: note powers organized as (chunk, 12 * octave + note)
+ *    @param flags: output of mark_events
+ *    @param offsets: output of scan_counts
+ *    @param chunk_offset: index of the first chunk relative to the stream
+ *    @param events: (chunk, note, is_note_on, power bits) of each event
+ */
+__kernel void write_events(__read_only __global float* notes, __read_only __global uchar* flags, __read_only __global uint* offsets, unsigned int chunk_offset, __write_only __global uint4* events)
+{
+	unsigned int chunk_id = get_global_id(0);
+	unsigned int index = offsets[chunk_id];
+
+	for (unsigned int i = 0; i < N_NOTES; ++i)
+	{
+		uchar flag = flags[chunk_id * N_NOTES + i];
+		if (flag)
+		{
+			events[index++] = (uint4)(chunk_offset + chunk_id, i, flag == 1, as_uint(notes[chunk_id * N_NOTES + i]));
+		}
+	}
+}
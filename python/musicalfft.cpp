@@ -0,0 +1,1645 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "audio_reader.h"
+#include "ffthw.h"
+#include "note_index.h"
+#include "note_profile.h"
+#include "note_sink.h"
+
+#include <stdexcept>
+#include <string>
+#include <string.h>
+#include <vector>
+
+
+/*! Python extension module over WavFile, MusicalFFT, NoteProfile and
+ *  NoteIndex
+ *
+ *  Arrays are exchanged through the buffer protocol: inputs are read in place
+ *  from any C-contiguous buffer (NumPy arrays, array.array, ...), outputs are
+ *  either written into a buffer of the caller or returned as an Array, which
+ *  NumPy wraps without copying (numpy.asarray)
+ *
+ *  The GIL is released while files are read and while the device works, so
+ *  several Python threads can keep the device busy; like the C++ classes, an
+ *  object is used by one thread at a time, which is checked
+ */
+
+
+/* ------------------------------------------------------------------------ */
+/* Helpers                                                                  */
+/* ------------------------------------------------------------------------ */
+
+
+/*! Run a function without the GIL; C++ exceptions become RuntimeError
+ *    @return false if an exception was raised
+ */
+template <typename F>
+static bool runWithoutGIL(F function)
+{
+	std::string error;
+	bool failed = false;
+	Py_BEGIN_ALLOW_THREADS
+	try
+	{
+		function();
+	}
+	catch (const std::exception& e)
+	{
+		failed = true;
+		error = e.what();
+	}
+	Py_END_ALLOW_THREADS
+	if (failed)
+	{
+		PyErr_SetString(PyExc_RuntimeError, error.c_str());
+	}
+	return !failed;
+}
+
+
+/*! Marks an object as in use for the lifetime of the guard; fails with
+ *  RuntimeError if another thread is using the object
+ */
+class UseGuard
+{
+public:
+	UseGuard(bool* busy) :
+		busy(busy),
+		acquired(!*busy)
+	{
+		if (acquired)
+		{
+			*busy = true;
+		}
+		else
+		{
+			PyErr_SetString(PyExc_RuntimeError, "Object is in use by another thread");
+		}
+	}
+
+	~UseGuard()
+	{
+		if (acquired)
+		{
+			*busy = false;
+		}
+	}
+
+	bool isAcquired() const
+	{
+		return acquired;
+	}
+
+protected:
+	bool* busy;
+	bool acquired;
+};
+
+
+/*! Holds a reference to an object until the end of the scope, so the object
+ *  outlives a call that releases the GIL even if its other references are
+ *  dropped meanwhile
+ */
+class ReferenceGuard
+{
+public:
+	ReferenceGuard(PyObject* object) :
+		object(object)
+	{
+		Py_INCREF(object);
+	}
+
+	~ReferenceGuard()
+	{
+		Py_DECREF(object);
+	}
+
+protected:
+	PyObject* object;
+};
+
+
+/*! Compare a struct format of a buffer with a native type code, ignoring the
+ *  byte order prefixes that mean native order
+ */
+static bool hasFormat(const char* format, const char type_code)
+{
+	if (!format) return type_code == 'B';
+	if (*format == '@' || *format == '=' || (*format == '<' && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
+	{
+		++format;
+	}
+	return format[0] == type_code && format[1] == '\0';
+}
+
+
+/*! Get a C-contiguous buffer of 32-bit floats */
+static bool getFloatBuffer(PyObject* obj, Py_buffer* view, const bool writable)
+{
+	if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) != 0)
+	{
+		return false;
+	}
+	if (view->itemsize != sizeof(float) || !hasFormat(view->format, 'f'))
+	{
+		PyBuffer_Release(view);
+		PyErr_SetString(PyExc_TypeError, "Expected a buffer of 32-bit floats");
+		return false;
+	}
+	return true;
+}
+
+
+/*! Get a C-contiguous buffer of 16-bit samples, one row of interleaved
+ *  samples per frame
+ *    @param n_channels: output for the number of samples per frame
+ */
+static bool getPcm16Buffer(PyObject* obj, Py_buffer* view, size_t* n_channels)
+{
+	if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+	{
+		return false;
+	}
+	if (view->itemsize != sizeof(int16_t) || !hasFormat(view->format, 'h') || view->ndim < 1 || view->ndim > 2)
+	{
+		PyBuffer_Release(view);
+		PyErr_SetString(PyExc_TypeError, "Expected a buffer of 16-bit integers of shape (n_frames,) or (n_frames, n_channels)");
+		return false;
+	}
+	*n_channels = view->ndim == 2 ? (size_t)view->shape[1] : 1;
+	return true;
+}
+
+
+/*! Convert a sequence of numbers into weights */
+static bool getWeights(PyObject* obj, std::vector<float>* weights)
+{
+	PyObject* sequence = PySequence_Fast(obj, "Weights must be a sequence of numbers");
+	if (!sequence) return false;
+	const Py_ssize_t n_weights = PySequence_Fast_GET_SIZE(sequence);
+	for (Py_ssize_t i = 0; i < n_weights; ++i)
+	{
+		const double weight = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(sequence, i));
+		if (weight == -1.0 && PyErr_Occurred())
+		{
+			Py_DECREF(sequence);
+			return false;
+		}
+		weights->push_back((float)weight);
+	}
+	Py_DECREF(sequence);
+	return true;
+}
+
+
+/*! Struct format of the notes of a precision */
+static const char* getNotePrecisionFormat(const NotePrecision precision)
+{
+	switch (precision)
+	{
+		case NOTE_PRECISION_FLOAT16: return "e";
+		case NOTE_PRECISION_LOG8: return "B";
+		default: return "f";
+	}
+}
+
+
+static bool checkNotePrecision(const long precision)
+{
+	if (precision < NOTE_PRECISION_FLOAT32 || precision > NOTE_PRECISION_LOG8)
+	{
+		PyErr_SetString(PyExc_ValueError, "Unknown note precision");
+		return false;
+	}
+	return true;
+}
+
+
+/* ------------------------------------------------------------------------ */
+/* Array                                                                    */
+/* ------------------------------------------------------------------------ */
+
+
+#define ARRAY_MAX_DIMS 3
+
+
+/*! Array exposed through the buffer protocol; it either owns its memory or
+ *  views the memory of another object, which it keeps alive
+ */
+typedef struct
+{
+	PyObject_HEAD
+	PyObject* owner;
+	Py_ssize_t* owner_exports;
+	char* data;
+	bool readonly;
+	const char* format;
+	Py_ssize_t itemsize;
+	int ndim;
+	Py_ssize_t shape[ARRAY_MAX_DIMS];
+	Py_ssize_t strides[ARRAY_MAX_DIMS];
+} ArrayObject;
+
+
+static PyTypeObject ArrayType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+
+static void Array_dealloc(ArrayObject* self)
+{
+	if (self->owner)
+	{
+		--*self->owner_exports;
+		Py_DECREF(self->owner);
+	}
+	else
+	{
+		PyMem_Free(self->data);
+	}
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static Py_ssize_t Array_getLength(const ArrayObject* self)
+{
+	Py_ssize_t length = self->itemsize;
+	for (int i = 0; i < self->ndim; ++i)
+	{
+		length *= self->shape[i];
+	}
+	return length;
+}
+
+
+static void Array_setShape(ArrayObject* self, const int ndim, const Py_ssize_t* shape)
+{
+	self->ndim = ndim;
+	Py_ssize_t stride = self->itemsize;
+	for (int i = ndim - 1; i >= 0; --i)
+	{
+		self->shape[i] = shape[i];
+		self->strides[i] = stride;
+		stride *= shape[i];
+	}
+}
+
+
+/*! Create an array which owns uninitialized, writable memory */
+static ArrayObject* newArray(const char* format, const Py_ssize_t itemsize, const int ndim, const Py_ssize_t* shape)
+{
+	ArrayObject* self = PyObject_New(ArrayObject, &ArrayType);
+	if (!self) return nullptr;
+	self->owner = nullptr;
+	self->owner_exports = nullptr;
+	self->readonly = false;
+	self->format = format;
+	self->itemsize = itemsize;
+	Array_setShape(self, ndim, shape);
+	self->data = static_cast<char*>(PyMem_Malloc(Array_getLength(self) ? Array_getLength(self) : 1));
+	if (!self->data)
+	{
+		Py_DECREF(self);
+		return reinterpret_cast<ArrayObject*>(PyErr_NoMemory());
+	}
+	return self;
+}
+
+
+/*! Create a read-only array over memory of an owner; the owner counts the
+ *  arrays viewing it, so it can refuse to modify the memory
+ */
+static ArrayObject* newArrayView(PyObject* owner, Py_ssize_t* owner_exports, const void* data, const char* format, const Py_ssize_t itemsize, const int ndim, const Py_ssize_t* shape)
+{
+	ArrayObject* self = PyObject_New(ArrayObject, &ArrayType);
+	if (!self) return nullptr;
+	Py_INCREF(owner);
+	self->owner = owner;
+	self->owner_exports = owner_exports;
+	++*owner_exports;
+	self->data = const_cast<char*>(static_cast<const char*>(data));
+	self->readonly = true;
+	self->format = format;
+	self->itemsize = itemsize;
+	Array_setShape(self, ndim, shape);
+	return self;
+}
+
+
+static int Array_getbuffer(ArrayObject* self, Py_buffer* view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) && self->readonly)
+	{
+		PyErr_SetString(PyExc_BufferError, "Array is read-only");
+		view->obj = nullptr;
+		return -1;
+	}
+
+	// The memory is always C-contiguous
+	view->buf = self->data;
+	view->obj = (PyObject*)self;
+	Py_INCREF(self);
+	view->len = Array_getLength(self);
+	view->readonly = self->readonly;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->format) : nullptr;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : nullptr;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : nullptr;
+	view->suboffsets = nullptr;
+	view->internal = nullptr;
+	return 0;
+}
+
+
+static PyObject* Array_getShape(ArrayObject* self, void*)
+{
+	PyObject* shape = PyTuple_New(self->ndim);
+	if (!shape) return nullptr;
+	for (int i = 0; i < self->ndim; ++i)
+	{
+		PyTuple_SET_ITEM(shape, i, PyLong_FromSsize_t(self->shape[i]));
+	}
+	return shape;
+}
+
+
+static PyObject* Array_getFormat(ArrayObject* self, void*)
+{
+	return PyUnicode_FromString(self->format);
+}
+
+
+static PyBufferProcs Array_as_buffer = {
+	(getbufferproc)Array_getbuffer,
+	nullptr
+};
+
+
+static PyGetSetDef Array_getset[] = {
+	{ "shape", (getter)Array_getShape, nullptr, "Dimensions of the array", nullptr },
+	{ "format", (getter)Array_getFormat, nullptr, "Struct format of the elements", nullptr },
+	{ nullptr }
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* WavFile                                                                  */
+/* ------------------------------------------------------------------------ */
+
+
+typedef struct
+{
+	PyObject_HEAD
+	AudioReader* file;
+	bool busy;
+} WavFileObject;
+
+
+static PyTypeObject WavFileType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+
+static void WavFile_dealloc(WavFileObject* self)
+{
+	delete self->file;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static int WavFile_init(WavFileObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "fname", nullptr };
+	const char* fname = nullptr;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", const_cast<char**>(keywords), &fname)) return -1;
+
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return -1;
+
+	AudioReader* file = nullptr;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { file = AudioReader::open(path).release(); })) return -1;
+	delete self->file;
+	self->file = file;
+	return 0;
+}
+
+
+static bool WavFile_check(WavFileObject* self)
+{
+	if (!self->file)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "WavFile is not initialized");
+		return false;
+	}
+	return true;
+}
+
+
+/*! Read samples into per-channel rows of a float buffer */
+static bool WavFile_readRows(WavFileObject* self, float* output, const size_t n_samples, size_t* n_read)
+{
+	const size_t n_channels = self->file->getNumChannels();
+	std::vector<float*> outputs(n_channels);
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		outputs[c] = output + c * n_samples;
+	}
+	AudioReader* file = self->file;
+	return runWithoutGIL([&]() { *n_read = file->readSamples(n_samples, outputs); });
+}
+
+
+static PyObject* WavFile_read(WavFileObject* self, PyObject* args)
+{
+	Py_ssize_t n_samples = 0;
+	if (!PyArg_ParseTuple(args, "n", &n_samples)) return nullptr;
+	if (!WavFile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	if (n_samples < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Number of samples must not be negative");
+		return nullptr;
+	}
+
+	const Py_ssize_t n_channels = self->file->getNumChannels();
+	const Py_ssize_t shape[] = { n_channels, n_samples };
+	ArrayObject* output = newArray("f", sizeof(float), 2, shape);
+	if (!output) return nullptr;
+
+	size_t n_read = 0;
+	float* data = reinterpret_cast<float*>(output->data);
+	if (!WavFile_readRows(self, data, n_samples, &n_read))
+	{
+		Py_DECREF(output);
+		return nullptr;
+	}
+
+	// Only the end of the file is shorter; close the gaps between the rows
+	if ((Py_ssize_t)n_read < n_samples)
+	{
+		for (Py_ssize_t c = 1; c < n_channels; ++c)
+		{
+			memmove(data + c * n_read, data + c * n_samples, n_read * sizeof(float));
+		}
+		const Py_ssize_t read_shape[] = { n_channels, (Py_ssize_t)n_read };
+		Array_setShape(output, 2, read_shape);
+	}
+	return (PyObject*)output;
+}
+
+
+static PyObject* WavFile_readinto(WavFileObject* self, PyObject* args)
+{
+	PyObject* out = nullptr;
+	if (!PyArg_ParseTuple(args, "O", &out)) return nullptr;
+	if (!WavFile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	Py_buffer view;
+	if (!getFloatBuffer(out, &view, true)) return nullptr;
+
+	// The buffer holds one row per channel
+	const size_t n_channels = self->file->getNumChannels();
+	const size_t n_samples = view.len / sizeof(float) / n_channels;
+	size_t n_read = 0;
+	bool ok = WavFile_readRows(self, static_cast<float*>(view.buf), n_samples, &n_read);
+	PyBuffer_Release(&view);
+	if (!ok) return nullptr;
+	return PyLong_FromSize_t(n_read);
+}
+
+
+static PyObject* WavFile_skip(WavFileObject* self, PyObject* args)
+{
+	Py_ssize_t n_samples = 0;
+	if (!PyArg_ParseTuple(args, "n", &n_samples)) return nullptr;
+	if (!WavFile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	size_t n_skipped = 0;
+	AudioReader* file = self->file;
+	if (!runWithoutGIL([&]() { n_skipped = file->skipSamples(n_samples); })) return nullptr;
+	return PyLong_FromSize_t(n_skipped);
+}
+
+
+static PyObject* WavFile_getSampleRate(WavFileObject* self, void*)
+{
+	if (!WavFile_check(self)) return nullptr;
+	return PyFloat_FromDouble(self->file->getSampleRate());
+}
+
+
+static PyObject* WavFile_getNumChannels(WavFileObject* self, void*)
+{
+	if (!WavFile_check(self)) return nullptr;
+	return PyLong_FromLong((long)self->file->getNumChannels());
+}
+
+
+static PyObject* WavFile_getNumSamplesRemaining(WavFileObject* self, void*)
+{
+	if (!WavFile_check(self)) return nullptr;
+	return PyLong_FromSize_t(self->file->getNumSamplesRemaining());
+}
+
+
+static PyMethodDef WavFile_methods[] = {
+	{ "read", (PyCFunction)WavFile_read, METH_VARARGS, "read(n_samples) -> Array of shape (n_channels, n_read)" },
+	{ "readinto", (PyCFunction)WavFile_readinto, METH_VARARGS, "readinto(out) -> n_read; out is a float32 buffer of n_channels rows" },
+	{ "skip", (PyCFunction)WavFile_skip, METH_VARARGS, "skip(n_samples) -> number of samples skipped" },
+	{ nullptr }
+};
+
+
+static PyGetSetDef WavFile_getset[] = {
+	{ "sample_rate", (getter)WavFile_getSampleRate, nullptr, "Samples per second", nullptr },
+	{ "n_channels", (getter)WavFile_getNumChannels, nullptr, "Number of channels", nullptr },
+	{ "samples_remaining", (getter)WavFile_getNumSamplesRemaining, nullptr, "Samples per channel left to read", nullptr },
+	{ nullptr }
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* MusicalFFT                                                               */
+/* ------------------------------------------------------------------------ */
+
+
+typedef struct
+{
+	PyObject_HEAD
+	MusicalFFT* mfft;
+	bool busy;
+} MusicalFFTObject;
+
+
+static PyTypeObject MusicalFFTType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+
+static void MusicalFFT_dealloc(MusicalFFTObject* self)
+{
+	if (self->mfft)
+	{
+		// The destructor waits for the device
+		MusicalFFT* mfft = self->mfft;
+		runWithoutGIL([&]() { delete mfft; });
+		PyErr_Clear();
+	}
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static int MusicalFFT_init(MusicalFFTObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "out_of_order", "device", nullptr };
+	int out_of_order = 0;
+	Py_ssize_t device_index = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pn", const_cast<char**>(keywords), &out_of_order, &device_index)) return -1;
+	if (device_index < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "device must not be negative");
+		return -1;
+	}
+
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return -1;
+
+	MusicalFFT* mfft = nullptr;
+	if (!runWithoutGIL([&]() { mfft = new MusicalFFT(OpenCLContext::getInstance(), out_of_order != 0, (size_t)device_index); })) return -1;
+	delete self->mfft;
+	self->mfft = mfft;
+	return 0;
+}
+
+
+static bool MusicalFFT_check(MusicalFFTObject* self)
+{
+	if (!self->mfft)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "MusicalFFT is not initialized");
+		return false;
+	}
+	return true;
+}
+
+
+static PyObject* MusicalFFT_runFFT(MusicalFFTObject* self, PyObject* args)
+{
+	float data_rate = 0;
+	PyObject* signal = nullptr;
+	Py_ssize_t samples_per_chunk = 0;
+	float base_note_freq = 0;
+	if (!PyArg_ParseTuple(args, "fOnf", &data_rate, &signal, &samples_per_chunk, &base_note_freq)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	if (samples_per_chunk <= 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Chunks must be spaced by at least one sample");
+		return nullptr;
+	}
+
+	// The signal is uploaded straight from the buffer
+	Py_buffer view;
+	if (!getFloatBuffer(signal, &view, false)) return nullptr;
+	size_t n_chunks = 0;
+	MusicalFFT* mfft = self->mfft;
+	const float* data = static_cast<const float*>(view.buf);
+	const size_t n_signal = view.len / sizeof(float);
+	bool ok = runWithoutGIL([&]() { n_chunks = mfft->runFFT(data_rate, n_signal, data, samples_per_chunk, base_note_freq); });
+	PyBuffer_Release(&view);
+	if (!ok) return nullptr;
+	return PyLong_FromSize_t(n_chunks);
+}
+
+
+static PyObject* MusicalFFT_runFFTPcm16(MusicalFFTObject* self, PyObject* args)
+{
+	float data_rate = 0;
+	PyObject* samples = nullptr;
+	PyObject* weights_object = nullptr;
+	Py_ssize_t samples_per_chunk = 0;
+	float base_note_freq = 0;
+	if (!PyArg_ParseTuple(args, "fOOnf", &data_rate, &samples, &weights_object, &samples_per_chunk, &base_note_freq)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	if (samples_per_chunk <= 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Chunks must be spaced by at least one sample");
+		return nullptr;
+	}
+	std::vector<float> weights;
+	if (!getWeights(weights_object, &weights)) return nullptr;
+
+	// The raw frames are uploaded straight from the buffer
+	Py_buffer view;
+	size_t n_channels = 0;
+	if (!getPcm16Buffer(samples, &view, &n_channels)) return nullptr;
+	if (weights.size() != n_channels)
+	{
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_ValueError, "There must be a weight for every channel");
+		return nullptr;
+	}
+	size_t n_chunks = 0;
+	MusicalFFT* mfft = self->mfft;
+	const int16_t* data = static_cast<const int16_t*>(view.buf);
+	const size_t n_frames = view.len / sizeof(int16_t) / n_channels;
+	bool ok = runWithoutGIL([&]() { n_chunks = mfft->runFFT(data_rate, n_frames, data, n_channels, weights.data(), samples_per_chunk, base_note_freq); });
+	PyBuffer_Release(&view);
+	if (!ok) return nullptr;
+	return PyLong_FromSize_t(n_chunks);
+}
+
+
+static PyObject* MusicalFFT_warmUp(MusicalFFTObject* self, PyObject* args)
+{
+	float data_rate = 0;
+	Py_ssize_t samples_per_chunk = 0;
+	float base_note_freq = 0;
+	if (!PyArg_ParseTuple(args, "fnf", &data_rate, &samples_per_chunk, &base_note_freq)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	if (samples_per_chunk <= 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Chunks must be spaced by at least one sample");
+		return nullptr;
+	}
+
+	// Only starts the build; it continues after the call returns
+	MusicalFFT* mfft = self->mfft;
+	if (!runWithoutGIL([&]() { mfft->warmUp(data_rate, samples_per_chunk, base_note_freq); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+/*! Resolve the output of a read: the buffer of the caller, or a new array
+ *    @param out: buffer of the caller or None
+ *    @param view: filled in if out is a buffer
+ *    @param array: set to a new array if out is None
+ *    @return pointer to at least n_bytes bytes of output
+ */
+static char* prepareOutput(PyObject* out, Py_buffer* view, ArrayObject** array, const char* format, const Py_ssize_t itemsize, const int ndim, const Py_ssize_t* shape)
+{
+	Py_ssize_t n_bytes = itemsize;
+	for (int i = 0; i < ndim; ++i)
+	{
+		n_bytes *= shape[i];
+	}
+
+	if (out && out != Py_None)
+	{
+		if (PyObject_GetBuffer(out, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | PyBUF_WRITABLE) != 0) return nullptr;
+		if (view->itemsize != itemsize || !hasFormat(view->format, format[0]) || view->len < n_bytes)
+		{
+			PyBuffer_Release(view);
+			PyErr_Format(PyExc_ValueError, "Output must be a buffer of at least %zd elements of format '%s'", n_bytes / itemsize, format);
+			return nullptr;
+		}
+		return static_cast<char*>(view->buf);
+	}
+
+	*array = newArray(format, itemsize, ndim, shape);
+	return *array ? (*array)->data : nullptr;
+}
+
+
+/*! Return the buffer of the caller or the new array */
+static PyObject* finishOutput(PyObject* out, Py_buffer* view, ArrayObject* array, const bool ok)
+{
+	if (array)
+	{
+		if (ok) return (PyObject*)array;
+		Py_DECREF(array);
+		return nullptr;
+	}
+	PyBuffer_Release(view);
+	if (!ok) return nullptr;
+	Py_INCREF(out);
+	return out;
+}
+
+
+static PyObject* MusicalFFT_readNotes(MusicalFFTObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "out", nullptr };
+	PyObject* out = nullptr;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", const_cast<char**>(keywords), &out)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	MusicalFFT* mfft = self->mfft;
+	const Py_ssize_t shape[] = { (Py_ssize_t)mfft->getNumChunks(), N_NOTES_PER_CHUNK };
+	Py_buffer view;
+	ArrayObject* array = nullptr;
+	char* output = prepareOutput(out, &view, &array, "f", sizeof(float), 2, shape);
+	if (!output) return nullptr;
+
+	// 32-bit notes go straight from the device to the output; narrow notes
+	// are widened into it
+	const size_t n_values = shape[0] * shape[1];
+	bool ok = runWithoutGIL([&]()
+	{
+		const NotePrecision precision = mfft->getNotePrecision();
+		if (precision == NOTE_PRECISION_FLOAT32)
+		{
+			mfft->readNotesPackedTo(reinterpret_cast<uint8_t*>(output), n_values * sizeof(float));
+		}
+		else
+		{
+			const uint8_t* packed_notes = mfft->readNotesPacked(nullptr, nullptr);
+			if (packed_notes)
+			{
+				widenNotes(packed_notes, n_values, precision, reinterpret_cast<float*>(output));
+			}
+		}
+	});
+	return finishOutput(out, &view, array, ok);
+}
+
+
+static PyObject* MusicalFFT_readNotesPacked(MusicalFFTObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "out", nullptr };
+	PyObject* out = nullptr;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", const_cast<char**>(keywords), &out)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	MusicalFFT* mfft = self->mfft;
+	const NotePrecision precision = mfft->getNotePrecision();
+	const Py_ssize_t itemsize = getNotePrecisionSize(precision);
+	const Py_ssize_t shape[] = { (Py_ssize_t)mfft->getNumChunks(), N_NOTES_PER_CHUNK };
+	Py_buffer view;
+	ArrayObject* array = nullptr;
+	char* output = prepareOutput(out, &view, &array, getNotePrecisionFormat(precision), itemsize, 2, shape);
+	if (!output) return nullptr;
+
+	const size_t n_bytes = shape[0] * shape[1] * itemsize;
+	bool ok = runWithoutGIL([&]() { mfft->readNotesPackedTo(reinterpret_cast<uint8_t*>(output), n_bytes); });
+	return finishOutput(out, &view, array, ok);
+}
+
+
+/*! Convert None or a slice with a step of 1 into a range of an axis */
+static bool parseAxisRange(PyObject* obj, const Py_ssize_t length, size_t* begin, size_t* n)
+{
+	if (!obj || obj == Py_None)
+	{
+		*begin = 0;
+		*n = (size_t)length;
+		return true;
+	}
+	Py_ssize_t start, stop, step;
+	if (!PySlice_Check(obj))
+	{
+		PyErr_SetString(PyExc_TypeError, "Ranges must be slices");
+		return false;
+	}
+	if (PySlice_Unpack(obj, &start, &stop, &step) < 0) return false;
+	if (step != 1)
+	{
+		PyErr_SetString(PyExc_ValueError, "Ranges must have a step of 1");
+		return false;
+	}
+	*n = (size_t)PySlice_AdjustIndices(length, &start, &stop, step);
+	*begin = (size_t)start;
+	return true;
+}
+
+
+static PyObject* MusicalFFT_readComplete(MusicalFFTObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "out", "chunks", "notes", "overtones", nullptr };
+	PyObject* out = nullptr;
+	PyObject* chunks = nullptr;
+	PyObject* notes = nullptr;
+	PyObject* overtones = nullptr;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O$OOO", const_cast<char**>(keywords), &out, &chunks, &notes, &overtones)) return nullptr;
+	if (!MusicalFFT_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	// Only the requested part of the spectrum is transferred
+	MusicalFFT* mfft = self->mfft;
+	SpectrumRange range;
+	if (!parseAxisRange(chunks, (Py_ssize_t)mfft->getNumChunks(), &range.chunk_begin, &range.n_chunks)) return nullptr;
+	if (!parseAxisRange(notes, 12, &range.note_begin, &range.n_notes)) return nullptr;
+	if (!parseAxisRange(overtones, FFT_SIZE / 2, &range.overtone_begin, &range.n_overtones)) return nullptr;
+
+	const Py_ssize_t shape[] = { (Py_ssize_t)range.n_chunks, (Py_ssize_t)range.n_notes, (Py_ssize_t)range.n_overtones };
+	Py_buffer view;
+	ArrayObject* array = nullptr;
+	char* output = prepareOutput(out, &view, &array, "f", sizeof(float), 3, shape);
+	if (!output) return nullptr;
+
+	const size_t n_values = shape[0] * shape[1] * shape[2];
+	const bool is_complete = range.n_chunks == mfft->getNumChunks() && range.n_notes == 12 && range.n_overtones == FFT_SIZE / 2;
+	bool ok = runWithoutGIL([&]()
+	{
+		if (is_complete) mfft->readCompleteTo(reinterpret_cast<float*>(output), n_values);
+		else mfft->readCompleteRangeTo(range, reinterpret_cast<float*>(output), n_values);
+	});
+	return finishOutput(out, &view, array, ok);
+}
+
+
+static PyObject* MusicalFFT_getNotePrecision(MusicalFFTObject* self, void*)
+{
+	if (!MusicalFFT_check(self)) return nullptr;
+	return PyLong_FromLong(self->mfft->getNotePrecision());
+}
+
+
+static int MusicalFFT_setNotePrecision(MusicalFFTObject* self, PyObject* value, void*)
+{
+	if (!value)
+	{
+		PyErr_SetString(PyExc_AttributeError, "Cannot delete the note precision");
+		return -1;
+	}
+	long precision = PyLong_AsLong(value);
+	if (PyErr_Occurred() || !checkNotePrecision(precision)) return -1;
+	if (!MusicalFFT_check(self)) return -1;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return -1;
+
+	// Switching plans may compile kernels
+	MusicalFFT* mfft = self->mfft;
+	return runWithoutGIL([&]() { mfft->setNotePrecision((NotePrecision)precision); }) ? 0 : -1;
+}
+
+
+static PyObject* MusicalFFT_getNumChunks(MusicalFFTObject* self, void*)
+{
+	if (!MusicalFFT_check(self)) return nullptr;
+	return PyLong_FromSize_t(self->mfft->getNumChunks());
+}
+
+
+static PyMethodDef MusicalFFT_methods[] = {
+	{ "run_fft", (PyCFunction)MusicalFFT_runFFT, METH_VARARGS, "run_fft(data_rate, signal, samples_per_chunk, base_note_freq) -> n_chunks" },
+	{ "run_fft_pcm16", (PyCFunction)MusicalFFT_runFFTPcm16, METH_VARARGS, "run_fft_pcm16(data_rate, samples, weights, samples_per_chunk, base_note_freq) -> n_chunks; int16 samples of shape (n_frames, n_channels) are converted and mixed on the device" },
+	{ "warm_up", (PyCFunction)MusicalFFT_warmUp, METH_VARARGS, "warm_up(data_rate, samples_per_chunk, base_note_freq); compile the kernels of a configuration in the background" },
+	{ "read_notes", (PyCFunction)MusicalFFT_readNotes, METH_VARARGS | METH_KEYWORDS, "read_notes(out=None) -> float32 notes of shape (n_chunks, n_notes)" },
+	{ "read_notes_packed", (PyCFunction)MusicalFFT_readNotesPacked, METH_VARARGS | METH_KEYWORDS, "read_notes_packed(out=None) -> notes in the note precision" },
+	{ "read_complete", (PyCFunction)MusicalFFT_readComplete, METH_VARARGS | METH_KEYWORDS, "read_complete(out=None, *, chunks=None, notes=None, overtones=None) -> float32 FFT of shape (n_chunks, 12, FFT_SIZE / 2), or of the given slices of each axis" },
+	{ nullptr }
+};
+
+
+static PyGetSetDef MusicalFFT_getset[] = {
+	{ "note_precision", (getter)MusicalFFT_getNotePrecision, (setter)MusicalFFT_setNotePrecision, "Format of packed notes", nullptr },
+	{ "n_chunks", (getter)MusicalFFT_getNumChunks, nullptr, "Number of chunks of the last FFT", nullptr },
+	{ nullptr }
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* NoteProfile                                                              */
+/* ------------------------------------------------------------------------ */
+
+
+typedef struct
+{
+	PyObject_HEAD
+	NoteProfile* profile;
+	bool busy;
+
+	// Arrays viewing the memory of the profile
+	Py_ssize_t n_exports;
+} NoteProfileObject;
+
+
+static PyTypeObject NoteProfileType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+
+static void NoteProfile_dealloc(NoteProfileObject* self)
+{
+	delete self->profile;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static int NoteProfile_init(NoteProfileObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "base_note_id", "precision", nullptr };
+	int base_note_id = 0;
+	long precision = NOTE_PRECISION_FLOAT32;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|l", const_cast<char**>(keywords), &base_note_id, &precision)) return -1;
+	if (!checkNotePrecision(precision)) return -1;
+
+	// The profile may be filled by another thread without the GIL
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return -1;
+	if (self->n_exports > 0)
+	{
+		PyErr_SetString(PyExc_BufferError, "Arrays of the profile are still in use");
+		return -1;
+	}
+
+	delete self->profile;
+	self->profile = new NoteProfile(base_note_id, (NotePrecision)precision);
+	return 0;
+}
+
+
+static bool NoteProfile_check(NoteProfileObject* self)
+{
+	if (!self->profile)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "NoteProfile is not initialized");
+		return false;
+	}
+	return true;
+}
+
+
+/*! Check that the profile exists and may be modified */
+static bool NoteProfile_checkModifiable(NoteProfileObject* self)
+{
+	if (!NoteProfile_check(self)) return false;
+	if (self->busy)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "Object is in use by another thread");
+		return false;
+	}
+	if (self->n_exports > 0)
+	{
+		PyErr_SetString(PyExc_BufferError, "Arrays of the profile are still in use");
+		return false;
+	}
+	return true;
+}
+
+
+static PyObject* NoteProfile_fromWav(NoteProfileObject* self, PyObject* args)
+{
+	const char* fname = nullptr;
+	float a4_freq = 0;
+	Py_ssize_t samples_per_chunk = 0;
+	if (!PyArg_ParseTuple(args, "sfn", &fname, &a4_freq, &samples_per_chunk)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	NoteProfile* profile = self->profile;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { profile->fromWav(path, a4_freq, samples_per_chunk); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_eventsFromWav(NoteProfileObject* self, PyObject* args)
+{
+	const char* fname = nullptr;
+	float a4_freq = 0;
+	Py_ssize_t samples_per_chunk = 0;
+	NoteEventThresholds thresholds;
+	if (!PyArg_ParseTuple(args, "sfnfff", &fname, &a4_freq, &samples_per_chunk, &thresholds.on_threshold, &thresholds.off_threshold, &thresholds.onset_ratio)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	NoteProfile* profile = self->profile;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { profile->eventsFromWav(path, a4_freq, samples_per_chunk, thresholds); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_loadNotes(NoteProfileObject* self, PyObject* args)
+{
+	const char* fname = nullptr;
+	if (!PyArg_ParseTuple(args, "s", &fname)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	NoteProfile* profile = self->profile;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { NoteFileSink::replay(path, *profile); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_setResampling(NoteProfileObject* self, PyObject* args)
+{
+	int enable = 0;
+	if (!PyArg_ParseTuple(args, "p", &enable)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	self->profile->setResampling(enable != 0);
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_setDownmix(NoteProfileObject* self, PyObject* args)
+{
+	int enable = 0;
+	PyObject* weights_object = Py_None;
+	if (!PyArg_ParseTuple(args, "p|O", &enable, &weights_object)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+
+	// Converting the weights may run Python code, which must not use the
+	// profile in the meantime
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	std::vector<float> weights;
+	if (weights_object != Py_None && !getWeights(weights_object, &weights)) return nullptr;
+	self->profile->setDownmix(enable != 0, weights);
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_setPyramid(NoteProfileObject* self, PyObject* args)
+{
+	int enable = 0;
+	if (!PyArg_ParseTuple(args, "p", &enable)) return nullptr;
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	self->profile->setPyramid(enable != 0);
+	Py_RETURN_NONE;
+}
+
+
+/*! Sum, mean or maximum of every note over a range of chunks from the pyramid */
+static PyObject* NoteProfile_queryRange(NoteProfileObject* self, PyObject* args)
+{
+	Py_ssize_t first = 0, last = 0;
+	const char* statistic = "sum";
+	if (!PyArg_ParseTuple(args, "nn|s", &first, &last, &statistic)) return nullptr;
+	if (!NoteProfile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	const NotePyramid* pyramid = self->profile->getPyramid();
+	if (!pyramid)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "The pyramid of the profile is not enabled");
+		return nullptr;
+	}
+	if (first < 0 || last <= first || (size_t)last > pyramid->getNumChunks())
+	{
+		PyErr_SetString(PyExc_IndexError, "Range of chunks is empty or out of bounds");
+		return nullptr;
+	}
+
+	const std::string name(statistic);
+	if (name != "sum" && name != "mean" && name != "max")
+	{
+		PyErr_SetString(PyExc_ValueError, "Statistic must be 'sum', 'mean' or 'max'");
+		return nullptr;
+	}
+	const Py_ssize_t shape[] = { (Py_ssize_t)pyramid->getNotesPerChunk() };
+	ArrayObject* output = newArray("f", sizeof(float), 1, shape);
+	if (!output) return nullptr;
+	float* values = reinterpret_cast<float*>(output->data);
+	if (name == "sum") pyramid->getRangeSum(first, last, values);
+	else if (name == "mean") pyramid->getRangeMean(first, last, values);
+	else pyramid->getRangeMax(first, last, values);
+	return (PyObject*)output;
+}
+
+
+static PyObject* NoteProfile_setNumSegments(NoteProfileObject* self, PyObject* args)
+{
+	Py_ssize_t n_segments = 0;
+	if (!PyArg_ParseTuple(args, "n", &n_segments)) return nullptr;
+	if (n_segments < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Number of segments must not be negative");
+		return nullptr;
+	}
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	self->profile->setNumSegments((size_t)n_segments);
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteProfile_setCheckpoint(NoteProfileObject* self, PyObject* args)
+{
+	const char* fname = nullptr;
+	Py_ssize_t n_chunks_per_checkpoint = 0;
+	if (!PyArg_ParseTuple(args, "z|n", &fname, &n_chunks_per_checkpoint)) return nullptr;
+	if (n_chunks_per_checkpoint < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Number of chunks per checkpoint must not be negative");
+		return nullptr;
+	}
+	if (!NoteProfile_checkModifiable(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	self->profile->setCheckpoint(fname ? fname : "", (size_t)n_chunks_per_checkpoint);
+	Py_RETURN_NONE;
+}
+
+
+/*! Read-only array over memory of the profile; memory that does not exist,
+ *  such as the notes of a profile of events, is an empty array
+ */
+static PyObject* NoteProfile_newView(NoteProfileObject* self, const void* data, const char* format, const Py_ssize_t itemsize, const int ndim, Py_ssize_t* shape)
+{
+	if (!data)
+	{
+		shape[0] = 0;
+		ArrayObject* output = newArray(format, itemsize, ndim, shape);
+		if (output) output->readonly = true;
+		return (PyObject*)output;
+	}
+	return (PyObject*)newArrayView((PyObject*)self, &self->n_exports, data, format, itemsize, ndim, shape);
+}
+
+
+static PyObject* NoteProfile_getNotes(NoteProfileObject* self, void*)
+{
+	if (!NoteProfile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	const NotePrecision precision = self->profile->getNotePrecision();
+	Py_ssize_t shape[] = { (Py_ssize_t)self->profile->getNumChunks(), (Py_ssize_t)self->profile->getNotesPerChunk() };
+	return NoteProfile_newView(self, self->profile->getPackedNotesByIndex(0), getNotePrecisionFormat(precision), getNotePrecisionSize(precision), 2, shape);
+}
+
+
+static PyObject* NoteProfile_getTimestamps(NoteProfileObject* self, void*)
+{
+	if (!NoteProfile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	Py_ssize_t shape[] = { (Py_ssize_t)self->profile->getNumChunks() };
+	return NoteProfile_newView(self, self->profile->getTimestamps(), "Q", sizeof(uint64_t), 1, shape);
+}
+
+
+static PyObject* NoteProfile_getEvents(NoteProfileObject* self, void*)
+{
+	if (!NoteProfile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	// One record of (chunk_index, note, is_note_on, power) per event
+	Py_ssize_t shape[] = { (Py_ssize_t)self->profile->getNumEvents() };
+	return NoteProfile_newView(self, self->profile->getEventByIndex(0), "IIIf", sizeof(NoteEvent), 1, shape);
+}
+
+
+static PyObject* NoteProfile_getInteger(NoteProfileObject* self, void* closure)
+{
+	if (!NoteProfile_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	const std::string name(static_cast<const char*>(closure));
+	if (name == "base_note_id") return PyLong_FromLong(self->profile->getBaseNoteId());
+	else if (name == "samples_per_second") return PyLong_FromUnsignedLongLong(self->profile->getSamplesPerSecond());
+	else if (name == "samples_per_chunk") return PyLong_FromSize_t(self->profile->getSamplesPerChunk());
+	else if (name == "notes_per_chunk") return PyLong_FromSize_t(self->profile->getNotesPerChunk());
+	else if (name == "n_chunks") return PyLong_FromSize_t(self->profile->getNumChunks());
+	else return PyLong_FromLong(self->profile->getNotePrecision());
+}
+
+
+static PyMethodDef NoteProfile_methods[] = {
+	{ "from_wav", (PyCFunction)NoteProfile_fromWav, METH_VARARGS, "from_wav(fname, a4_freq, samples_per_chunk)" },
+	{ "events_from_wav", (PyCFunction)NoteProfile_eventsFromWav, METH_VARARGS, "events_from_wav(fname, a4_freq, samples_per_chunk, on_threshold, off_threshold, onset_ratio)" },
+	{ "load_notes", (PyCFunction)NoteProfile_loadNotes, METH_VARARGS, "load_notes(fname); read a note file written by a NoteFileSink" },
+	{ "set_resampling", (PyCFunction)NoteProfile_setResampling, METH_VARARGS, "set_resampling(enable)" },
+	{ "set_downmix", (PyCFunction)NoteProfile_setDownmix, METH_VARARGS, "set_downmix(enable, weights=None)" },
+	{ "set_pyramid", (PyCFunction)NoteProfile_setPyramid, METH_VARARGS, "set_pyramid(enable)" },
+	{ "query_range", (PyCFunction)NoteProfile_queryRange, METH_VARARGS, "query_range(first, last, statistic='sum'); 'sum', 'mean' or 'max' of every note over chunks [first, last)" },
+	{ "set_num_segments", (PyCFunction)NoteProfile_setNumSegments, METH_VARARGS, "set_num_segments(n_segments); 0 uses a segment per hardware thread" },
+	{ "set_checkpoint", (PyCFunction)NoteProfile_setCheckpoint, METH_VARARGS, "set_checkpoint(fname, chunks_per_checkpoint=0); None disables checkpoints" },
+	{ nullptr }
+};
+
+
+static PyGetSetDef NoteProfile_getset[] = {
+	{ "notes", (getter)NoteProfile_getNotes, nullptr, "Read-only notes of shape (n_chunks, notes_per_chunk) in the note precision", nullptr },
+	{ "timestamps", (getter)NoteProfile_getTimestamps, nullptr, "Read-only sample index of each chunk", nullptr },
+	{ "events", (getter)NoteProfile_getEvents, nullptr, "Read-only records of (chunk_index, note, is_note_on, power)", nullptr },
+	{ "base_note_id", (getter)NoteProfile_getInteger, nullptr, "MIDI note number of the lowest note", (void*)"base_note_id" },
+	{ "samples_per_second", (getter)NoteProfile_getInteger, nullptr, "Sample rate of the timestamps", (void*)"samples_per_second" },
+	{ "samples_per_chunk", (getter)NoteProfile_getInteger, nullptr, "Spacing of the chunks in samples", (void*)"samples_per_chunk" },
+	{ "notes_per_chunk", (getter)NoteProfile_getInteger, nullptr, "Number of notes of each chunk", (void*)"notes_per_chunk" },
+	{ "n_chunks", (getter)NoteProfile_getInteger, nullptr, "Number of chunks", (void*)"n_chunks" },
+	{ "note_precision", (getter)NoteProfile_getInteger, nullptr, "Format of the notes", (void*)"note_precision" },
+	{ nullptr }
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* NoteIndex                                                                */
+/* ------------------------------------------------------------------------ */
+
+
+typedef struct
+{
+	PyObject_HEAD
+	NoteIndex* index;
+	bool busy;
+} NoteIndexObject;
+
+
+static PyTypeObject NoteIndexType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+
+static void NoteIndex_dealloc(NoteIndexObject* self)
+{
+	delete self->index;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+
+static int NoteIndex_init(NoteIndexObject* self, PyObject* args, PyObject* kwargs)
+{
+	static const char* keywords[] = { "feature", "shingle_size", "shingle_step", "mode", "n_threads", nullptr };
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	int feature = params.feature;
+	int mode = params.mode;
+	Py_ssize_t shingle_size = params.shingle_size;
+	Py_ssize_t shingle_step = params.shingle_step;
+	Py_ssize_t n_threads = params.n_threads;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|innin", const_cast<char**>(keywords), &feature, &shingle_size, &shingle_step, &mode, &n_threads)) return -1;
+	if (feature < NOTE_INDEX_CHROMA || feature > NOTE_INDEX_NOTES || mode < NOTE_INDEX_BRUTE_FORCE || mode > NOTE_INDEX_IVF)
+	{
+		PyErr_SetString(PyExc_ValueError, "Unknown index feature or mode");
+		return -1;
+	}
+	if (shingle_size <= 0 || shingle_step <= 0 || n_threads < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Shingles must have at least one chunk");
+		return -1;
+	}
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return -1;
+
+	params.feature = (NoteIndexFeature)feature;
+	params.mode = (NoteIndexMode)mode;
+	params.shingle_size = shingle_size;
+	params.shingle_step = shingle_step;
+	params.n_threads = n_threads;
+	delete self->index;
+	self->index = new NoteIndex(params);
+	return 0;
+}
+
+
+static bool NoteIndex_check(NoteIndexObject* self)
+{
+	if (!self->index)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "NoteIndex is not initialized");
+		return false;
+	}
+	return true;
+}
+
+
+/*! Map an index file into a new NoteIndex object */
+static PyObject* NoteIndex_open(PyObject* type, PyObject* args)
+{
+	const char* fname = nullptr;
+	if (!PyArg_ParseTuple(args, "s", &fname)) return nullptr;
+
+	NoteIndex* index = nullptr;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { index = NoteIndex::open(path).release(); })) return nullptr;
+	NoteIndexObject* self = PyObject_New(NoteIndexObject, &NoteIndexType);
+	if (!self)
+	{
+		delete index;
+		return nullptr;
+	}
+	self->index = index;
+	self->busy = false;
+	return (PyObject*)self;
+}
+
+
+static PyObject* NoteIndex_addProfile(NoteIndexObject* self, PyObject* args)
+{
+	NoteProfileObject* profile_object = nullptr;
+	if (!PyArg_ParseTuple(args, "O!", &NoteProfileType, &profile_object)) return nullptr;
+	if (!NoteIndex_check(self) || !NoteProfile_check(profile_object)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	// The profile must not change or go away while the index reads it
+	ReferenceGuard profile_reference((PyObject*)profile_object);
+	UseGuard profile_guard(&profile_object->busy);
+	if (!profile_guard.isAcquired()) return nullptr;
+
+	uint32_t profile_id = 0;
+	NoteIndex* index = self->index;
+	const NoteProfile* profile = profile_object->profile;
+	if (!runWithoutGIL([&]() { profile_id = index->addProfile(*profile); })) return nullptr;
+	return PyLong_FromUnsignedLong(profile_id);
+}
+
+
+static PyObject* NoteIndex_build(NoteIndexObject* self, PyObject*)
+{
+	if (!NoteIndex_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	NoteIndex* index = self->index;
+	if (!runWithoutGIL([&]() { index->build(); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+/*! List of (profile_id, chunk_index, similarity) tuples */
+static PyObject* newMatchList(const std::vector<NoteIndexMatch>& matches)
+{
+	PyObject* list = PyList_New(matches.size());
+	if (!list) return nullptr;
+	for (size_t i = 0; i < matches.size(); ++i)
+	{
+		PyObject* item = Py_BuildValue("(kkf)", (unsigned long)matches[i].profile_id, (unsigned long)matches[i].chunk_index, matches[i].similarity);
+		if (!item)
+		{
+			Py_DECREF(list);
+			return nullptr;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return list;
+}
+
+
+static PyObject* NoteIndex_search(NoteIndexObject* self, PyObject* args)
+{
+	PyObject* queries_object = nullptr;
+	Py_ssize_t n_matches = 10;
+	if (!PyArg_ParseTuple(args, "O|n", &queries_object, &n_matches)) return nullptr;
+	if (!NoteIndex_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	if (n_matches < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Number of matches must not be negative");
+		return nullptr;
+	}
+
+	// Queries of the dimension of the index are padded for the search
+	Py_buffer view;
+	if (!getFloatBuffer(queries_object, &view, false)) return nullptr;
+	NoteIndex* index = self->index;
+	const size_t dimension = index->getDimension();
+	const size_t stride = index->getPaddedDimension();
+	const size_t n_values = view.len / sizeof(float);
+	if (dimension == 0 || n_values % dimension != 0)
+	{
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_ValueError, "Queries must be vectors of the dimension of the index");
+		return nullptr;
+	}
+	const size_t n_queries = n_values / dimension;
+	std::vector<float> queries(n_queries * stride, 0.0f);
+	for (size_t i = 0; i < n_queries; ++i)
+	{
+		memcpy(queries.data() + i * stride, static_cast<const float*>(view.buf) + i * dimension, dimension * sizeof(float));
+	}
+	PyBuffer_Release(&view);
+
+	std::vector<std::vector<NoteIndexMatch> > matches;
+	if (!runWithoutGIL([&]() { matches = index->searchBatch(queries.data(), n_queries, n_matches); })) return nullptr;
+	PyObject* output = PyList_New(n_queries);
+	if (!output) return nullptr;
+	for (size_t i = 0; i < n_queries; ++i)
+	{
+		PyObject* list = newMatchList(matches[i]);
+		if (!list)
+		{
+			Py_DECREF(output);
+			return nullptr;
+		}
+		PyList_SET_ITEM(output, i, list);
+	}
+	return output;
+}
+
+
+static PyObject* NoteIndex_searchChunk(NoteIndexObject* self, PyObject* args)
+{
+	NoteProfileObject* profile_object = nullptr;
+	Py_ssize_t chunk_index = 0;
+	Py_ssize_t n_matches = 10;
+	if (!PyArg_ParseTuple(args, "O!n|n", &NoteProfileType, &profile_object, &chunk_index, &n_matches)) return nullptr;
+	if (!NoteIndex_check(self) || !NoteProfile_check(profile_object)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+
+	// The profile must not change or go away while the index reads it
+	ReferenceGuard profile_reference((PyObject*)profile_object);
+	UseGuard profile_guard(&profile_object->busy);
+	if (!profile_guard.isAcquired()) return nullptr;
+	if (chunk_index < 0 || n_matches < 0)
+	{
+		PyErr_SetString(PyExc_ValueError, "Chunk index and number of matches must not be negative");
+		return nullptr;
+	}
+
+	NoteIndex* index = self->index;
+	const NoteProfile* profile = profile_object->profile;
+	std::vector<float> query(index->getPaddedDimension());
+	std::vector<NoteIndexMatch> matches;
+	bool found = false;
+	bool ok = runWithoutGIL([&]()
+	{
+		found = index->getFeatureVector(*profile, chunk_index, query.data());
+		if (found) matches = index->search(query.data(), n_matches);
+	});
+	if (!ok) return nullptr;
+	if (!found)
+	{
+		PyErr_SetString(PyExc_IndexError, "Shingle does not fit into the profile");
+		return nullptr;
+	}
+	return newMatchList(matches);
+}
+
+
+static PyObject* NoteIndex_save(NoteIndexObject* self, PyObject* args)
+{
+	const char* fname = nullptr;
+	if (!PyArg_ParseTuple(args, "s", &fname)) return nullptr;
+	if (!NoteIndex_check(self)) return nullptr;
+	UseGuard guard(&self->busy);
+	if (!guard.isAcquired()) return nullptr;
+	NoteIndex* index = self->index;
+	std::string path(fname);
+	if (!runWithoutGIL([&]() { index->save(path); })) return nullptr;
+	Py_RETURN_NONE;
+}
+
+
+static PyObject* NoteIndex_getInteger(NoteIndexObject* self, void* closure)
+{
+	if (!NoteIndex_check(self)) return nullptr;
+	const std::string name(static_cast<const char*>(closure));
+	if (name == "dimension") return PyLong_FromSize_t(self->index->getDimension());
+	else if (name == "n_profiles") return PyLong_FromSize_t(self->index->getNumProfiles());
+	else return PyLong_FromSize_t(self->index->getNumVectors());
+}
+
+
+static PyMethodDef NoteIndex_methods[] = {
+	{ "open", (PyCFunction)NoteIndex_open, METH_VARARGS | METH_CLASS, "open(fname): map an index written by save()" },
+	{ "add_profile", (PyCFunction)NoteIndex_addProfile, METH_VARARGS, "add_profile(profile); returns the id of the profile in matches" },
+	{ "build", (PyCFunction)NoteIndex_build, METH_NOARGS, "build()" },
+	{ "search", (PyCFunction)NoteIndex_search, METH_VARARGS, "search(queries, n_matches=10); a list of (profile_id, chunk_index, similarity) per query vector" },
+	{ "search_chunk", (PyCFunction)NoteIndex_searchChunk, METH_VARARGS, "search_chunk(profile, chunk_index, n_matches=10)" },
+	{ "save", (PyCFunction)NoteIndex_save, METH_VARARGS, "save(fname)" },
+	{ nullptr }
+};
+
+
+static PyGetSetDef NoteIndex_getset[] = {
+	{ "dimension", (getter)NoteIndex_getInteger, nullptr, "Number of values of a query vector", (void*)"dimension" },
+	{ "n_profiles", (getter)NoteIndex_getInteger, nullptr, "Number of added profiles", (void*)"n_profiles" },
+	{ "n_vectors", (getter)NoteIndex_getInteger, nullptr, "Number of indexed shingles", (void*)"n_vectors" },
+	{ nullptr }
+};
+
+
+/* ------------------------------------------------------------------------ */
+/* Module                                                                   */
+/* ------------------------------------------------------------------------ */
+
+
+static PyModuleDef musicalfft_module = {
+	PyModuleDef_HEAD_INIT,
+	"musicalfft",
+	"GPU-accelerated musical FFT",
+	-1,
+	nullptr
+};
+
+
+/*! Fill in the common parts of a type and add it to the module */
+static bool addType(PyObject* module, PyTypeObject* type, const char* name, const char* qualified_name, const Py_ssize_t size)
+{
+	type->tp_name = qualified_name;
+	type->tp_basicsize = size;
+	type->tp_flags = Py_TPFLAGS_DEFAULT;
+	if (!type->tp_new && type->tp_init)
+	{
+		type->tp_new = PyType_GenericNew;
+	}
+	if (PyType_Ready(type) < 0) return false;
+	Py_INCREF(type);
+	if (PyModule_AddObject(module, name, (PyObject*)type) < 0)
+	{
+		Py_DECREF(type);
+		return false;
+	}
+	return true;
+}
+
+
+PyMODINIT_FUNC PyInit_musicalfft()
+{
+	ArrayType.tp_dealloc = (destructor)Array_dealloc;
+	ArrayType.tp_as_buffer = &Array_as_buffer;
+	ArrayType.tp_getset = Array_getset;
+	ArrayType.tp_doc = "Array shared through the buffer protocol; use numpy.asarray() or memoryview()";
+
+	WavFileType.tp_dealloc = (destructor)WavFile_dealloc;
+	WavFileType.tp_init = (initproc)WavFile_init;
+	WavFileType.tp_methods = WavFile_methods;
+	WavFileType.tp_getset = WavFile_getset;
+	WavFileType.tp_doc = "WavFile(fname): 16-bit PCM WAV or FLAC file";
+
+	MusicalFFTType.tp_dealloc = (destructor)MusicalFFT_dealloc;
+	MusicalFFTType.tp_init = (initproc)MusicalFFT_init;
+	MusicalFFTType.tp_methods = MusicalFFT_methods;
+	MusicalFFTType.tp_getset = MusicalFFT_getset;
+	MusicalFFTType.tp_doc = "MusicalFFT(out_of_order=False, device=0): musical FFT on an OpenCL device of the context";
+
+	NoteProfileType.tp_dealloc = (destructor)NoteProfile_dealloc;
+	NoteProfileType.tp_init = (initproc)NoteProfile_init;
+	NoteProfileType.tp_methods = NoteProfile_methods;
+	NoteProfileType.tp_getset = NoteProfile_getset;
+	NoteProfileType.tp_doc = "NoteProfile(base_note_id, precision=PRECISION_FLOAT32)";
+
+	NoteIndexType.tp_dealloc = (destructor)NoteIndex_dealloc;
+	NoteIndexType.tp_init = (initproc)NoteIndex_init;
+	NoteIndexType.tp_methods = NoteIndex_methods;
+	NoteIndexType.tp_getset = NoteIndex_getset;
+	NoteIndexType.tp_doc = "NoteIndex(feature=INDEX_CHROMA, shingle_size=1, shingle_step=1, mode=INDEX_BRUTE_FORCE, n_threads=0): similarity search over the chunks of profiles";
+
+	PyObject* module = PyModule_Create(&musicalfft_module);
+	if (!module) return nullptr;
+
+	if (!addType(module, &ArrayType, "Array", "musicalfft.Array", sizeof(ArrayObject)) ||
+		!addType(module, &WavFileType, "WavFile", "musicalfft.WavFile", sizeof(WavFileObject)) ||
+		!addType(module, &MusicalFFTType, "MusicalFFT", "musicalfft.MusicalFFT", sizeof(MusicalFFTObject)) ||
+		!addType(module, &NoteProfileType, "NoteProfile", "musicalfft.NoteProfile", sizeof(NoteProfileObject)) ||
+		!addType(module, &NoteIndexType, "NoteIndex", "musicalfft.NoteIndex", sizeof(NoteIndexObject)) ||
+		PyModule_AddIntConstant(module, "PRECISION_FLOAT32", NOTE_PRECISION_FLOAT32) < 0 ||
+		PyModule_AddIntConstant(module, "PRECISION_FLOAT16", NOTE_PRECISION_FLOAT16) < 0 ||
+		PyModule_AddIntConstant(module, "PRECISION_LOG8", NOTE_PRECISION_LOG8) < 0 ||
+		PyModule_AddIntConstant(module, "INDEX_CHROMA", NOTE_INDEX_CHROMA) < 0 ||
+		PyModule_AddIntConstant(module, "INDEX_NOTES", NOTE_INDEX_NOTES) < 0 ||
+		PyModule_AddIntConstant(module, "INDEX_BRUTE_FORCE", NOTE_INDEX_BRUTE_FORCE) < 0 ||
+		PyModule_AddIntConstant(module, "INDEX_LSH", NOTE_INDEX_LSH) < 0 ||
+		PyModule_AddIntConstant(module, "INDEX_IVF", NOTE_INDEX_IVF) < 0 ||
+		PyModule_AddIntConstant(module, "FFT_SIZE", FFT_SIZE) < 0 ||
+		PyModule_AddIntConstant(module, "N_NOTES_PER_CHUNK", N_NOTES_PER_CHUNK) < 0)
+	{
+		Py_DECREF(module);
+		return nullptr;
+	}
+	return module;
+}
@@ -0,0 +1,375 @@
+#include "analysis_plan.h"
+
+#include "ffthw.h"
+
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <math.h>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+
+// Number of plans kept in the cache unless changed
+#define DEFAULT_PLAN_CACHE_CAPACITY 8
+
+
+/*! Plan of the cache, which may still be building */
+struct AnalysisPlanEntry
+{
+	OpenCLContext* ctx;
+	AnalysisPlanKey key;
+	uint64_t build_id;
+	std::shared_future<std::shared_ptr<const AnalysisPlan> > plan;
+};
+
+
+/*! Process-wide cache of plans, ordered from the most to the least recently
+ *  used
+ */
+struct AnalysisPlanCache
+{
+	std::mutex mutex;
+	std::list<AnalysisPlanEntry> plans;
+	size_t capacity;
+	uint64_t n_builds;
+};
+
+
+static AnalysisPlanCache& getPlanCache()
+{
+	static AnalysisPlanCache cache = { {}, {}, DEFAULT_PLAN_CACHE_CAPACITY, 0 };
+	return cache;
+}
+
+
+/*! Compiler options shared by the kernels in gather_notes.cl */
+static std::string getNotesCompilerOptions(const NotePrecision precision)
+{
+	std::stringstream compiler_options;
+	compiler_options << "-D N_STAGES=" << N_STAGES;
+	if (precision == NOTE_PRECISION_FLOAT16)
+	{
+		compiler_options << " -D NOTES_FLOAT16";
+	}
+	else if (precision == NOTE_PRECISION_LOG8)
+	{
+		compiler_options << std::fixed << std::setprecision(4);
+		compiler_options << " -D NOTES_LOG8 -D LOG8_DB_MIN=" << LOG8_DB_MIN << "f -D LOG8_DB_STEP=" << LOG8_DB_STEP << "f";
+	}
+	return compiler_options.str();
+}
+
+
+/*! Function names of the kernels, in the order of AnalysisKernel */
+static const char* const kernel_names[N_ANALYSIS_KERNELS] = {
+	"musical_fft",
+	"musical_fft_pcm16",
+	"gather_notes",
+	"accumulate_notes",
+	"pack_notes",
+	"mark_events",
+	"count_events",
+	"scan_counts",
+	"write_events"
+};
+
+
+AnalysisPlan::AnalysisPlan(OpenCLContext* ctx, const AnalysisPlanKey& key) :
+	ctx(ctx),
+	key(key),
+	samples_per_base_note(key.data_rate / key.base_note_freq),
+	samples_per_chunk_window((size_t)floor(samples_per_base_note + 2)),
+	fft_radix(FFT_RADIX),
+	pcm16_supported(true),
+	note_table_mem(nullptr),
+	twiddle_table_mem(nullptr),
+	programs()
+{
+	// NOTE: not good practice to have base_note_freq > chunk_rate
+	if (key.data_rate <= 0 || key.base_note_freq <= 0 || key.samples_per_chunk == 0)
+	{
+		throw std::runtime_error("Invalid configuration of the musical FFT");
+	}
+
+	std::vector<OpenCLDevice*> devices = ctx->getDevices();
+
+	// The window of a low note at a high rate may leave too little local
+	// memory for the buffers of the radix-4 passes
+	const size_t local_memory_size = getLocalMemorySize(ctx);
+	fft_radix = chooseFftRadix(samples_per_chunk_window, local_memory_size);
+
+	// Staging the 16-bit samples too may not fit even at radix 2; signals
+	// are then only analyzed as floats
+	pcm16_supported = getFftLocalMemorySize(fft_radix, samples_per_chunk_window, true) <= local_memory_size;
+
+	// Spacing of the interpolated samples of each note and the offset that
+	// is added to them
+	note_table_mem = new OpenCLWriteOnlyMemory(devices[0], 12 * 2 * sizeof(cl_float), CL_MEM_READ_ONLY);
+	cl_float* note_table = reinterpret_cast<cl_float*>(note_table_mem->getWriteableBuffer());
+	for (size_t note_id = 0; note_id < 12; ++note_id)
+	{
+		double samples_per_fft_slot = samples_per_base_note / pow(2, note_id / 12.0) / FFT_SIZE;
+		note_table[2 * note_id] = (cl_float)samples_per_fft_slot;
+		note_table[2 * note_id + 1] = (cl_float)(samples_per_fft_slot * key.samples_per_chunk / 2);
+	}
+	note_table_mem->write(nullptr);
+
+	// Roots of unity of the last stage; stage s uses every 2^(N_STAGES-s-1)th
+	twiddle_table_mem = new OpenCLWriteOnlyMemory(devices[0], (FFT_SIZE / 2) * 2 * sizeof(cl_float), CL_MEM_READ_ONLY);
+	cl_float* twiddle_table = reinterpret_cast<cl_float*>(twiddle_table_mem->getWriteableBuffer());
+	for (size_t i = 0; i < FFT_SIZE / 2; ++i)
+	{
+		twiddle_table[2 * i] = (cl_float)cos(2 * M_PI * i / FFT_SIZE);
+		twiddle_table[2 * i + 1] = (cl_float)sin(2 * M_PI * i / FFT_SIZE);
+	}
+	twiddle_table_mem->write(nullptr);
+
+	// Compile the kernels from the sources embedded in the library
+	std::cout << "Compile kernels" << std::endl;
+	std::stringstream fft_options;
+	fft_options << "-D OUTPUT_POWER -D N_STAGES=" << N_STAGES << " -D FFT_RADIX=" << fft_radix;
+	const std::string notes_options = getNotesCompilerOptions(key.note_precision);
+	std::stringstream events_options;
+	events_options << "-D N_STAGES=" << N_STAGES << " -D SCAN_SIZE=" << EVENTS_SCAN_SIZE;
+
+	for (size_t i = 0; i < N_ANALYSIS_KERNELS; ++i)
+	{
+		cl_kernel kernel = nullptr;
+		if (i == ANALYSIS_KERNEL_FFT)
+		{
+			kernel = ctx->createEmbeddedKernel(kernel_names[i], "musical_fft.cl", fft_options.str());
+		}
+		else if (i == ANALYSIS_KERNEL_FFT_PCM16)
+		{
+			if (!pcm16_supported) continue;
+			kernel = ctx->createEmbeddedKernel(kernel_names[i], "musical_fft.cl", fft_options.str() + " -D SIGNAL_PCM16");
+		}
+		else if (i <= ANALYSIS_KERNEL_PACK_NOTES)
+		{
+			kernel = ctx->createEmbeddedKernel(kernel_names[i], "gather_notes.cl", notes_options);
+		}
+		else
+		{
+			kernel = ctx->createEmbeddedKernel(kernel_names[i], "note_events.cl", events_options.str());
+		}
+
+		// Keep the program; kernel objects are created for each user
+		cl_int err = clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &programs[i], nullptr);
+		checkError(err, "clGetKernelInfo");
+		err = clRetainProgram(programs[i]);
+		checkError(err, "clRetainProgram");
+		clReleaseKernel(kernel);
+	}
+}
+
+
+AnalysisPlan::~AnalysisPlan()
+{
+	for (size_t i = 0; i < N_ANALYSIS_KERNELS; ++i)
+	{
+		if (programs[i])
+		{
+			clReleaseProgram(programs[i]);
+			programs[i] = nullptr;
+		}
+	}
+	if (note_table_mem)
+	{
+		delete note_table_mem;
+		note_table_mem = nullptr;
+	}
+	if (twiddle_table_mem)
+	{
+		delete twiddle_table_mem;
+		twiddle_table_mem = nullptr;
+	}
+}
+
+
+std::shared_ptr<const AnalysisPlan> AnalysisPlan::get(OpenCLContext* ctx, const AnalysisPlanKey& key)
+{
+	AnalysisPlanCache& cache = getPlanCache();
+	std::promise<std::shared_ptr<const AnalysisPlan> > promise;
+	uint64_t build_id = 0;
+	{
+		std::unique_lock<std::mutex> lock(cache.mutex);
+
+		// Move a cached plan to the front; a plan that is still building is
+		// waited for without the lock, so other configurations are not held up
+		for (std::list<AnalysisPlanEntry>::iterator it = cache.plans.begin(); it != cache.plans.end(); ++it)
+		{
+			if (it->ctx == ctx && it->key == key)
+			{
+				cache.plans.splice(cache.plans.begin(), cache.plans, it);
+				std::shared_future<std::shared_ptr<const AnalysisPlan> > plan = it->plan;
+				lock.unlock();
+				return plan.get();
+			}
+		}
+
+		// Other threads that need the plan wait for this build
+		build_id = ++cache.n_builds;
+		if (cache.capacity > 0)
+		{
+			cache.plans.push_front({ ctx, key, build_id, promise.get_future().share() });
+			if (cache.plans.size() > cache.capacity)
+			{
+				cache.plans.pop_back();
+			}
+		}
+	}
+
+	try
+	{
+		std::shared_ptr<const AnalysisPlan> plan(new AnalysisPlan(ctx, key));
+		promise.set_value(plan);
+		return plan;
+	}
+	catch (...)
+	{
+		// Drop the entry, so the next get() tries again
+		{
+			std::lock_guard<std::mutex> lock(cache.mutex);
+			for (std::list<AnalysisPlanEntry>::iterator it = cache.plans.begin(); it != cache.plans.end(); ++it)
+			{
+				if (it->build_id == build_id)
+				{
+					cache.plans.erase(it);
+					break;
+				}
+			}
+		}
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+}
+
+
+std::shared_future<std::shared_ptr<const AnalysisPlan> > AnalysisPlan::prepare(OpenCLContext* ctx, const AnalysisPlanKey& key)
+{
+	// A get() of the same configuration in the meantime waits for this build
+	// instead of compiling again
+	return std::async(std::launch::async, &AnalysisPlan::get, ctx, key).share();
+}
+
+
+void AnalysisPlan::setCacheCapacity(const size_t capacity)
+{
+	AnalysisPlanCache& cache = getPlanCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.capacity = capacity;
+	while (cache.plans.size() > capacity)
+	{
+		cache.plans.pop_back();
+	}
+}
+
+
+void AnalysisPlan::clearCache()
+{
+	AnalysisPlanCache& cache = getPlanCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.plans.clear();
+}
+
+
+size_t AnalysisPlan::getCacheSize()
+{
+	AnalysisPlanCache& cache = getPlanCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	return cache.plans.size();
+}
+
+
+size_t AnalysisPlan::getSizeClass(const size_t size)
+{
+	// Round up to a multiple of the largest power of two that is at most a
+	// quarter of the size
+	size_t step = 1;
+	while ((step << 3) < size)
+	{
+		step <<= 1;
+	}
+	return (size + step - 1) / step * step;
+}
+
+
+size_t AnalysisPlan::getFftLocalMemorySize(const uint32_t fft_radix, const size_t samples_per_chunk_window, const bool pcm16)
+{
+	// Radix-4 passes go back and forth between two buffers with a padding
+	// element per 16, radix-2 passes work in place
+	const size_t fft_size = fft_radix == 4 ? 2 * (FFT_SIZE + FFT_SIZE / 16) : FFT_SIZE;
+	size_t size = fft_size * sizeof(cl_float2) + (FFT_SIZE / 2) * sizeof(cl_float) + samples_per_chunk_window * sizeof(cl_float);
+	if (pcm16)
+	{
+		size += samples_per_chunk_window * sizeof(cl_short);
+	}
+	return size;
+}
+
+
+uint32_t AnalysisPlan::chooseFftRadix(const size_t samples_per_chunk_window, const size_t local_memory_size)
+{
+	if (FFT_RADIX != 2 && getFftLocalMemorySize(FFT_RADIX, samples_per_chunk_window, true) <= local_memory_size)
+	{
+		return FFT_RADIX;
+	}
+	if (getFftLocalMemorySize(2, samples_per_chunk_window, false) > local_memory_size)
+	{
+		throw std::runtime_error("The window of the lowest note does not fit into the local memory of the device");
+	}
+	return 2;
+}
+
+
+bool AnalysisPlan::supportsPcm16(OpenCLContext* ctx, const AnalysisPlanKey& key)
+{
+	const size_t samples_per_chunk_window = (size_t)floor(key.data_rate / key.base_note_freq + 2);
+	const size_t local_memory_size = getLocalMemorySize(ctx);
+	return getFftLocalMemorySize(chooseFftRadix(samples_per_chunk_window, local_memory_size), samples_per_chunk_window, true) <= local_memory_size;
+}
+
+
+size_t AnalysisPlan::getLocalMemorySize(OpenCLContext* ctx)
+{
+	std::vector<OpenCLDevice*> devices = ctx->getDevices();
+	size_t local_memory_size = SIZE_MAX;
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		const size_t device_memory_size = devices[i]->getLocalMemorySize();
+		if (device_memory_size < local_memory_size) local_memory_size = device_memory_size;
+	}
+	return local_memory_size;
+}
+
+
+size_t AnalysisPlan::getNumChunks(const size_t n_signal) const
+{
+	// Every chunk needs the wavelength of the lowest note and the samples
+	// around it for interpolation
+	const size_t n_needed = 3 + (size_t)ceil(samples_per_base_note);
+	if (n_signal < n_needed) return 0;
+	return (n_signal - n_needed) / key.samples_per_chunk + 1;
+}
+
+
+void AnalysisPlan::setTablesAsKernelArguments(cl_kernel kernel, const uint32_t note_table_index, const uint32_t twiddle_table_index) const
+{
+	note_table_mem->setAsKernelArgument(kernel, note_table_index);
+	twiddle_table_mem->setAsKernelArgument(kernel, twiddle_table_index);
+}
+
+
+cl_kernel AnalysisPlan::createKernel(const AnalysisKernel kernel) const
+{
+	if (!programs[kernel])
+	{
+		throw std::runtime_error("The samples of the musical FFT do not fit into the local memory of the device as 16-bit integers");
+	}
+	cl_int err = 0;
+	cl_kernel output = clCreateKernel(programs[kernel], kernel_names[kernel], &err);
+	checkError(err, "clCreateKernel");
+	return output;
+}
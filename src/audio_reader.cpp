@@ -0,0 +1,83 @@
+#include "audio_reader.h"
+
+#include "flac.h"
+#include "simd.h"
+#include "wav.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <string.h>
+
+
+std::unique_ptr<AudioReader> AudioReader::open(const std::string& fname)
+{
+	std::ifstream ist(fname, std::ios::binary);
+	if (!ist)
+	{
+		throw std::runtime_error("Could not open audio file '" + fname + "'");
+	}
+	char magic[4] = { 0, 0, 0, 0 };
+	ist.read(magic, 4);
+	ist.close();
+
+	// FLAC streams may start with an ID3 tag
+	if (memcmp(magic, "fLaC", 4) == 0 || memcmp(magic, "ID3", 3) == 0)
+	{
+		return std::unique_ptr<AudioReader>(new FlacFile(fname));
+	}
+	return std::unique_ptr<AudioReader>(new WavFile(fname));
+}
+
+
+size_t AudioReader::readMixedSamples(const size_t n_samples, const std::vector<float>& weights, float* output)
+{
+	const size_t n_channels = getNumChannels();
+	if (weights.size() != n_channels)
+	{
+		throw std::runtime_error("There must be a weight for every channel");
+	}
+
+	// Read in blocks so the channels stay small next to the output
+	const size_t block_size = 65536;
+	std::vector<std::vector<float> > channel_storage(n_channels, std::vector<float>(block_size));
+	std::vector<float*> channels(n_channels);
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		channels[c] = channel_storage[c].data();
+	}
+
+	size_t n_read = 0;
+	while (n_read < n_samples)
+	{
+		const size_t n_to_read = n_samples - n_read < block_size ? n_samples - n_read : block_size;
+		const size_t n = readSamples(n_to_read, channels);
+		if (n == 0) break;
+		mixChannels(n, channels, weights, output + n_read);
+		n_read += n;
+	}
+	return n_read;
+}
+
+
+void AudioReader::mixChannels(const size_t n_samples, const std::vector<float*>& inputs, const std::vector<float>& weights, float* output)
+{
+	size_t i = 0;
+	for (; i + SIMD_WIDTH <= n_samples; i += SIMD_WIDTH)
+	{
+		simd_float mix = simdBroadcast(0.0f);
+		for (size_t c = 0; c < inputs.size(); ++c)
+		{
+			mix += simdLoad(inputs[c] + i) * weights[c];
+		}
+		simdStore(output + i, mix);
+	}
+	for (; i < n_samples; ++i)
+	{
+		float mix = 0;
+		for (size_t c = 0; c < inputs.size(); ++c)
+		{
+			mix += inputs[c][i] * weights[c];
+		}
+		output[i] = mix;
+	}
+}
@@ -0,0 +1,198 @@
+#include "decimator.h"
+
+#include "ffthw.h"
+#include "simd.h"
+
+#include <math.h>
+#include <stdexcept>
+
+
+// Length of the filter delay in output samples; the filter has
+// 2 * DECIMATOR_DELAY * factor + 1 taps
+#define DECIMATOR_DELAY 32
+
+// The passband must reach the highest analyzed frequency and the stopband
+// starts at the output Nyquist frequency; the output rate must be at least
+// this multiple of the highest analyzed frequency
+#define DECIMATOR_RATE_MARGIN 2.4f
+
+// Consumed history is discarded once it exceeds this many samples
+#define DECIMATOR_COMPACT_SIZE 65536
+
+
+Decimator::Decimator(const size_t factor, const size_t n_channels) :
+	factor(factor),
+	n_channels(n_channels),
+	taps(),
+	delay(DECIMATOR_DELAY * factor),
+	history(n_channels),
+	next_start(0)
+{
+	if (factor == 0 || n_channels == 0)
+	{
+		throw std::runtime_error("Decimator needs a positive factor and at least one channel");
+	}
+
+	// Blackman-windowed sinc with the cutoff halfway between the passband
+	// edge and the output Nyquist frequency
+	const size_t n_taps = 2 * delay + 1;
+	const double cutoff = (1 / DECIMATOR_RATE_MARGIN + 0.5) / 2 / factor;
+	std::vector<double> coefficients(n_taps);
+	double sum = 0;
+	for (size_t i = 0; i < n_taps; ++i)
+	{
+		const double x = (double)i - delay;
+		const double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+		const double window = 0.42 - 0.5 * cos(2 * M_PI * i / (n_taps - 1)) + 0.08 * cos(4 * M_PI * i / (n_taps - 1));
+		coefficients[i] = sinc * window;
+		sum += coefficients[i];
+	}
+
+	// Reverse the coefficients so each output is a plain dot product with the
+	// history; the zero padding goes in front
+	const size_t n_padded = simdPadded(n_taps);
+	const size_t n_padding = n_padded - n_taps;
+	taps.assign(n_padded, 0);
+	for (size_t i = 0; i < n_taps; ++i)
+	{
+		taps[n_padding + i] = coefficients[n_taps - 1 - i] / sum;
+	}
+
+	// Samples before the beginning of the stream are zero; the history index
+	// of input sample i is i + delay + n_padding
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		history[c].assign(delay + n_padding, 0);
+	}
+}
+
+
+size_t Decimator::chooseFactor(const uint32_t sample_rate, const float base_note_freq, const size_t samples_per_chunk)
+{
+	// The highest analyzed frequency is the top octave of the highest note
+	const float max_freq = base_note_freq * pow(2, 11.0f / 12) * (1 << (N_STAGES - 2));
+
+	for (size_t candidate = samples_per_chunk; candidate > 1; --candidate)
+	{
+		if (samples_per_chunk % candidate != 0 || sample_rate % candidate != 0) continue;
+		if ((float)sample_rate / candidate >= DECIMATOR_RATE_MARGIN * max_freq) return candidate;
+	}
+	return 1;
+}
+
+
+size_t Decimator::process(const int16_t* input, const size_t n_frames, const std::vector<float*>& outputs)
+{
+	if (outputs.size() != n_channels)
+	{
+		throw std::runtime_error("There must be as many output buffers as there are channels");
+	}
+
+	// Deinterleave and convert to floats directly into the filter history
+	const float scale = 1 / 32768.0f;
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		std::vector<float>& channel_history = history[c];
+		const size_t offset = channel_history.size();
+		channel_history.resize(offset + n_frames);
+		float* dst = channel_history.data() + offset;
+		const int16_t* src = input + c;
+		for (size_t i = 0; i < n_frames; ++i)
+		{
+			dst[i] = src[i * n_channels] * scale;
+		}
+	}
+
+	return filter(outputs);
+}
+
+
+void Decimator::prime(const int16_t* input, const size_t n_frames)
+{
+	const size_t n_priming = getNumPrimingFrames();
+	if (n_frames > n_priming || next_start != 0 || history[0].size() != n_priming)
+	{
+		throw std::runtime_error("The decimator can only be primed with the frames before the stream");
+	}
+
+	// The frames go at the end of the history before the first input sample
+	const float scale = 1 / 32768.0f;
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		float* dst = history[c].data() + n_priming - n_frames;
+		const int16_t* src = input + c;
+		for (size_t i = 0; i < n_frames; ++i)
+		{
+			dst[i] = src[i * n_channels] * scale;
+		}
+	}
+}
+
+
+size_t Decimator::flush(const std::vector<float*>& outputs)
+{
+	if (outputs.size() != n_channels)
+	{
+		throw std::runtime_error("There must be as many output buffers as there are channels");
+	}
+
+	// Samples after the end of the stream are zero; the last output needs
+	// delay samples beyond the last input
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		history[c].resize(history[c].size() + delay, 0);
+	}
+	size_t n_output = filter(outputs);
+
+	// Nothing more can be produced
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		history[c].clear();
+	}
+	next_start = 0;
+	return n_output;
+}
+
+
+size_t Decimator::getMaxOutputSamples(const size_t n_frames) const
+{
+	return (n_frames + delay) / factor + 2;
+}
+
+
+size_t Decimator::filter(const std::vector<float*>& outputs)
+{
+	const size_t n_taps = taps.size();
+	const size_t history_size = history[0].size();
+	if (history_size < next_start + n_taps) return 0;
+	const size_t n_output = (history_size - n_taps - next_start) / factor + 1;
+
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		const float* channel_history = history[c].data() + next_start;
+		float* output = outputs[c];
+		for (size_t j = 0; j < n_output; ++j)
+		{
+			const float* window = channel_history + j * factor;
+			simd_float sum = simdBroadcast(0.0f);
+			for (size_t k = 0; k < n_taps; k += SIMD_WIDTH)
+			{
+				sum += simdLoad(taps.data() + k) * simdLoad(window + k);
+			}
+			output[j] = simdSum(sum);
+		}
+	}
+	next_start += n_output * factor;
+
+	// Discard history that no output needs anymore
+	if (next_start > DECIMATOR_COMPACT_SIZE)
+	{
+		for (size_t c = 0; c < n_channels; ++c)
+		{
+			history[c].erase(history[c].begin(), history[c].begin() + next_start);
+		}
+		next_start = 0;
+	}
+
+	return n_output;
+}
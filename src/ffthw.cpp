@@ -1,29 +1,89 @@
 #include "ffthw.h"
 
 #include <iostream>
-#include <sstream>
+#include <stdexcept>
 
 
-MusicalFFT::MusicalFFT(OpenCLContext* ctx) :
+/*! Make sure a buffer of the given size exists; if the buffer is the wrong
+ *  size, delete and resize
+ *    @return whether the buffer was (re)created
+ */
+template <typename T>
+static bool prepareMemory(T** mem, OpenCLDevice* device, cl_command_queue queue, const size_t size, const cl_mem_flags flags)
+{
+	if (*mem && (*mem)->getSize() != size)
+	{
+		delete *mem;
+		*mem = nullptr;
+	}
+	if (!*mem)
+	{
+		*mem = new T(device, size, flags);
+		(*mem)->setCommandQueue(queue);
+		return true;
+	}
+	return false;
+}
+
+
+/*! Delete a buffer if it exists */
+template <typename T>
+static void releaseMemory(T** mem)
+{
+	if (*mem)
+	{
+		delete *mem;
+		*mem = nullptr;
+	}
+}
+
+
+MusicalFFT::MusicalFFT(OpenCLContext* ctx, const bool out_of_order, const size_t device_index) :
 	ctx(ctx),
-	fft_kernel(nullptr),
+	device(ctx->getDevice(device_index)),
+	cmdq(nullptr),
+	plan(),
+	kernels(),
+	warm_up_key(),
+	warm_up_plan(),
 	fft_kernel_done(nullptr),
 	fft_input_mem(nullptr),
 	fft_output_mem(nullptr),
-	notes_kernel(nullptr),
+	histories(),
+	fft_raw_input_mem(nullptr),
+	raw_history({ nullptr, 0, 0, 0 }),
+	raw_history_channels(0),
+	channel_weights_mem(nullptr),
 	notes_output_mem(nullptr),
+	notes_accumulator_mem(nullptr),
+	notes_accumulated(false),
+	note_precision(NOTE_PRECISION_FLOAT32),
+	note_layout(NOTE_LAYOUT_CHUNK_MAJOR),
+	widened_notes(),
+	event_state_mem(nullptr),
+	event_flags_mem(nullptr),
+	event_counts_mem(nullptr),
+	event_offsets_mem(nullptr),
+	event_count_mem(nullptr),
+	event_list_mem(nullptr),
+	event_chunk_offset(0),
+	events(),
 	n_chunks(0)
-{}
+{
+	// The queue is used by this instance only, so instances on different
+	// threads do not share one
+	cmdq = device->acquireCommandQueue(out_of_order);
+}
 
 
 MusicalFFT::~MusicalFFT()
 {
-	if (fft_kernel)
-	{
-		cl_int err = clReleaseKernel(fft_kernel);
-		checkError(err, "clReleaseKernel");
-		fft_kernel = nullptr;
-	}
+	// Nothing may still run when the queue goes back to the pool
+	clFinish(cmdq);
+	device->returnCommandQueue(cmdq);
+	cmdq = nullptr;
+	releaseKernels();
+
 	if (fft_kernel_done)
 	{
 		cl_int err = clReleaseEvent(fft_kernel_done);
@@ -40,98 +100,252 @@ MusicalFFT::~MusicalFFT()
 		delete fft_output_mem;
 		fft_output_mem = nullptr;
 	}
-	if (notes_kernel)
-	{
-		cl_int err = clReleaseKernel(notes_kernel);
-		checkError(err, "clReleaseKernel");
-		notes_kernel = nullptr;
-	}
+	resetHistory();
+	releaseMemory(&fft_raw_input_mem);
+	releaseMemory(&channel_weights_mem);
 	if (notes_output_mem)
 	{
 		delete notes_output_mem;
 		notes_output_mem = nullptr;
 	}
+	if (notes_accumulator_mem)
+	{
+		delete notes_accumulator_mem;
+		notes_accumulator_mem = nullptr;
+	}
+	releaseMemory(&event_state_mem);
+	releaseMemory(&event_flags_mem);
+	releaseMemory(&event_counts_mem);
+	releaseMemory(&event_offsets_mem);
+	releaseMemory(&event_count_mem);
+	releaseMemory(&event_list_mem);
 }
 
 
 size_t MusicalFFT::runFFT(const float data_rate, const size_t n_signal, const float* signal, const size_t samples_per_chunk, const float base_note_freq)
 {
-	// Calculate number of samples for the longest frequency
-	// NOTE: not good practice to have base_note_freq > chunk_rate
-	float samples_per_base_note = data_rate / base_note_freq;
-	float max_base_note_freq = base_note_freq * pow(2, 11.0f / 12);
+	// The input buffer may still be read by the previous FFT
+	waitForEvent(&fft_kernel_done);
 
-	// Calculate number of chunks that can be done with amount of data supplied
-	n_chunks = ((n_signal - 3) - (size_t)ceil(samples_per_base_note)) / samples_per_chunk + 1;
-	if (n_chunks == 0)
+	// Everything that depends only on the configuration is shared
+	selectPlan({ data_rate, base_note_freq, samples_per_chunk, note_precision });
+
+	// Create the input buffer; buffers are only reallocated when the size
+	// class changes
+	prepareMemory(&fft_input_mem, device, cmdq, AnalysisPlan::getSizeClass(n_signal * sizeof(float)), CL_MEM_READ_ONLY);
+
+	// Write signal to device memory straight from the caller's array
+	fft_input_mem->allocateDeviceMemory();
+	fft_input_mem->writeFrom(reinterpret_cast<const uint8_t*>(signal), n_signal * sizeof(float), nullptr);
+
+	return launchFFT(fft_input_mem, 0, n_signal, fft_input_mem->getSize() / sizeof(float), samples_per_chunk);
+}
+
+
+size_t MusicalFFT::runFFT(const float data_rate, const size_t n_frames, const int16_t* samples, const size_t n_channels, const float* channel_weights, const size_t samples_per_chunk, const float base_note_freq)
+{
+	waitForEvent(&fft_kernel_done);
+	selectPlan({ data_rate, base_note_freq, samples_per_chunk, note_precision });
+
+	// The frames are uploaded as they are; the kernel deinterleaves them
+	const size_t frame_size = n_channels * sizeof(int16_t);
+	prepareMemory(&fft_raw_input_mem, device, cmdq, AnalysisPlan::getSizeClass(n_frames * frame_size), CL_MEM_READ_ONLY);
+	fft_raw_input_mem->allocateDeviceMemory();
+	fft_raw_input_mem->writeFrom(reinterpret_cast<const uint8_t*>(samples), n_frames * frame_size, nullptr);
+
+	return launchFFT(fft_raw_input_mem, 0, n_frames, fft_raw_input_mem->getSize() / frame_size, samples_per_chunk, channel_weights, n_channels);
+}
+
+
+void MusicalFFT::appendSignal(const size_t channel, const size_t n_samples, const float* samples)
+{
+	if (n_samples == 0) return;
+	if (channel >= histories.size())
 	{
-		throw std::runtime_error("Cannot have 0 chunks");
+		histories.resize(channel + 1, { nullptr, 0, 0, 0 });
 	}
+	appendToHistory(histories[channel], n_samples, reinterpret_cast<const uint8_t*>(samples), sizeof(float));
+}
 
-	// Compile the kernel
-	if (!fft_kernel)
+
+void MusicalFFT::appendRawSignal(const size_t n_frames, const int16_t* samples, const size_t n_channels)
+{
+	if (n_frames == 0) return;
+	if (raw_history.n_samples > 0 && n_channels != raw_history_channels)
+	{
+		throw std::runtime_error("Raw frames must have the same number of channels as the history");
+	}
+	if (n_channels != raw_history_channels)
 	{
-		std::cout << "Compile kernel" << std::endl;
-		std::stringstream compiler_options;
-		compiler_options << "-D OUTPUT_POWER -D N_STAGES=" << N_STAGES;
-		fft_kernel = ctx->createKernel("musical_fft", "../kernels/musical_fft.cl", compiler_options.str());
+		// The frames of the old history have another size
+		waitForEvent(&fft_kernel_done);
+		releaseMemory(&raw_history.mem);
+		raw_history = { nullptr, 0, 0, 0 };
+		raw_history_channels = n_channels;
 	}
+	appendToHistory(raw_history, n_frames, reinterpret_cast<const uint8_t*>(samples), n_channels * sizeof(int16_t));
+}
 
-	// Create buffers for the input and output
-	// If the buffer is the wrong size, delete and resize
-	std::vector<OpenCLDevice*> devices = ctx->getDevices();
 
-	size_t fft_input_mem_size = n_signal * sizeof(float);
-	if (fft_input_mem && fft_input_mem->getSize() != fft_input_mem_size)
+void MusicalFFT::appendToHistory(SignalHistory& history, const size_t n_frames, const uint8_t* frames, const size_t frame_size)
+{
+	// The ring buffer may still be read by the previous FFT
+	waitForEvent(&fft_kernel_done);
+
+	// Grow the ring buffer and move the history to its beginning on the device
+	if (history.n_samples + n_frames > history.capacity)
 	{
-		std::cout << "Resize input memory" << std::endl;
-		delete fft_input_mem;
-		fft_input_mem = nullptr;
+		const size_t capacity = AnalysisPlan::getSizeClass((history.n_samples + n_frames) * frame_size) / frame_size;
+		OpenCLWriteOnlyMemory* mem = new OpenCLWriteOnlyMemory(device, capacity * frame_size, CL_MEM_READ_ONLY);
+		mem->setCommandQueue(cmdq);
+		mem->allocateDeviceMemory();
+		if (history.n_samples > 0)
+		{
+			const size_t n_first = history.n_samples < history.capacity - history.start ? history.n_samples : history.capacity - history.start;
+			history.mem->copyTo(mem, history.start * frame_size, 0, n_first * frame_size);
+			if (n_first < history.n_samples)
+			{
+				history.mem->copyTo(mem, 0, n_first * frame_size, (history.n_samples - n_first) * frame_size);
+			}
+		}
+		releaseMemory(&history.mem);
+		history.mem = mem;
+		history.capacity = capacity;
+		history.start = 0;
 	}
-	if (!fft_input_mem)
+
+	// Transfer only the new frames, wrapping around the end of the ring
+	const size_t end = (history.start + history.n_samples) % history.capacity;
+	const size_t n_first = n_frames < history.capacity - end ? n_frames : history.capacity - end;
+	history.mem->writeFromAt(end * frame_size, frames, n_first * frame_size);
+	if (n_first < n_frames)
 	{
-		std::cout << "Allocate input memory" << std::endl;
-		fft_input_mem = new OpenCLWriteOnlyMemory(devices[0], fft_input_mem_size, CL_MEM_READ_ONLY);
+		history.mem->writeFromAt(0, frames + n_first * frame_size, (n_frames - n_first) * frame_size);
 	}
+	history.n_samples += n_frames;
+}
+
 
-	size_t fft_output_mem_size = n_chunks * FFT_SIZE * 6 * sizeof(float);
-	if (fft_output_mem && fft_output_mem->getSize() != fft_output_mem_size)
+size_t MusicalFFT::runFFTOnHistory(const size_t channel, const float data_rate, const size_t samples_per_chunk, const float base_note_freq)
+{
+	if (channel >= histories.size())
 	{
-		std::cout << "Resize output memory" << std::endl;
-		delete fft_output_mem;
-		fft_output_mem = nullptr;
+		throw std::runtime_error("Channel has no signal history");
+	}
+	SignalHistory& history = histories[channel];
+
+	waitForEvent(&fft_kernel_done);
+	selectPlan({ data_rate, base_note_freq, samples_per_chunk, note_precision });
+	const size_t n_new_chunks = launchFFT(history.mem, history.start, history.n_samples, history.capacity, samples_per_chunk);
+	consumeHistory(history, n_new_chunks, samples_per_chunk);
+	return n_new_chunks;
+}
+
+
+bool MusicalFFT::supportsRawSignal(const float data_rate, const size_t samples_per_chunk, const float base_note_freq)
+{
+	return AnalysisPlan::supportsPcm16(ctx, { data_rate, base_note_freq, samples_per_chunk, note_precision });
+}
+
+
+size_t MusicalFFT::runFFTOnRawHistory(const float* channel_weights, const float data_rate, const size_t samples_per_chunk, const float base_note_freq, const bool consume)
+{
+	if (!raw_history.mem)
+	{
+		throw std::runtime_error("There is no raw signal history");
 	}
-	if (!fft_output_mem)
+
+	waitForEvent(&fft_kernel_done);
+	selectPlan({ data_rate, base_note_freq, samples_per_chunk, note_precision });
+	const size_t n_new_chunks = launchFFT(raw_history.mem, raw_history.start, raw_history.n_samples, raw_history.capacity, samples_per_chunk, channel_weights, raw_history_channels);
+	if (consume)
+	{
+		consumeHistory(raw_history, n_new_chunks, samples_per_chunk);
+	}
+	return n_new_chunks;
+}
+
+
+void MusicalFFT::consumeHistory(SignalHistory& history, const size_t n_new_chunks, const size_t samples_per_chunk)
+{
+	// Samples are only overwritten by appendSignal(), which waits for the FFT
+	const size_t n_consumed = n_new_chunks * samples_per_chunk;
+	history.start = (history.start + n_consumed) % history.capacity;
+	history.n_samples -= n_consumed;
+}
+
+
+void MusicalFFT::resetHistory()
+{
+	waitForEvent(&fft_kernel_done);
+	for (size_t i = 0; i < histories.size(); ++i)
 	{
-		std::cout << "Allocate output memory" << std::endl;
-		fft_output_mem = new OpenCLReadOnlyMemory(devices[0], fft_output_mem_size, CL_MEM_READ_WRITE);
+		releaseMemory(&histories[i].mem);
 	}
+	histories.clear();
+	releaseMemory(&raw_history.mem);
+	raw_history = { nullptr, 0, 0, 0 };
+	raw_history_channels = 0;
+}
+
 
-	// Write signal to device memory
-	uint8_t* signal_buffer = fft_input_mem->getWriteableBuffer();
-	memcpy(signal_buffer, signal, fft_input_mem->getSize());
-	fft_input_mem->write(nullptr);
+size_t MusicalFFT::launchFFT(OpenCLWriteOnlyMemory* signal_mem, const size_t signal_start, const size_t n_signal, const size_t ring_size, const size_t samples_per_chunk, const float* channel_weights, const size_t n_channels)
+{
+	// Calculate number of chunks that can be done with amount of data supplied
+	n_chunks = plan->getNumChunks(n_signal);
+	if (n_chunks == 0)
+	{
+		throw std::runtime_error("Cannot have 0 chunks");
+	}
+	prepareMemory(&fft_output_mem, device, cmdq, AnalysisPlan::getSizeClass(n_chunks * FFT_SIZE * 6 * sizeof(float)), CL_MEM_READ_WRITE);
 
 	// Set up arguments
+	cl_kernel fft_kernel = getKernel(channel_weights ? ANALYSIS_KERNEL_FFT_PCM16 : ANALYSIS_KERNEL_FFT);
 	cl_int err = 0;
-	fft_input_mem->setAsKernelArgument(fft_kernel, 0);
+	signal_mem->setAsKernelArgument(fft_kernel, 0);
 	cl_uint samples_per_chunk_arg = (cl_uint)samples_per_chunk;
 	err = clSetKernelArg(fft_kernel, 1, sizeof(cl_uint), (void*)&samples_per_chunk_arg);
 	checkError(err, "clSetKernelArg");
+	float samples_per_base_note = plan->getSamplesPerBaseNote();
 	err = clSetKernelArg(fft_kernel, 2, sizeof(float), (void*)&samples_per_base_note);
 	checkError(err, "clSetKernelArg");
-	err = clSetKernelArg(fft_kernel, 3, (size_t)floor(samples_per_base_note + 2) * sizeof(cl_float), nullptr);
+	err = clSetKernelArg(fft_kernel, 3, plan->getSamplesPerChunkWindow() * sizeof(cl_float), nullptr);
 	checkError(err, "clSetKernelArg");
 	fft_output_mem->setAsKernelArgument(fft_kernel, 4);
+	plan->setTablesAsKernelArguments(fft_kernel, 5, 6);
+	cl_uint signal_start_arg = (cl_uint)signal_start;
+	err = clSetKernelArg(fft_kernel, 7, sizeof(cl_uint), (void*)&signal_start_arg);
+	checkError(err, "clSetKernelArg");
+	cl_uint ring_size_arg = (cl_uint)ring_size;
+	err = clSetKernelArg(fft_kernel, 8, sizeof(cl_uint), (void*)&ring_size_arg);
+	checkError(err, "clSetKernelArg");
+	if (channel_weights)
+	{
+		// The weights include the scale of 16-bit samples to [-1, 1)
+		prepareMemory(&channel_weights_mem, device, cmdq, n_channels * sizeof(cl_float), CL_MEM_READ_ONLY);
+		cl_float* weights = reinterpret_cast<cl_float*>(channel_weights_mem->getWriteableBuffer());
+		for (size_t i = 0; i < n_channels; ++i)
+		{
+			weights[i] = channel_weights[i] / 32768;
+		}
+		channel_weights_mem->write(nullptr);
+
+		cl_uint n_channels_arg = (cl_uint)n_channels;
+		err = clSetKernelArg(fft_kernel, 9, sizeof(cl_uint), (void*)&n_channels_arg);
+		checkError(err, "clSetKernelArg");
+		channel_weights_mem->setAsKernelArgument(fft_kernel, 10);
+		err = clSetKernelArg(fft_kernel, 11, plan->getSamplesPerChunkWindow() * sizeof(cl_short), nullptr);
+		checkError(err, "clSetKernelArg");
+	}
 
 	// Kernel execution configuration
 	cl_uint work_dim = 1;
 	size_t global_work_offset[] = { 0 };
-	size_t global_work_size[] = { (FFT_SIZE / 2) * n_chunks };
-	size_t local_work_size[] = { FFT_SIZE / 2 };
+	size_t global_work_size[] = { (FFT_SIZE / plan->getFftRadix()) * n_chunks };
+	size_t local_work_size[] = { FFT_SIZE / plan->getFftRadix() };
 
 	// Execute kernel
-	err = clEnqueueNDRangeKernel(devices[0]->getCommandQueue(), fft_kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, nullptr, &fft_kernel_done);
+	err = clEnqueueNDRangeKernel(cmdq, fft_kernel, work_dim, global_work_offset, global_work_size, local_work_size, 0, nullptr, &fft_kernel_done);
 	checkError(err, "clEnqueueNDRangeKernel");
 
 	return n_chunks;
@@ -147,61 +361,355 @@ const float* MusicalFFT::readComplete(size_t* n_chunks, size_t* n_overtones_per_
 	// Retrieve output from the buffer
 	if (n_chunks) *n_chunks = this->n_chunks;
 	if (n_overtones_per_note) *n_overtones_per_note = FFT_SIZE / 2;
-	return reinterpret_cast<const float*>(fft_output_mem->read(nullptr));
+	return reinterpret_cast<const float*>(fft_output_mem->read(this->n_chunks * FFT_SIZE * 6 * sizeof(float), nullptr));
 }
 
 
 const float* MusicalFFT::readNotes(size_t* n_chunks, size_t* n_notes)
 {
-	// Make sure the FFT computation executed and completed
-	if (!fft_output_mem) return nullptr;
+	size_t n_values = 0;
+	const uint8_t* packed_notes = readNotesPacked(n_chunks, &n_values);
+	if (!packed_notes) return nullptr;
+	if (n_notes) *n_notes = n_values;
+	if (note_precision == NOTE_PRECISION_FLOAT32)
+	{
+		return reinterpret_cast<const float*>(packed_notes);
+	}
+
+	// Widen the narrow values on the host
+	n_values *= this->n_chunks;
+	widened_notes.resize(n_values);
+	widenNotes(packed_notes, n_values, note_precision, widened_notes.data());
+	return widened_notes.data();
+}
+
+
+const uint8_t* MusicalFFT::readNotesPacked(size_t* n_chunks, size_t* n_notes)
+{
+	size_t notes_output_size = convertNotes();
+	if (!notes_output_size) return nullptr;
+
+	// Return output
+	if (n_chunks) *n_chunks = this->n_chunks;
+	if (n_notes) *n_notes = N_NOTES_PER_CHUNK;
+	return notes_output_mem->read(notes_output_size, nullptr);
+}
+
+
+bool MusicalFFT::readNotesPackedTo(uint8_t* output, const size_t n_output)
+{
+	size_t notes_output_size = convertNotes();
+	if (!notes_output_size) return false;
+	if (n_output < notes_output_size)
+	{
+		throw std::runtime_error("Output is too small for the notes");
+	}
+	return notes_output_mem->readTo(output, notes_output_size, nullptr);
+}
+
+
+bool MusicalFFT::readCompleteTo(float* output, const size_t n_output)
+{
+	// Make sure the computation executed and completed
+	if (!fft_output_mem) return false;
+	waitForEvent(&fft_kernel_done);
+
+	size_t n_values = n_chunks * FFT_SIZE * 6;
+	if (n_output < n_values)
+	{
+		throw std::runtime_error("Output is too small for the FFT");
+	}
+	return fft_output_mem->readTo(reinterpret_cast<uint8_t*>(output), n_values * sizeof(float), nullptr);
+}
+
+
+bool MusicalFFT::readCompleteRangeTo(const SpectrumRange& range, float* output, const size_t n_output, size_t note_pitch, size_t chunk_pitch)
+{
+	// Make sure the computation executed and completed
+	if (!fft_output_mem) return false;
 	waitForEvent(&fft_kernel_done);
 
-	// Execute a kernel to gather the notes from global memory
-	if (!notes_kernel)
+	if (range.chunk_begin + range.n_chunks > n_chunks || range.note_begin + range.n_notes > 12 || range.overtone_begin + range.n_overtones > FFT_SIZE / 2)
 	{
-		std::cout << "Compile kernel" << std::endl;
-		std::stringstream compiler_options;
-		compiler_options << "-D N_STAGES=" << N_STAGES;
-		notes_kernel = ctx->createKernel("gather_notes", "../kernels/gather_notes.cl", compiler_options.str());
+		throw std::runtime_error("Range is outside of the FFT");
 	}
+	if (range.n_chunks == 0 || range.n_notes == 0 || range.n_overtones == 0) return true;
+
+	if (note_pitch == 0) note_pitch = range.n_overtones;
+	if (chunk_pitch == 0) chunk_pitch = range.n_notes * note_pitch;
+	if (note_pitch < range.n_overtones || chunk_pitch < range.n_notes * note_pitch)
+	{
+		throw std::runtime_error("Rows of the output overlap");
+	}
+	if (n_output < (range.n_chunks - 1) * chunk_pitch + (range.n_notes - 1) * note_pitch + range.n_overtones)
+	{
+		throw std::runtime_error("Output is too small for the range");
+	}
+
+	// The output is a box of (chunk, note, overtone) with a row per note
+	const size_t origin[] = { range.overtone_begin * sizeof(float), range.note_begin, range.chunk_begin };
+	const size_t region[] = { range.n_overtones * sizeof(float), range.n_notes, range.n_chunks };
+	return fft_output_mem->readRectTo(reinterpret_cast<uint8_t*>(output), origin, region, FFT_SIZE / 2 * sizeof(float), FFT_SIZE * 6 * sizeof(float), note_pitch * sizeof(float), chunk_pitch * sizeof(float));
+}
+
+
+size_t MusicalFFT::convertNotes()
+{
+	// Make sure the FFT computation executed and completed
+	if (!fft_output_mem) return 0;
+	waitForEvent(&fft_kernel_done);
 
 	// Create buffer for the output
-	// If the buffer is the wrong size, delete and resize
-	std::vector<OpenCLDevice*> devices = ctx->getDevices();
+	size_t notes_output_size = n_chunks * N_NOTES_PER_CHUNK * getNotePrecisionSize(note_precision);
+	prepareMemory(&notes_output_mem, device, cmdq, AnalysisPlan::getSizeClass(notes_output_size), CL_MEM_WRITE_ONLY);
 
-	size_t notes_output_mem_size = this->n_chunks * (N_STAGES - 1) * 12 * sizeof(float);
-	if (notes_output_mem && notes_output_mem->getSize() != notes_output_mem_size)
+	// Convert either the accumulated notes or the last FFT
+	cl_kernel kernel = getKernel(notes_accumulated ? ANALYSIS_KERNEL_PACK_NOTES : ANALYSIS_KERNEL_GATHER_NOTES);
+	if (notes_accumulated)
 	{
-		std::cout << "Resize output memory" << std::endl;
-		delete notes_output_mem;
-		notes_output_mem = nullptr;
+		notes_accumulator_mem->setAsKernelArgument(kernel, 0);
+		notes_accumulated = false;
 	}
-	if (!notes_output_mem)
+	else
+	{
+		fft_output_mem->setAsKernelArgument(kernel, 0);
+	}
+	notes_output_mem->setAsKernelArgument(kernel, 1);
+	cl_int err = 0;
+	cl_uint layout_arg = (cl_uint)note_layout;
+	err = clSetKernelArg(kernel, 2, sizeof(cl_uint), (void*)&layout_arg);
+	checkError(err, "clSetKernelArg");
+	cl_uint n_chunks_arg = (cl_uint)n_chunks;
+	err = clSetKernelArg(kernel, 3, sizeof(cl_uint), (void*)&n_chunks_arg);
+	checkError(err, "clSetKernelArg");
+	runKernel(kernel, n_chunks);
+	return notes_output_size;
+}
+
+
+void MusicalFFT::accumulateNotes(const float weight)
+{
+	// Make sure the FFT computation executed and completed
+	if (!fft_output_mem) return;
+	waitForEvent(&fft_kernel_done);
+
+	// The running sum is only kept on the device
+	size_t notes_accumulator_size = AnalysisPlan::getSizeClass(n_chunks * N_NOTES_PER_CHUNK * sizeof(float));
+	if (prepareMemory(&notes_accumulator_mem, device, cmdq, notes_accumulator_size, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS))
 	{
-		std::cout << "Allocate output memory" << std::endl;
-		notes_output_mem = new OpenCLReadOnlyMemory(devices[0], notes_output_mem_size, CL_MEM_WRITE_ONLY);
+		notes_accumulated = false;
 	}
 
+	cl_kernel accumulate_kernel = getKernel(ANALYSIS_KERNEL_ACCUMULATE_NOTES);
+
 	// Set up arguments
-	fft_output_mem->setAsKernelArgument(notes_kernel, 0);
-	notes_output_mem->setAsKernelArgument(notes_kernel, 1);
+	cl_int err = 0;
+	fft_output_mem->setAsKernelArgument(accumulate_kernel, 0);
+	err = clSetKernelArg(accumulate_kernel, 1, sizeof(float), (void*)&weight);
+	checkError(err, "clSetKernelArg");
+	cl_uint reset_arg = notes_accumulated ? 0 : 1;
+	err = clSetKernelArg(accumulate_kernel, 2, sizeof(cl_uint), (void*)&reset_arg);
+	checkError(err, "clSetKernelArg");
+	notes_accumulator_mem->setAsKernelArgument(accumulate_kernel, 3);
+
+	runKernel(accumulate_kernel, n_chunks);
+	notes_accumulated = true;
+}
+
+
+void MusicalFFT::setNotePrecision(const NotePrecision precision)
+{
+	if (precision == note_precision) return;
+
+	// The kernels producing notes are specialized for the precision
+	note_precision = precision;
+	if (plan)
+	{
+		AnalysisPlanKey key = plan->getKey();
+		key.note_precision = precision;
+		selectPlan(key);
+	}
+}
+
+
+const NoteEvent* MusicalFFT::readNoteEvents(const NoteEventThresholds& thresholds, size_t* n_events)
+{
+	// Event detection works on the note powers as floats on the device
+	if (!fft_output_mem) return nullptr;
+	if (!notes_accumulated)
+	{
+		accumulateNotes(1.0f);
+	}
+	notes_accumulated = false;
+
+	cl_kernel mark_events_kernel = getKernel(ANALYSIS_KERNEL_MARK_EVENTS);
+	cl_kernel count_events_kernel = getKernel(ANALYSIS_KERNEL_COUNT_EVENTS);
+	cl_kernel scan_counts_kernel = getKernel(ANALYSIS_KERNEL_SCAN_COUNTS);
+	cl_kernel write_events_kernel = getKernel(ANALYSIS_KERNEL_WRITE_EVENTS);
+
+	// Create buffers; the state of the notes persists between calls
+	const cl_mem_flags device_only = CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS;
+	prepareEventState();
+	prepareMemory(&event_flags_mem, device, cmdq, AnalysisPlan::getSizeClass(n_chunks * N_NOTES_PER_CHUNK * sizeof(cl_uchar)), device_only);
+	prepareMemory(&event_counts_mem, device, cmdq, AnalysisPlan::getSizeClass(n_chunks * sizeof(cl_uint)), device_only);
+	prepareMemory(&event_offsets_mem, device, cmdq, AnalysisPlan::getSizeClass(n_chunks * sizeof(cl_uint)), device_only);
+	prepareMemory(&event_count_mem, device, cmdq, sizeof(cl_uint), CL_MEM_READ_WRITE);
+	prepareMemory(&event_list_mem, device, cmdq, AnalysisPlan::getSizeClass(n_chunks * N_NOTES_PER_CHUNK * sizeof(NoteEvent)), CL_MEM_READ_WRITE);
+
+	// Mark events for each note
+	cl_int err = 0;
+	cl_uint n_chunks_arg = (cl_uint)n_chunks;
+	notes_accumulator_mem->setAsKernelArgument(mark_events_kernel, 0);
+	err = clSetKernelArg(mark_events_kernel, 1, sizeof(cl_uint), (void*)&n_chunks_arg);
+	checkError(err, "clSetKernelArg");
+	err = clSetKernelArg(mark_events_kernel, 2, sizeof(float), (void*)&thresholds.on_threshold);
+	checkError(err, "clSetKernelArg");
+	err = clSetKernelArg(mark_events_kernel, 3, sizeof(float), (void*)&thresholds.off_threshold);
+	checkError(err, "clSetKernelArg");
+	err = clSetKernelArg(mark_events_kernel, 4, sizeof(float), (void*)&thresholds.onset_ratio);
+	checkError(err, "clSetKernelArg");
+	event_state_mem->setAsKernelArgument(mark_events_kernel, 5);
+	event_flags_mem->setAsKernelArgument(mark_events_kernel, 6);
+	runKernel(mark_events_kernel, N_NOTES_PER_CHUNK);
+
+	// Find where the events of each chunk go in the compacted list
+	event_flags_mem->setAsKernelArgument(count_events_kernel, 0);
+	event_counts_mem->setAsKernelArgument(count_events_kernel, 1);
+	runKernel(count_events_kernel, n_chunks);
+
+	event_counts_mem->setAsKernelArgument(scan_counts_kernel, 0);
+	err = clSetKernelArg(scan_counts_kernel, 1, sizeof(cl_uint), (void*)&n_chunks_arg);
+	checkError(err, "clSetKernelArg");
+	event_offsets_mem->setAsKernelArgument(scan_counts_kernel, 2);
+	event_count_mem->setAsKernelArgument(scan_counts_kernel, 3);
+	runKernel(scan_counts_kernel, EVENTS_SCAN_SIZE, EVENTS_SCAN_SIZE);
+
+	// Compact the events
+	cl_uint chunk_offset_arg = (cl_uint)event_chunk_offset;
+	notes_accumulator_mem->setAsKernelArgument(write_events_kernel, 0);
+	event_flags_mem->setAsKernelArgument(write_events_kernel, 1);
+	event_offsets_mem->setAsKernelArgument(write_events_kernel, 2);
+	err = clSetKernelArg(write_events_kernel, 3, sizeof(cl_uint), (void*)&chunk_offset_arg);
+	checkError(err, "clSetKernelArg");
+	event_list_mem->setAsKernelArgument(write_events_kernel, 4);
+	runKernel(write_events_kernel, n_chunks);
+	event_chunk_offset += n_chunks;
+
+	// Only transfer the events that exist
+	cl_uint n_events_found = 0;
+	event_count_mem->readTo(reinterpret_cast<uint8_t*>(&n_events_found), sizeof(cl_uint), nullptr);
+	events.resize(n_events_found);
+	if (n_events_found > 0)
+	{
+		event_list_mem->readTo(reinterpret_cast<uint8_t*>(events.data()), n_events_found * sizeof(NoteEvent), nullptr);
+	}
+
+	if (n_events) *n_events = n_events_found;
+	return events.data();
+}
+
+
+void MusicalFFT::resetNoteEvents()
+{
+	event_chunk_offset = 0;
+	if (event_state_mem)
+	{
+		event_state_mem->fillZero();
+	}
+}
+
+
+void MusicalFFT::prepareEventState()
+{
+	// The state can be saved and restored by the host
+	if (prepareMemory(&event_state_mem, device, cmdq, N_NOTES_PER_CHUNK * 2 * sizeof(float), CL_MEM_READ_WRITE))
+	{
+		event_state_mem->fillZero();
+	}
+}
+
+
+void MusicalFFT::readNoteEventState(float* output)
+{
+	prepareEventState();
+	event_state_mem->readTo(reinterpret_cast<uint8_t*>(output), N_NOTES_PER_CHUNK * 2 * sizeof(float), nullptr);
+}
+
+
+void MusicalFFT::writeNoteEventState(const float* state, const size_t chunk_offset)
+{
+	prepareEventState();
+	event_state_mem->writeFrom(reinterpret_cast<const uint8_t*>(state), N_NOTES_PER_CHUNK * 2 * sizeof(float), nullptr);
+	event_chunk_offset = chunk_offset;
+}
+
+
+void MusicalFFT::warmUp(const float data_rate, const size_t samples_per_chunk, const float base_note_freq)
+{
+	warm_up_key = { data_rate, base_note_freq, samples_per_chunk, note_precision };
+	warm_up_plan = AnalysisPlan::prepare(ctx, warm_up_key);
+}
+
+
+void MusicalFFT::selectPlan(const AnalysisPlanKey& key)
+{
+	if (!plan || !(plan->getKey() == key))
+	{
+		releaseKernels();
+
+		// The plan of a warm-up is used even if the cache has dropped it
+		if (warm_up_plan.valid() && warm_up_key == key)
+		{
+			std::shared_future<std::shared_ptr<const AnalysisPlan> > pending = warm_up_plan;
+			warm_up_plan = std::shared_future<std::shared_ptr<const AnalysisPlan> >();
+			plan = pending.get();
+		}
+		else
+		{
+			plan = AnalysisPlan::get(ctx, key);
+		}
+	}
+}
+
+
+cl_kernel MusicalFFT::getKernel(const AnalysisKernel kernel)
+{
+	if (!kernels[kernel])
+	{
+		kernels[kernel] = plan->createKernel(kernel);
+	}
+	return kernels[kernel];
+}
+
+
+void MusicalFFT::releaseKernels()
+{
+	for (size_t i = 0; i < N_ANALYSIS_KERNELS; ++i)
+	{
+		if (kernels[i])
+		{
+			cl_int err = clReleaseKernel(kernels[i]);
+			checkError(err, "clReleaseKernel");
+			kernels[i] = nullptr;
+		}
+	}
+}
+
+
+void MusicalFFT::runKernel(cl_kernel kernel, const size_t n_workitems, const size_t workgroup_size)
+{
 
 	// Kernel execution configuration
 	cl_uint work_dim = 1;
 	size_t global_work_offset[] = { 0 };
-	size_t global_work_size[] = { this->n_chunks };
+	size_t global_work_size[] = { n_workitems };
+	size_t local_work_size[] = { workgroup_size };
 
 	// Execute kernel
-	cl_event notes_kernel_done;
-	cl_int err = clEnqueueNDRangeKernel(devices[0]->getCommandQueue(), notes_kernel, work_dim, global_work_offset, global_work_size, nullptr, 0, nullptr, &notes_kernel_done);
+	cl_event kernel_done;
+	cl_int err = clEnqueueNDRangeKernel(cmdq, kernel, work_dim, global_work_offset, global_work_size, workgroup_size ? local_work_size : nullptr, 0, nullptr, &kernel_done);
 	checkError(err, "clEnqueueNDRangeKernel");
-	waitForEvent(&notes_kernel_done);
-
-	// Return output
-	if (n_chunks) *n_chunks = this->n_chunks;
-	if (n_notes) *n_notes = 12 * (N_STAGES - 1);
-	return reinterpret_cast<const float*>(notes_output_mem->read(nullptr));
+	waitForEvent(&kernel_done);
 }
 
 
@@ -1,9 +1,12 @@
 #include <fftsw.h>
+#include <simd.h>
 
 #include <algorithm>
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 
 void fft_sw(const float* data, const uint32_t n_samples, complex_t* output)
@@ -64,6 +67,146 @@ void fft_sw(const float* data, const uint32_t n_samples, complex_t* output)
 }
 
 
+// Signals per block of fft_sw_batch; two vectors per row keep two
+// independent chains of butterflies in flight
+#define FFT_SW_BLOCK_WIDTH (2 * SIMD_WIDTH)
+
+
+/*! Butterfly of one vector of a row of a block: the even element plus and
+ *  minus the rotated odd element
+ */
+static inline void fft_sw_butterfly(const float* inputs_re, const float* inputs_im, float* outputs_re, float* outputs_im, const size_t even, const size_t odd, const size_t sum, const size_t difference, const simd_float exp_re, const simd_float exp_im)
+{
+    const simd_float even_re = simdLoad(inputs_re + even);
+    const simd_float even_im = simdLoad(inputs_im + even);
+    const simd_float odd_re = simdLoad(inputs_re + odd);
+    const simd_float odd_im = simdLoad(inputs_im + odd);
+    const simd_float rotated_re = odd_re * exp_re - odd_im * exp_im;
+    const simd_float rotated_im = odd_re * exp_im + odd_im * exp_re;
+    simdStore(outputs_re + sum, even_re + rotated_re);
+    simdStore(outputs_im + sum, even_im + rotated_im);
+    simdStore(outputs_re + difference, even_re - rotated_re);
+    simdStore(outputs_im + difference, even_im - rotated_im);
+}
+
+
+/*! Transform the signals first to first + FFT_SW_BLOCK_WIDTH of a batch,
+ *  with fewer valid lanes in the last block
+ *    @param cosines, sines: rotation k of n_samples / 2
+ *    @param buffers: 4 * n_samples * FFT_SW_BLOCK_WIDTH floats for the real
+ *                    and imaginary parts of the swapped inputs and outputs
+ */
+static void fft_sw_block(const float* data, const uint32_t n_samples, const size_t n_signals, const size_t first, const float* cosines, const float* sines, float* buffers, complex_t* output)
+{
+    const uint32_t max_stage = __builtin_ctz(n_samples);
+    const size_t n_lanes = std::min((size_t)FFT_SW_BLOCK_WIDTH, n_signals - first);
+    float* inputs_re = buffers;
+    float* inputs_im = buffers + n_samples * FFT_SW_BLOCK_WIDTH;
+    float* outputs_re = buffers + 2 * n_samples * FFT_SW_BLOCK_WIDTH;
+    float* outputs_im = buffers + 3 * n_samples * FFT_SW_BLOCK_WIDTH;
+
+    // Row i holds sample i of every signal of the block
+    for (uint32_t i = 0; i < n_samples; ++i)
+    {
+        const float* row = data + i * n_signals + first;
+        float* row_re = inputs_re + i * FFT_SW_BLOCK_WIDTH;
+        if (n_lanes == FFT_SW_BLOCK_WIDTH)
+        {
+            simdStore(row_re, simdLoad(row));
+            simdStore(row_re + SIMD_WIDTH, simdLoad(row + SIMD_WIDTH));
+        }
+        else
+        {
+            simdStore(row_re, simdBroadcast(0.0f));
+            simdStore(row_re + SIMD_WIDTH, simdBroadcast(0.0f));
+            memcpy(row_re, row, n_lanes * sizeof(float));
+        }
+        simdStore(inputs_im + i * FFT_SW_BLOCK_WIDTH, simdBroadcast(0.0f));
+        simdStore(inputs_im + i * FFT_SW_BLOCK_WIDTH + SIMD_WIDTH, simdBroadcast(0.0f));
+    }
+
+    // Same stages as fft_sw, with a whole row per element
+    for (uint32_t stage = 0; stage < max_stage; ++stage)
+    {
+        const uint32_t n_universes = n_samples >> (stage + 1);
+        const uint32_t n_pairs = 1 << stage;
+        const uint32_t exp_spacing = max_stage - (stage + 1);
+
+        for (uint32_t u = 0; u < n_universes; ++u)
+        {
+            const size_t evens = (u << stage) * FFT_SW_BLOCK_WIDTH;
+            const size_t odds = ((u + n_universes) << stage) * FFT_SW_BLOCK_WIDTH;
+            const size_t results = (u << (stage + 1)) * FFT_SW_BLOCK_WIDTH;
+
+            for (uint32_t k = 0; k < n_pairs; ++k)
+            {
+                const simd_float exp_re = simdBroadcast(cosines[k << exp_spacing]);
+                const simd_float exp_im = simdBroadcast(sines[k << exp_spacing]);
+                const size_t even = evens + k * FFT_SW_BLOCK_WIDTH;
+                const size_t odd = odds + k * FFT_SW_BLOCK_WIDTH;
+                const size_t sum = results + k * FFT_SW_BLOCK_WIDTH;
+                const size_t difference = results + (k + n_pairs) * FFT_SW_BLOCK_WIDTH;
+                fft_sw_butterfly(inputs_re, inputs_im, outputs_re, outputs_im, even, odd, sum, difference, exp_re, exp_im);
+                fft_sw_butterfly(inputs_re, inputs_im, outputs_re, outputs_im, even + SIMD_WIDTH, odd + SIMD_WIDTH, sum + SIMD_WIDTH, difference + SIMD_WIDTH, exp_re, exp_im);
+            }
+        }
+
+        std::swap(inputs_re, outputs_re);
+        std::swap(inputs_im, outputs_im);
+    }
+
+    for (uint32_t k = 0; k < n_samples / 2; ++k)
+    {
+        complex_t* row = output + k * n_signals + first;
+        for (size_t lane = 0; lane < n_lanes; ++lane)
+        {
+            row[lane] = complex_t(inputs_re[k * FFT_SW_BLOCK_WIDTH + lane], inputs_im[k * FFT_SW_BLOCK_WIDTH + lane]);
+        }
+    }
+}
+
+
+void fft_sw_batch(const float* data, const uint32_t n_samples, const size_t n_signals, complex_t* output, const size_t n_threads)
+{
+    // Lookup tables for the real and imaginary parts of the exponentials
+    std::vector<float> cosines(n_samples / 2), sines(n_samples / 2);
+    for (uint32_t i = 0; i < n_samples / 2; ++i)
+    {
+        cosines[i] = (float)cos(i * 2*M_PI / n_samples);
+        sines[i] = (float)sin(i * 2*M_PI / n_samples);
+    }
+
+    const size_t n_blocks = (n_signals + FFT_SW_BLOCK_WIDTH - 1) / FFT_SW_BLOCK_WIDTH;
+    size_t n_workers = n_threads > 0 ? n_threads : std::thread::hardware_concurrency();
+    if (n_workers > n_blocks) n_workers = n_blocks;
+    if (n_workers == 0) n_workers = 1;
+
+    // Each thread transforms consecutive blocks in its own buffers
+    auto transform = [&](const size_t begin, const size_t end)
+    {
+        std::vector<float> buffers(4 * n_samples * FFT_SW_BLOCK_WIDTH);
+        for (size_t block = begin; block < end; ++block)
+        {
+            fft_sw_block(data, n_samples, n_signals, block * FFT_SW_BLOCK_WIDTH, cosines.data(), sines.data(), buffers.data(), output);
+        }
+    };
+    if (n_workers == 1)
+    {
+        transform(0, n_blocks);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < n_workers; ++i)
+    {
+        threads.push_back(std::thread(transform, n_blocks * i / n_workers, n_blocks * (i + 1) / n_workers));
+    }
+    for (size_t i = 0; i < n_workers; ++i)
+    {
+        threads[i].join();
+    }
+}
+
+
 void dft_sw(const float* data, const uint32_t n_samples, complex_t* output)
 {
 	for (int i = 0; i < n_samples / 2; ++i)
@@ -0,0 +1,840 @@
+#include "flac.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+
+
+// Bytes of compressed data read at a time; a block holds many frames, so
+// their decoding can be spread over threads
+#define FLAC_READ_SIZE (1 << 22)
+
+// Largest header of a frame in bytes
+#define FLAC_MAX_FRAME_HEADER_SIZE 16
+
+#define FLAC_CHANNELS_LEFT_SIDE 8
+#define FLAC_CHANNELS_SIDE_RIGHT 9
+#define FLAC_CHANNELS_MID_SIDE 10
+
+
+/*! Tables of the CRC-8 of frame headers (polynomial x^8 + x^2 + x + 1) and
+ *  the CRC-16 of frames (polynomial x^16 + x^15 + x^2 + 1)
+ */
+struct FlacCrcTables
+{
+	uint8_t crc8[256];
+	uint16_t crc16[256];
+
+	FlacCrcTables()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint8_t crc = (uint8_t)i;
+			uint16_t crc_wide = (uint16_t)(i << 8);
+			for (int bit = 0; bit < 8; ++bit)
+			{
+				crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+				crc_wide = (crc_wide & 0x8000) ? (uint16_t)((crc_wide << 1) ^ 0x8005) : (uint16_t)(crc_wide << 1);
+			}
+			crc8[i] = crc;
+			crc16[i] = crc_wide;
+		}
+	}
+};
+
+
+static const FlacCrcTables& getCrcTables()
+{
+	static const FlacCrcTables tables;
+	return tables;
+}
+
+
+static uint8_t crc8(const uint8_t* data, const size_t size)
+{
+	const uint8_t* table = getCrcTables().crc8;
+	uint8_t crc = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		crc = table[crc ^ data[i]];
+	}
+	return crc;
+}
+
+
+/*! Reads a stream of bits, most significant bit first */
+class FlacBitReader
+{
+public:
+	FlacBitReader(const uint8_t* data, const size_t size) :
+		data(data),
+		size(size),
+		offset(0),
+		cache(0),
+		n_cached(0)
+	{}
+
+	/*! Read an unsigned value of up to 32 bits */
+	uint32_t read(const uint32_t n_bits)
+	{
+		if (n_bits == 0) return 0;
+		if (n_cached < n_bits) refill();
+		if (n_cached < n_bits)
+		{
+			throw std::runtime_error("Invalid file format (FLAC frame is cut off)");
+		}
+		const uint32_t output = (uint32_t)(cache >> (64 - n_bits));
+		cache <<= n_bits;
+		n_cached -= n_bits;
+		return output;
+	}
+
+	/*! Read a two's complement value of up to 32 bits */
+	int32_t readSigned(const uint32_t n_bits)
+	{
+		if (n_bits == 0) return 0;
+		const uint32_t value = read(n_bits);
+		const uint32_t sign = 1u << (n_bits - 1);
+		return (int32_t)((value ^ sign) - sign);
+	}
+
+	/*! Count the zeros before the next one and skip the one */
+	uint32_t readUnary()
+	{
+		uint32_t count = 0;
+		while (1)
+		{
+			if (cache == 0)
+			{
+				count += n_cached;
+				cache = 0;
+				n_cached = 0;
+				refill();
+				if (n_cached == 0)
+				{
+					throw std::runtime_error("Invalid file format (FLAC frame is cut off)");
+				}
+				continue;
+			}
+
+			// Bits after the cached ones are zero, so the one is cached
+			const uint32_t n_zeros = __builtin_clzll(cache);
+			count += n_zeros;
+			cache = n_zeros == 63 ? 0 : cache << (n_zeros + 1);
+			n_cached -= n_zeros + 1;
+			return count;
+		}
+	}
+
+protected:
+	void refill()
+	{
+		while (n_cached <= 56 && offset < size)
+		{
+			cache |= (uint64_t)data[offset++] << (56 - n_cached);
+			n_cached += 8;
+		}
+	}
+
+protected:
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+
+	// Cached bits are aligned to the most significant bit
+	uint64_t cache;
+	uint32_t n_cached;
+};
+
+
+/*! Decode the residual of a subframe after its warm-up samples */
+static void decodeResidual(FlacBitReader& bits, const uint32_t block_size, const uint32_t predictor_order, int32_t* output)
+{
+	const uint32_t method = bits.read(2);
+	if (method > 1)
+	{
+		throw std::runtime_error("Invalid file format (FLAC residual coding)");
+	}
+	const uint32_t n_parameter_bits = method == 0 ? 4 : 5;
+	const uint32_t escape = method == 0 ? 15 : 31;
+
+	const uint32_t partition_order = bits.read(4);
+	const uint32_t n_partition_samples = block_size >> partition_order;
+	if ((n_partition_samples << partition_order) != block_size || n_partition_samples < predictor_order)
+	{
+		throw std::runtime_error("Invalid file format (FLAC residual partitions)");
+	}
+
+	uint32_t index = predictor_order;
+	for (uint32_t partition = 0; partition < (1u << partition_order); ++partition)
+	{
+		const uint32_t n_samples = partition == 0 ? n_partition_samples - predictor_order : n_partition_samples;
+		const uint32_t parameter = bits.read(n_parameter_bits);
+		if (parameter == escape)
+		{
+			// Unencoded samples of a fixed size
+			const uint32_t n_bits = bits.read(5);
+			for (uint32_t i = 0; i < n_samples; ++i)
+			{
+				output[index++] = bits.readSigned(n_bits);
+			}
+		}
+		else
+		{
+			// Rice codes of zigzag-encoded values
+			for (uint32_t i = 0; i < n_samples; ++i)
+			{
+				const uint32_t value = (bits.readUnary() << parameter) | bits.read(parameter);
+				output[index++] = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+			}
+		}
+	}
+}
+
+
+/*! Decode a subframe of a channel */
+static void decodeSubframe(FlacBitReader& bits, const uint32_t block_size, uint32_t bits_per_sample, int32_t* output)
+{
+	if (bits.read(1) != 0)
+	{
+		throw std::runtime_error("Invalid file format (FLAC subframe padding)");
+	}
+	const uint32_t type = bits.read(6);
+
+	// Low bits that are zero in every sample are not stored
+	uint32_t n_wasted_bits = 0;
+	if (bits.read(1))
+	{
+		n_wasted_bits = bits.readUnary() + 1;
+		if (n_wasted_bits >= bits_per_sample)
+		{
+			throw std::runtime_error("Invalid file format (FLAC wasted bits)");
+		}
+		bits_per_sample -= n_wasted_bits;
+	}
+
+	if (type == 0)
+	{
+		// Constant
+		const int32_t value = bits.readSigned(bits_per_sample);
+		std::fill(output, output + block_size, value);
+	}
+	else if (type == 1)
+	{
+		// Verbatim
+		for (uint32_t i = 0; i < block_size; ++i)
+		{
+			output[i] = bits.readSigned(bits_per_sample);
+		}
+	}
+	else if (type >= 8 && type <= 12)
+	{
+		// Fixed polynomial predictor
+		const uint32_t order = type - 8;
+		if (order > block_size)
+		{
+			throw std::runtime_error("Invalid file format (FLAC predictor order)");
+		}
+		for (uint32_t i = 0; i < order; ++i)
+		{
+			output[i] = bits.readSigned(bits_per_sample);
+		}
+		decodeResidual(bits, block_size, order, output);
+
+		int32_t* s = output;
+		switch (order)
+		{
+		case 1:
+			for (uint32_t i = 1; i < block_size; ++i) s[i] += s[i - 1];
+			break;
+		case 2:
+			for (uint32_t i = 2; i < block_size; ++i) s[i] += 2 * s[i - 1] - s[i - 2];
+			break;
+		case 3:
+			for (uint32_t i = 3; i < block_size; ++i) s[i] += 3 * (s[i - 1] - s[i - 2]) + s[i - 3];
+			break;
+		case 4:
+			for (uint32_t i = 4; i < block_size; ++i) s[i] += 4 * (s[i - 1] + s[i - 3]) - 6 * s[i - 2] - s[i - 4];
+			break;
+		}
+	}
+	else if (type >= 32)
+	{
+		// Linear predictor with quantized coefficients
+		const uint32_t order = type - 31;
+		if (order > block_size)
+		{
+			throw std::runtime_error("Invalid file format (FLAC predictor order)");
+		}
+		for (uint32_t i = 0; i < order; ++i)
+		{
+			output[i] = bits.readSigned(bits_per_sample);
+		}
+		const uint32_t precision = bits.read(4) + 1;
+		const int32_t shift = bits.readSigned(5);
+		if (precision == 16 || shift < 0)
+		{
+			throw std::runtime_error("Invalid file format (FLAC predictor coefficients)");
+		}
+		int32_t coefficients[32];
+		for (uint32_t i = 0; i < order; ++i)
+		{
+			coefficients[i] = bits.readSigned(precision);
+		}
+		decodeResidual(bits, block_size, order, output);
+
+		for (uint32_t i = order; i < block_size; ++i)
+		{
+			int64_t prediction = 0;
+			for (uint32_t j = 0; j < order; ++j)
+			{
+				prediction += (int64_t)coefficients[j] * output[i - 1 - j];
+			}
+			output[i] += (int32_t)(prediction >> shift);
+		}
+	}
+	else
+	{
+		throw std::runtime_error("Invalid file format (FLAC subframe type)");
+	}
+
+	if (n_wasted_bits > 0)
+	{
+		for (uint32_t i = 0; i < block_size; ++i)
+		{
+			output[i] = (int32_t)((uint32_t)output[i] << n_wasted_bits);
+		}
+	}
+}
+
+
+FlacFile::FlacFile(const std::string& fname, const size_t n_threads) :
+	sample_rate(0),
+	n_channels(0),
+	bits_per_sample(0),
+	max_block_size(0),
+	n_total_samples(0),
+	seek_points(),
+	n_threads(n_threads > 0 ? n_threads : std::max(1u, std::thread::hardware_concurrency())),
+	ist(fname, std::ios::binary),
+	first_frame_offset(0),
+	end_of_file(false),
+	compressed(),
+	compressed_first_sample(0),
+	decoded(),
+	decoded_first_sample(0),
+	position(0)
+{
+	// https://xiph.org/flac/format.html
+	if (!ist)
+	{
+		throw std::runtime_error("Could not open FLAC file '" + fname + "'");
+	}
+	uint8_t buffer[34];
+
+	// Skip an ID3v2 tag in front of the stream
+	if (!ist.read(reinterpret_cast<char*>(buffer), 4))
+	{
+		throw std::runtime_error("Invalid file format (fLaC)");
+	}
+	if (memcmp(buffer, "ID3", 3) == 0)
+	{
+		if (!ist.read(reinterpret_cast<char*>(buffer + 4), 6))
+		{
+			throw std::runtime_error("Invalid file format (ID3)");
+		}
+		const uint32_t tag_size = (buffer[6] & 0x7f) << 21 | (buffer[7] & 0x7f) << 14 | (buffer[8] & 0x7f) << 7 | (buffer[9] & 0x7f);
+		ist.seekg(tag_size, std::ios_base::cur);
+		ist.read(reinterpret_cast<char*>(buffer), 4);
+	}
+	if (!ist || memcmp(buffer, "fLaC", 4) != 0)
+	{
+		throw std::runtime_error("Invalid file format (fLaC)");
+	}
+
+	// Iterate through the metadata blocks until the first frame
+	bool seen_streaminfo = false;
+	bool is_last = false;
+	while (!is_last)
+	{
+		if (!ist.read(reinterpret_cast<char*>(buffer), 4))
+		{
+			throw std::runtime_error("Invalid file format (FLAC metadata)");
+		}
+		is_last = (buffer[0] & 0x80) != 0;
+		const uint32_t block_type = buffer[0] & 0x7f;
+		const uint32_t block_size = buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+
+		if (block_type == 0)
+		{
+			// Stream info
+			if (block_size != 34 || !ist.read(reinterpret_cast<char*>(buffer), 34))
+			{
+				throw std::runtime_error("Invalid file format (FLAC STREAMINFO)");
+			}
+			seen_streaminfo = true;
+			max_block_size = buffer[2] << 8 | buffer[3];
+			sample_rate = buffer[10] << 12 | buffer[11] << 4 | buffer[12] >> 4;
+			n_channels = ((buffer[12] >> 1) & 0x07) + 1;
+			bits_per_sample = ((buffer[12] & 0x01) << 4 | buffer[13] >> 4) + 1;
+			n_total_samples = (uint64_t)(buffer[13] & 0x0f) << 32 | (uint64_t)buffer[14] << 24 | buffer[15] << 16 | buffer[16] << 8 | buffer[17];
+		}
+		else if (block_type == 3)
+		{
+			// Seek table; placeholders have the largest sample number
+			for (uint32_t i = 0; i < block_size / 18; ++i)
+			{
+				if (!ist.read(reinterpret_cast<char*>(buffer), 18))
+				{
+					throw std::runtime_error("Invalid file format (FLAC SEEKTABLE)");
+				}
+				FlacSeekPoint point = { 0, 0 };
+				for (int j = 0; j < 8; ++j)
+				{
+					point.sample = point.sample << 8 | buffer[j];
+					point.offset = point.offset << 8 | buffer[8 + j];
+				}
+				if (point.sample != UINT64_MAX)
+				{
+					seek_points.push_back(point);
+				}
+			}
+			ist.seekg(block_size % 18, std::ios_base::cur);
+		}
+		else
+		{
+			// Skip the rest of the block
+			ist.seekg(block_size, std::ios_base::cur);
+		}
+	}
+
+	if (!seen_streaminfo)
+	{
+		throw std::runtime_error("Did not find a FLAC STREAMINFO block");
+	}
+	else if (bits_per_sample < 4 || bits_per_sample > 24)
+	{
+		throw std::runtime_error("FLAC samples must have 4 to 24 bits");
+	}
+	first_frame_offset = ist.tellg();
+	decoded.resize(n_channels);
+}
+
+
+size_t FlacFile::getNumSamplesRemaining() const
+{
+	if (n_total_samples > 0)
+	{
+		return position < n_total_samples ? n_total_samples - position : 0;
+	}
+	const uint64_t decoded_end = getDecodedEnd();
+	return position < decoded_end ? decoded_end - position : 0;
+}
+
+
+size_t FlacFile::readSamples(const size_t n_samples, const std::vector<float*> outputs)
+{
+	if (outputs.size() != n_channels)
+	{
+		throw std::runtime_error("There must be as many output buffers as there are channels");
+	}
+
+	const float factor = 1 / (float)(1 << (bits_per_sample - 1));
+	size_t n_read = 0;
+	while (n_read < n_samples)
+	{
+		if (position >= getDecodedEnd())
+		{
+			if (!decodeNextFrames()) break;
+			continue;
+		}
+
+		const size_t offset = position - decoded_first_sample;
+		const size_t n_available = decoded[0].size() - offset;
+		const size_t n = n_samples - n_read < n_available ? n_samples - n_read : n_available;
+		for (uint32_t channel = 0; channel < n_channels; ++channel)
+		{
+			const int32_t* input = decoded[channel].data() + offset;
+			float* output = outputs[channel] + n_read;
+			for (size_t i = 0; i < n; ++i)
+			{
+				output[i] = input[i] * factor;
+			}
+		}
+		n_read += n;
+		position += n;
+	}
+	return n_read;
+}
+
+
+size_t FlacFile::readMixedSamples(const size_t n_samples, const std::vector<float>& weights, float* output)
+{
+	if (weights.size() != n_channels)
+	{
+		throw std::runtime_error("There must be a weight for every channel");
+	}
+
+	// The conversion to [-1, 1) is part of the weights
+	const float factor = 1 / (float)(1 << (bits_per_sample - 1));
+	std::vector<float> scaled_weights(n_channels);
+	for (uint32_t channel = 0; channel < n_channels; ++channel)
+	{
+		scaled_weights[channel] = weights[channel] * factor;
+	}
+
+	size_t n_read = 0;
+	while (n_read < n_samples)
+	{
+		if (position >= getDecodedEnd())
+		{
+			if (!decodeNextFrames()) break;
+			continue;
+		}
+
+		const size_t offset = position - decoded_first_sample;
+		const size_t n_available = decoded[0].size() - offset;
+		const size_t n = n_samples - n_read < n_available ? n_samples - n_read : n_available;
+		// Channels are decoded separately, so the mix accumulates one
+		// channel at a time in contiguous passes
+		float* mix_output = output + n_read;
+		for (uint32_t channel = 0; channel < n_channels; ++channel)
+		{
+			const int32_t* input = decoded[channel].data() + offset;
+			const float weight = scaled_weights[channel];
+			if (channel == 0)
+			{
+				for (size_t i = 0; i < n; ++i)
+				{
+					mix_output[i] = input[i] * weight;
+				}
+			}
+			else
+			{
+				for (size_t i = 0; i < n; ++i)
+				{
+					mix_output[i] += input[i] * weight;
+				}
+			}
+		}
+		n_read += n;
+		position += n;
+	}
+	return n_read;
+}
+
+
+size_t FlacFile::readRawSamples(const size_t n_samples, int16_t* output)
+{
+	size_t n_read = 0;
+	while (n_read < n_samples)
+	{
+		if (position >= getDecodedEnd())
+		{
+			if (!decodeNextFrames()) break;
+			continue;
+		}
+
+		const size_t offset = position - decoded_first_sample;
+		const size_t n_available = decoded[0].size() - offset;
+		const size_t n = n_samples - n_read < n_available ? n_samples - n_read : n_available;
+		for (uint32_t channel = 0; channel < n_channels; ++channel)
+		{
+			const int32_t* input = decoded[channel].data() + offset;
+			int16_t* channel_output = output + n_read * n_channels + channel;
+			for (size_t i = 0; i < n; ++i)
+			{
+				channel_output[i * n_channels] = bits_per_sample >= 16 ? (int16_t)(input[i] >> (bits_per_sample - 16)) : (int16_t)(input[i] << (16 - bits_per_sample));
+			}
+		}
+		n_read += n;
+		position += n;
+	}
+	return n_read;
+}
+
+
+size_t FlacFile::skipSamples(const size_t n_samples)
+{
+	// Frames before the target are only located, not decoded
+	const uint64_t start = position;
+	uint64_t target = position + n_samples;
+	if (n_total_samples > 0 && target > n_total_samples)
+	{
+		target = n_total_samples;
+	}
+	if (target >= getDecodedEnd())
+	{
+		seek(target);
+	}
+	position = target;
+	while (position >= getDecodedEnd() && decodeNextFrames());
+
+	// A file without a length may end before the target
+	if (position > getDecodedEnd())
+	{
+		position = getDecodedEnd();
+	}
+	return position - start;
+}
+
+
+void FlacFile::seek(const uint64_t sample)
+{
+	const FlacSeekPoint* best = nullptr;
+	for (std::vector<FlacSeekPoint>::const_iterator it = seek_points.begin(); it != seek_points.end(); ++it)
+	{
+		if (it->sample <= sample && (!best || it->sample > best->sample))
+		{
+			best = &*it;
+		}
+	}
+	if (!best || best->sample <= compressed_first_sample) return;
+
+	ist.clear();
+	ist.seekg(first_frame_offset + best->offset);
+	end_of_file = false;
+	compressed.clear();
+	compressed_first_sample = best->sample;
+	for (uint32_t channel = 0; channel < n_channels; ++channel)
+	{
+		decoded[channel].clear();
+	}
+	decoded_first_sample = best->sample;
+}
+
+
+bool FlacFile::parseFrameHeader(const size_t offset, const uint64_t first_sample, Frame* frame) const
+{
+	const uint8_t* data = compressed.data() + offset;
+	const size_t size = compressed.size() - offset;
+	if (size < 6 || data[0] != 0xff || (data[1] & 0xfe) != 0xf8) return false;
+
+	const uint32_t block_size_code = data[2] >> 4;
+	const uint32_t sample_rate_code = data[2] & 0x0f;
+	const uint32_t channel_assignment = data[3] >> 4;
+	const uint32_t sample_size_code = (data[3] >> 1) & 0x07;
+	if (block_size_code == 0 || sample_rate_code == 15 || sample_size_code == 3 || (data[3] & 0x01)) return false;
+
+	// Channels and sample size must be those of the stream
+	if (channel_assignment < 8 ? channel_assignment + 1 != n_channels : (channel_assignment > 10 || n_channels != 2)) return false;
+	static const uint32_t sample_sizes[] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+	if (sample_size_code != 0 && sample_sizes[sample_size_code] != bits_per_sample) return false;
+
+	// Frame or sample number, coded like UTF-8; sample numbers of frames with
+	// variable block sizes have up to 36 bits, so a lead byte of 0xfe with
+	// six continuation bytes is allowed for them
+	const bool is_variable = (data[1] & 0x01) != 0;
+	size_t index = 4;
+	uint64_t number = data[index++];
+	uint32_t n_continuation = 0;
+	if (number == 0xff || (number == 0xfe && !is_variable)) return false;
+	while (number & (0x80 >> n_continuation)) ++n_continuation;
+	if (n_continuation == 1) return false;
+	if (n_continuation > 0)
+	{
+		number &= 0x7f >> n_continuation;
+		--n_continuation;
+	}
+	if (size < index + n_continuation + 4) return false;
+	for (uint32_t i = 0; i < n_continuation; ++i)
+	{
+		if ((data[index] & 0xc0) != 0x80) return false;
+		number = number << 6 | (data[index++] & 0x3f);
+	}
+
+	// Block size and sample rate stored after the number
+	uint32_t block_size = 0;
+	if (block_size_code == 1) block_size = 192;
+	else if (block_size_code <= 5) block_size = 576 << (block_size_code - 2);
+	else if (block_size_code == 6) block_size = data[index++] + 1;
+	else if (block_size_code == 7)
+	{
+		block_size = (data[index] << 8 | data[index + 1]) + 1;
+		index += 2;
+	}
+	else block_size = 256 << (block_size_code - 8);
+	if (sample_rate_code == 12) index += 1;
+	else if (sample_rate_code >= 13) index += 2;
+	if (size < index + 1 || crc8(data, index) != data[index]) return false;
+
+	// Frames with fixed block sizes are numbered, the others start at a sample
+	if ((is_variable ? number : number * max_block_size) != first_sample) return false;
+
+	frame->offset = offset;
+	frame->size = 0;
+	frame->header_size = index + 1;
+	frame->first_sample = first_sample;
+	frame->block_size = block_size;
+	frame->channel_assignment = channel_assignment;
+	frame->bits_per_sample = bits_per_sample;
+	return true;
+}
+
+
+bool FlacFile::decodeNextFrames()
+{
+	std::vector<Frame> frames;
+	size_t offset = 0;
+	uint64_t next_sample = compressed_first_sample;
+	while (frames.empty())
+	{
+		// Append a block of compressed data
+		if (!end_of_file)
+		{
+			const size_t n_old = compressed.size();
+			compressed.resize(n_old + FLAC_READ_SIZE);
+			ist.read(reinterpret_cast<char*>(compressed.data() + n_old), FLAC_READ_SIZE);
+			compressed.resize(n_old + ist.gcount());
+			end_of_file = ist.gcount() < FLAC_READ_SIZE;
+		}
+
+		// A frame ends where the next frame starts and the CRC-16 of its bytes,
+		// which include the stored CRC, is zero
+		const uint16_t* crc_table = getCrcTables().crc16;
+		while (offset < compressed.size())
+		{
+			// Anything after the last sample is ignored
+			if (n_total_samples > 0 && next_sample >= n_total_samples)
+			{
+				offset = compressed.size();
+				end_of_file = true;
+				break;
+			}
+
+			Frame frame;
+			if (!parseFrameHeader(offset, next_sample, &frame))
+			{
+				if (compressed.size() - offset < FLAC_MAX_FRAME_HEADER_SIZE && !end_of_file) break;
+				throw std::runtime_error("Invalid file format (FLAC frame header)");
+			}
+
+			uint16_t crc = 0;
+			size_t end = offset;
+			for (; end < offset + frame.header_size; ++end)
+			{
+				crc = (uint16_t)(crc << 8) ^ crc_table[(crc >> 8) ^ compressed[end]];
+			}
+			Frame next;
+			for (; end < compressed.size(); ++end)
+			{
+				if (crc == 0 && compressed[end] == 0xff && parseFrameHeader(end, next_sample + frame.block_size, &next)) break;
+				crc = (uint16_t)(crc << 8) ^ crc_table[(crc >> 8) ^ compressed[end]];
+			}
+
+			// The last frame of the file ends with the file; only its decoding
+			// tells where its data stops
+			if (end == compressed.size() && !end_of_file) break;
+			frame.size = end - offset;
+			frames.push_back(frame);
+			offset = end;
+			next_sample += frame.block_size;
+		}
+
+		if (frames.empty() && end_of_file)
+		{
+			compressed.clear();
+			return false;
+		}
+	}
+
+	// Frames before the position are not needed
+	size_t first_frame = 0;
+	while (first_frame < frames.size() && frames[first_frame].first_sample + frames[first_frame].block_size <= position)
+	{
+		++first_frame;
+	}
+	decoded_first_sample = first_frame < frames.size() ? frames[first_frame].first_sample : next_sample;
+	const size_t n_decoded = next_sample - decoded_first_sample;
+	for (uint32_t channel = 0; channel < n_channels; ++channel)
+	{
+		decoded[channel].resize(n_decoded);
+	}
+
+	// Frames are independent, so threads decode them in any order
+	std::atomic<size_t> next_frame(first_frame);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto decode = [&]()
+	{
+		std::vector<int32_t*> outputs(n_channels);
+		for (size_t i = next_frame++; i < frames.size(); i = next_frame++)
+		{
+			try
+			{
+				for (uint32_t channel = 0; channel < n_channels; ++channel)
+				{
+					outputs[channel] = decoded[channel].data() + (frames[i].first_sample - decoded_first_sample);
+				}
+				decodeFrame(frames[i], outputs.data());
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(error_mutex);
+				error = std::current_exception();
+			}
+		}
+	};
+
+	const size_t n_frames_to_decode = frames.size() - first_frame;
+	const size_t n_workers = n_threads < n_frames_to_decode ? n_threads : n_frames_to_decode;
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < n_workers; ++i)
+	{
+		threads.push_back(std::thread(decode));
+	}
+	decode();
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+
+	compressed.erase(compressed.begin(), compressed.begin() + offset);
+	compressed_first_sample = next_sample;
+	return true;
+}
+
+
+void FlacFile::decodeFrame(const Frame& frame, int32_t* const* outputs) const
+{
+	FlacBitReader bits(compressed.data() + frame.offset + frame.header_size, frame.size - frame.header_size);
+
+	// The side channel has an extra bit
+	for (uint32_t channel = 0; channel < n_channels; ++channel)
+	{
+		const bool is_side = (frame.channel_assignment == FLAC_CHANNELS_LEFT_SIDE && channel == 1) ||
+			(frame.channel_assignment == FLAC_CHANNELS_SIDE_RIGHT && channel == 0) ||
+			(frame.channel_assignment == FLAC_CHANNELS_MID_SIDE && channel == 1);
+		decodeSubframe(bits, frame.block_size, frame.bits_per_sample + (is_side ? 1 : 0), outputs[channel]);
+	}
+
+	// Undo the stereo decorrelation
+	int32_t* left = outputs[0];
+	int32_t* right = n_channels > 1 ? outputs[1] : nullptr;
+	if (frame.channel_assignment == FLAC_CHANNELS_LEFT_SIDE)
+	{
+		for (uint32_t i = 0; i < frame.block_size; ++i) right[i] = left[i] - right[i];
+	}
+	else if (frame.channel_assignment == FLAC_CHANNELS_SIDE_RIGHT)
+	{
+		for (uint32_t i = 0; i < frame.block_size; ++i) left[i] += right[i];
+	}
+	else if (frame.channel_assignment == FLAC_CHANNELS_MID_SIDE)
+	{
+		for (uint32_t i = 0; i < frame.block_size; ++i)
+		{
+			const int32_t side = right[i];
+			const int32_t mid = (int32_t)((uint32_t)left[i] << 1) | (side & 1);
+			left[i] = (mid + side) >> 1;
+			right[i] = (mid - side) >> 1;
+		}
+	}
+}
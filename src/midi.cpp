@@ -1,96 +1,349 @@
 #include "midi.h"
 
-#include <assert.h>
-#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <queue>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Default tempo of 120 beats per minute
+#define DEFAULT_MICROSECONDS_PER_BEAT 500000
 
 
 MidiFile::MidiFile(const std::string& fname) :
-	ist(fname),
-	data_bytes_remaining(0),
-	msgs()
+	format(0),
+	n_tracks(0),
+	division(0),
+	msgs(),
+	tempo_map()
 {
-	// Parse the header
-	if (read32be() != 0x4d546864 || read32be() != 6)
+	// Map the whole file; parsing works on the bytes in place
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
 	{
+		throw std::runtime_error("Could not open MIDI file '" + fname + "'");
+	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close(fd);
 		throw std::runtime_error("Invalid file format (MIDI header)");
 	}
+	const size_t size = file_stat.st_size;
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		throw std::runtime_error("Could not map MIDI file '" + fname + "'");
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	try
+	{
+		parse(static_cast<const uint8_t*>(data), size);
+	}
+	catch (...)
+	{
+		munmap(data, size);
+		throw;
+	}
+	munmap(data, size);
+}
+
+
+MidiFile::MidiFile(const uint8_t* data, const size_t size) :
+	format(0),
+	n_tracks(0),
+	division(0),
+	msgs(),
+	tempo_map()
+{
+	parse(data, size);
+}
+
+
+double MidiFile::ticksToSeconds(const uint64_t ticks) const
+{
+	// Find the last segment starting at or before the time
+	size_t lo = 0;
+	size_t hi = tempo_map.size();
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (tempo_map[mid].abs_time <= ticks) lo = mid;
+		else hi = mid;
+	}
+	const TempoSegment& segment = tempo_map[lo];
+	return segment.seconds + (double)(ticks - segment.abs_time) * segment.seconds_per_tick;
+}
+
+
+void MidiFile::parse(const uint8_t* data, const size_t size)
+{
+	const uint8_t* ptr = data;
+	const uint8_t* end = data + size;
 
-	// Discard the next 6 bytes
-	read16be();
-	read16be();
-	read16be();
+	// Parse the header
+	if (read32be(ptr, end) != 0x4d546864)
+	{
+		throw std::runtime_error("Invalid file format (MIDI header)");
+	}
+	const uint32_t header_size = read32be(ptr, end);
+	if (header_size < 6 || header_size > (size_t)(end - ptr))
+	{
+		throw std::runtime_error("Invalid file format (MIDI header)");
+	}
+	const uint8_t* header_end = ptr + header_size;
+	format = read16be(ptr, end);
+	n_tracks = read16be(ptr, end);
+	division = read16be(ptr, end);
+	ptr = header_end;
+	if (format > 2)
+	{
+		throw std::runtime_error("Invalid file format (MIDI format)");
+	}
+	if (division == 0)
+	{
+		throw std::runtime_error("Invalid file format (MIDI division)");
+	}
 
-	// There should be exactly one track; record its length
-	if (read32be() != 0x4d54726b)
+	// Parse every track chunk; the track count of the header is not trusted
+	// and unknown chunks are skipped
+	std::vector<std::vector<NoteMessage> > track_msgs;
+	std::vector<TempoChange> tempos;
+	uint64_t time_offset = 0;
+	while (end - ptr >= 8)
+	{
+		const uint32_t chunk_type = read32be(ptr, end);
+		const size_t chunk_size = std::min((size_t)read32be(ptr, end), (size_t)(end - ptr));
+		if (chunk_type == 0x4d54726b)
+		{
+			track_msgs.push_back(std::vector<NoteMessage>());
+			uint64_t track_end = parseTrack(ptr, ptr + chunk_size, track_msgs.size() - 1, time_offset, track_msgs.back(), tempos);
+			if (format == 2)
+			{
+				time_offset = track_end;
+			}
+		}
+		ptr += chunk_size;
+	}
+	if (track_msgs.empty())
 	{
 		throw std::runtime_error("Invalid file format (MIDI track)");
 	}
-	data_bytes_remaining = read32be();
+	n_tracks = track_msgs.size();
+
+	mergeTracks(track_msgs);
+	buildTempoMap(tempos);
+}
+
 
-	// Iterate through all messages
-	uint64_t abs_time = 0;
-	while (data_bytes_remaining > 0)
+uint64_t MidiFile::parseTrack(const uint8_t* begin, const uint8_t* end, const uint16_t track_index, const uint64_t time_offset, std::vector<NoteMessage>& track_msgs, std::vector<TempoChange>& tempos)
+{
+	const uint8_t* ptr = begin;
+	uint64_t abs_time = time_offset;
+	uint8_t running_status = 0;
+
+	while (ptr < end)
 	{
-		abs_time += readVarInt();
-		uint8_t type = read8() >> 4;
-		if (type == 8 || type == 9)
+		abs_time += readVarInt(ptr, end);
+		if (ptr >= end) break;
+
+		// Data bytes without a status byte continue the previous message type
+		uint8_t status = *ptr;
+		if (status & 0x80)
+		{
+			++ptr;
+		}
+		else if (running_status)
+		{
+			status = running_status;
+		}
+		else
 		{
-			uint8_t note = read8();
-			uint8_t velocity = read8();
-			assert(note < 128);
-			assert(velocity < 128);
+			throw std::runtime_error("Invalid file format (MIDI running status)");
+		}
 
-			msgs.push_back({abs_time, note, type == 9});
+		if (status == 0xff)
+		{
+			// Meta event
+			running_status = 0;
+			const uint8_t type = read8(ptr, end);
+			const uint32_t length = readVarInt(ptr, end);
+			if (length > (size_t)(end - ptr))
+			{
+				throw std::runtime_error("Invalid file format (MIDI meta event)");
+			}
+			if (type == 0x51 && length >= 3)
+			{
+				tempos.push_back({ abs_time, ((uint32_t)ptr[0] << 16) | ((uint32_t)ptr[1] << 8) | ptr[2] });
+			}
+			ptr += length;
+			if (type == 0x2f) break;
+		}
+		else if (status == 0xf0 || status == 0xf7)
+		{
+			// System exclusive event
+			running_status = 0;
+			const uint32_t length = readVarInt(ptr, end);
+			if (length > (size_t)(end - ptr))
+			{
+				throw std::runtime_error("Invalid file format (MIDI sysex event)");
+			}
+			ptr += length;
+		}
+		else if (status >= 0xf8)
+		{
+			// System real-time messages have no data and keep the running status
+		}
+		else if (status >= 0xf1)
+		{
+			// System common messages
+			running_status = 0;
+			const size_t length = status == 0xf2 ? 2 : (status == 0xf1 || status == 0xf3) ? 1 : 0;
+			if (length > (size_t)(end - ptr))
+			{
+				throw std::runtime_error("Invalid file format (MIDI system message)");
+			}
+			ptr += length;
 		}
 		else
 		{
-			// Sometimes there are extra artifacts that should be ignored
-			uint8_t byte = read8();
+			// Channel message
+			running_status = status;
+			const uint8_t type = status >> 4;
+			const uint8_t data1 = read8(ptr, end) & 0x7f;
+			if (type == 0xc || type == 0xd) continue;
+			const uint8_t data2 = read8(ptr, end) & 0x7f;
+
+			if (type == 8 || type == 9)
+			{
+				// A note on with zero velocity is a note off
+				track_msgs.push_back({ abs_time, data1, type == 9 && data2 > 0, data2, (uint8_t)(status & 0xf), track_index });
+			}
 		}
 	}
 
-	ist.close();
+	return abs_time;
 }
 
 
-uint8_t MidiFile::read8()
+/*! Position in the message list of a track during the merge */
+struct TrackCursor
 {
-	uint8_t output = 0;
-	ist.read(reinterpret_cast<char*>(&output), 1);
-	data_bytes_remaining -= 1;
-	return output;
+	uint64_t abs_time;
+	uint16_t track;
+	size_t index;
+
+	bool operator>(const TrackCursor& other) const
+	{
+		if (abs_time != other.abs_time) return abs_time > other.abs_time;
+		return track > other.track;
+	}
+};
+
+
+void MidiFile::mergeTracks(const std::vector<std::vector<NoteMessage> >& track_msgs)
+{
+	size_t n_msgs = 0;
+	std::priority_queue<TrackCursor, std::vector<TrackCursor>, std::greater<TrackCursor> > heads;
+	for (size_t i = 0; i < track_msgs.size(); ++i)
+	{
+		n_msgs += track_msgs[i].size();
+		if (!track_msgs[i].empty())
+		{
+			heads.push({ track_msgs[i][0].abs_time, (uint16_t)i, 0 });
+		}
+	}
+
+	// Take the earliest message of all tracks until every track is exhausted;
+	// messages at the same time keep the order of their tracks
+	msgs.clear();
+	msgs.reserve(n_msgs);
+	while (!heads.empty())
+	{
+		TrackCursor cursor = heads.top();
+		heads.pop();
+		const std::vector<NoteMessage>& track = track_msgs[cursor.track];
+		msgs.push_back(track[cursor.index]);
+		if (++cursor.index < track.size())
+		{
+			cursor.abs_time = track[cursor.index].abs_time;
+			heads.push(cursor);
+		}
+	}
 }
 
 
-uint16_t MidiFile::read16be()
+void MidiFile::buildTempoMap(std::vector<TempoChange>& tempos)
 {
-	uint16_t output = 0;
-	ist.read(reinterpret_cast<char*>(&output), 2);
-	data_bytes_remaining -= 2;
-	return be16toh(output);
+	tempo_map.clear();
+
+	if (division & 0x8000)
+	{
+		// SMPTE time code: frames per second and ticks per frame; tempo
+		// changes do not apply
+		const int8_t frames_per_second = -(int8_t)(division >> 8);
+		tempo_map.push_back({ 0, 0, 1 / ((double)frames_per_second * (division & 0xff)) });
+		return;
+	}
+
+	// Ticks per quarter note
+	tempo_map.push_back({ 0, 0, DEFAULT_MICROSECONDS_PER_BEAT * 1e-6 / division });
+	std::stable_sort(tempos.begin(), tempos.end(), [](const TempoChange& a, const TempoChange& b) { return a.abs_time < b.abs_time; });
+	for (std::vector<TempoChange>::const_iterator it = tempos.begin(); it != tempos.end(); ++it)
+	{
+		const TempoSegment& last = tempo_map.back();
+		const double seconds_per_tick = it->microseconds_per_beat * 1e-6 / division;
+		if (it->abs_time == last.abs_time)
+		{
+			tempo_map.back().seconds_per_tick = seconds_per_tick;
+		}
+		else
+		{
+			const double seconds = last.seconds + (double)(it->abs_time - last.abs_time) * last.seconds_per_tick;
+			tempo_map.push_back({ it->abs_time, seconds, seconds_per_tick });
+		}
+	}
 }
 
 
-uint32_t MidiFile::read32be()
+uint8_t MidiFile::read8(const uint8_t*& ptr, const uint8_t* end)
 {
-	uint32_t output = 0;
-	ist.read(reinterpret_cast<char*>(&output), 4);
-	data_bytes_remaining -= 4;
-	return be32toh(output);
+	if (ptr >= end)
+	{
+		throw std::runtime_error("Invalid file format (MIDI truncated)");
+	}
+	return *ptr++;
+}
+
+
+uint16_t MidiFile::read16be(const uint8_t*& ptr, const uint8_t* end)
+{
+	uint16_t output = read8(ptr, end) << 8;
+	return output | read8(ptr, end);
+}
+
+
+uint32_t MidiFile::read32be(const uint8_t*& ptr, const uint8_t* end)
+{
+	uint32_t output = (uint32_t)read16be(ptr, end) << 16;
+	return output | read16be(ptr, end);
 }
 
 
-uint32_t MidiFile::readVarInt()
+uint32_t MidiFile::readVarInt(const uint8_t*& ptr, const uint8_t* end)
 {
 	uint32_t output = 0;
 	for (size_t i = 0; i < 4; ++i)
 	{
 		output <<= 7;
-		uint8_t next_byte;
-		ist.read(reinterpret_cast<char*>(&next_byte), 1);
-		data_bytes_remaining -= 1;
+		uint8_t next_byte = read8(ptr, end);
 		output += next_byte & 0x7f;
 		if (!(next_byte & 0x80)) break;
 	}
 	return output;
-}
\ No newline at end of file
+}
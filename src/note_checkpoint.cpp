@@ -0,0 +1,266 @@
+#include "note_checkpoint.h"
+
+#include <boost/filesystem.hpp>
+#include <sstream>
+#include <stdexcept>
+
+
+// "MFCK" in a little-endian file
+#define NOTE_CHECKPOINT_MAGIC 0x4b43464d
+#define NOTE_CHECKPOINT_VERSION 1
+
+// Blocks like those of a note file, and commits
+#define NOTE_CHECKPOINT_BLOCK_NOTES 1
+#define NOTE_CHECKPOINT_BLOCK_EVENTS 2
+#define NOTE_CHECKPOINT_BLOCK_TIMESTAMPS 3
+#define NOTE_CHECKPOINT_BLOCK_COMMIT 4
+
+// 64-bit FNV-1a
+#define CHECKSUM_OFFSET 0xcbf29ce484222325ULL
+#define CHECKSUM_PRIME 0x100000001b3ULL
+
+// Bytes read from either end of a file to identify it
+#define FILE_IDENTITY_BLOCK_SIZE 65536
+
+
+/*! Header of a checkpoint file, followed by the key */
+struct NoteCheckpointHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key_size;
+};
+
+
+/*! Header of a block; for a commit, the count is the number of floats of
+ *  the state and first_chunk_index the number of complete chunks, and the
+ *  state is followed by the checksum of everything since the last commit
+ */
+struct NoteCheckpointBlockHeader
+{
+	uint32_t type;
+	uint32_t count;
+	uint64_t first_chunk_index;
+};
+
+
+static uint64_t updateChecksum(uint64_t checksum, const void* data, const size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		checksum = (checksum ^ bytes[i]) * CHECKSUM_PRIME;
+	}
+	return checksum;
+}
+
+
+std::string NoteCheckpoint::getFileIdentity(const std::string& fname)
+{
+	std::ifstream ist(fname, std::ios::binary | std::ios::ate);
+	if (!ist)
+	{
+		throw std::runtime_error("Could not open file '" + fname + "'");
+	}
+	const uint64_t file_size = ist.tellg();
+
+	// The blocks overlap in files shorter than both
+	std::vector<char> block(file_size < FILE_IDENTITY_BLOCK_SIZE ? file_size : FILE_IDENTITY_BLOCK_SIZE);
+	uint64_t identity = CHECKSUM_OFFSET;
+	const uint64_t offsets[2] = { 0, file_size - block.size() };
+	for (size_t i = 0; i < 2; ++i)
+	{
+		ist.seekg(offsets[i]);
+		if (!ist.read(block.data(), block.size()))
+		{
+			throw std::runtime_error("Could not read file '" + fname + "'");
+		}
+		identity = updateChecksum(identity, block.data(), block.size());
+	}
+
+	std::stringstream output;
+	output << "size " << file_size << " checksum " << std::hex << identity;
+	return output.str();
+}
+
+
+NoteCheckpoint::NoteCheckpoint(const std::string& fname, const std::string& key, NoteSink& sink, const size_t n_chunks_per_commit) :
+	fname(fname),
+	key(key),
+	sink(sink),
+	n_chunks_per_commit(n_chunks_per_commit),
+	ost(),
+	note_row_size(0),
+	checksum(CHECKSUM_OFFSET),
+	n_chunks_complete(0),
+	state()
+{}
+
+
+void NoteCheckpoint::begin(const NoteStreamInfo& info)
+{
+	// The notes of the file must have the format of the stream
+	std::stringstream stream_key;
+	stream_key << key << "; notes " << info.base_note_id << " " << info.precision << " " << info.layout << " " << info.n_notes_per_chunk << " " << info.n_samples_per_second << " " << info.n_samples_per_chunk << " " << info.n_chunks_hint;
+	const std::string file_key = stream_key.str();
+	note_row_size = info.n_notes_per_chunk * getNotePrecisionSize(info.precision);
+	n_chunks_complete = 0;
+	state.clear();
+
+	sink.begin(info);
+	const uint64_t committed_size = restore(file_key);
+	if (committed_size > 0)
+	{
+		// Drop the blocks after the last commit and continue the file
+		boost::filesystem::resize_file(fname, committed_size);
+		ost.open(fname, std::ios::binary | std::ios::app);
+	}
+	else
+	{
+		ost.open(fname, std::ios::binary | std::ios::trunc);
+		NoteCheckpointHeader header = { NOTE_CHECKPOINT_MAGIC, NOTE_CHECKPOINT_VERSION, file_key.size() };
+		ost.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ost.write(file_key.data(), file_key.size());
+		ost.flush();
+	}
+	if (!ost)
+	{
+		throw std::runtime_error("Could not open checkpoint file '" + fname + "'");
+	}
+	checksum = CHECKSUM_OFFSET;
+}
+
+
+void NoteCheckpoint::writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)
+{
+	sink.writeNotes(first_chunk_index, n_chunks, timestamps, notes);
+	if (n_chunks == 0) return;
+	writeBlockHeader(notes ? NOTE_CHECKPOINT_BLOCK_NOTES : NOTE_CHECKPOINT_BLOCK_TIMESTAMPS, n_chunks, first_chunk_index);
+	write(timestamps, n_chunks * sizeof(uint64_t));
+	if (notes)
+	{
+		write(notes, n_chunks * note_row_size);
+	}
+}
+
+
+void NoteCheckpoint::writeEvents(const NoteEvent* events, const size_t n_events)
+{
+	sink.writeEvents(events, n_events);
+	if (n_events == 0) return;
+	writeBlockHeader(NOTE_CHECKPOINT_BLOCK_EVENTS, n_events, events[0].chunk_index);
+	write(events, n_events * sizeof(NoteEvent));
+}
+
+
+void NoteCheckpoint::end()
+{
+	ost.close();
+	sink.end();
+}
+
+
+void NoteCheckpoint::commit(const size_t n_chunks, const std::vector<float>& state)
+{
+	writeBlockHeader(NOTE_CHECKPOINT_BLOCK_COMMIT, state.size(), n_chunks);
+	write(state.data(), state.size() * sizeof(float));
+
+	// The checksum is not part of the next one; the commit is complete once
+	// it is in the file
+	ost.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+	ost.flush();
+	if (!ost)
+	{
+		throw std::runtime_error("Could not write checkpoint file '" + fname + "'");
+	}
+	checksum = CHECKSUM_OFFSET;
+	n_chunks_complete = n_chunks;
+	this->state = state;
+}
+
+
+uint64_t NoteCheckpoint::restore(const std::string& file_key)
+{
+	std::ifstream ist(fname, std::ios::binary | std::ios::ate);
+	if (!ist) return 0;
+	const uint64_t file_size = ist.tellg();
+	ist.seekg(0);
+
+	NoteCheckpointHeader header;
+	if (!ist.read(reinterpret_cast<char*>(&header), sizeof(header))) return 0;
+	if (header.magic != NOTE_CHECKPOINT_MAGIC || header.version != NOTE_CHECKPOINT_VERSION || header.key_size != file_key.size()) return 0;
+	std::string stored_key(file_key.size(), '\0');
+	if (!ist.read(&stored_key[0], stored_key.size()) || stored_key != file_key) return 0;
+	uint64_t committed_size = sizeof(header) + file_key.size();
+
+	// Blocks are only passed on once their commit is verified
+	struct Block
+	{
+		NoteCheckpointBlockHeader header;
+		std::vector<uint8_t> data;
+	};
+	std::vector<Block> pending;
+	uint64_t running_checksum = CHECKSUM_OFFSET;
+	NoteCheckpointBlockHeader block;
+	while (ist.read(reinterpret_cast<char*>(&block), sizeof(block)))
+	{
+		running_checksum = updateChecksum(running_checksum, &block, sizeof(block));
+		size_t data_size = 0;
+		if (block.type == NOTE_CHECKPOINT_BLOCK_NOTES) data_size = block.count * (sizeof(uint64_t) + note_row_size);
+		else if (block.type == NOTE_CHECKPOINT_BLOCK_TIMESTAMPS) data_size = block.count * sizeof(uint64_t);
+		else if (block.type == NOTE_CHECKPOINT_BLOCK_EVENTS) data_size = block.count * sizeof(NoteEvent);
+		else if (block.type == NOTE_CHECKPOINT_BLOCK_COMMIT) data_size = block.count * sizeof(float);
+		else break;
+		if (data_size > file_size - (uint64_t)ist.tellg()) break;
+
+		pending.push_back({ block, std::vector<uint8_t>(data_size) });
+		std::vector<uint8_t>& data = pending.back().data;
+		if (!ist.read(reinterpret_cast<char*>(data.data()), data_size)) break;
+		running_checksum = updateChecksum(running_checksum, data.data(), data_size);
+		if (block.type != NOTE_CHECKPOINT_BLOCK_COMMIT) continue;
+
+		uint64_t stored_checksum = 0;
+		if (!ist.read(reinterpret_cast<char*>(&stored_checksum), sizeof(stored_checksum)) || stored_checksum != running_checksum) break;
+
+		// Pass on the blocks of the commit as they were written
+		for (size_t i = 0; i + 1 < pending.size(); ++i)
+		{
+			const NoteCheckpointBlockHeader& header = pending[i].header;
+			const uint8_t* block_data = pending[i].data.data();
+			if (header.type == NOTE_CHECKPOINT_BLOCK_EVENTS)
+			{
+				sink.writeEvents(reinterpret_cast<const NoteEvent*>(block_data), header.count);
+			}
+			else
+			{
+				const uint8_t* notes = header.type == NOTE_CHECKPOINT_BLOCK_NOTES ? block_data + header.count * sizeof(uint64_t) : nullptr;
+				sink.writeNotes(header.first_chunk_index, header.count, reinterpret_cast<const uint64_t*>(block_data), notes);
+			}
+		}
+		const float* commit_state = reinterpret_cast<const float*>(data.data());
+		state.assign(commit_state, commit_state + block.count);
+		n_chunks_complete = block.first_chunk_index;
+		pending.clear();
+		committed_size = ist.tellg();
+		running_checksum = CHECKSUM_OFFSET;
+	}
+	return committed_size;
+}
+
+
+void NoteCheckpoint::write(const void* data, const size_t size)
+{
+	if (!ost.is_open())
+	{
+		throw std::runtime_error("Checkpoint file is not open");
+	}
+	ost.write(static_cast<const char*>(data), size);
+	checksum = updateChecksum(checksum, data, size);
+}
+
+
+void NoteCheckpoint::writeBlockHeader(const uint32_t type, const uint32_t count, const uint64_t first_chunk_index)
+{
+	NoteCheckpointBlockHeader header = { type, count, first_chunk_index };
+	write(&header, sizeof(header));
+}
@@ -0,0 +1,789 @@
+#include "note_index.h"
+
+#include "simd.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <math.h>
+#include <random>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+
+// "MFNI" in a little-endian file
+#define NOTE_INDEX_FILE_MAGIC 0x494e464d
+#define NOTE_INDEX_FILE_VERSION 2
+
+// Sections of a file start at multiples of a cache line
+#define NOTE_INDEX_FILE_ALIGNMENT 64
+
+// Vectors per thread below which a single query is searched on one thread
+#define NOTE_INDEX_VECTORS_PER_THREAD 65536
+
+
+/*! Header of an index file */
+struct NoteIndexFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t feature;
+	uint32_t mode;
+	uint64_t shingle_size;
+	uint64_t shingle_step;
+	uint64_t n_lsh_tables;
+	uint64_t n_lsh_bits;
+	uint64_t n_ivf_lists;
+	uint64_t n_ivf_probes;
+	uint64_t n_lists;
+	uint64_t dimension;
+	uint64_t stride;
+	uint64_t n_vectors;
+	uint64_t n_profiles;
+	uint64_t built;
+};
+
+
+/*! Product of the counts of a header and the size of an element
+ *    @return false if the product does not fit into a size_t
+ */
+static bool multiplySizes(const std::vector<uint64_t>& counts, const size_t element_size, size_t* product)
+{
+	size_t output = element_size;
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		if (counts[i] > SIZE_MAX || __builtin_mul_overflow(output, (size_t)counts[i], &output)) return false;
+	}
+	*product = output;
+	return true;
+}
+
+
+/*! Sizes in bytes of the sections of a file, in the order of the arrays of an
+ *  index; sections a mode does not use are empty
+ *    @return false if a size of a corrupted header does not fit into a size_t
+ */
+static bool getSectionSizes(const NoteIndexFileHeader& header, std::vector<size_t>* sizes)
+{
+	const bool lsh = header.built && header.mode == NOTE_INDEX_LSH;
+	const bool ivf = header.built && header.mode == NOTE_INDEX_IVF;
+	sizes->assign(8, 0);
+	return multiplySizes({ header.n_vectors, header.stride }, sizeof(float), &(*sizes)[0]) &&
+		multiplySizes({ header.n_vectors }, sizeof(NoteIndexEntry), &(*sizes)[1]) &&
+		(!lsh || multiplySizes({ header.n_lsh_tables, header.n_lsh_bits, header.stride }, sizeof(float), &(*sizes)[2])) &&
+		(!lsh || multiplySizes({ header.n_lsh_tables, header.n_vectors }, sizeof(uint32_t), &(*sizes)[3])) &&
+		(!lsh || multiplySizes({ header.n_lsh_tables, header.n_vectors }, sizeof(uint32_t), &(*sizes)[4])) &&
+		(!ivf || multiplySizes({ header.n_lists, header.stride }, sizeof(float), &(*sizes)[5])) &&
+		(!ivf || (header.n_lists < UINT64_MAX && multiplySizes({ header.n_lists + 1 }, sizeof(uint64_t), &(*sizes)[6]))) &&
+		(!ivf || multiplySizes({ header.n_vectors }, sizeof(uint32_t), &(*sizes)[7]));
+}
+
+
+static size_t alignFileOffset(const size_t offset)
+{
+	return (offset + NOTE_INDEX_FILE_ALIGNMENT - 1) / NOTE_INDEX_FILE_ALIGNMENT * NOTE_INDEX_FILE_ALIGNMENT;
+}
+
+
+/*! Dot product of two vectors of stride values, a multiple of SIMD_WIDTH */
+static inline float dotProduct(const float* a, const float* b, const size_t stride)
+{
+	simd_float sum = simdBroadcast(0.0f);
+	for (size_t i = 0; i < stride; i += SIMD_WIDTH)
+	{
+		sum += simdLoad(a + i) * simdLoad(b + i);
+	}
+	return simdSum(sum);
+}
+
+
+/*! Scale a vector to unit length unless it is zero */
+static void normalize(float* vector, const size_t n)
+{
+	float norm = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		norm += vector[i] * vector[i];
+	}
+	if (norm <= 0) return;
+	const float scale = 1 / sqrtf(norm);
+	for (size_t i = 0; i < n; ++i)
+	{
+		vector[i] *= scale;
+	}
+}
+
+
+/*! Call a function on consecutive ranges of items on several threads
+ *    @param function: called with the first and last item of a range
+ */
+template<typename Function>
+static void runInParallel(const size_t n_items, const size_t n_threads, const Function& function)
+{
+	if (n_threads <= 1)
+	{
+		function(0, n_items);
+		return;
+	}
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		const size_t begin = n_items * i / n_threads;
+		const size_t end = n_items * (i + 1) / n_threads;
+		threads.push_back(std::thread([&function, begin, end]() { function(begin, end); }));
+	}
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		threads[i].join();
+	}
+}
+
+
+/*! Keeps the most similar vectors seen so far in a min-heap */
+class MatchHeap
+{
+public:
+	MatchHeap(const size_t n_matches) :
+		n_matches(n_matches),
+		matches()
+	{
+		matches.reserve(n_matches + 1);
+	}
+
+	void add(const uint32_t vector_index, const float similarity)
+	{
+		if (matches.size() == n_matches && (n_matches == 0 || similarity <= matches[0].second)) return;
+		matches.push_back(std::make_pair(vector_index, similarity));
+		std::push_heap(matches.begin(), matches.end(), compare);
+		if (matches.size() > n_matches)
+		{
+			std::pop_heap(matches.begin(), matches.end(), compare);
+			matches.pop_back();
+		}
+	}
+
+	void merge(const MatchHeap& other)
+	{
+		for (size_t i = 0; i < other.matches.size(); ++i)
+		{
+			add(other.matches[i].first, other.matches[i].second);
+		}
+	}
+
+	/*! Matches ordered from the most similar on */
+	std::vector<NoteIndexMatch> getMatches(const NoteIndexEntry* entries) const
+	{
+		std::vector<std::pair<uint32_t, float> > sorted(matches);
+		std::sort(sorted.begin(), sorted.end(), compare);
+		std::vector<NoteIndexMatch> output(sorted.size());
+		for (size_t i = 0; i < sorted.size(); ++i)
+		{
+			const NoteIndexEntry& entry = entries[sorted[i].first];
+			output[i].profile_id = entry.profile_id;
+			output[i].chunk_index = entry.chunk_index;
+			output[i].similarity = sorted[i].second;
+		}
+		return output;
+	}
+
+protected:
+	/*! Orders by descending similarity, then by vector, so ties are stable */
+	static bool compare(const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b)
+	{
+		return a.second > b.second || (a.second == b.second && a.first < b.first);
+	}
+
+protected:
+	size_t n_matches;
+	std::vector<std::pair<uint32_t, float> > matches;
+};
+
+
+NoteIndexParams NoteIndexParams::getDefault()
+{
+	NoteIndexParams params;
+	params.feature = NOTE_INDEX_CHROMA;
+	params.shingle_size = 1;
+	params.shingle_step = 1;
+	params.mode = NOTE_INDEX_BRUTE_FORCE;
+	params.n_lsh_tables = 8;
+	params.n_lsh_bits = 12;
+	params.n_ivf_lists = 256;
+	params.n_ivf_probes = 8;
+	params.n_ivf_iterations = 10;
+	params.n_threads = 0;
+	return params;
+}
+
+
+NoteIndex::NoteIndex(const NoteIndexParams& params) :
+	params(params),
+	dimension(params.feature == NOTE_INDEX_CHROMA ? 12 * params.shingle_size : 0),
+	stride(simdPadded(dimension, SIMD_MAX_WIDTH)),
+	n_vectors(0),
+	n_profiles(0),
+	built(false),
+	n_lists(0),
+	vector_storage(),
+	entry_storage(),
+	hyperplane_storage(),
+	lsh_key_storage(),
+	lsh_id_storage(),
+	centroid_storage(),
+	list_offset_storage(),
+	list_id_storage(),
+	vectors(nullptr),
+	entries(nullptr),
+	hyperplanes(nullptr),
+	lsh_keys(nullptr),
+	lsh_ids(nullptr),
+	centroids(nullptr),
+	list_offsets(nullptr),
+	list_ids(nullptr),
+	mapping(nullptr),
+	mapping_size(0)
+{
+	if (params.shingle_size == 0 || params.shingle_step == 0)
+	{
+		throw std::runtime_error("Shingles must have at least one chunk");
+	}
+	if (params.n_lsh_bits == 0 || params.n_lsh_bits > 32)
+	{
+		throw std::runtime_error("Hash tables need between 1 and 32 hyperplanes");
+	}
+}
+
+
+NoteIndex::~NoteIndex()
+{
+	if (mapping)
+	{
+		munmap(mapping, mapping_size);
+		mapping = nullptr;
+	}
+}
+
+
+std::unique_ptr<NoteIndex> NoteIndex::open(const std::string& fname)
+{
+	int fd = ::open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw std::runtime_error("Could not open index file '" + fname + "'");
+	}
+	struct stat file_stat;
+	NoteIndexFileHeader header;
+	if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != NOTE_INDEX_FILE_MAGIC)
+	{
+		close(fd);
+		throw std::runtime_error("Invalid file format (index file header)");
+	}
+	if (header.version != NOTE_INDEX_FILE_VERSION || header.feature > NOTE_INDEX_NOTES || header.mode > NOTE_INDEX_IVF)
+	{
+		close(fd);
+		throw std::runtime_error("Invalid file format (index file version)");
+	}
+
+	// Vectors are padded like those of every build
+	if (header.dimension > SIZE_MAX - SIMD_MAX_WIDTH || header.stride < header.dimension || header.stride != simdPadded(header.dimension, SIMD_MAX_WIDTH) || header.n_vectors > UINT32_MAX)
+	{
+		close(fd);
+		throw std::runtime_error("Invalid file format (index file dimension)");
+	}
+
+	// The sections must lie within the file
+	const size_t size = file_stat.st_size;
+	std::vector<size_t> sizes;
+	std::vector<size_t> offsets;
+	size_t offset = sizeof(header);
+	bool fits = getSectionSizes(header, &sizes);
+	for (size_t i = 0; fits && i < sizes.size(); ++i)
+	{
+		offsets.push_back(alignFileOffset(offset));
+		fits = sizes[i] <= size && offsets[i] <= size - sizes[i];
+		offset = offsets[i] + sizes[i];
+	}
+	if (!fits)
+	{
+		close(fd);
+		throw std::runtime_error("Invalid file format (index file truncated)");
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		throw std::runtime_error("Could not map index file '" + fname + "'");
+	}
+
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.feature = (NoteIndexFeature)header.feature;
+	params.mode = (NoteIndexMode)header.mode;
+	params.shingle_size = header.shingle_size;
+	params.shingle_step = header.shingle_step;
+	params.n_lsh_tables = header.n_lsh_tables;
+	params.n_lsh_bits = header.n_lsh_bits;
+	params.n_ivf_lists = header.n_ivf_lists;
+	params.n_ivf_probes = header.n_ivf_probes;
+
+	std::unique_ptr<NoteIndex> index;
+	try
+	{
+		index.reset(new NoteIndex(params));
+	}
+	catch (...)
+	{
+		munmap(data, size);
+		throw;
+	}
+	index->mapping = data;
+	index->mapping_size = size;
+	index->dimension = header.dimension;
+	index->stride = header.stride;
+	index->n_vectors = header.n_vectors;
+	index->n_profiles = header.n_profiles;
+	index->built = header.built != 0;
+	index->n_lists = header.n_lists;
+
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	index->vectors = reinterpret_cast<const float*>(bytes + offsets[0]);
+	index->entries = reinterpret_cast<const NoteIndexEntry*>(bytes + offsets[1]);
+	index->hyperplanes = reinterpret_cast<const float*>(bytes + offsets[2]);
+	index->lsh_keys = reinterpret_cast<const uint32_t*>(bytes + offsets[3]);
+	index->lsh_ids = reinterpret_cast<const uint32_t*>(bytes + offsets[4]);
+	index->centroids = reinterpret_cast<const float*>(bytes + offsets[5]);
+	index->list_offsets = reinterpret_cast<const uint64_t*>(bytes + offsets[6]);
+	index->list_ids = reinterpret_cast<const uint32_t*>(bytes + offsets[7]);
+
+	// Searches follow the ids and offsets without checking them
+	if (!index->hasValidIds())
+	{
+		throw std::runtime_error("Invalid file format (index file ids)");
+	}
+	return index;
+}
+
+
+bool NoteIndex::hasValidIds() const
+{
+	if (!built) return true;
+	if (params.mode == NOTE_INDEX_LSH)
+	{
+		for (size_t i = 0; i < params.n_lsh_tables * n_vectors; ++i)
+		{
+			if (lsh_ids[i] >= n_vectors) return false;
+		}
+	}
+	else if (params.mode == NOTE_INDEX_IVF)
+	{
+		if (list_offsets[0] != 0 || list_offsets[n_lists] != n_vectors) return false;
+		for (size_t list = 0; list < n_lists; ++list)
+		{
+			if (list_offsets[list] > list_offsets[list + 1]) return false;
+		}
+		for (size_t i = 0; i < n_vectors; ++i)
+		{
+			if (list_ids[i] >= n_vectors) return false;
+		}
+	}
+	return true;
+}
+
+
+bool NoteIndex::getFeatureVector(const NoteProfile& profile, const size_t chunk_index, float* output) const
+{
+	const size_t n_notes = profile.getNotesPerChunk();
+	const size_t frame_size = params.feature == NOTE_INDEX_CHROMA ? 12 : n_notes;
+	if (frame_size * params.shingle_size != dimension)
+	{
+		throw std::runtime_error("Notes of the profile do not match the index");
+	}
+	if (chunk_index + params.shingle_size > profile.getNumChunks()) return false;
+
+	std::fill(output, output + stride, 0.0f);
+	std::vector<float> notes(n_notes);
+	for (size_t i = 0; i < params.shingle_size; ++i)
+	{
+		if (!profile.readNotesByIndex(chunk_index + i, notes.data())) return false;
+		float* frame = output + i * frame_size;
+		if (params.feature == NOTE_INDEX_CHROMA)
+		{
+			// Pitch class 0 is C for any base note
+			const int32_t base_class = ((profile.getBaseNoteId() % 12) + 12) % 12;
+			for (size_t note = 0; note < n_notes; ++note)
+			{
+				frame[(base_class + note) % 12] += notes[note];
+			}
+		}
+		else
+		{
+			std::copy(notes.begin(), notes.end(), frame);
+		}
+		normalize(frame, frame_size);
+	}
+	normalize(output, dimension);
+	return true;
+}
+
+
+uint32_t NoteIndex::addProfile(const NoteProfile& profile)
+{
+	if (mapping)
+	{
+		throw std::runtime_error("A mapped index cannot be modified");
+	}
+	if (dimension == 0)
+	{
+		dimension = profile.getNotesPerChunk() * params.shingle_size;
+		stride = simdPadded(dimension, SIMD_MAX_WIDTH);
+	}
+	if ((params.feature == NOTE_INDEX_CHROMA ? 12 : profile.getNotesPerChunk()) * params.shingle_size != dimension)
+	{
+		throw std::runtime_error("Notes of the profile do not match the index");
+	}
+
+	const uint32_t profile_id = n_profiles;
+	const size_t n_chunks = profile.getNumChunks();
+	const size_t n_new = n_chunks >= params.shingle_size ? (n_chunks - params.shingle_size) / params.shingle_step + 1 : 0;
+	const size_t first = n_vectors;
+	vector_storage.resize((first + n_new) * stride);
+	entry_storage.resize(first + n_new);
+
+	// Profiles without stored notes, such as those of events, add no vectors
+	std::vector<char> valid(n_new, 1);
+	runInParallel(n_new, getNumThreads(n_new / 1024 + 1), [&](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			const size_t chunk_index = i * params.shingle_step;
+			valid[i] = getFeatureVector(profile, chunk_index, vector_storage.data() + (first + i) * stride);
+			entry_storage[first + i].profile_id = profile_id;
+			entry_storage[first + i].chunk_index = chunk_index;
+		}
+	});
+	if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+	{
+		vector_storage.resize(first * stride);
+		entry_storage.resize(first);
+	}
+	else
+	{
+		n_vectors = first + n_new;
+	}
+
+	++n_profiles;
+	built = false;
+	updateViews();
+	return profile_id;
+}
+
+
+void NoteIndex::updateViews()
+{
+	vectors = vector_storage.data();
+	entries = entry_storage.data();
+	hyperplanes = hyperplane_storage.data();
+	lsh_keys = lsh_key_storage.data();
+	lsh_ids = lsh_id_storage.data();
+	centroids = centroid_storage.data();
+	list_offsets = list_offset_storage.data();
+	list_ids = list_id_storage.data();
+}
+
+
+size_t NoteIndex::getNumThreads(const size_t n_items) const
+{
+	size_t n_threads = params.n_threads;
+	if (n_threads == 0)
+	{
+		n_threads = std::thread::hardware_concurrency();
+	}
+	if (n_threads > n_items) n_threads = n_items;
+	return n_threads > 0 ? n_threads : 1;
+}
+
+
+void NoteIndex::build()
+{
+	if (mapping)
+	{
+		throw std::runtime_error("A mapped index cannot be modified");
+	}
+	hyperplane_storage.clear();
+	lsh_key_storage.clear();
+	lsh_id_storage.clear();
+	centroid_storage.clear();
+	list_offset_storage.clear();
+	list_id_storage.clear();
+	n_lists = 0;
+
+	if (params.mode == NOTE_INDEX_LSH) buildLsh();
+	else if (params.mode == NOTE_INDEX_IVF) buildIvf();
+	built = true;
+	updateViews();
+}
+
+
+uint32_t NoteIndex::getLshKey(const size_t table, const float* vector) const
+{
+	const float* table_hyperplanes = hyperplanes + table * params.n_lsh_bits * stride;
+	uint32_t key = 0;
+	for (size_t bit = 0; bit < params.n_lsh_bits; ++bit)
+	{
+		key |= (uint32_t)(dotProduct(table_hyperplanes + bit * stride, vector, stride) > 0) << bit;
+	}
+	return key;
+}
+
+
+void NoteIndex::buildLsh()
+{
+	// Random hyperplanes through the origin, the same for every build
+	const size_t n_tables = params.n_lsh_tables;
+	std::mt19937 generator(5489);
+	std::normal_distribution<float> distribution;
+	hyperplane_storage.assign(n_tables * params.n_lsh_bits * stride, 0.0f);
+	for (size_t i = 0; i < n_tables * params.n_lsh_bits; ++i)
+	{
+		for (size_t j = 0; j < dimension; ++j)
+		{
+			hyperplane_storage[i * stride + j] = distribution(generator);
+		}
+	}
+	hyperplanes = hyperplane_storage.data();
+
+	// The vectors of a bucket are contiguous in the sorted keys of a table
+	lsh_key_storage.resize(n_tables * n_vectors);
+	lsh_id_storage.resize(n_tables * n_vectors);
+	runInParallel(n_vectors, getNumThreads(n_vectors / 1024 + 1), [&](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			for (size_t table = 0; table < n_tables; ++table)
+			{
+				lsh_key_storage[table * n_vectors + i] = getLshKey(table, vectors + i * stride);
+			}
+		}
+	});
+	runInParallel(n_tables, getNumThreads(n_tables), [&](const size_t begin, const size_t end)
+	{
+		std::vector<std::pair<uint32_t, uint32_t> > pairs(n_vectors);
+		for (size_t table = begin; table < end; ++table)
+		{
+			uint32_t* keys = lsh_key_storage.data() + table * n_vectors;
+			uint32_t* ids = lsh_id_storage.data() + table * n_vectors;
+			for (size_t i = 0; i < n_vectors; ++i)
+			{
+				pairs[i] = std::make_pair(keys[i], (uint32_t)i);
+			}
+			std::sort(pairs.begin(), pairs.end());
+			for (size_t i = 0; i < n_vectors; ++i)
+			{
+				keys[i] = pairs[i].first;
+				ids[i] = pairs[i].second;
+			}
+		}
+	});
+}
+
+
+void NoteIndex::buildIvf()
+{
+	// Spherical k-means, started from vectors spread over the corpus; there
+	// are no more lists than vectors
+	n_lists = params.n_ivf_lists < n_vectors ? params.n_ivf_lists : n_vectors;
+	centroid_storage.assign(n_lists * stride, 0.0f);
+	for (size_t list = 0; list < n_lists; ++list)
+	{
+		const float* vector = vectors + (n_vectors * list / n_lists) * stride;
+		std::copy(vector, vector + stride, centroid_storage.data() + list * stride);
+	}
+
+	std::vector<uint32_t> assignments(n_vectors);
+	const size_t n_threads = getNumThreads(n_vectors / 1024 + 1);
+	for (size_t iteration = 0; iteration <= params.n_ivf_iterations; ++iteration)
+	{
+		runInParallel(n_vectors, n_threads, [&](const size_t begin, const size_t end)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				float best_similarity = -INFINITY;
+				for (size_t list = 0; list < n_lists; ++list)
+				{
+					const float similarity = dotProduct(centroid_storage.data() + list * stride, vectors + i * stride, stride);
+					if (similarity > best_similarity)
+					{
+						best_similarity = similarity;
+						assignments[i] = list;
+					}
+				}
+			}
+		});
+		if (iteration == params.n_ivf_iterations) break;
+
+		// Clusters that lose every vector keep their centroid
+		std::vector<float> sums(n_lists * stride, 0.0f);
+		std::vector<size_t> counts(n_lists, 0);
+		for (size_t i = 0; i < n_vectors; ++i)
+		{
+			float* sum = sums.data() + assignments[i] * stride;
+			const float* vector = vectors + i * stride;
+			for (size_t j = 0; j < dimension; ++j)
+			{
+				sum[j] += vector[j];
+			}
+			++counts[assignments[i]];
+		}
+		for (size_t list = 0; list < n_lists; ++list)
+		{
+			if (counts[list] == 0) continue;
+			normalize(sums.data() + list * stride, dimension);
+			std::copy(sums.data() + list * stride, sums.data() + (list + 1) * stride, centroid_storage.data() + list * stride);
+		}
+	}
+
+	// The vectors of each list are contiguous, in the order of the index
+	list_offset_storage.assign(n_lists + 1, 0);
+	for (size_t i = 0; i < n_vectors; ++i)
+	{
+		++list_offset_storage[assignments[i] + 1];
+	}
+	for (size_t list = 0; list < n_lists; ++list)
+	{
+		list_offset_storage[list + 1] += list_offset_storage[list];
+	}
+	list_id_storage.resize(n_vectors);
+	std::vector<uint64_t> positions(list_offset_storage.begin(), list_offset_storage.end() - 1);
+	for (size_t i = 0; i < n_vectors; ++i)
+	{
+		list_id_storage[positions[assignments[i]]++] = i;
+	}
+}
+
+
+void NoteIndex::getCandidates(const float* query, std::vector<uint32_t>* candidates) const
+{
+	candidates->clear();
+	if (params.mode == NOTE_INDEX_LSH)
+	{
+		// The bucket of the query and the buckets that differ in one bit
+		for (size_t table = 0; table < params.n_lsh_tables; ++table)
+		{
+			const uint32_t* keys = lsh_keys + table * n_vectors;
+			const uint32_t* ids = lsh_ids + table * n_vectors;
+			const uint32_t query_key = getLshKey(table, query);
+			for (size_t flip = 0; flip <= params.n_lsh_bits; ++flip)
+			{
+				const uint32_t key = flip < params.n_lsh_bits ? query_key ^ ((uint32_t)1 << flip) : query_key;
+				const std::pair<const uint32_t*, const uint32_t*> bucket = std::equal_range(keys, keys + n_vectors, key);
+				candidates->insert(candidates->end(), ids + (bucket.first - keys), ids + (bucket.second - keys));
+			}
+		}
+		std::sort(candidates->begin(), candidates->end());
+		candidates->erase(std::unique(candidates->begin(), candidates->end()), candidates->end());
+	}
+	else if (params.mode == NOTE_INDEX_IVF)
+	{
+		std::vector<std::pair<float, uint32_t> > lists(n_lists);
+		for (size_t list = 0; list < n_lists; ++list)
+		{
+			lists[list] = std::make_pair(-dotProduct(centroids + list * stride, query, stride), (uint32_t)list);
+		}
+		const size_t n_probes = params.n_ivf_probes < n_lists ? params.n_ivf_probes : n_lists;
+		std::partial_sort(lists.begin(), lists.begin() + n_probes, lists.end());
+		for (size_t i = 0; i < n_probes; ++i)
+		{
+			const uint32_t list = lists[i].second;
+			candidates->insert(candidates->end(), list_ids + list_offsets[list], list_ids + list_offsets[list + 1]);
+		}
+	}
+}
+
+
+std::vector<NoteIndexMatch> NoteIndex::searchWithThreads(const float* query, const size_t n_matches, const size_t n_threads) const
+{
+	if (built && params.mode != NOTE_INDEX_BRUTE_FORCE)
+	{
+		std::vector<uint32_t> candidates;
+		getCandidates(query, &candidates);
+		MatchHeap heap(n_matches);
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			heap.add(candidates[i], dotProduct(vectors + candidates[i] * stride, query, stride));
+		}
+		return heap.getMatches(entries);
+	}
+
+	// Every thread keeps the best matches of its vectors
+	std::vector<MatchHeap> heaps(n_threads, MatchHeap(n_matches));
+	runInParallel(n_threads, n_threads, [&](const size_t begin, const size_t end)
+	{
+		for (size_t thread = begin; thread < end; ++thread)
+		{
+			MatchHeap& heap = heaps[thread];
+			const size_t first = n_vectors * thread / n_threads;
+			const size_t last = n_vectors * (thread + 1) / n_threads;
+			for (size_t i = first; i < last; ++i)
+			{
+				heap.add(i, dotProduct(vectors + i * stride, query, stride));
+			}
+		}
+	});
+	for (size_t thread = 1; thread < n_threads; ++thread)
+	{
+		heaps[0].merge(heaps[thread]);
+	}
+	return heaps[0].getMatches(entries);
+}
+
+
+std::vector<NoteIndexMatch> NoteIndex::search(const float* query, const size_t n_matches) const
+{
+	return searchWithThreads(query, n_matches, getNumThreads(n_vectors / NOTE_INDEX_VECTORS_PER_THREAD));
+}
+
+
+std::vector<std::vector<NoteIndexMatch> > NoteIndex::searchBatch(const float* queries, const size_t n_queries, const size_t n_matches) const
+{
+	std::vector<std::vector<NoteIndexMatch> > output(n_queries);
+	runInParallel(n_queries, getNumThreads(n_queries), [&](const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			output[i] = searchWithThreads(queries + i * stride, n_matches, 1);
+		}
+	});
+	return output;
+}
+
+
+void NoteIndex::save(const std::string& fname) const
+{
+	std::ofstream ost(fname, std::ios::binary | std::ios::trunc);
+	if (!ost)
+	{
+		throw std::runtime_error("Could not open index file '" + fname + "'");
+	}
+
+	NoteIndexFileHeader header = { NOTE_INDEX_FILE_MAGIC, NOTE_INDEX_FILE_VERSION, (uint32_t)params.feature, (uint32_t)params.mode, params.shingle_size, params.shingle_step, params.n_lsh_tables, params.n_lsh_bits, params.n_ivf_lists, params.n_ivf_probes, n_lists, dimension, stride, n_vectors, n_profiles, built };
+	ost.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<size_t> sizes;
+	getSectionSizes(header, &sizes);
+	const void* sections[] = { vectors, entries, hyperplanes, lsh_keys, lsh_ids, centroids, list_offsets, list_ids };
+	const char padding[NOTE_INDEX_FILE_ALIGNMENT] = {};
+	size_t offset = sizeof(header);
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		ost.write(padding, alignFileOffset(offset) - offset);
+		ost.write(static_cast<const char*>(sections[i]), sizes[i]);
+		offset = alignFileOffset(offset) + sizes[i];
+	}
+	if (!ost)
+	{
+		throw std::runtime_error("Could not write index file '" + fname + "'");
+	}
+}
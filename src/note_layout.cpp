@@ -0,0 +1,38 @@
+#include "note_layout.h"
+
+#include <string.h>
+
+
+void convertNoteLayout(const uint8_t* src, const NoteLayout src_layout, uint8_t* dst, const NoteLayout dst_layout, const size_t n_chunks, const size_t n_notes, const size_t value_size)
+{
+	if (src_layout == dst_layout)
+	{
+		memcpy(dst, src, n_chunks * n_notes * value_size);
+		return;
+	}
+
+	// Walk the destination in order, so the writes are sequential
+	for (size_t i = 0; i < n_chunks * n_notes; ++i)
+	{
+		size_t chunk, note;
+		if (dst_layout == NOTE_LAYOUT_NOTE_MAJOR)
+		{
+			note = i / n_chunks;
+			chunk = i % n_chunks;
+		}
+		else if (dst_layout == NOTE_LAYOUT_TILED)
+		{
+			const size_t tile_begin = i / (NOTE_TILE_CHUNKS * n_notes) * NOTE_TILE_CHUNKS;
+			const size_t tile_size = n_chunks - tile_begin < NOTE_TILE_CHUNKS ? n_chunks - tile_begin : NOTE_TILE_CHUNKS;
+			const size_t tile_offset = i - tile_begin * n_notes;
+			note = tile_offset / tile_size;
+			chunk = tile_begin + tile_offset % tile_size;
+		}
+		else
+		{
+			chunk = i / n_notes;
+			note = i % n_notes;
+		}
+		memcpy(dst + i * value_size, src + getNoteLayoutIndex(src_layout, n_chunks, n_notes, chunk, note) * value_size, value_size);
+	}
+}
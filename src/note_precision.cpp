@@ -0,0 +1,190 @@
+#include "note_precision.h"
+
+#include <math.h>
+#include <stdexcept>
+#include <string.h>
+
+
+/*! Lookup table for decoding the logarithmic 8-bit encoding */
+struct Log8Table
+{
+	Log8Table()
+	{
+		values[0] = 0;
+		for (size_t i = 1; i < 256; ++i)
+		{
+			values[i] = powf(10, (LOG8_DB_MIN + (i - 1) * LOG8_DB_STEP) / 10);
+		}
+	}
+
+	float values[256];
+};
+
+
+static const Log8Table& getLog8Table()
+{
+	static const Log8Table table;
+	return table;
+}
+
+
+size_t getNotePrecisionSize(const NotePrecision precision)
+{
+	switch (precision)
+	{
+	case NOTE_PRECISION_FLOAT32: return sizeof(float);
+	case NOTE_PRECISION_FLOAT16: return sizeof(uint16_t);
+	case NOTE_PRECISION_LOG8: return sizeof(uint8_t);
+	}
+	throw std::runtime_error("Unknown note precision");
+}
+
+
+float halfToFloat(const uint16_t value)
+{
+	uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1f;
+	uint32_t mantissa = value & 0x3ff;
+
+	uint32_t bits = 0;
+	if (exponent == 0x1f)
+	{
+		// Infinity or NaN
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0)
+	{
+		// Normal number; rebias the exponent
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	else if (mantissa == 0)
+	{
+		// Signed zero
+		bits = sign;
+	}
+	else
+	{
+		// Subnormal half is a normal float; shift until the implicit bit
+		exponent = 113;
+		while (!(mantissa & 0x400))
+		{
+			mantissa <<= 1;
+			--exponent;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float output = 0;
+	memcpy(&output, &bits, sizeof(float));
+	return output;
+}
+
+
+uint16_t floatToHalf(const float value)
+{
+	uint32_t bits = 0;
+	memcpy(&bits, &value, sizeof(float));
+	uint16_t sign = (bits >> 16) & 0x8000;
+	uint32_t magnitude = bits & 0x7fffffff;
+
+	// Infinity and NaN
+	if (magnitude >= 0x7f800000)
+	{
+		return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+	}
+
+	// Too large to represent; everything from 65520 upwards rounds to infinity
+	if (magnitude >= 0x477ff000)
+	{
+		return sign | 0x7c00;
+	}
+
+	// Subnormal halves (and values that round to zero)
+	if (magnitude < 0x38800000)
+	{
+		if (magnitude < 0x33000000) return sign;
+		uint32_t exponent = magnitude >> 23;
+		uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+		uint32_t shift = 126 - exponent;
+		uint32_t result = mantissa >> shift;
+		uint32_t remainder = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (result & 1))) ++result;
+		return sign | result;
+	}
+
+	// Normal numbers; round to nearest even (a carry correctly bumps the
+	// exponent)
+	uint32_t result = (magnitude >> 13) - (112 << 10);
+	uint32_t remainder = magnitude & 0x1fff;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (result & 1))) ++result;
+	return sign | result;
+}
+
+
+float log8ToFloat(const uint8_t value)
+{
+	return getLog8Table().values[value];
+}
+
+
+uint8_t floatToLog8(const float value)
+{
+	if (!(value > 0)) return 0;
+	float code = (10 * log10f(value) - LOG8_DB_MIN) / LOG8_DB_STEP + 1;
+	if (code < 1) return 0;
+	if (code > 255) return 255;
+	return (uint8_t)nearbyintf(code);
+}
+
+
+void widenNotes(const uint8_t* src, const size_t n_notes, const NotePrecision precision, float* dst)
+{
+	switch (precision)
+	{
+	case NOTE_PRECISION_FLOAT32:
+		memcpy(dst, src, n_notes * sizeof(float));
+		break;
+	case NOTE_PRECISION_FLOAT16:
+		for (size_t i = 0; i < n_notes; ++i)
+		{
+			uint16_t value = 0;
+			memcpy(&value, src + i * sizeof(uint16_t), sizeof(uint16_t));
+			dst[i] = halfToFloat(value);
+		}
+		break;
+	case NOTE_PRECISION_LOG8:
+	{
+		const float* table = getLog8Table().values;
+		for (size_t i = 0; i < n_notes; ++i)
+		{
+			dst[i] = table[src[i]];
+		}
+		break;
+	}
+	}
+}
+
+
+void narrowNotes(const float* src, const size_t n_notes, const NotePrecision precision, uint8_t* dst)
+{
+	switch (precision)
+	{
+	case NOTE_PRECISION_FLOAT32:
+		memcpy(dst, src, n_notes * sizeof(float));
+		break;
+	case NOTE_PRECISION_FLOAT16:
+		for (size_t i = 0; i < n_notes; ++i)
+		{
+			uint16_t value = floatToHalf(src[i]);
+			memcpy(dst + i * sizeof(uint16_t), &value, sizeof(uint16_t));
+		}
+		break;
+	case NOTE_PRECISION_LOG8:
+		for (size_t i = 0; i < n_notes; ++i)
+		{
+			dst[i] = floatToLog8(src[i]);
+		}
+		break;
+	}
+}
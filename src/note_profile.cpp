@@ -1,152 +1,749 @@
 #include "note_profile.h"
 
+#include "decimator.h"
+#include "audio_reader.h"
 #include "ffthw.h"
-#include "wav.h"
+#include "note_checkpoint.h"
 
+#include <exception>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 
-NoteProfile::NoteProfile(const int32_t base_note_id) :
-	timestamps(nullptr),
+/*! Reads blocks of samples at the analysis rate; samples are either converted
+ *  by the reader or converted and decimated in one pass by a Decimator, and
+ *  mixed down to one channel if there are mix weights
+ */
+class AnalysisReader
+{
+public:
+	/*! @param mix_weights: weight of each channel; empty to read every channel
+	 */
+	AnalysisReader(AudioReader& file, const size_t decimation, const std::vector<float>& mix_weights) :
+		file(file),
+		decimator(nullptr),
+		raw_samples(),
+		flushed(false),
+		mix_weights(mix_weights),
+		channel_storage(),
+		channels()
+	{
+		if (decimation > 1)
+		{
+			decimator = new Decimator(decimation, file.getNumChannels());
+		}
+	}
+
+	~AnalysisReader()
+	{
+		if (decimator)
+		{
+			delete decimator;
+			decimator = nullptr;
+		}
+	}
+
+	/*! Number of channels passed to read() */
+	size_t getNumChannels() const
+	{
+		return mix_weights.empty() ? file.getNumChannels() : 1;
+	}
+
+	/*! Move ahead to a frame of the file before the first read; the
+	 *  decimation filter is primed with the frames before it, so the samples
+	 *  are the same as those of a reader that starts at the beginning
+	 */
+	void seek(const size_t n_frames)
+	{
+		if (!decimator)
+		{
+			file.skipSamples(n_frames);
+			return;
+		}
+		const size_t n_priming = n_frames < decimator->getNumPrimingFrames() ? n_frames : decimator->getNumPrimingFrames();
+		file.skipSamples(n_frames - n_priming);
+		raw_samples.resize(n_priming * file.getNumChannels());
+		if (file.readRawSamples(n_priming, raw_samples.data()) != n_priming)
+		{
+			throw std::runtime_error("The file ends before the position to analyze");
+		}
+		decimator->prime(raw_samples.data(), n_priming);
+	}
+
+	/*! Read up to n_samples samples per channel; returns 0 at the end */
+	size_t read(const size_t n_samples, const std::vector<float*>& outputs)
+	{
+		if (mix_weights.empty()) return readChannels(n_samples, outputs);
+		if (!decimator) return file.readMixedSamples(n_samples, mix_weights, outputs[0]);
+
+		// The filter runs on every channel before they are mixed
+		if (channels.empty())
+		{
+			channel_storage.assign(file.getNumChannels(), std::vector<float>(n_samples));
+			for (size_t c = 0; c < channel_storage.size(); ++c)
+			{
+				channels.push_back(channel_storage[c].data());
+			}
+		}
+		const size_t n_read = readChannels(n_samples < channel_storage[0].size() ? n_samples : channel_storage[0].size(), channels);
+		AudioReader::mixChannels(n_read, channels, mix_weights, outputs[0]);
+		return n_read;
+	}
+
+protected:
+	size_t readChannels(const size_t n_samples, const std::vector<float*>& outputs)
+	{
+		if (!decimator) return file.readSamples(n_samples, outputs);
+
+		// Read as many input samples as can be decimated into the outputs
+		const size_t factor = decimator->getFactor();
+		size_t n_frames = n_samples * factor;
+		while (n_frames > 0 && decimator->getMaxOutputSamples(n_frames) > n_samples)
+		{
+			n_frames -= n_frames > factor ? factor : n_frames;
+		}
+		if (n_frames == 0)
+		{
+			throw std::runtime_error("Buffer is too small for decimation");
+		}
+		raw_samples.resize(n_frames * file.getNumChannels());
+
+		// The filter delays the output, so the first reads may not produce
+		// any samples
+		size_t n_output = 0;
+		while (n_output == 0 && !flushed)
+		{
+			size_t n_read = file.readRawSamples(n_frames, raw_samples.data());
+			if (n_read == 0)
+			{
+				flushed = true;
+				n_output = decimator->flush(outputs);
+			}
+			else
+			{
+				n_output = decimator->process(raw_samples.data(), n_read, outputs);
+			}
+		}
+		return n_output;
+	}
+
+protected:
+	AudioReader& file;
+	Decimator* decimator;
+	std::vector<int16_t> raw_samples;
+	bool flushed;
+
+	std::vector<float> mix_weights;
+	std::vector<std::vector<float> > channel_storage;
+	std::vector<float*> channels;
+};
+
+
+NoteProfile::NoteProfile(const int32_t base_note_id, const NotePrecision precision) :
+	timestamps(),
 	n_samples_per_second(0),
-	notes(nullptr),
-	n_chunks(0),
+	notes(),
+	note_series(),
+	converted_notes(),
+	precision(precision),
+	layout(NOTE_LAYOUT_CHUNK_MAJOR),
+	stream_layout(NOTE_LAYOUT_CHUNK_MAJOR),
 	n_notes_per_chunk(12 * (N_STAGES - 1)),
+	n_samples_per_chunk(0),
 	base_note_id(base_note_id),
-	n_samples_per_chunk(0)
+	resampling(false),
+	downmix(false),
+	downmix_weights(),
+	n_segments_requested(1),
+	checkpoint_fname(),
+	n_chunks_per_checkpoint(0),
+	events(),
+	pyramid_enabled(false),
+	pyramid()
 {}
 
 
-NoteProfile::~NoteProfile()
+void NoteProfile::fromWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk)
 {
-	if (timestamps)
+	streamWav(fname, a4_freq, n_samples_per_chunk, *this, nullptr);
+}
+
+
+void NoteProfile::eventsFromWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk, const NoteEventThresholds& thresholds)
+{
+	streamWav(fname, a4_freq, n_samples_per_chunk, *this, &thresholds);
+}
+
+
+void NoteProfile::fromFile(const std::string& fname)
+{
+	const std::string pyramid_fname = NotePyramid::getFileName(fname);
+	if (!pyramid_enabled || !std::ifstream(pyramid_fname))
 	{
-		delete[] timestamps;
-		timestamps = nullptr;
+		NoteFileSink::replay(fname, *this);
+		return;
 	}
-	if (notes)
+
+	// Read the notes without building the pyramid, then load it
+	pyramid_enabled = false;
+	try
+	{
+		NoteFileSink::replay(fname, *this);
+	}
+	catch (...)
 	{
-		delete[] notes;
-		notes = nullptr;
+		pyramid_enabled = true;
+		throw;
+	}
+	pyramid_enabled = true;
+	pyramid.load(pyramid_fname);
+
+	// The file may have grown after the pyramid was saved
+	if (pyramid.getNumChunks() != timestamps.size() || pyramid.getNotesPerChunk() != n_notes_per_chunk)
+	{
+		NoteFileSink::replay(fname, pyramid);
 	}
 }
 
 
-void NoteProfile::fromWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk)
+void NoteProfile::setNoteLayout(const NoteLayout layout)
 {
-	WavFile file(fname);
-	MusicalFFT mfft(OpenCLContext::getInstance());
+	if (layout != NOTE_LAYOUT_CHUNK_MAJOR && layout != NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		throw std::runtime_error("Note profiles are stored chunk-major or note-major");
+	}
+	this->layout = layout;
+}
 
-	// Determine parametrizations of note frequency
-	const float base_note_freq = a4_freq * pow(2, (float)(base_note_id - 69) / 12.0);
-	const float samples_per_base_note = file.getSampleRate() / base_note_freq;
 
-	// Determine how much memory to allocate for notes
-	this->n_samples_per_chunk = n_samples_per_chunk;
-	const size_t n_total_samples = file.getNumSamplesRemaining();
-	n_chunks = (n_total_samples - 3 - (size_t)ceil(samples_per_base_note)) / n_samples_per_chunk + 1;
+void NoteProfile::begin(const NoteStreamInfo& info)
+{
+	base_note_id = info.base_note_id;
+	precision = info.precision;
+	stream_layout = info.layout;
+	n_notes_per_chunk = info.n_notes_per_chunk;
+	n_samples_per_second = info.n_samples_per_second;
+	n_samples_per_chunk = info.n_samples_per_chunk;
+
+	timestamps.clear();
+	notes.clear();
+	note_series.clear();
+	events.clear();
+	timestamps.reserve(info.n_chunks_hint);
+	if (pyramid_enabled)
+	{
+		pyramid.begin(info);
+	}
+}
 
-	// Allocate memory for output
-	timestamps = new uint64_t[n_chunks];
-	notes = new float[n_chunks * n_notes_per_chunk];
 
-	// The number of chunks processed at a time is dependent on the rate at
-	// which the audio file is read
-	const size_t buffer_size = file.getSampleRate() * 5;
-	std::vector<float*> buffers(file.getNumChannels());
-	for (size_t i = 0; i < file.getNumChannels(); ++i)
+void NoteProfile::writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)
+{
+	if (first_chunk_index != this->timestamps.size())
 	{
-		buffers[i] = new float[buffer_size];
+		throw std::runtime_error("Chunks of a note stream are not consecutive");
+	}
+	this->timestamps.insert(this->timestamps.end(), timestamps, timestamps + n_chunks);
+	if (!notes) return;
+	if (pyramid_enabled)
+	{
+		pyramid.writeNotes(first_chunk_index, n_chunks, timestamps, notes);
 	}
 
-	// The FFT will not consume all samples, so there will usually be an offset
-	size_t n_unused_samples = 0;
-	std::vector<float*> buffers_with_offset(buffers);
+	// Streams in another layout, such as files, are converted block by block
+	const size_t value_size = getNotePrecisionSize(precision);
+	if (stream_layout != layout)
+	{
+		converted_notes.resize(n_chunks * n_notes_per_chunk * value_size);
+		convertNoteLayout(notes, stream_layout, converted_notes.data(), layout, n_chunks, n_notes_per_chunk, value_size);
+		notes = converted_notes.data();
+	}
 
-	// The FFT will return a certain number of chunks that will not increase
-	// over time; to aggregate over multiple channels, have another buffer
-	float* aggregation_buffer = nullptr;
+	// Reserve the whole file at once instead of growing block by block
+	if (layout == NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		if (note_series.empty())
+		{
+			note_series.resize(n_notes_per_chunk);
+			for (size_t note = 0; note < n_notes_per_chunk; ++note)
+			{
+				note_series[note].reserve(this->timestamps.capacity() * value_size);
+			}
+		}
+		for (size_t note = 0; note < n_notes_per_chunk; ++note)
+		{
+			const uint8_t* row = notes + note * n_chunks * value_size;
+			note_series[note].insert(note_series[note].end(), row, row + n_chunks * value_size);
+		}
+	}
+	else
+	{
+		const size_t row_size = n_notes_per_chunk * value_size;
+		if (this->notes.empty())
+		{
+			this->notes.reserve(this->timestamps.capacity() * row_size);
+		}
+		this->notes.insert(this->notes.end(), notes, notes + n_chunks * row_size);
+	}
+}
 
-	// Keep track of how many notes have been processed
-	size_t chunk_index = 0;
 
-	while (1)
+void NoteProfile::writeEvents(const NoteEvent* events, const size_t n_events)
+{
+	this->events.insert(this->events.end(), events, events + n_events);
+}
+
+
+/*! Everything the analysis of a file needs besides the samples */
+struct AnalysisParams
+{
+	float sample_rate;
+	float base_note_freq;
+	size_t decimation;
+	size_t chunk_spacing;
+	NotePrecision precision;
+	NoteLayout layout;
+
+	// Weight of each channel in the analyzed mix; empty to analyze every
+	// channel and average the notes
+	std::vector<float> mix_weights;
+
+	// Samples needed for one chunk and the offset of its timestamp
+	size_t n_needed;
+	size_t center_offset;
+
+	// Samples read at a time
+	size_t buffer_size;
+};
+
+
+/*! Stores the notes of a segment until the segments before it are passed on;
+ *  the blocks are kept as they are, since the layout applies to each block
+ */
+class SegmentSink : public NoteSink
+{
+public:
+	void begin(const NoteStreamInfo& info) override
+	{
+		row_size = info.n_notes_per_chunk * getNotePrecisionSize(info.precision);
+	}
+
+	void writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes) override
 	{
-		// Move remaining samples to the beginning of the buffers and define
-		// buffer pointers with an offset
-		for (size_t i = 0; i < file.getNumChannels(); ++i)
+		blocks.push_back(Block());
+		blocks.back().first_chunk_index = first_chunk_index;
+		blocks.back().timestamps.assign(timestamps, timestamps + n_chunks);
+		blocks.back().notes.assign(notes, notes + n_chunks * row_size);
+	}
+
+	void writeEvents(const NoteEvent*, const size_t) override
+	{}
+
+	void forward(NoteSink& sink) const
+	{
+		for (size_t i = 0; i < blocks.size(); ++i)
 		{
-			memcpy(buffers[i], buffers[i] + buffer_size - n_unused_samples, n_unused_samples * sizeof(float));
-			buffers_with_offset[i] = buffers[i] + n_unused_samples;
+			sink.writeNotes(blocks[i].first_chunk_index, blocks[i].timestamps.size(), blocks[i].timestamps.data(), blocks[i].notes.data());
 		}
-		const size_t n_samples_to_read = buffer_size - n_unused_samples;
+	}
+
+protected:
+	struct Block
+	{
+		size_t first_chunk_index;
+		std::vector<uint64_t> timestamps;
+		std::vector<uint8_t> notes;
+	};
+
+	size_t row_size = 0;
+	std::vector<Block> blocks;
+};
+
+
+/*! Analyze the samples of a file from a chunk on and pass the notes to a
+ *  sink, without calling begin() or end()
+ *    @param first_chunk_index: first chunk to analyze, counted from the
+ *                              current position of the file
+ *    @param n_samples_limit: number of samples at the analysis rate after
+ *                            which to stop reading
+ *    @param device_index: device of the context that runs the segment
+ *    @param checkpoint: if given, committed as the chunks are analyzed; the
+ *                       event detection continues from its state
+ */
+static void analyzeSegment(AudioReader& file, const AnalysisParams& params, const size_t first_chunk_index, const size_t n_samples_limit, NoteSink& sink, const NoteEventThresholds* thresholds, const size_t device_index = 0, NoteCheckpoint* checkpoint = nullptr)
+{
+	MusicalFFT mfft(OpenCLContext::getInstance(), false, device_index);
+	mfft.setNotePrecision(params.precision);
+	mfft.setNoteLayout(params.layout);
+	AnalysisReader reader(file, params.decimation, params.mix_weights);
+	const size_t n_channels = reader.getNumChannels();
+
+	// Without decimation, samples of at most 16 bits are uploaded as they
+	// are and deinterleaved, converted and mixed on the device; each set of
+	// channel weights is analyzed like a channel; a window that does not fit
+	// into local memory as 16-bit samples is analyzed as floats
+	const bool raw = params.decimation <= 1 && file.getBitsPerSample() <= 16 && mfft.supportsRawSignal(params.sample_rate, params.chunk_spacing, params.base_note_freq);
+	const size_t n_file_channels = file.getNumChannels();
+	std::vector<std::vector<float> > channel_weights;
+	if (!params.mix_weights.empty())
+	{
+		channel_weights.push_back(params.mix_weights);
+	}
+	else
+	{
+		for (size_t channel_index = 0; channel_index < n_file_channels; ++channel_index)
+		{
+			channel_weights.push_back(std::vector<float>(n_file_channels, 0.0f));
+			channel_weights.back()[channel_index] = 1.0f;
+		}
+	}
+	std::vector<int16_t> raw_buffer(raw ? params.buffer_size * n_file_channels : 0);
+	reader.seek(first_chunk_index * params.chunk_spacing * params.decimation);
+
+	// Events after a checkpoint depend on the state of the notes at it
+	std::vector<float> event_state;
+	if (checkpoint && thresholds && first_chunk_index > 0)
+	{
+		if (checkpoint->getState().size() != N_NOTES_PER_CHUNK * 2)
+		{
+			throw std::runtime_error("The checkpoint has no state of the note events");
+		}
+		mfft.writeNoteEventState(checkpoint->getState().data(), first_chunk_index);
+	}
+
+	// The kernels compile while the first block is read
+	mfft.warmUp(params.sample_rate, params.chunk_spacing, params.base_note_freq);
+
+	std::vector<std::vector<float> > buffer_storage(raw ? 0 : n_channels, std::vector<float>(params.buffer_size));
+	std::vector<float*> buffers(buffer_storage.size());
+	for (size_t i = 0; i < buffers.size(); ++i)
+	{
+		buffers[i] = buffer_storage[i].data();
+	}
+
+	// The FFT will not consume all samples; the rest stays in the signal
+	// history on the device, so only new samples are transferred
+	size_t n_samples_left = n_samples_limit;
+
+	// Keep track of how many notes have been processed
+	size_t chunk_index = first_chunk_index;
+	std::vector<uint64_t> block_timestamps;
+
+	while (1)
+	{
+		size_t n_samples_to_read = params.buffer_size < n_samples_left ? params.buffer_size : n_samples_left;
+		if (n_samples_to_read == 0) break;
 
 		// Read as many samples as possible into the buffers
-		size_t n_samples_read = file.readSamples(n_samples_to_read, buffers_with_offset);
+		size_t n_samples_read = raw ? file.readRawSamples(n_samples_to_read, raw_buffer.data()) : reader.read(n_samples_to_read, buffers);
 		if (n_samples_read == 0) break;
+		n_samples_left -= n_samples_read;
+		if (raw)
+		{
+			mfft.appendRawSignal(n_samples_read, raw_buffer.data(), n_file_channels);
+		}
+		else
+		{
+			for (size_t channel_index = 0; channel_index < n_channels; ++channel_index)
+			{
+				mfft.appendSignal(channel_index, n_samples_read, buffers[channel_index]);
+			}
+		}
+
+		// Wait for more samples if there are not enough for a chunk
+		if ((raw ? mfft.getRawHistorySize() : mfft.getHistorySize(0)) < params.n_needed) continue;
 
 		// Perform the FFT and aggregate the data
-		size_t n_samples_to_process = n_samples_read + n_unused_samples;
-		size_t n_samples_processed = 0;
+		const size_t n_runs = raw ? channel_weights.size() : n_channels;
 		size_t n_new_chunks = 0;
-		size_t n_new_notes = 0;
-
-		for (size_t channel_index = 0; channel_index < file.getNumChannels(); ++channel_index)
+		for (size_t run_index = 0; run_index < n_runs; ++run_index)
 		{
-			std::cout << n_samples_to_process << std::endl;
-			// Perform the FFT
-			n_new_chunks = mfft.runFFT(file.getSampleRate(), n_samples_to_process, buffers[channel_index], n_samples_per_chunk, base_note_freq);
-			n_samples_processed = n_new_chunks * n_samples_per_chunk;
-			n_unused_samples = n_samples_to_process - n_samples_processed;
-			n_new_notes = n_new_chunks * n_notes_per_chunk;
-
-			// Create a buffer for aggregating the results from all channels
-			if (!aggregation_buffer)
+			// Perform the FFT; the raw frames are only dropped after the
+			// last channel
+			if (raw)
 			{
-				aggregation_buffer = new float[n_new_notes];
+				n_new_chunks = mfft.runFFTOnRawHistory(channel_weights[run_index].data(), params.sample_rate, params.chunk_spacing, params.base_note_freq, run_index + 1 == n_runs);
 			}
-			if (channel_index == 0)
+			else
 			{
-				for (size_t i = 0; i < n_new_notes; ++i)
-				{
-					aggregation_buffer[i] = 0;
-				}
+				n_new_chunks = mfft.runFFTOnHistory(run_index, params.sample_rate, params.chunk_spacing, params.base_note_freq);
 			}
 
-			// Add the results to the buffer
-			const float* notes_output = mfft.readNotes(nullptr, nullptr);
-			for (size_t i = 0; i < n_new_notes; ++i)
+			// Average the channels on the device; the conversion to the
+			// storage format happens after the last channel
+			if (n_runs > 1)
 			{
-				aggregation_buffer[i] += notes_output[i];
+				mfft.accumulateNotes(1.0f / n_runs);
 			}
 		}
 
-		// Average the signal and copy into the output
-		for (size_t i = 0; i < n_new_notes; ++i)
+		block_timestamps.resize(n_new_chunks);
+		for (size_t i = 0; i < n_new_chunks; ++i)
+		{
+			block_timestamps[i] = (chunk_index + i) * params.chunk_spacing + params.center_offset;
+		}
+
+		if (thresholds)
+		{
+			// Only the events are transferred
+			size_t n_new_events = 0;
+			const NoteEvent* new_events = mfft.readNoteEvents(*thresholds, &n_new_events);
+			sink.writeNotes(chunk_index, n_new_chunks, block_timestamps.data(), nullptr);
+			sink.writeEvents(new_events, n_new_events);
+		}
+		else
 		{
-			aggregation_buffer[i] /= file.getNumChannels();
+			// Pass the notes in the storage format straight to the sink
+			const uint8_t* notes_output = mfft.readNotesPacked(nullptr, nullptr);
+			sink.writeNotes(chunk_index, n_new_chunks, block_timestamps.data(), notes_output);
 		}
-		memcpy(notes + chunk_index * n_notes_per_chunk, aggregation_buffer, n_new_notes * sizeof(float));
 		chunk_index += n_new_chunks;
+
+		if (checkpoint && checkpoint->isCommitDue(chunk_index))
+		{
+			if (thresholds)
+			{
+				event_state.resize(N_NOTES_PER_CHUNK * 2);
+				mfft.readNoteEventState(event_state.data());
+			}
+			checkpoint->commit(chunk_index, event_state);
+		}
+	}
+
+	if (checkpoint && chunk_index > checkpoint->getNumChunksComplete())
+	{
+		if (thresholds)
+		{
+			event_state.resize(N_NOTES_PER_CHUNK * 2);
+			mfft.readNoteEventState(event_state.data());
+		}
+		checkpoint->commit(chunk_index, event_state);
+	}
+}
+
+
+void NoteProfile::streamWav(const std::string& fname, const float a4_freq, const size_t n_samples_per_chunk, NoteSink& sink, const NoteEventThresholds* thresholds) const
+{
+	std::unique_ptr<AudioReader> file_reader = AudioReader::open(fname);
+	AudioReader& file = *file_reader;
+
+	// Determine parametrizations of note frequency
+	AnalysisParams params;
+	params.base_note_freq = a4_freq * pow(2, (float)(base_note_id - 69) / 12.0);
+
+	// Analyze at the lowest sample rate that still covers every note
+	params.decimation = resampling ? Decimator::chooseFactor((uint32_t)file.getSampleRate(), params.base_note_freq, n_samples_per_chunk) : 1;
+	params.sample_rate = file.getSampleRate() / params.decimation;
+	params.chunk_spacing = n_samples_per_chunk / params.decimation;
+	params.precision = precision;
+	params.layout = sink.getPreferredLayout();
+	if (downmix)
+	{
+		params.mix_weights = downmix_weights;
+		if (params.mix_weights.empty())
+		{
+			params.mix_weights.assign(file.getNumChannels(), 1.0f / file.getNumChannels());
+		}
+		if (params.mix_weights.size() != file.getNumChannels())
+		{
+			throw std::runtime_error("There must be a downmix weight for every channel");
+		}
+	}
+	const float samples_per_base_note = params.sample_rate / params.base_note_freq;
+	params.n_needed = 3 + (size_t)ceil(samples_per_base_note);
+	params.center_offset = samples_per_base_note / 2;
+
+	// The number of chunks processed at a time is dependent on the rate at
+	// which the audio file is read
+	params.buffer_size = params.sample_rate * 5;
+	if (params.buffer_size < params.n_needed + params.chunk_spacing)
+	{
+		params.buffer_size = params.n_needed + params.chunk_spacing;
+	}
+
+	// Count the chunks so in-memory sinks can reserve storage
+	const size_t n_total_samples = (file.getNumSamplesRemaining() + params.decimation - 1) / params.decimation;
+	const size_t n_chunks = n_total_samples >= params.n_needed ? (n_total_samples - params.n_needed) / params.chunk_spacing + 1 : 0;
+
+	NoteStreamInfo info = { base_note_id, precision, params.layout, n_notes_per_chunk, (uint64_t)params.sample_rate, params.chunk_spacing, n_chunks };
+
+	// A checkpointed analysis continues serially after the last commit of a
+	// previous run with the same input and configuration
+	if (!checkpoint_fname.empty())
+	{
+		std::stringstream key;
+		key << std::setprecision(9) << NoteCheckpoint::getFileIdentity(fname) << "; format " << file.getSampleRate() << " " << file.getNumChannels() << " " << file.getBitsPerSample() << " " << file.getNumSamplesRemaining();
+		key << "; base " << params.base_note_freq << "; decimation " << params.decimation << "; mix";
+		for (size_t i = 0; i < params.mix_weights.size(); ++i)
+		{
+			key << " " << params.mix_weights[i];
+		}
+		if (thresholds)
+		{
+			key << "; events " << thresholds->on_threshold << " " << thresholds->off_threshold << " " << thresholds->onset_ratio;
+		}
+		else
+		{
+			key << "; notes";
+		}
+
+		NoteCheckpoint checkpoint(checkpoint_fname, key.str(), sink, n_chunks_per_checkpoint);
+		checkpoint.begin(info);
+		analyzeSegment(file, params, checkpoint.getNumChunksComplete(), SIZE_MAX, checkpoint, thresholds, 0, &checkpoint);
+		checkpoint.end();
+		return;
+	}
+	sink.begin(info);
+
+	// Events depend on the chunks before them and the decimation filter on the
+	// samples before them, so only plain notes are analyzed in segments; every
+	// segment should fill at least one buffer
+	size_t n_segments = n_segments_requested;
+	if (n_segments == 0)
+	{
+		n_segments = std::thread::hardware_concurrency();
+	}
+	const size_t min_chunks_per_segment = params.buffer_size / params.chunk_spacing + 1;
+	if (n_segments > n_chunks / min_chunks_per_segment) n_segments = n_chunks / min_chunks_per_segment;
+	if (thresholds || params.decimation > 1 || n_segments < 2)
+	{
+		analyzeSegment(file, params, 0, SIZE_MAX, sink, thresholds);
+		sink.end();
+		return;
+	}
+
+	// Every segment starts at its first chunk and reads the samples of its
+	// last chunk, so it overlaps the next one by the window of a chunk; the
+	// chunks of a segment are then identical to those of a serial analysis.
+	// Segments take turns on the devices, so each partition of a CPU runs
+	// its own segments
+	const size_t n_devices = OpenCLContext::getInstance()->getNumDevices();
+	std::vector<SegmentSink> segment_sinks(n_segments);
+	std::vector<std::exception_ptr> errors(n_segments);
+	std::vector<std::thread> threads;
+	size_t n_samples_first = 0;
+
+	// Threads that started must be joined before an error leaves this scope;
+	// reserving up front keeps push_back() from failing with a started thread
+	threads.reserve(n_segments - 1);
+	try
+	{
+		for (size_t i = 0; i < n_segments; ++i)
+		{
+			const size_t begin = n_chunks * i / n_segments;
+			const size_t end = n_chunks * (i + 1) / n_segments;
+			const size_t n_samples = (end - begin - 1) * params.chunk_spacing + params.n_needed;
+			segment_sinks[i].begin(info);
+
+			// The first segment streams to the sink on the calling thread
+			if (i == 0)
+			{
+				n_samples_first = n_samples;
+				continue;
+			}
+			threads.push_back(std::thread([&, i, begin, n_samples]()
+			{
+				try
+				{
+					std::unique_ptr<AudioReader> segment_file = AudioReader::open(fname);
+					analyzeSegment(*segment_file, params, begin, n_samples, segment_sinks[i], nullptr, i % n_devices);
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+				}
+			}));
+		}
+	}
+	catch (...)
+	{
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i].join();
+		}
+		throw;
 	}
 
-	// There might be one or two extra slots for FFT output
-	n_chunks = chunk_index;
+	try
+	{
+		analyzeSegment(file, params, 0, n_samples_first, sink, nullptr);
+	}
+	catch (...)
+	{
+		errors[0] = std::current_exception();
+	}
 
-	// Fill in timestamps
-	n_samples_per_second = file.getSampleRate();
-	const size_t center_offset = samples_per_base_note / 2;
-	for (size_t i = 0; i < n_chunks; ++i)
+	// Pass the segments on in order; an error of the sink stops the
+	// forwarding, but every thread is still joined
+	std::exception_ptr sink_error;
+	for (size_t i = 1; i < n_segments; ++i)
+	{
+		threads[i - 1].join();
+		if (!errors[0] && !errors[i] && !sink_error)
+		{
+			try
+			{
+				segment_sinks[i].forward(sink);
+			}
+			catch (...)
+			{
+				sink_error = std::current_exception();
+			}
+		}
+	}
+	for (size_t i = 0; i < n_segments; ++i)
 	{
-		timestamps[i] = i * n_samples_per_chunk + center_offset;
+		if (errors[i]) std::rethrow_exception(errors[i]);
 	}
+	if (sink_error) std::rethrow_exception(sink_error);
+	sink.end();
+}
+
 
-	// Clean up
-	for (size_t i = 0; i < file.getNumChannels(); ++i)
+float NoteProfile::getNote(const size_t index, const size_t note) const
+{
+	if (index >= timestamps.size() || note >= n_notes_per_chunk) return 0;
+	const size_t value_size = getNotePrecisionSize(precision);
+	const uint8_t* value = nullptr;
+	if (layout == NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		const uint8_t* series = getPackedNoteSeries(note);
+		if (series) value = series + index * value_size;
+	}
+	else
 	{
-		delete[] buffers[i];
-		buffers[i] = nullptr;
+		const uint8_t* chunk_notes = getPackedNotesByIndex(index);
+		if (chunk_notes) value = chunk_notes + note * value_size;
 	}
-	delete[] aggregation_buffer;
-	aggregation_buffer = nullptr;
-}
\ No newline at end of file
+	if (!value) return 0;
+
+	float output = 0;
+	widenNotes(value, 1, precision, &output);
+	return output;
+}
+
+
+bool NoteProfile::readNotesByIndex(const size_t index, float* output) const
+{
+	if (layout == NOTE_LAYOUT_NOTE_MAJOR)
+	{
+		// Gather the chunk from the series of every note
+		if (index >= timestamps.size() || note_series.empty()) return false;
+		const size_t value_size = getNotePrecisionSize(precision);
+		for (size_t note = 0; note < n_notes_per_chunk; ++note)
+		{
+			widenNotes(note_series[note].data() + index * value_size, 1, precision, output + note);
+		}
+		return true;
+	}
+
+	const uint8_t* chunk_notes = getPackedNotesByIndex(index);
+	if (!chunk_notes) return false;
+
+	widenNotes(chunk_notes, n_notes_per_chunk, precision, output);
+	return true;
+}
@@ -0,0 +1,254 @@
+#include "note_pyramid.h"
+
+#include "note_layout.h"
+#include "note_precision.h"
+
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+
+// "MFPY" in a little-endian file
+#define PYRAMID_FILE_MAGIC 0x5950464d
+#define PYRAMID_FILE_VERSION 1
+
+
+/*! Header of a pyramid file */
+struct PyramidFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t n_notes_per_chunk;
+	uint64_t n_chunks;
+};
+
+
+NotePyramid::NotePyramid() :
+	n_notes_per_chunk(0),
+	n_chunks(0),
+	max_levels(),
+	sum_levels(),
+	prefix_sums(),
+	stream_precision(NOTE_PRECISION_FLOAT32),
+	stream_layout(NOTE_LAYOUT_CHUNK_MAJOR),
+	converted_notes(),
+	widened_notes()
+{}
+
+
+void NotePyramid::begin(const NoteStreamInfo& info)
+{
+	clear(info.n_notes_per_chunk);
+	stream_precision = info.precision;
+	stream_layout = info.layout;
+	max_levels[0].reserve(info.n_chunks_hint * n_notes_per_chunk);
+	prefix_sums.reserve((info.n_chunks_hint + 1) * n_notes_per_chunk);
+}
+
+
+void NotePyramid::writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t*, const uint8_t* notes)
+{
+	if (!notes) return;
+	if (first_chunk_index != this->n_chunks)
+	{
+		throw std::runtime_error("Chunks of a note stream are not consecutive");
+	}
+
+	// The pyramid is built chunk by chunk from 32-bit floats
+	if (stream_layout != NOTE_LAYOUT_CHUNK_MAJOR)
+	{
+		const size_t value_size = getNotePrecisionSize(stream_precision);
+		converted_notes.resize(n_chunks * n_notes_per_chunk * value_size);
+		convertNoteLayout(notes, stream_layout, converted_notes.data(), NOTE_LAYOUT_CHUNK_MAJOR, n_chunks, n_notes_per_chunk, value_size);
+		notes = converted_notes.data();
+	}
+	widened_notes.resize(n_chunks * n_notes_per_chunk);
+	widenNotes(notes, n_chunks * n_notes_per_chunk, stream_precision, widened_notes.data());
+
+	for (size_t i = 0; i < n_chunks; ++i)
+	{
+		appendChunk(widened_notes.data() + i * n_notes_per_chunk);
+	}
+}
+
+
+void NotePyramid::clear(const size_t n_notes_per_chunk)
+{
+	this->n_notes_per_chunk = n_notes_per_chunk;
+	n_chunks = 0;
+	max_levels.assign(1, std::vector<float>());
+	sum_levels.assign(1, std::vector<float>());
+	prefix_sums.assign(n_notes_per_chunk, 0.0);
+}
+
+
+void NotePyramid::appendChunk(const float* notes)
+{
+	max_levels[0].insert(max_levels[0].end(), notes, notes + n_notes_per_chunk);
+
+	const size_t prefix_offset = prefix_sums.size() - n_notes_per_chunk;
+	prefix_sums.resize(prefix_sums.size() + n_notes_per_chunk);
+	for (size_t note = 0; note < n_notes_per_chunk; ++note)
+	{
+		prefix_sums[prefix_offset + n_notes_per_chunk + note] = prefix_sums[prefix_offset + note] + notes[note];
+	}
+	++n_chunks;
+
+	// A chunk completes a span on every level at which its index is aligned
+	for (size_t level = 0; (n_chunks >> level) % 2 == 0; ++level)
+	{
+		mergeSpans(level);
+	}
+}
+
+
+void NotePyramid::mergeSpans(const size_t level)
+{
+	if (level + 1 == max_levels.size())
+	{
+		max_levels.push_back(std::vector<float>());
+		sum_levels.push_back(std::vector<float>());
+	}
+	const size_t index = (n_chunks >> level) - 2;
+	const float* max_a = getSpanMax(level, index);
+	const float* max_b = max_a + n_notes_per_chunk;
+	const float* sum_a = getSpanSum(level, index);
+	const float* sum_b = sum_a + n_notes_per_chunk;
+
+	std::vector<float>& max_output = max_levels[level + 1];
+	std::vector<float>& sum_output = sum_levels[level + 1];
+	const size_t offset = max_output.size();
+	max_output.resize(offset + n_notes_per_chunk);
+	sum_output.resize(offset + n_notes_per_chunk);
+	for (size_t note = 0; note < n_notes_per_chunk; ++note)
+	{
+		max_output[offset + note] = max_a[note] > max_b[note] ? max_a[note] : max_b[note];
+		sum_output[offset + note] = sum_a[note] + sum_b[note];
+	}
+}
+
+
+void NotePyramid::checkRange(const size_t first, const size_t last) const
+{
+	if (first >= last || last > n_chunks)
+	{
+		throw std::runtime_error("Range of chunks is empty or out of bounds");
+	}
+}
+
+
+void NotePyramid::getRangeSum(const size_t first, const size_t last, float* output) const
+{
+	checkRange(first, last);
+	const double* prefix_first = prefix_sums.data() + first * n_notes_per_chunk;
+	const double* prefix_last = prefix_sums.data() + last * n_notes_per_chunk;
+	for (size_t note = 0; note < n_notes_per_chunk; ++note)
+	{
+		output[note] = (float)(prefix_last[note] - prefix_first[note]);
+	}
+}
+
+
+void NotePyramid::getRangeMean(const size_t first, const size_t last, float* output) const
+{
+	getRangeSum(first, last, output);
+	const float scale = 1.0f / (last - first);
+	for (size_t note = 0; note < n_notes_per_chunk; ++note)
+	{
+		output[note] *= scale;
+	}
+}
+
+
+void NotePyramid::getRangeMax(const size_t first, const size_t last, float* output) const
+{
+	checkRange(first, last);
+	for (size_t note = 0; note < n_notes_per_chunk; ++note)
+	{
+		output[note] = -std::numeric_limits<float>::infinity();
+	}
+
+	// The spans grow towards the middle of the range and shrink towards its
+	// end, so there are at most two per level
+	size_t chunk = first;
+	while (chunk < last)
+	{
+		size_t level = 0;
+		while (level + 1 < max_levels.size() && chunk % ((size_t)2 << level) == 0 && chunk + ((size_t)2 << level) <= last)
+		{
+			++level;
+		}
+		const float* span_max = getSpanMax(level, chunk >> level);
+		for (size_t note = 0; note < n_notes_per_chunk; ++note)
+		{
+			output[note] = span_max[note] > output[note] ? span_max[note] : output[note];
+		}
+		chunk += (size_t)1 << level;
+	}
+}
+
+
+void NotePyramid::save(const std::string& fname) const
+{
+	std::ofstream ost(fname, std::ios::binary | std::ios::trunc);
+	if (!ost)
+	{
+		throw std::runtime_error("Could not open pyramid file '" + fname + "'");
+	}
+
+	PyramidFileHeader header = { PYRAMID_FILE_MAGIC, PYRAMID_FILE_VERSION, n_notes_per_chunk, n_chunks };
+	ost.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	for (size_t level = 0; level < max_levels.size(); ++level)
+	{
+		ost.write(reinterpret_cast<const char*>(max_levels[level].data()), max_levels[level].size() * sizeof(float));
+		ost.write(reinterpret_cast<const char*>(sum_levels[level].data()), sum_levels[level].size() * sizeof(float));
+	}
+	ost.write(reinterpret_cast<const char*>(prefix_sums.data()), prefix_sums.size() * sizeof(double));
+	if (!ost)
+	{
+		throw std::runtime_error("Could not write pyramid file '" + fname + "'");
+	}
+}
+
+
+void NotePyramid::load(const std::string& fname)
+{
+	std::ifstream ist(fname, std::ios::binary);
+	if (!ist)
+	{
+		throw std::runtime_error("Could not open pyramid file '" + fname + "'");
+	}
+
+	PyramidFileHeader header;
+	if (!ist.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != PYRAMID_FILE_MAGIC)
+	{
+		throw std::runtime_error("Invalid file format (pyramid file header)");
+	}
+	if (header.version != PYRAMID_FILE_VERSION)
+	{
+		throw std::runtime_error("Invalid file format (pyramid file version)");
+	}
+
+	// The sizes of the levels follow from the number of chunks
+	clear(header.n_notes_per_chunk);
+	n_chunks = header.n_chunks;
+	for (size_t level = 0; n_chunks >> level > 0; ++level)
+	{
+		if (level > 0)
+		{
+			max_levels.push_back(std::vector<float>());
+			sum_levels.push_back(std::vector<float>());
+		}
+		const size_t n_values = (n_chunks >> level) * n_notes_per_chunk;
+		max_levels[level].resize(n_values);
+		sum_levels[level].resize(level > 0 ? n_values : 0);
+		ist.read(reinterpret_cast<char*>(max_levels[level].data()), max_levels[level].size() * sizeof(float));
+		ist.read(reinterpret_cast<char*>(sum_levels[level].data()), sum_levels[level].size() * sizeof(float));
+	}
+	prefix_sums.resize((n_chunks + 1) * n_notes_per_chunk);
+	if (!ist.read(reinterpret_cast<char*>(prefix_sums.data()), prefix_sums.size() * sizeof(double)))
+	{
+		clear(n_notes_per_chunk);
+		throw std::runtime_error("Invalid file format (pyramid file truncated)");
+	}
+}
@@ -0,0 +1,231 @@
+#include "note_sink.h"
+
+#include "note_pyramid.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <vector>
+
+
+// "MFNP" in a little-endian file
+#define NOTE_FILE_MAGIC 0x504e464d
+#define NOTE_FILE_VERSION 1
+
+#define NOTE_FILE_BLOCK_NOTES 1
+#define NOTE_FILE_BLOCK_EVENTS 2
+#define NOTE_FILE_BLOCK_TIMESTAMPS 3
+
+
+/*! Header of a note file */
+struct NoteFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t base_note_id;
+	uint32_t precision;
+	uint32_t n_notes_per_chunk;
+	uint32_t layout;
+	uint64_t n_samples_per_second;
+	uint64_t n_samples_per_chunk;
+};
+
+
+/*! Header of a block of notes or events */
+struct NoteFileBlockHeader
+{
+	uint32_t type;
+	uint32_t count;
+	uint64_t first_chunk_index;
+};
+
+
+NoteFileSink::NoteFileSink(const std::string& fname) :
+	fname(fname),
+	ost(),
+	note_row_size(0),
+	pyramid(nullptr)
+{}
+
+
+NoteFileSink::~NoteFileSink()
+{
+	setPyramid(false);
+}
+
+
+void NoteFileSink::setPyramid(const bool enable)
+{
+	if (enable && !pyramid)
+	{
+		pyramid = new NotePyramid();
+	}
+	else if (!enable && pyramid)
+	{
+		delete pyramid;
+		pyramid = nullptr;
+	}
+}
+
+
+void NoteFileSink::begin(const NoteStreamInfo& info)
+{
+	// A pyramid of an earlier stream no longer matches the file
+	remove(NotePyramid::getFileName(fname).c_str());
+	if (pyramid)
+	{
+		pyramid->begin(info);
+	}
+
+	ost.open(fname, std::ios::binary | std::ios::trunc);
+	if (!ost)
+	{
+		throw std::runtime_error("Could not open note file '" + fname + "'");
+	}
+
+	NoteFileHeader header = { NOTE_FILE_MAGIC, NOTE_FILE_VERSION, info.base_note_id, (uint32_t)info.precision, (uint32_t)info.n_notes_per_chunk, (uint32_t)info.layout, info.n_samples_per_second, info.n_samples_per_chunk };
+	ost.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	note_row_size = info.n_notes_per_chunk * getNotePrecisionSize(info.precision);
+}
+
+
+void NoteFileSink::writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)
+{
+	if (n_chunks == 0) return;
+	writeBlockHeader(notes ? NOTE_FILE_BLOCK_NOTES : NOTE_FILE_BLOCK_TIMESTAMPS, n_chunks, first_chunk_index);
+	ost.write(reinterpret_cast<const char*>(timestamps), n_chunks * sizeof(uint64_t));
+	if (notes)
+	{
+		ost.write(reinterpret_cast<const char*>(notes), n_chunks * note_row_size);
+	}
+	if (pyramid)
+	{
+		pyramid->writeNotes(first_chunk_index, n_chunks, timestamps, notes);
+	}
+
+	// Every complete block is in the file even if the process stops
+	ost.flush();
+	if (!ost)
+	{
+		throw std::runtime_error("Could not write note file '" + fname + "'");
+	}
+}
+
+
+void NoteFileSink::writeEvents(const NoteEvent* events, const size_t n_events)
+{
+	if (n_events == 0) return;
+	writeBlockHeader(NOTE_FILE_BLOCK_EVENTS, n_events, events[0].chunk_index);
+	ost.write(reinterpret_cast<const char*>(events), n_events * sizeof(NoteEvent));
+	ost.flush();
+	if (!ost)
+	{
+		throw std::runtime_error("Could not write note file '" + fname + "'");
+	}
+}
+
+
+void NoteFileSink::end()
+{
+	ost.close();
+	if (pyramid)
+	{
+		pyramid->save(NotePyramid::getFileName(fname));
+	}
+}
+
+
+void NoteFileSink::writeBlockHeader(const uint32_t type, const uint32_t count, const uint64_t first_chunk_index)
+{
+	if (!ost.is_open())
+	{
+		throw std::runtime_error("Note file is not open");
+	}
+	NoteFileBlockHeader header = { type, count, first_chunk_index };
+	ost.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+
+void NoteFileSink::replay(const std::string& fname, NoteSink& sink)
+{
+	std::ifstream ist(fname, std::ios::binary);
+	if (!ist)
+	{
+		throw std::runtime_error("Could not open note file '" + fname + "'");
+	}
+
+	NoteFileHeader header;
+	if (!ist.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != NOTE_FILE_MAGIC)
+	{
+		throw std::runtime_error("Invalid file format (note file header)");
+	}
+	if (header.version != NOTE_FILE_VERSION || header.precision > NOTE_PRECISION_LOG8 || header.layout > NOTE_LAYOUT_TILED)
+	{
+		throw std::runtime_error("Invalid file format (note file version)");
+	}
+
+	NoteStreamInfo info = { header.base_note_id, (NotePrecision)header.precision, (NoteLayout)header.layout, header.n_notes_per_chunk, header.n_samples_per_second, (size_t)header.n_samples_per_chunk, 0 };
+	const size_t note_row_size = info.n_notes_per_chunk * getNotePrecisionSize(info.precision);
+	sink.begin(info);
+
+	// A block cut off at the end of the file is ignored
+	std::vector<uint64_t> timestamps;
+	std::vector<uint8_t> notes;
+	std::vector<NoteEvent> events;
+	NoteFileBlockHeader block;
+	while (ist.read(reinterpret_cast<char*>(&block), sizeof(block)))
+	{
+		if (block.type == NOTE_FILE_BLOCK_NOTES || block.type == NOTE_FILE_BLOCK_TIMESTAMPS)
+		{
+			const bool has_notes = block.type == NOTE_FILE_BLOCK_NOTES;
+			timestamps.resize(block.count);
+			notes.resize(has_notes ? block.count * note_row_size : 0);
+			if (!ist.read(reinterpret_cast<char*>(timestamps.data()), block.count * sizeof(uint64_t))) break;
+			if (!ist.read(reinterpret_cast<char*>(notes.data()), notes.size())) break;
+			sink.writeNotes(block.first_chunk_index, block.count, timestamps.data(), has_notes ? notes.data() : nullptr);
+		}
+		else if (block.type == NOTE_FILE_BLOCK_EVENTS)
+		{
+			events.resize(block.count);
+			if (!ist.read(reinterpret_cast<char*>(events.data()), block.count * sizeof(NoteEvent))) break;
+			sink.writeEvents(events.data(), block.count);
+		}
+		else
+		{
+			throw std::runtime_error("Invalid file format (note file block)");
+		}
+	}
+
+	sink.end();
+}
+
+
+NoteCallbackSink::NoteCallbackSink(const NotesCallback& on_notes, const EventsCallback& on_events, const NoteLayout layout) :
+	on_notes(on_notes),
+	on_events(on_events),
+	layout(layout),
+	info()
+{}
+
+
+void NoteCallbackSink::begin(const NoteStreamInfo& info)
+{
+	this->info = info;
+}
+
+
+void NoteCallbackSink::writeNotes(const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)
+{
+	if (on_notes)
+	{
+		on_notes(info, first_chunk_index, n_chunks, timestamps, notes);
+	}
+}
+
+
+void NoteCallbackSink::writeEvents(const NoteEvent* events, const size_t n_events)
+{
+	if (on_events)
+	{
+		on_events(info, events, n_events);
+	}
+}
@@ -1,9 +1,13 @@
 #include "opencl_context.h"
 
+#include "embedded_kernels.h"
+
 #include <boost/filesystem.hpp>
+#include <cstdlib>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
 #include <string.h>
 
@@ -16,10 +20,76 @@ void checkError(cl_int err, const char * message) {
 }
 
 
-OpenCLDevice::OpenCLDevice(const cl_device_id device_id, cl_context ctx) :
+DeviceSelection DeviceSelection::getDefault()
+{
+    return { "", "", CL_DEVICE_TYPE_ALL, DEVICE_PARTITION_NONE, 0 };
+}
+
+
+DeviceSelection DeviceSelection::parse(const std::string& platform_name, const std::string& device_name, const std::string& device_type, const std::string& partition)
+{
+    DeviceSelection selection = getDefault();
+    selection.platform_name = platform_name;
+    selection.device_name = device_name;
+
+    if (device_type == "gpu")
+    {
+        selection.device_type = CL_DEVICE_TYPE_GPU;
+    }
+    else if (device_type == "cpu")
+    {
+        selection.device_type = CL_DEVICE_TYPE_CPU;
+    }
+    else if (device_type == "accelerator")
+    {
+        selection.device_type = CL_DEVICE_TYPE_ACCELERATOR;
+    }
+    else if (!device_type.empty() && device_type != "all")
+    {
+        throw std::runtime_error("Unknown OpenCL device type '" + device_type + "'");
+    }
+
+    if (partition == "numa")
+    {
+        selection.partition = DEVICE_PARTITION_NUMA;
+    }
+    else if (partition.compare(0, 6, "cores:") == 0)
+    {
+        char* end = nullptr;
+        const unsigned long units = strtoul(partition.c_str() + 6, &end, 10);
+        if (end == partition.c_str() + 6 || *end != '\0' || units == 0)
+        {
+            throw std::runtime_error("Invalid number of cores in the partition '" + partition + "'");
+        }
+        selection.partition = DEVICE_PARTITION_CORES;
+        selection.partition_units = (cl_uint)units;
+    }
+    else if (!partition.empty() && partition != "none")
+    {
+        throw std::runtime_error("Unknown OpenCL device partition '" + partition + "'");
+    }
+
+    return selection;
+}
+
+
+DeviceSelection DeviceSelection::fromEnvironment()
+{
+    const char* platform_name = getenv("MUSICALFFT_PLATFORM");
+    const char* device_name = getenv("MUSICALFFT_DEVICE");
+    const char* device_type = getenv("MUSICALFFT_DEVICE_TYPE");
+    const char* partition = getenv("MUSICALFFT_PARTITION");
+    return parse(platform_name ? platform_name : "", device_name ? device_name : "", device_type ? device_type : "", partition ? partition : "");
+}
+
+
+OpenCLDevice::OpenCLDevice(const cl_device_id device_id, cl_context ctx, const bool is_sub_device) :
     device(device_id),
     ctx(ctx),
-    cmdq(nullptr)
+    is_sub_device(is_sub_device),
+    cmdq(nullptr),
+    queue_pool(),
+    queue_pool_mutex()
 {
     cl_int err = 0;
     cmdq = clCreateCommandQueueWithProperties(ctx, device_id, nullptr, &err);
@@ -29,7 +99,59 @@ OpenCLDevice::OpenCLDevice(const cl_device_id device_id, cl_context ctx) :
 
 OpenCLDevice::~OpenCLDevice()
 {
-    // TODO: address release
+    for (std::vector<PooledQueue>::iterator it = queue_pool.begin(); it != queue_pool.end(); ++it)
+    {
+        clReleaseCommandQueue(it->queue);
+    }
+    queue_pool.clear();
+    if (cmdq)
+    {
+        clReleaseCommandQueue(cmdq);
+        cmdq = nullptr;
+    }
+    if (is_sub_device)
+    {
+        clReleaseDevice(device);
+    }
+}
+
+
+cl_command_queue OpenCLDevice::acquireCommandQueue(const bool out_of_order)
+{
+    std::lock_guard<std::mutex> lock(queue_pool_mutex);
+    for (std::vector<PooledQueue>::iterator it = queue_pool.begin(); it != queue_pool.end(); ++it)
+    {
+        if (!it->in_use && it->out_of_order == out_of_order)
+        {
+            it->in_use = true;
+            return it->queue;
+        }
+    }
+
+    cl_int err = 0;
+    const cl_queue_properties properties[] = {
+        CL_QUEUE_PROPERTIES, (cl_queue_properties)(out_of_order ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0),
+        0
+    };
+    cl_command_queue queue = clCreateCommandQueueWithProperties(ctx, device, properties, &err);
+    checkError(err, "clCreateCommandQueueWithProperties");
+    queue_pool.push_back({ queue, out_of_order, true });
+    return queue;
+}
+
+
+void OpenCLDevice::returnCommandQueue(cl_command_queue queue)
+{
+    std::lock_guard<std::mutex> lock(queue_pool_mutex);
+    for (std::vector<PooledQueue>::iterator it = queue_pool.begin(); it != queue_pool.end(); ++it)
+    {
+        if (it->queue == queue)
+        {
+            it->in_use = false;
+            return;
+        }
+    }
+    throw std::runtime_error("Command queue does not belong to the device");
 }
 
 
@@ -57,16 +179,147 @@ uint32_t OpenCLDevice::getMaxComputeUnits()
 }
 
 
-OpenCLContext::OpenCLContext() :
+std::string OpenCLDevice::getName() const
+{
+    size_t n_written = 0;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, 0, nullptr, &n_written);
+    std::string result(n_written, '\0');
+    clGetDeviceInfo(device, CL_DEVICE_NAME, n_written, &result[0], nullptr);
+    return result.c_str();
+}
+
+
+cl_device_type OpenCLDevice::getType() const
+{
+    cl_device_type result = 0;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &result, nullptr);
+    return result;
+}
+
+
+/*! Name of a platform */
+static std::string getPlatformName(cl_platform_id platform)
+{
+    size_t n_written = 0;
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, 0, nullptr, &n_written);
+    std::string result(n_written, '\0');
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, n_written, &result[0], nullptr);
+    return result.c_str();
+}
+
+
+/*! Devices of a type on a platform whose names contain a substring */
+static std::vector<cl_device_id> getMatchingDevices(cl_platform_id platform, const cl_device_type device_type, const std::string& device_name)
+{
+    // A platform without devices of the type is not an error
+    cl_uint n_all = 0;
+    cl_int err = clGetDeviceIDs(platform, device_type, 0, nullptr, &n_all);
+    if (err == CL_DEVICE_NOT_FOUND || n_all == 0)
+    {
+        return std::vector<cl_device_id>();
+    }
+    checkError(err, "clGetDeviceIDs");
+
+    std::vector<cl_device_id> all(n_all, nullptr);
+    err = clGetDeviceIDs(platform, device_type, n_all, all.data(), nullptr);
+    checkError(err, "clGetDeviceIDs");
+
+    std::vector<cl_device_id> result;
+    for (cl_uint i = 0; i < n_all; ++i)
+    {
+        size_t n_written = 0;
+        clGetDeviceInfo(all[i], CL_DEVICE_NAME, 0, nullptr, &n_written);
+        std::string name(n_written, '\0');
+        clGetDeviceInfo(all[i], CL_DEVICE_NAME, n_written, &name[0], nullptr);
+        if (name.find(device_name) != std::string::npos)
+        {
+            result.push_back(all[i]);
+        }
+    }
+    return result;
+}
+
+
+/*! Selection of the context of the process and whether it was created */
+static std::mutex instance_mutex;
+static bool instance_created = false;
+static bool has_instance_selection = false;
+static DeviceSelection instance_selection;
+
+
+OpenCLContext* OpenCLContext::getInstance()
+{
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    instance_created = true;
+    static OpenCLContext instance(has_instance_selection ? instance_selection : DeviceSelection::fromEnvironment());
+    return &instance;
+}
+
+
+void OpenCLContext::setDeviceSelection(const DeviceSelection& selection)
+{
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    if (instance_created)
+    {
+        throw std::runtime_error("The devices of the OpenCL context are already chosen");
+    }
+    instance_selection = selection;
+    has_instance_selection = true;
+}
+
+
+std::vector<cl_device_id> OpenCLContext::partitionDevice(cl_device_id device, const DeviceSelection& selection, bool* is_partitioned)
+{
+    *is_partitioned = false;
+    cl_device_type device_type = 0;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, nullptr);
+    if (selection.partition == DEVICE_PARTITION_NONE || !(device_type & CL_DEVICE_TYPE_CPU))
+    {
+        return std::vector<cl_device_id>(1, device);
+    }
+
+    cl_device_partition_property properties[3] = { 0, 0, 0 };
+    if (selection.partition == DEVICE_PARTITION_NUMA)
+    {
+        properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+        properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+    }
+    else
+    {
+        properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+        properties[1] = selection.partition_units;
+    }
+
+    // A device that cannot be partitioned this way is used whole
+    cl_uint n_sub_devices = 0;
+    cl_int err = clCreateSubDevices(device, properties, 0, nullptr, &n_sub_devices);
+    if (err != CL_SUCCESS || n_sub_devices == 0)
+    {
+        std::cerr << "OpenCL device cannot be partitioned (" << err << "), using the whole device" << std::endl;
+        return std::vector<cl_device_id>(1, device);
+    }
+
+    std::vector<cl_device_id> sub_devices(n_sub_devices, nullptr);
+    err = clCreateSubDevices(device, properties, n_sub_devices, sub_devices.data(), nullptr);
+    checkError(err, "clCreateSubDevices");
+    *is_partitioned = true;
+    return sub_devices;
+}
+
+
+OpenCLContext::OpenCLContext(const DeviceSelection& selection) :
     ctx(nullptr),
     devices(),
     n_devices(0),
-    device_ids(nullptr)
+    device_ids(nullptr),
+    programs(),
+    n_program_builds(0),
+    programs_mutex()
 {
     cl_int err = 0;
 
 
-    // Get a list of OpenCL platforms and choose one
+    // Get a list of OpenCL platforms
     cl_uint n_platforms = 0;
     err = clGetPlatformIDs(0, nullptr, &n_platforms);
     checkError(err, "clGetPlatformIDs");
@@ -75,28 +328,46 @@ OpenCLContext::OpenCLContext() :
         throw std::runtime_error("There are no OpenCL platforms");
     }
 
-    cl_platform_id* platform_ids = new cl_platform_id[n_platforms];
-    memset(platform_ids, 0, n_platforms * sizeof(cl_platform_id));
-    err = clGetPlatformIDs(n_platforms, platform_ids, nullptr);
+    std::vector<cl_platform_id> platform_ids(n_platforms, nullptr);
+    err = clGetPlatformIDs(n_platforms, platform_ids.data(), nullptr);
     checkError(err, "clGetPlatformIDs");
 
-    cl_platform_id platform = platform_ids[0];
-    delete[] platform_ids;
-    platform_ids = nullptr;
 
+    // Take all matching devices of the most preferred type present on a
+    // matching platform
+    const cl_device_type preferred_types[] = { CL_DEVICE_TYPE_GPU, CL_DEVICE_TYPE_ACCELERATOR, CL_DEVICE_TYPE_CPU };
+    cl_platform_id platform = nullptr;
+    std::vector<cl_device_id> root_ids;
+    for (size_t i = 0; i < 3 && root_ids.empty(); ++i)
+    {
+        if (!(selection.device_type & preferred_types[i])) continue;
+        for (cl_uint j = 0; j < n_platforms && root_ids.empty(); ++j)
+        {
+            if (getPlatformName(platform_ids[j]).find(selection.platform_name) == std::string::npos) continue;
+            root_ids = getMatchingDevices(platform_ids[j], preferred_types[i], selection.device_name);
+            platform = platform_ids[j];
+        }
+    }
+    if (root_ids.empty())
+    {
+        throw std::runtime_error("There are no OpenCL devices matching the selection");
+    }
 
-    // Get a list of GPU devices
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, nullptr, &n_devices);
-    checkError(err, "clGetDeviceIDs");
-    if (n_devices == 0)
+
+    // Split CPU devices into sub-devices
+    std::vector<cl_device_id> ids;
+    std::vector<bool> is_sub_device;
+    for (std::vector<cl_device_id>::iterator it = root_ids.begin(); it != root_ids.end(); ++it)
     {
-        throw std::runtime_error("There are no OpenCL GPU devices");
+        bool is_partitioned = false;
+        std::vector<cl_device_id> parts = partitionDevice(*it, selection, &is_partitioned);
+        ids.insert(ids.end(), parts.begin(), parts.end());
+        is_sub_device.resize(ids.size(), is_partitioned);
     }
 
+    n_devices = (cl_uint)ids.size();
     device_ids = new cl_device_id[n_devices];
-    memset(device_ids, 0, n_devices * sizeof(cl_device_id));
-    err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, n_devices, device_ids, nullptr);
-    checkError(err, "clGetDeviceIDs");
+    memcpy(device_ids, ids.data(), n_devices * sizeof(cl_device_id));
 
 
     // Create an OpenCL context
@@ -111,18 +382,66 @@ OpenCLContext::OpenCLContext() :
     // Create a queue for each device
     for (cl_uint i = 0; i < n_devices; ++i)
     {
-        devices.push_back(new OpenCLDevice(device_ids[i], ctx));
+        devices.push_back(new OpenCLDevice(device_ids[i], ctx, is_sub_device[i]));
     }
 }
 
 
 OpenCLContext::~OpenCLContext()
 {
+    releasePrograms();
     for (std::vector<OpenCLDevice*>::iterator it = devices.begin(); it < devices.end(); ++it)
     {
         delete *it;
         *it = nullptr;
     }
+    if (ctx)
+    {
+        clReleaseContext(ctx);
+        ctx = nullptr;
+    }
+    delete[] device_ids;
+    device_ids = nullptr;
+}
+
+
+OpenCLDevice* OpenCLContext::getDevice(const size_t index) const
+{
+    if (index >= devices.size())
+    {
+        throw std::runtime_error("Invalid index of an OpenCL device");
+    }
+    return devices[index];
+}
+
+
+size_t OpenCLContext::getNumPrograms() const
+{
+    std::lock_guard<std::mutex> lock(programs_mutex);
+    return programs.size();
+}
+
+
+void OpenCLContext::releasePrograms()
+{
+    std::map<ProgramKey, ProgramEntry> released;
+    {
+        std::lock_guard<std::mutex> lock(programs_mutex);
+        released.swap(programs);
+    }
+
+    // Programs that are still building are released once they are built
+    for (std::map<ProgramKey, ProgramEntry>::iterator it = released.begin(); it != released.end(); ++it)
+    {
+        try
+        {
+            clReleaseProgram(it->second.program.get());
+        }
+        catch (const std::exception&)
+        {
+            // The build failed; there is nothing to release
+        }
+    }
 }
 
 
@@ -165,6 +484,11 @@ cl_kernel OpenCLContext::createKernel(const std::string& kernel_name, const std:
             // Go with the cached version
             return loadKernelFromBinary(kernel_name, cached_path.string());
         }
+        else if (getEmbeddedKernelSource(src_path.filename().string()))
+        {
+            // Fall back to the source built into the library
+            return createEmbeddedKernel(kernel_name, src_path.filename().string(), compiler_options);
+        }
         else
         {
             // Neither option is available
@@ -174,43 +498,34 @@ cl_kernel OpenCLContext::createKernel(const std::string& kernel_name, const std:
 }
 
 
+cl_kernel OpenCLContext::createEmbeddedKernel(const std::string& kernel_name, const std::string& file_name, const std::string& compiler_options)
+{
+    const char* src = getEmbeddedKernelSource(file_name);
+    if (!src)
+    {
+        throw std::runtime_error("The kernel source '" + file_name + "' is not embedded in the library");
+    }
+
+    // Embedded and read sources of the same text share a program
+    cl_int err = 0;
+    cl_program program = getProgram({ false, src, compiler_options });
+    cl_kernel kernel = clCreateKernel(program, kernel_name.c_str(), &err);
+    checkError(err, "clCreateKernel");
+
+    return kernel;
+}
+
+
 cl_kernel OpenCLContext::compileKernelFromSource(const std::string& kernel_name, const std::string& file_path, const std::string& compiler_options)
 {
     cl_int err = 0;
-    
+
     // Read file
     std::ifstream ist(file_path);
     std::string src((std::istreambuf_iterator<char>(ist)), std::istreambuf_iterator<char>());
-    
-    // Create program
-    const char* srcs[1] = { src.c_str() };
-    const size_t lengths[1] = { src.length() };
-    cl_program program = clCreateProgramWithSource(ctx, 1, srcs, lengths, &err);
-    checkError(err, "clCreateProgramWithSource");
-
-    // Compile program
-    err = clBuildProgram(program, n_devices, device_ids, compiler_options.c_str(), NULL, NULL);
-    try
-    {
-        checkError(err, "clBuildProgram");
-    }
-    catch (std::runtime_error e)
-    {
-        if (err == CL_BUILD_PROGRAM_FAILURE)
-        {
-            cl_ulong n_written = 0;
-            clGetProgramBuildInfo(program, device_ids[0], CL_PROGRAM_BUILD_LOG, 0, nullptr, &n_written);
-
-            char* buffer = new char[n_written + 5];
-            clGetProgramBuildInfo(program, device_ids[0], CL_PROGRAM_BUILD_LOG, n_written + 5, buffer, nullptr);
-            std::cerr << "Program build info:" << std::endl << buffer << std::endl;
-            delete[] buffer;
 
-            throw std::runtime_error("Program build failed");
-        }
-    }
-    
-    // Create kernel
+    // Create kernel from the program of this source and options
+    cl_program program = getProgram({ false, src, compiler_options });
     cl_kernel kernel = clCreateKernel(program, kernel_name.c_str(), &err);
     checkError(err, "clCreateKernel");
 
@@ -223,18 +538,102 @@ cl_kernel OpenCLContext::loadKernelFromBinary(const std::string& kernel_name, co
     cl_int err = 0;
 
     // Read file
-    std::ifstream ist(file_path);
+    std::ifstream ist(file_path, std::ios::binary);
     std::string binary((std::istreambuf_iterator<char>(ist)), std::istreambuf_iterator<char>());
 
-    // Create the program
-    const unsigned char* binaries[1] = { reinterpret_cast<const unsigned char*>(binary.c_str()) };
-    const size_t lengths[1] = { binary.length() };
-    cl_program program = clCreateProgramWithBinary(ctx, n_devices, device_ids, lengths, binaries, nullptr, &err);
-    checkError(err, "clCreateProgramWithBinary");
-
-    // Create kernel
+    // Create kernel from the program of this binary
+    cl_program program = getProgram({ true, binary, "" });
     cl_kernel kernel = clCreateKernel(program, kernel_name.c_str(), &err);
     checkError(err, "clCreateKernel");
 
     return kernel;
-}
\ No newline at end of file
+}
+
+
+cl_program OpenCLContext::getProgram(const ProgramKey& key)
+{
+    std::promise<cl_program> promise;
+    uint64_t build_id = 0;
+    {
+        std::unique_lock<std::mutex> lock(programs_mutex);
+        std::map<ProgramKey, ProgramEntry>::iterator it = programs.find(key);
+        if (it != programs.end())
+        {
+            // Wait for the build of another thread without the lock
+            std::shared_future<cl_program> program = it->second.program;
+            lock.unlock();
+            return program.get();
+        }
+
+        // Other threads that need the program wait for this build
+        build_id = ++n_program_builds;
+        programs[key] = { build_id, promise.get_future().share() };
+    }
+
+    try
+    {
+        cl_program program = buildProgram(key);
+        promise.set_value(program);
+        return program;
+    }
+    catch (...)
+    {
+        // Drop the entry, so the next caller tries again, unless the
+        // registry was released in the meantime
+        {
+            std::lock_guard<std::mutex> lock(programs_mutex);
+            std::map<ProgramKey, ProgramEntry>::iterator it = programs.find(key);
+            if (it != programs.end() && it->second.build_id == build_id)
+            {
+                programs.erase(it);
+            }
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+
+cl_program OpenCLContext::buildProgram(const ProgramKey& key)
+{
+    cl_int err = 0;
+    cl_program program = nullptr;
+    if (key.is_binary)
+    {
+        // Create the program; every device gets the same binary
+        std::vector<const unsigned char*> binaries(n_devices, reinterpret_cast<const unsigned char*>(key.content.c_str()));
+        std::vector<size_t> lengths(n_devices, key.content.length());
+        program = clCreateProgramWithBinary(ctx, n_devices, device_ids, lengths.data(), binaries.data(), nullptr, &err);
+        checkError(err, "clCreateProgramWithBinary");
+    }
+    else
+    {
+        // Create program
+        const char* srcs[1] = { key.content.c_str() };
+        const size_t lengths[1] = { key.content.length() };
+        program = clCreateProgramWithSource(ctx, 1, srcs, lengths, &err);
+        checkError(err, "clCreateProgramWithSource");
+    }
+
+    // Compile program; binaries still need to be built for the devices
+    err = clBuildProgram(program, n_devices, device_ids, key.compiler_options.c_str(), NULL, NULL);
+    if (err == CL_BUILD_PROGRAM_FAILURE)
+    {
+        size_t n_written = 0;
+        clGetProgramBuildInfo(program, device_ids[0], CL_PROGRAM_BUILD_LOG, 0, nullptr, &n_written);
+
+        char* buffer = new char[n_written + 5];
+        clGetProgramBuildInfo(program, device_ids[0], CL_PROGRAM_BUILD_LOG, n_written + 5, buffer, nullptr);
+        std::cerr << "Program build info:" << std::endl << buffer << std::endl;
+        delete[] buffer;
+
+        clReleaseProgram(program);
+        throw std::runtime_error("Program build failed");
+    }
+    else if (err != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        checkError(err, "clBuildProgram");
+    }
+    return program;
+}
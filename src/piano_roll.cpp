@@ -0,0 +1,231 @@
+#include "piano_roll.h"
+
+#include "simd.h"
+
+#include <math.h>
+#include <stdexcept>
+#include <thread>
+
+
+PianoRoll::PianoRoll(const MidiFile& midi, const NoteProfile& profile) :
+	base_note_id(profile.getBaseNoteId()),
+	n_notes_per_frame(profile.getNotesPerChunk()),
+	n_frames(profile.getNumChunks()),
+	roll()
+{
+	// Timestamps of a profile are uniformly spaced
+	const double samples_per_second = profile.getSamplesPerSecond();
+	if (samples_per_second == 0 && n_frames > 0)
+	{
+		throw std::runtime_error("Note profile has no sample rate");
+	}
+	const double first_frame_seconds = n_frames ? profile.getTimestampByIndex(0) / samples_per_second : 0;
+	const double seconds_per_frame = n_frames ? profile.getSamplesPerChunk() / samples_per_second : 1;
+	rasterize(midi, first_frame_seconds, seconds_per_frame);
+}
+
+
+PianoRoll::PianoRoll(const MidiFile& midi, const int32_t base_note_id, const size_t n_notes_per_frame, const double first_frame_seconds, const double seconds_per_frame, const size_t n_frames) :
+	base_note_id(base_note_id),
+	n_notes_per_frame(n_notes_per_frame),
+	n_frames(n_frames),
+	roll()
+{
+	if (seconds_per_frame <= 0)
+	{
+		throw std::runtime_error("Frames must be spaced by a positive time");
+	}
+	rasterize(midi, first_frame_seconds, seconds_per_frame);
+}
+
+
+void PianoRoll::rasterize(const MidiFile& midi, const double first_frame_seconds, const double seconds_per_frame)
+{
+	roll.assign(n_frames * n_notes_per_frame, 0);
+
+	// Overlapping note ons of the same note are counted so the note ends with
+	// the last matching note off
+	std::vector<uint32_t> n_active(128, 0);
+	std::vector<size_t> start_frame(128, 0);
+
+	const std::vector<MidiFile::NoteMessage>& msgs = midi.getMessages();
+	for (std::vector<MidiFile::NoteMessage>::const_iterator it = msgs.begin(); it != msgs.end(); ++it)
+	{
+		const int32_t note = (int32_t)it->note - base_note_id;
+		if (note < 0 || note >= (int32_t)n_notes_per_frame) continue;
+
+		const size_t frame = getFrameAtTime(midi.ticksToSeconds(it->abs_time), first_frame_seconds, seconds_per_frame);
+		if (it->is_note_on)
+		{
+			if (n_active[it->note]++ == 0)
+			{
+				start_frame[it->note] = frame;
+			}
+		}
+		else if (n_active[it->note] > 0 && --n_active[it->note] == 0)
+		{
+			for (size_t i = start_frame[it->note]; i < frame; ++i)
+			{
+				roll[i * n_notes_per_frame + note] = 1;
+			}
+		}
+	}
+
+	// Notes without a note off last until the end
+	for (int32_t midi_note = 0; midi_note < 128; ++midi_note)
+	{
+		const int32_t note = midi_note - base_note_id;
+		if (n_active[midi_note] == 0 || note < 0 || note >= (int32_t)n_notes_per_frame) continue;
+		for (size_t i = start_frame[midi_note]; i < n_frames; ++i)
+		{
+			roll[i * n_notes_per_frame + note] = 1;
+		}
+	}
+}
+
+
+size_t PianoRoll::getFrameAtTime(const double seconds, const double first_frame_seconds, const double seconds_per_frame) const
+{
+	const double frame = ceil((seconds - first_frame_seconds) / seconds_per_frame);
+	if (frame <= 0) return 0;
+	else if (frame >= n_frames) return n_frames;
+	else return (size_t)frame;
+}
+
+
+/*! Number of frames after which the per-lane counts are flushed so they
+ *  cannot overflow
+ */
+#define SCORE_FLUSH_FRAMES (1 << 16)
+
+
+/*! Score a range of frames; notes are vectorized within a frame and every
+ *  threshold is evaluated on the same loaded vector
+ */
+static void scoreFrames(const NoteProfile* profile, const float* notes, const uint8_t* roll, const size_t begin, const size_t end, const size_t n_notes_per_frame, const std::vector<float>* thresholds, std::vector<TranscriptionScore>* output)
+{
+	const size_t n_thresholds = thresholds->size();
+	const size_t n_padded = simdPadded(n_notes_per_frame);
+
+	// Padding never counts as a detection or a reference note
+	std::vector<float> frame(n_padded, -INFINITY);
+	std::vector<int32_t> reference(n_padded, 0);
+
+	// Per-lane counts of each threshold
+	std::vector<int32_t> true_positives(n_thresholds * SIMD_WIDTH, 0);
+	std::vector<int32_t> detected(n_thresholds * SIMD_WIDTH, 0);
+	simd_int positives = simdBroadcast((int32_t)0);
+	uint64_t total_positives = 0;
+
+	output->assign(n_thresholds, TranscriptionScore());
+	std::vector<uint64_t> total_true_positives(n_thresholds, 0);
+	std::vector<uint64_t> total_detected(n_thresholds, 0);
+
+	for (size_t f = begin; f < end; ++f)
+	{
+		if (profile)
+		{
+			profile->readNotesByIndex(f, frame.data());
+		}
+		else
+		{
+			memcpy(frame.data(), notes + f * n_notes_per_frame, n_notes_per_frame * sizeof(float));
+		}
+		const uint8_t* roll_frame = roll + f * n_notes_per_frame;
+		for (size_t i = 0; i < n_notes_per_frame; ++i)
+		{
+			reference[i] = roll_frame[i];
+		}
+
+		for (size_t k = 0; k < n_padded; k += SIMD_WIDTH)
+		{
+			const simd_float power = simdLoad(frame.data() + k);
+			const simd_int active = simdLoad(reference.data() + k);
+			positives += active;
+
+			for (size_t t = 0; t < n_thresholds; ++t)
+			{
+				// Comparisons produce -1 for true and 0 for false
+				const simd_int is_detected = power > simdBroadcast((*thresholds)[t]);
+				int32_t* tp = true_positives.data() + t * SIMD_WIDTH;
+				int32_t* dt = detected.data() + t * SIMD_WIDTH;
+				simdStore(tp, simdLoad(tp) + (is_detected & active));
+				simdStore(dt, simdLoad(dt) - is_detected);
+			}
+		}
+
+		// Flush the lanes into 64-bit totals
+		if ((f - begin + 1) % SCORE_FLUSH_FRAMES == 0 || f + 1 == end)
+		{
+			total_positives += simdSum(positives);
+			positives = simdBroadcast((int32_t)0);
+			for (size_t t = 0; t < n_thresholds; ++t)
+			{
+				int32_t* tp = true_positives.data() + t * SIMD_WIDTH;
+				int32_t* dt = detected.data() + t * SIMD_WIDTH;
+				total_true_positives[t] += simdSum(simdLoad(tp));
+				total_detected[t] += simdSum(simdLoad(dt));
+				simdStore(tp, simdBroadcast((int32_t)0));
+				simdStore(dt, simdBroadcast((int32_t)0));
+			}
+		}
+	}
+
+	for (size_t t = 0; t < n_thresholds; ++t)
+	{
+		(*output)[t].true_positives = total_true_positives[t];
+		(*output)[t].false_positives = total_detected[t] - total_true_positives[t];
+		(*output)[t].false_negatives = total_positives - total_true_positives[t];
+	}
+}
+
+
+/*! Split the frames among threads and add up the scores */
+static std::vector<TranscriptionScore> scoreInParallel(const NoteProfile* profile, const float* notes, const uint8_t* roll, const size_t n_frames, const size_t n_notes_per_frame, const std::vector<float>& thresholds, size_t n_threads)
+{
+	if (n_threads == 0)
+	{
+		n_threads = std::thread::hardware_concurrency();
+	}
+	if (n_threads == 0) n_threads = 1;
+	if (n_threads > n_frames) n_threads = n_frames ? n_frames : 1;
+
+	std::vector<std::vector<TranscriptionScore> > partial_scores(n_threads);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		const size_t begin = n_frames * i / n_threads;
+		const size_t end = n_frames * (i + 1) / n_threads;
+		threads.push_back(std::thread(scoreFrames, profile, notes, roll, begin, end, n_notes_per_frame, &thresholds, &partial_scores[i]));
+	}
+
+	std::vector<TranscriptionScore> output(thresholds.size(), TranscriptionScore());
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		threads[i].join();
+		for (size_t t = 0; t < thresholds.size(); ++t)
+		{
+			output[t].true_positives += partial_scores[i][t].true_positives;
+			output[t].false_positives += partial_scores[i][t].false_positives;
+			output[t].false_negatives += partial_scores[i][t].false_negatives;
+		}
+	}
+	return output;
+}
+
+
+std::vector<TranscriptionScore> scoreTranscription(const float* notes, const uint8_t* roll, const size_t n_frames, const size_t n_notes_per_frame, const std::vector<float>& thresholds, const size_t n_threads)
+{
+	return scoreInParallel(nullptr, notes, roll, n_frames, n_notes_per_frame, thresholds, n_threads);
+}
+
+
+std::vector<TranscriptionScore> scoreTranscription(const NoteProfile& profile, const PianoRoll& roll, const std::vector<float>& thresholds, const size_t n_threads)
+{
+	if (profile.getNotesPerChunk() != roll.getNotesPerFrame() || profile.getBaseNoteId() != roll.getBaseNoteId())
+	{
+		throw std::runtime_error("Piano roll does not match the note profile");
+	}
+	const size_t n_frames = profile.getNumChunks() < roll.getNumFrames() ? profile.getNumChunks() : roll.getNumFrames();
+	return scoreInParallel(&profile, nullptr, roll.getFrameByIndex(0), n_frames, roll.getNotesPerFrame(), thresholds, n_threads);
+}
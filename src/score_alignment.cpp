@@ -0,0 +1,348 @@
+#include "score_alignment.h"
+
+#include "piano_roll.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdexcept>
+
+
+// Sequences of at most this many frames are aligned without a coarser level
+#define ALIGNMENT_MIN_MULTI_SCALE_FRAMES 64
+
+
+/*! Window of profile chunks [first, last) that a score frame may align with;
+ *  both bounds are non-decreasing from frame to frame
+ */
+struct AlignmentBand
+{
+	std::vector<size_t> first;
+	std::vector<size_t> last;
+};
+
+
+AlignmentParams AlignmentParams::getDefault()
+{
+	AlignmentParams params;
+	params.constraint = ALIGNMENT_MULTI_SCALE;
+	params.radius = 32;
+	params.seconds_per_frame = 0;
+	return params;
+}
+
+
+/*! Band around the line from the first to the last pair of frames; a row
+ *  reaches the center of the next row, so the band stays connected for any
+ *  ratio of the lengths
+ */
+static AlignmentBand getSakoeChibaBand(const size_t n_score, const size_t n_profile, const size_t radius)
+{
+	AlignmentBand band;
+	band.first.resize(n_score);
+	band.last.resize(n_score);
+	const double slope = n_score > 1 ? (double)(n_profile - 1) / (n_score - 1) : 0;
+	for (size_t i = 0; i < n_score; ++i)
+	{
+		const size_t center = (size_t)floor(i * slope);
+		const size_t next_center = i + 1 < n_score ? (size_t)ceil((i + 1) * slope) : n_profile - 1;
+		band.first[i] = center > radius ? center - radius : 0;
+		band.last[i] = std::min(n_profile, next_center + radius + 1);
+	}
+	band.last[n_score - 1] = n_profile;
+	return band;
+}
+
+
+/*! Band around a path at half the frame rate in both sequences */
+static AlignmentBand projectPath(const std::vector<AlignmentStep>& coarse_path, const size_t n_score, const size_t n_profile, const size_t radius)
+{
+	AlignmentBand band;
+	band.first.assign(n_score, n_profile);
+	band.last.assign(n_score, 0);
+	for (size_t s = 0; s < coarse_path.size(); ++s)
+	{
+		const size_t first_chunk = 2 * (size_t)coarse_path[s].profile_chunk;
+		const size_t last_chunk = std::min(first_chunk + 2, n_profile);
+		for (size_t i = 2 * (size_t)coarse_path[s].score_frame; i < 2 * (size_t)coarse_path[s].score_frame + 2 && i < n_score; ++i)
+		{
+			band.first[i] = std::min(band.first[i], first_chunk);
+			band.last[i] = std::max(band.last[i], last_chunk);
+		}
+	}
+
+	// Widen by the radius, then make both bounds non-decreasing
+	for (size_t i = 0; i < n_score; ++i)
+	{
+		band.first[i] = band.first[i] > radius ? band.first[i] - radius : 0;
+		band.last[i] = std::min(n_profile, band.last[i] + radius);
+	}
+	for (size_t i = n_score - 1; i > 0; --i)
+	{
+		band.first[i - 1] = std::min(band.first[i - 1], band.first[i]);
+	}
+	for (size_t i = 1; i < n_score; ++i)
+	{
+		band.last[i] = std::max(band.last[i], band.last[i - 1]);
+	}
+	band.first[0] = 0;
+	band.last[n_score - 1] = n_profile;
+	return band;
+}
+
+
+/*! Average pairs of consecutive vectors */
+static std::vector<float> halveSequence(const float* features, const size_t n_frames, const size_t n_dims)
+{
+	const size_t n_half = (n_frames + 1) / 2;
+	std::vector<float> output(n_half * n_dims, 0.0f);
+	for (size_t i = 0; i < n_frames; ++i)
+	{
+		for (size_t k = 0; k < n_dims; ++k)
+		{
+			output[(i / 2) * n_dims + k] += features[i * n_dims + k] * 0.5f;
+		}
+	}
+	return output;
+}
+
+
+/*! Features organized as (dimension, frame) with unit-length frames, so the
+ *  dimension of consecutive frames loads as a SIMD vector
+ *    @param reverse: store the frames from the last to the first
+ *    @param stride: frames per dimension, including padding
+ */
+static std::vector<float> transposeFeatures(const float* features, const size_t n_frames, const size_t n_dims, const bool reverse, const size_t stride)
+{
+	std::vector<float> output(n_dims * stride, 0.0f);
+	for (size_t i = 0; i < n_frames; ++i)
+	{
+		const float* frame = features + i * n_dims;
+		float norm = 0;
+		for (size_t k = 0; k < n_dims; ++k)
+		{
+			norm += frame[k] * frame[k];
+		}
+		const float scale = norm > 0 ? 1 / sqrtf(norm) : 0;
+		const size_t position = reverse ? n_frames - 1 - i : i;
+		for (size_t k = 0; k < n_dims; ++k)
+		{
+			output[k * stride + position] = frame[k] * scale;
+		}
+	}
+	return output;
+}
+
+
+/*! Dynamic time warping restricted to a band */
+static std::vector<AlignmentStep> alignInBand(const float* score, const size_t n_score, const float* profile, const size_t n_profile, const size_t n_dims, const AlignmentBand& band, float* cost)
+{
+	// Cell (i, j) lies on anti-diagonal i + j; with the profile reversed, the
+	// features of the cells of a diagonal are consecutive in both sequences
+	const size_t score_stride = n_score + SIMD_WIDTH;
+	const size_t profile_stride = n_profile + SIMD_WIDTH;
+	const std::vector<float> score_t = transposeFeatures(score, n_score, n_dims, false, score_stride);
+	const std::vector<float> profile_t = transposeFeatures(profile, n_profile, n_dims, true, profile_stride);
+
+	// Accumulated costs of three diagonals, indexed by i + 1 so that i = -1
+	// is a border of infinite cost
+	const float infinity = INFINITY;
+	const size_t n_diagonals = n_score + n_profile - 1;
+	std::vector<std::vector<float> > diagonals(3, std::vector<float>(n_score + 1 + SIMD_WIDTH, infinity));
+	std::vector<size_t> diagonal_first(3, 0);
+	std::vector<size_t> diagonal_count(3, 0);
+
+	// Backtrack directions of every cell in the band, diagonal by diagonal
+	std::vector<size_t> first_rows(n_diagonals);
+	std::vector<size_t> offsets(n_diagonals + 1, 0);
+	size_t n_cells = 0;
+	for (size_t i = 0; i < n_score; ++i)
+	{
+		n_cells += band.last[i] - band.first[i];
+	}
+	std::vector<uint8_t> directions;
+	directions.reserve(n_cells + SIMD_WIDTH);
+
+	// The path starts from cell (0, 0) through the border
+	diagonals[1][0] = 0;
+
+	size_t first_row = 0;
+	size_t last_row = 0;
+	for (size_t d = 0; d < n_diagonals; ++d)
+	{
+		// Rows of the band on this diagonal: j = d - i must lie in the
+		// window of row i, which holds for a contiguous range of rows
+		while (first_row < n_score && first_row + band.last[first_row] <= d) ++first_row;
+		while (last_row + 1 < n_score && last_row + 1 <= d && last_row + 1 + band.first[last_row + 1] <= d) ++last_row;
+		if (first_row > last_row || first_row >= n_score)
+		{
+			throw std::runtime_error("Alignment band is not connected");
+		}
+		const size_t count = last_row - first_row + 1;
+		first_rows[d] = first_row;
+		offsets[d + 1] = offsets[d] + count;
+		directions.resize(offsets[d + 1] + SIMD_WIDTH);
+
+		// Diagonal d - 1 and d - 2, and the buffer of d - 3 for this one
+		std::vector<float>& current = diagonals[d % 3];
+		const std::vector<float>& previous = diagonals[(d + 2) % 3];
+		const std::vector<float>& before_previous = diagonals[(d + 1) % 3];
+		std::fill(current.begin() + diagonal_first[d % 3], current.begin() + diagonal_first[d % 3] + diagonal_count[d % 3] + 1 + SIMD_WIDTH, infinity);
+		diagonal_first[d % 3] = first_row;
+		diagonal_count[d % 3] = count;
+
+		uint8_t* diagonal_directions = directions.data() + offsets[d];
+		for (size_t i = first_row; i <= last_row; i += SIMD_WIDTH)
+		{
+			// Cosine distance of the cells (i, d - i) ... (i + 7, d - i - 7)
+			const size_t profile_position = n_profile - 1 - (d - i);
+			simd_float similarity = simdBroadcast(0.0f);
+			for (size_t k = 0; k < n_dims; ++k)
+			{
+				similarity += simdLoad(score_t.data() + k * score_stride + i) * simdLoad(profile_t.data() + k * profile_stride + profile_position);
+			}
+			const simd_float cell_cost = 1.0f - similarity;
+
+			// Steps from (i - 1, j - 1), (i - 1, j) and (i, j - 1)
+			const simd_float diagonal_step = simdLoad(before_previous.data() + i);
+			const simd_float score_step = simdLoad(previous.data() + i);
+			const simd_float profile_step = simdLoad(previous.data() + i + 1);
+			const simd_float best = simdMin(diagonal_step, simdMin(score_step, profile_step));
+			const simd_int direction = diagonal_step == best ? simdBroadcast(0) : (score_step == best ? simdBroadcast(1) : simdBroadcast(2));
+			simdStore(current.data() + i + 1, best + cell_cost);
+			for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+			{
+				diagonal_directions[i - first_row + lane] = (uint8_t)direction[lane];
+			}
+		}
+
+		// Lanes past the last row wrote outside the band
+		std::fill(current.begin() + last_row + 2, current.begin() + last_row + 2 + SIMD_WIDTH, infinity);
+		if (d == 0)
+		{
+			diagonals[1][0] = infinity;
+		}
+	}
+	directions.resize(offsets[n_diagonals]);
+
+	if (cost)
+	{
+		*cost = diagonals[(n_diagonals - 1) % 3][n_score];
+	}
+
+	// Follow the directions back from the last cell
+	std::vector<AlignmentStep> path;
+	size_t i = n_score - 1;
+	size_t j = n_profile - 1;
+	while (1)
+	{
+		AlignmentStep step = { (uint32_t)i, (uint32_t)j };
+		path.push_back(step);
+		if (i == 0 && j == 0) break;
+		const size_t d = i + j;
+		const uint8_t direction = directions[offsets[d] + i - first_rows[d]];
+		if (direction != 2) --i;
+		if (direction != 1) --j;
+	}
+	std::reverse(path.begin(), path.end());
+	return path;
+}
+
+
+std::vector<AlignmentStep> alignSequences(const float* score, const size_t n_score, const float* profile, const size_t n_profile, const size_t n_dims, const AlignmentParams& params, float* cost)
+{
+	if (n_score == 0 || n_profile == 0)
+	{
+		throw std::runtime_error("Sequences to align must not be empty");
+	}
+	if (n_score > UINT32_MAX || n_profile > UINT32_MAX)
+	{
+		throw std::runtime_error("Sequences to align are too long");
+	}
+
+	AlignmentBand band;
+	if (params.constraint == ALIGNMENT_MULTI_SCALE && n_score > ALIGNMENT_MIN_MULTI_SCALE_FRAMES && n_profile > ALIGNMENT_MIN_MULTI_SCALE_FRAMES)
+	{
+		const std::vector<float> coarse_score = halveSequence(score, n_score, n_dims);
+		const std::vector<float> coarse_profile = halveSequence(profile, n_profile, n_dims);
+		const std::vector<AlignmentStep> coarse_path = alignSequences(coarse_score.data(), (n_score + 1) / 2, coarse_profile.data(), (n_profile + 1) / 2, n_dims, params);
+		band = projectPath(coarse_path, n_score, n_profile, params.radius);
+	}
+	else if (params.constraint == ALIGNMENT_MULTI_SCALE)
+	{
+		// The coarsest level is aligned without constraint
+		band = getSakoeChibaBand(n_score, n_profile, n_profile);
+	}
+	else
+	{
+		band = getSakoeChibaBand(n_score, n_profile, params.radius);
+	}
+	return alignInBand(score, n_score, profile, n_profile, n_dims, band, cost);
+}
+
+
+size_t ScoreAlignment::getProfileChunk(const double score_seconds) const
+{
+	if (path.empty()) return 0;
+	const double frame = score_seconds > 0 ? floor(score_seconds / seconds_per_frame + 0.5) : 0;
+	const uint32_t score_frame = frame < path.back().score_frame ? (uint32_t)frame : path.back().score_frame;
+
+	// The path visits every frame of the score in order
+	size_t lo = 0;
+	size_t hi = path.size() - 1;
+	while (lo < hi)
+	{
+		const size_t mid = (lo + hi) / 2;
+		if (path[mid].score_frame < score_frame) lo = mid + 1;
+		else hi = mid;
+	}
+	return path[lo].profile_chunk;
+}
+
+
+ScoreAlignment alignScore(const MidiFile& midi, const NoteProfile& profile, const AlignmentParams& params)
+{
+	const size_t n_chunks = profile.getNumChunks();
+	const size_t n_notes = profile.getNotesPerChunk();
+	if (n_chunks == 0 || profile.getSamplesPerSecond() == 0)
+	{
+		throw std::runtime_error("Note profile has no chunks to align with");
+	}
+	const double chunk_seconds = (double)profile.getSamplesPerChunk() / profile.getSamplesPerSecond();
+
+	// Frames of the score up to its last message
+	ScoreAlignment alignment;
+	alignment.seconds_per_frame = params.seconds_per_frame > 0 ? params.seconds_per_frame : chunk_seconds;
+	const std::vector<MidiFile::NoteMessage>& msgs = midi.getMessages();
+	const double score_seconds = msgs.empty() ? 0 : midi.ticksToSeconds(msgs.back().abs_time);
+	const size_t n_frames = (size_t)ceil(score_seconds / alignment.seconds_per_frame) + 1;
+	const PianoRoll roll(midi, profile.getBaseNoteId(), n_notes, 0, alignment.seconds_per_frame, n_frames);
+
+	// Fold both into pitch classes, where class 0 is C
+	const size_t base_class = ((profile.getBaseNoteId() % 12) + 12) % 12;
+	std::vector<float> score_chroma(n_frames * 12, 0.0f);
+	for (size_t i = 0; i < n_frames; ++i)
+	{
+		const uint8_t* frame = roll.getFrameByIndex(i);
+		for (size_t note = 0; note < n_notes; ++note)
+		{
+			score_chroma[i * 12 + (base_class + note) % 12] += frame[note];
+		}
+	}
+	std::vector<float> profile_chroma(n_chunks * 12, 0.0f);
+	std::vector<float> notes(n_notes);
+	for (size_t i = 0; i < n_chunks; ++i)
+	{
+		if (!profile.readNotesByIndex(i, notes.data()))
+		{
+			throw std::runtime_error("Note profile has no notes to align with");
+		}
+		for (size_t note = 0; note < n_notes; ++note)
+		{
+			profile_chroma[i * 12 + (base_class + note) % 12] += sqrtf(notes[note] > 0 ? notes[note] : 0);
+		}
+	}
+
+	alignment.path = alignSequences(score_chroma.data(), n_frames, profile_chroma.data(), n_chunks, 12, params, &alignment.cost);
+	return alignment;
+}
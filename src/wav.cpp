@@ -1,5 +1,7 @@
 #include "wav.h"
 
+#include "simd.h"
+
 #include <endian.h>
 #include <iostream>
 #include <math.h>
@@ -102,12 +104,6 @@ WavFile::~WavFile()
 }
 
 
-size_t WavFile::readSeconds(const float seconds, const std::vector<float*> outputs)
-{
-	return readSamples((size_t)floor(seconds * sample_rate), outputs);
-}
-
-
 size_t WavFile::readSamples(const size_t samples, const std::vector<float*> outputs)
 {
 	if (outputs.size() != n_channels)
@@ -153,18 +149,104 @@ size_t WavFile::readSamples(const size_t samples, const std::vector<float*> outp
 }
 
 
-size_t WavFile::skipSeconds(const float seconds)
+size_t WavFile::readMixedSamples(const size_t samples, const std::vector<float>& weights, float* output)
+{
+	if (weights.size() != n_channels)
+	{
+		throw std::runtime_error("There must be a weight for every channel");
+	}
+
+	// The conversion to [-1, 1) is part of the weights
+	const float factor = 1 / (float)(1 << (sample_size * 8 - 1));
+	std::vector<float> scaled_weights(n_channels);
+	for (size_t c = 0; c < n_channels; ++c)
+	{
+		scaled_weights[c] = weights[c] * factor;
+	}
+
+	// Set up the buffer
+	const size_t buffer_size = 32768;
+	int16_t buffer[buffer_size];
+	const size_t buffer_capacity = buffer_size * sizeof(int16_t) / block_align;
+
+	// Determine how many samples to read
+	const size_t samples_in_file = data_bytes_remaining / block_align;
+	const size_t total_samples = samples < samples_in_file ? samples : samples_in_file;
+
+	size_t output_offset = 0;
+	size_t samples_left = total_samples;
+
+	while (samples_left > 0)
+	{
+		size_t samples_to_read = buffer_capacity < samples_left ? buffer_capacity : samples_left;
+		ist.read(reinterpret_cast<char*>(buffer), samples_to_read * block_align);
+		data_bytes_remaining -= samples_to_read * block_align;
+		samples_left -= samples_to_read;
+
+		#if __BYTE_ORDER != __LITTLE_ENDIAN
+		for (size_t i = 0; i < samples_to_read * n_channels; ++i)
+		{
+			buffer[i] = le16toh(buffer[i]);
+		}
+		#endif
+
+		float* mix_output = output + output_offset;
+		size_t j = 0;
+		for (; j + SIMD_WIDTH <= samples_to_read; j += SIMD_WIDTH)
+		{
+			simd_float mix = simdBroadcast(0.0f);
+			for (size_t channel = 0; channel < n_channels; ++channel)
+			{
+				mix += simdLoadStrided(buffer + j * n_channels + channel, n_channels) * scaled_weights[channel];
+			}
+			simdStore(mix_output + j, mix);
+		}
+		for (; j < samples_to_read; ++j)
+		{
+			float mix = 0;
+			for (size_t channel = 0; channel < n_channels; ++channel)
+			{
+				mix += buffer[j * n_channels + channel] * scaled_weights[channel];
+			}
+			mix_output[j] = mix;
+		}
+
+		output_offset += samples_to_read;
+	}
+
+	return total_samples;
+}
+
+
+size_t WavFile::readRawSamples(const size_t samples, int16_t* output)
 {
-	return skipSamples((size_t)floor(seconds * sample_rate));
+	// Determine how many samples to read
+	const size_t samples_in_file = data_bytes_remaining / block_align;
+	const size_t total_samples = samples < samples_in_file ? samples : samples_in_file;
+
+	ist.read(reinterpret_cast<char*>(output), total_samples * block_align);
+	data_bytes_remaining -= total_samples * block_align;
+
+	#if __BYTE_ORDER != __LITTLE_ENDIAN
+	for (size_t i = 0; i < total_samples * n_channels; ++i)
+	{
+		output[i] = le16toh(output[i]);
+	}
+	#endif
+
+	return total_samples;
 }
 
 
 size_t WavFile::skipSamples(const size_t samples)
 {
-	size_t ideal_bytes = samples * block_align;
-	size_t bytes_to_skip = ideal_bytes < data_bytes_remaining ? ideal_bytes : data_bytes_remaining;
-	ist.seekg(bytes_to_skip, std::ios_base::cur);
-	return bytes_to_skip;
+	// Determine how many samples to skip
+	const size_t samples_in_file = data_bytes_remaining / block_align;
+	const size_t total_samples = samples < samples_in_file ? samples : samples_in_file;
+
+	ist.seekg(total_samples * block_align, std::ios_base::cur);
+	data_bytes_remaining -= total_samples * block_align;
+	return total_samples;
 }
 
 
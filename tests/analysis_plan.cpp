@@ -0,0 +1,56 @@
+#include <analysis_plan.h>
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdexcept>
+
+
+TEST(AnalysisPlan, SizeClass)
+{
+	// Small sizes are exact
+	for (size_t size = 0; size <= 8; ++size)
+	{
+		EXPECT_EQ(size, AnalysisPlan::getSizeClass(size));
+	}
+
+	size_t last_class = 0;
+	for (size_t size = 1; size < 1000000; size += 997)
+	{
+		const size_t size_class = AnalysisPlan::getSizeClass(size);
+		EXPECT_GE(size_class, size);
+		EXPECT_LE(size_class, size + size / 4);
+		EXPECT_EQ(size_class, AnalysisPlan::getSizeClass(size_class));
+		EXPECT_GE(size_class, last_class);
+		last_class = size_class;
+	}
+
+	// Nearby sizes share a class
+	EXPECT_EQ(AnalysisPlan::getSizeClass(10000), AnalysisPlan::getSizeClass(10200));
+}
+
+
+TEST(AnalysisPlan, FftRadixFallback)
+{
+	// A0 at 44.1 kHz fits with the radix of the build into 32 KB
+	const size_t local_memory_size = 32768;
+	const size_t window_44k = (size_t)floor(44100 / 27.5 + 2);
+	EXPECT_EQ((uint32_t)FFT_RADIX, AnalysisPlan::chooseFftRadix(window_44k, local_memory_size));
+
+	// At 96 kHz only the single buffer of radix 2 leaves room for the window
+	const size_t window_96k = (size_t)floor(96000 / 27.5 + 2);
+	EXPECT_GT(AnalysisPlan::getFftLocalMemorySize(4, window_96k, true), local_memory_size);
+	EXPECT_LE(AnalysisPlan::getFftLocalMemorySize(2, window_96k, true), local_memory_size);
+	EXPECT_EQ(2u, AnalysisPlan::chooseFftRadix(window_96k, local_memory_size));
+
+	// With less memory the 16-bit samples no longer fit at radix 2, but the
+	// kernel of floats still does; that plan is built without the kernel of
+	// 16-bit samples
+	const size_t float_only_size = AnalysisPlan::getFftLocalMemorySize(2, window_96k, false);
+	EXPECT_GT(AnalysisPlan::getFftLocalMemorySize(2, window_96k, true), float_only_size);
+	EXPECT_EQ(2u, AnalysisPlan::chooseFftRadix(window_96k, float_only_size));
+
+	// A window that does not fit at all is an error
+	EXPECT_THROW(AnalysisPlan::chooseFftRadix(window_96k, 16384), std::runtime_error);
+	EXPECT_THROW(AnalysisPlan::chooseFftRadix(window_96k, float_only_size - 1), std::runtime_error);
+}
@@ -0,0 +1,135 @@
+#include <decimator.h>
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <vector>
+
+
+/*! Generate interleaved 16-bit stereo with a sine of a different frequency in
+ *  each channel
+ */
+static std::vector<int16_t> generateStereo(const size_t n_frames, const float sample_rate, const float freq_left, const float freq_right)
+{
+	std::vector<int16_t> output(2 * n_frames);
+	for (size_t i = 0; i < n_frames; ++i)
+	{
+		output[2 * i] = (int16_t)(16384 * sin(2 * M_PI * freq_left * i / sample_rate));
+		output[2 * i + 1] = (int16_t)(16384 * sin(2 * M_PI * freq_right * i / sample_rate));
+	}
+	return output;
+}
+
+
+TEST(Decimator, ChooseFactor)
+{
+	// A0 as base note needs content up to about 13.3kHz
+	EXPECT_EQ(1, Decimator::chooseFactor(44100, 27.5f, 441));
+	EXPECT_EQ(3, Decimator::chooseFactor(96000, 27.5f, 480));
+	EXPECT_EQ(6, Decimator::chooseFactor(192000, 27.5f, 960));
+
+	// The factor must divide the chunk spacing and the sample rate
+	EXPECT_EQ(2, Decimator::chooseFactor(96000, 27.5f, 482));
+	EXPECT_EQ(3, Decimator::chooseFactor(192000, 27.5f, 963));
+	EXPECT_EQ(1, Decimator::chooseFactor(96000, 27.5f, 481));
+}
+
+
+TEST(Decimator, PassbandAndStopband)
+{
+	const float sample_rate = 96000;
+	const size_t n_frames = 96000;
+	const size_t factor = 2;
+	std::vector<int16_t> input = generateStereo(n_frames, sample_rate, 1000, 30000);
+
+	Decimator decimator(factor, 2);
+	std::vector<float> left(n_frames / factor + 64);
+	std::vector<float> right(n_frames / factor + 64);
+	std::vector<float*> outputs { left.data(), right.data() };
+	size_t n_output = decimator.process(input.data(), n_frames, outputs);
+	std::vector<float*> tail_outputs { left.data() + n_output, right.data() + n_output };
+	n_output += decimator.flush(tail_outputs);
+	ASSERT_EQ(n_frames / factor, n_output);
+
+	// Away from the edges, the passband tone is unchanged and aligned with the
+	// input, and the tone above the new Nyquist frequency is removed
+	for (size_t j = 1000; j < n_output - 1000; ++j)
+	{
+		EXPECT_NEAR(0.5f * sin(2 * M_PI * 1000 * j * factor / sample_rate), left[j], 2e-3f);
+		EXPECT_NEAR(0, right[j], 1e-3f);
+	}
+}
+
+
+TEST(Decimator, BlockSizeIndependent)
+{
+	const size_t n_frames = 20000;
+	const size_t factor = 3;
+	std::vector<int16_t> input = generateStereo(n_frames, 48000, 440, 3000);
+
+	// Decimate in one block
+	Decimator whole(factor, 2);
+	std::vector<float> left(n_frames), right(n_frames);
+	std::vector<float*> outputs { left.data(), right.data() };
+	size_t n_whole = whole.process(input.data(), n_frames, outputs);
+	std::vector<float*> tail_outputs { left.data() + n_whole, right.data() + n_whole };
+	n_whole += whole.flush(tail_outputs);
+
+	// Decimate in uneven blocks
+	Decimator blocks(factor, 2);
+	std::vector<float> block_left(n_frames), block_right(n_frames);
+	size_t n_blocks = 0;
+	size_t position = 0;
+	for (size_t block_size = 1; position < n_frames; block_size = block_size * 3 + 7)
+	{
+		size_t n = block_size < n_frames - position ? block_size : n_frames - position;
+		std::vector<float*> block_outputs { block_left.data() + n_blocks, block_right.data() + n_blocks };
+		n_blocks += blocks.process(input.data() + 2 * position, n, block_outputs);
+		position += n;
+	}
+	std::vector<float*> block_tail_outputs { block_left.data() + n_blocks, block_right.data() + n_blocks };
+	n_blocks += blocks.flush(block_tail_outputs);
+
+	ASSERT_EQ(n_whole, n_blocks);
+	for (size_t j = 0; j < n_whole; ++j)
+	{
+		EXPECT_EQ(left[j], block_left[j]);
+		EXPECT_EQ(right[j], block_right[j]);
+	}
+}
+
+
+TEST(Decimator, PrimedContinuesStream)
+{
+	const size_t n_frames = 20000;
+	const size_t factor = 3;
+	std::vector<int16_t> input = generateStereo(n_frames, 48000, 440, 3000);
+
+	Decimator whole(factor, 2);
+	std::vector<float> left(n_frames), right(n_frames);
+	std::vector<float*> outputs { left.data(), right.data() };
+	size_t n_whole = whole.process(input.data(), n_frames, outputs);
+	std::vector<float*> tail_outputs { left.data() + n_whole, right.data() + n_whole };
+	n_whole += whole.flush(tail_outputs);
+
+	// A stream that starts partway through, primed with the frames before it,
+	// continues the samples of the whole stream exactly
+	const size_t start = 3000;
+	Decimator resumed(factor, 2);
+	const size_t n_priming = resumed.getNumPrimingFrames();
+	ASSERT_LT(n_priming, start);
+	resumed.prime(input.data() + 2 * (start - n_priming), n_priming);
+	std::vector<float> resumed_left(n_frames), resumed_right(n_frames);
+	std::vector<float*> resumed_outputs { resumed_left.data(), resumed_right.data() };
+	size_t n_resumed = resumed.process(input.data() + 2 * start, n_frames - start, resumed_outputs);
+	std::vector<float*> resumed_tail_outputs { resumed_left.data() + n_resumed, resumed_right.data() + n_resumed };
+	n_resumed += resumed.flush(resumed_tail_outputs);
+
+	ASSERT_EQ(n_whole - start / factor, n_resumed);
+	for (size_t j = 0; j < n_resumed; ++j)
+	{
+		ASSERT_EQ(left[start / factor + j], resumed_left[j]) << j;
+		ASSERT_EQ(right[start / factor + j], resumed_right[j]) << j;
+	}
+	EXPECT_THROW(resumed.prime(input.data(), 1), std::runtime_error);
+}
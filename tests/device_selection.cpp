@@ -0,0 +1,30 @@
+#include <opencl_context.h>
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+
+
+TEST(DeviceSelection, Parse)
+{
+	DeviceSelection selection = DeviceSelection::parse("", "", "", "");
+	EXPECT_EQ(CL_DEVICE_TYPE_ALL, selection.device_type);
+	EXPECT_EQ(DEVICE_PARTITION_NONE, selection.partition);
+
+	selection = DeviceSelection::parse("Intel", "Xeon", "cpu", "numa");
+	EXPECT_EQ("Intel", selection.platform_name);
+	EXPECT_EQ("Xeon", selection.device_name);
+	EXPECT_EQ(CL_DEVICE_TYPE_CPU, selection.device_type);
+	EXPECT_EQ(DEVICE_PARTITION_NUMA, selection.partition);
+
+	selection = DeviceSelection::parse("", "", "gpu", "cores:4");
+	EXPECT_EQ(CL_DEVICE_TYPE_GPU, selection.device_type);
+	EXPECT_EQ(DEVICE_PARTITION_CORES, selection.partition);
+	EXPECT_EQ(4, selection.partition_units);
+
+	EXPECT_THROW(DeviceSelection::parse("", "", "fpga", ""), std::runtime_error);
+	EXPECT_THROW(DeviceSelection::parse("", "", "", "cores:"), std::runtime_error);
+	EXPECT_THROW(DeviceSelection::parse("", "", "", "cores:0"), std::runtime_error);
+	EXPECT_THROW(DeviceSelection::parse("", "", "", "cores:2x"), std::runtime_error);
+	EXPECT_THROW(DeviceSelection::parse("", "", "", "sockets"), std::runtime_error);
+}
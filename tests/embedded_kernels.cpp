@@ -0,0 +1,31 @@
+#include <embedded_kernels.h>
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <string.h>
+#include <string>
+
+
+TEST(EmbeddedKernels, Source)
+{
+	// Every kernel file of the analysis is built into the library
+	const char* names[] = { "musical_fft.cl", "gather_notes.cl", "note_events.cl" };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		const char* src = getEmbeddedKernelSource(names[i]);
+		ASSERT_NE(nullptr, src) << names[i];
+		EXPECT_NE(std::string::npos, std::string(src).find("__kernel")) << names[i];
+	}
+	EXPECT_NE(nullptr, strstr(getEmbeddedKernelSource("musical_fft.cl"), "void musical_fft("));
+	EXPECT_EQ(nullptr, getEmbeddedKernelSource("missing.cl"));
+	EXPECT_EQ(nullptr, getEmbeddedKernelSource("../kernels/musical_fft.cl"));
+
+	// The embedded text is the text of the file
+	std::ifstream ist("../kernels/vector_add.cl");
+	if (ist)
+	{
+		std::string file_src((std::istreambuf_iterator<char>(ist)), std::istreambuf_iterator<char>());
+		EXPECT_EQ(file_src, getEmbeddedKernelSource("vector_add.cl"));
+	}
+}
@@ -3,6 +3,7 @@
 #include <fftsw.h>
 
 #include <complex>
+#include <vector>
 
 
 TEST_F(FFTTest, SoftwareFFTMatchesDFT)
@@ -17,4 +18,39 @@ TEST_F(FFTTest, SoftwareFFTMatchesDFT)
 	{
 		EXPECT_PRED3(CheckCoefficients, fft_buffer[k], dft_buffer[k], k);
 	}
-}
\ No newline at end of file
+}
+
+TEST_F(FFTTest, BatchMatchesSingleFFT)
+{
+	// A number of signals that leaves a partial SIMD block
+	const size_t n_signals = 37;
+	std::vector<float> batch(n_samples * n_signals);
+	for (size_t s = 0; s < n_signals; ++s)
+	{
+		for (size_t i = 0; i < n_samples; ++i)
+		{
+			batch[i * n_signals + s] = data[(i + s * 13) % n_samples] * (1 + s * 0.25f);
+		}
+	}
+
+	for (const size_t n_threads : { 1, 3 })
+	{
+		std::vector<complex_t> output(n_samples / 2 * n_signals);
+		fft_sw_batch(batch.data(), n_samples, n_signals, output.data(), n_threads);
+
+		std::vector<float> signal(n_samples);
+		std::vector<complex_t> expected(n_samples / 2);
+		for (size_t s = 0; s < n_signals; ++s)
+		{
+			for (size_t i = 0; i < n_samples; ++i)
+			{
+				signal[i] = batch[i * n_signals + s];
+			}
+			fft_sw(signal.data(), n_samples, expected.data());
+			for (size_t k = 0; k < n_samples / 2; ++k)
+			{
+				ASSERT_LT(std::abs(expected[k] - output[k * n_signals + s]), 1e-3f * (1 + std::abs(expected[k]))) << "signal " << s << ", coefficient " << k;
+			}
+		}
+	}
+}
@@ -0,0 +1,448 @@
+#include <audio_reader.h>
+#include <flac.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <math.h>
+#include <vector>
+
+
+#define TEST_BLOCK_SIZE 4096
+
+
+/*! Writes bits most significant bit first */
+class BitWriter
+{
+public:
+	void write(const uint32_t value, const uint32_t n_bits)
+	{
+		for (uint32_t i = n_bits; i > 0; --i)
+		{
+			if (n_used == 8)
+			{
+				bytes.push_back(0);
+				n_used = 0;
+			}
+			bytes.back() |= ((value >> (i - 1)) & 1) << (7 - n_used);
+			++n_used;
+		}
+	}
+
+	void writeUnary(const uint32_t n_zeros)
+	{
+		for (uint32_t i = 0; i < n_zeros; ++i) write(0, 1);
+		write(1, 1);
+	}
+
+	void align()
+	{
+		n_used = 8;
+	}
+
+	std::vector<uint8_t> bytes;
+	uint32_t n_used = 8;
+};
+
+
+static uint8_t testCrc8(const uint8_t* data, const size_t size)
+{
+	uint8_t crc = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; ++bit) crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+
+static uint16_t testCrc16(const uint8_t* data, const size_t size)
+{
+	uint16_t crc = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		crc ^= data[i] << 8;
+		for (int bit = 0; bit < 8; ++bit) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+	}
+	return crc;
+}
+
+
+/*! Rice-coded residual; blocks of a multiple of four samples have four
+ *  partitions, the second of which is escaped
+ */
+static void writeResidual(BitWriter& bits, const std::vector<int32_t>& samples, const uint32_t order, const std::vector<int32_t>& prediction)
+{
+	const size_t n_partitions = samples.size() % 4 == 0 ? 4 : 1;
+	bits.write(0, 2);
+	bits.write(n_partitions == 4 ? 2 : 0, 4);
+	const size_t n_partition = samples.size() / n_partitions;
+	for (size_t partition = 0; partition < n_partitions; ++partition)
+	{
+		const size_t begin = partition == 0 ? order : partition * n_partition;
+		if (partition == 1)
+		{
+			bits.write(15, 4);
+			bits.write(20, 5);
+			for (size_t i = begin; i < (partition + 1) * n_partition; ++i) bits.write((uint32_t)(samples[i] - prediction[i]) & 0xfffff, 20);
+			continue;
+		}
+		bits.write(10, 4);
+		for (size_t i = begin; i < (partition + 1) * n_partition; ++i)
+		{
+			const int32_t error = samples[i] - prediction[i];
+			const uint32_t value = error >= 0 ? 2 * error : -2 * error - 1;
+			bits.writeUnary(value >> 10);
+			bits.write(value & 0x3ff, 10);
+		}
+	}
+}
+
+
+/*! Subframe of every type the decoder supports, chosen by kind */
+static void writeSubframe(BitWriter& bits, const std::vector<int32_t>& samples, const uint32_t n_bits, const int kind)
+{
+	const size_t n = samples.size();
+	std::vector<int32_t> prediction(n, 0);
+	for (size_t i = 2; i < n; ++i) prediction[i] = 2 * samples[i - 1] - samples[i - 2];
+
+	bits.write(0, 1);
+	if (kind == 0)
+	{
+		// Constant
+		bits.write(0, 6);
+		bits.write(0, 1);
+		bits.write((uint32_t)samples[0] & ((1u << n_bits) - 1), n_bits);
+	}
+	else if (kind == 1)
+	{
+		// Verbatim
+		bits.write(1, 6);
+		bits.write(0, 1);
+		for (size_t i = 0; i < n; ++i) bits.write((uint32_t)samples[i] & ((1u << n_bits) - 1), n_bits);
+	}
+	else if (kind == 2)
+	{
+		// Fixed predictor of order 2
+		bits.write(8 + 2, 6);
+		bits.write(0, 1);
+		for (size_t i = 0; i < 2; ++i) bits.write((uint32_t)samples[i] & ((1u << n_bits) - 1), n_bits);
+		writeResidual(bits, samples, 2, prediction);
+	}
+	else if (kind == 3)
+	{
+		// The same predictor as quantized coefficients 4 and -2 with a shift of 1
+		bits.write(32 + 1, 6);
+		bits.write(0, 1);
+		for (size_t i = 0; i < 2; ++i) bits.write((uint32_t)samples[i] & ((1u << n_bits) - 1), n_bits);
+		bits.write(4 - 1, 4);
+		bits.write(1, 5);
+		bits.write(4, 4);
+		bits.write((uint32_t)-2 & 0x0f, 4);
+		writeResidual(bits, samples, 2, prediction);
+	}
+	else
+	{
+		// Verbatim without two wasted bits
+		bits.write(1, 6);
+		bits.write(1, 1);
+		bits.writeUnary(1);
+		for (size_t i = 0; i < n; ++i) bits.write((uint32_t)(samples[i] >> 2) & ((1u << (n_bits - 2)) - 1), n_bits - 2);
+	}
+}
+
+
+/*! Write a 16-bit stereo FLAC file of varied frames and return its samples
+ *    @param with_seek_table: whether to write a point every 16 frames
+ *    @param with_length: whether STREAMINFO states the number of samples
+ */
+static void writeTestFlac(const std::string& fname, const size_t n_samples, const bool with_seek_table, const bool with_length, std::vector<int32_t>* left, std::vector<int32_t>* right)
+{
+	left->resize(n_samples);
+	right->resize(n_samples);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < n_samples; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		(*left)[i] = (int32_t)(10000 * sin(2 * M_PI * 440 * i / 44100)) + (int32_t)((seed >> 16) % 200) - 100;
+		(*right)[i] = (int32_t)(8000 * sin(2 * M_PI * 660 * i / 44100)) - (int32_t)((seed >> 8) % 100);
+	}
+
+	// Frames of every channel assignment and subframe type
+	std::vector<uint8_t> frames;
+	std::vector<uint64_t> frame_offsets;
+	const size_t n_frames = (n_samples + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE;
+	for (size_t frame = 0; frame < n_frames; ++frame)
+	{
+		const size_t begin = frame * TEST_BLOCK_SIZE;
+		const size_t n = n_samples - begin < TEST_BLOCK_SIZE ? n_samples - begin : TEST_BLOCK_SIZE;
+		std::vector<int32_t> l(left->begin() + begin, left->begin() + begin + n);
+		std::vector<int32_t> r(right->begin() + begin, right->begin() + begin + n);
+
+		int kind = frame % 4 + 1;
+		uint32_t assignment = frame % 5 == 4 ? 1 : 8 + frame % 3;
+		if (frame % 7 == 3)
+		{
+			kind = 0;
+			assignment = 1;
+			std::fill(l.begin(), l.end(), -3);
+			std::fill(r.begin(), r.end(), 5);
+		}
+		else if (kind == 4)
+		{
+			assignment = 1;
+			for (size_t i = 0; i < n; ++i)
+			{
+				l[i] &= ~3;
+				r[i] &= ~3;
+			}
+		}
+		std::copy(l.begin(), l.end(), left->begin() + begin);
+		std::copy(r.begin(), r.end(), right->begin() + begin);
+
+		BitWriter bits;
+		bits.write(0xfff8, 16);
+		bits.write(0x79, 8);
+		bits.write(assignment << 4 | 4 << 1, 8);
+		if (frame < 128)
+		{
+			bits.write((uint32_t)frame, 8);
+		}
+		else
+		{
+			bits.write(0xc0 | (uint32_t)(frame >> 6), 8);
+			bits.write(0x80 | (uint32_t)(frame & 0x3f), 8);
+		}
+		bits.write((uint32_t)n - 1, 16);
+		bits.write(testCrc8(bits.bytes.data(), bits.bytes.size()), 8);
+
+		std::vector<int32_t> side(n), mid(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			side[i] = l[i] - r[i];
+			mid[i] = (l[i] + r[i]) >> 1;
+		}
+		if (assignment == 1)
+		{
+			writeSubframe(bits, l, 16, kind);
+			writeSubframe(bits, r, 16, kind);
+		}
+		else if (assignment == 8)
+		{
+			writeSubframe(bits, l, 16, kind);
+			writeSubframe(bits, side, 17, kind);
+		}
+		else if (assignment == 9)
+		{
+			writeSubframe(bits, side, 17, kind);
+			writeSubframe(bits, r, 16, kind);
+		}
+		else
+		{
+			writeSubframe(bits, mid, 16, kind);
+			writeSubframe(bits, side, 17, kind);
+		}
+		bits.align();
+		const uint16_t crc = testCrc16(bits.bytes.data(), bits.bytes.size());
+		bits.write(crc, 16);
+
+		frame_offsets.push_back(frames.size());
+		frames.insert(frames.end(), bits.bytes.begin(), bits.bytes.end());
+	}
+
+	std::ofstream ost(fname, std::ios::binary);
+	ost.write("fLaC", 4);
+
+	BitWriter info;
+	info.write(with_seek_table ? 0 : 0x80, 8);
+	info.write(34, 24);
+	info.write(TEST_BLOCK_SIZE, 16);
+	info.write(TEST_BLOCK_SIZE, 16);
+	info.write(0, 24);
+	info.write(0, 24);
+	info.write(44100, 20);
+	info.write(1, 3);
+	info.write(15, 5);
+	info.write(0, 4);
+	info.write(with_length ? (uint32_t)n_samples : 0, 32);
+	for (int i = 0; i < 4; ++i) info.write(0, 32);
+	ost.write(reinterpret_cast<const char*>(info.bytes.data()), info.bytes.size());
+
+	if (with_seek_table)
+	{
+		BitWriter table;
+		const size_t n_points = (n_frames + 15) / 16;
+		table.write(0x83, 8);
+		table.write((uint32_t)(n_points + 1) * 18, 24);
+		for (size_t i = 0; i < n_points; ++i)
+		{
+			table.write(0, 32);
+			table.write((uint32_t)(i * 16 * TEST_BLOCK_SIZE), 32);
+			table.write(0, 32);
+			table.write((uint32_t)frame_offsets[i * 16], 32);
+			table.write(TEST_BLOCK_SIZE, 16);
+		}
+
+		// Placeholder
+		table.write(0xffffffff, 32);
+		table.write(0xffffffff, 32);
+		for (int i = 0; i < 5; ++i) table.write(0, 16);
+		ost.write(reinterpret_cast<const char*>(table.bytes.data()), table.bytes.size());
+	}
+
+	ost.write(reinterpret_cast<const char*>(frames.data()), frames.size());
+}
+
+
+TEST(FlacFile, Read)
+{
+	// More than one block of compressed data
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	const size_t n_samples = 500 * TEST_BLOCK_SIZE + 1234;
+	std::vector<int32_t> left, right;
+	writeTestFlac(path.string(), n_samples, true, true, &left, &right);
+
+	FlacFile file(path.string(), 3);
+	EXPECT_EQ(44100, file.getSampleRate());
+	EXPECT_EQ(2, file.getNumChannels());
+	EXPECT_EQ(16, file.getBitsPerSample());
+	EXPECT_EQ(32, file.getNumSeekPoints());
+	EXPECT_EQ(n_samples, file.getNumSamplesRemaining());
+
+	std::vector<int16_t> samples(2 * 7777);
+	size_t n_read = 0;
+	size_t n_mismatches = 0;
+	while (size_t n = file.readRawSamples(7777, samples.data()))
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			n_mismatches += samples[2 * i] != left[n_read + i] || samples[2 * i + 1] != right[n_read + i];
+		}
+		n_read += n;
+	}
+	EXPECT_EQ(n_samples, n_read);
+	EXPECT_EQ(0, n_mismatches);
+	EXPECT_EQ(0, file.getNumSamplesRemaining());
+
+	// Jump through the seek table
+	FlacFile seeking_file(path.string(), 3);
+	EXPECT_EQ(450 * TEST_BLOCK_SIZE + 7, seeking_file.skipSamples(450 * TEST_BLOCK_SIZE + 7));
+	EXPECT_EQ(3, seeking_file.readRawSamples(3, samples.data()));
+	EXPECT_EQ(left[450 * TEST_BLOCK_SIZE + 7], samples[0]);
+	EXPECT_EQ(right[450 * TEST_BLOCK_SIZE + 9], samples[5]);
+	EXPECT_EQ(n_samples - 450 * TEST_BLOCK_SIZE - 10, seeking_file.getNumSamplesRemaining());
+	boost::filesystem::remove(path);
+}
+
+
+TEST(FlacFile, Skip)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	const size_t n_samples = 40 * TEST_BLOCK_SIZE + 100;
+	std::vector<int32_t> left, right;
+
+	for (int with_seek_table = 0; with_seek_table < 2; ++with_seek_table)
+	{
+		writeTestFlac(path.string(), n_samples, with_seek_table != 0, with_seek_table != 0, &left, &right);
+
+		// Files are recognized by their contents
+		std::unique_ptr<AudioReader> file = AudioReader::open(path.string());
+		ASSERT_NE(nullptr, dynamic_cast<FlacFile*>(file.get()));
+
+		float buffer_left[4], buffer_right[4];
+		std::vector<float*> buffers { buffer_left, buffer_right };
+		EXPECT_EQ(4, file->readSamples(4, buffers));
+		EXPECT_FLOAT_EQ(left[3] / 32768.0f, buffer_left[3]);
+
+		// Into a later frame, then within it
+		EXPECT_EQ(20 * TEST_BLOCK_SIZE + 5, file->skipSamples(20 * TEST_BLOCK_SIZE + 5));
+		EXPECT_EQ(3, file->skipSamples(3));
+		EXPECT_EQ(4, file->readSamples(4, buffers));
+		EXPECT_FLOAT_EQ(left[20 * TEST_BLOCK_SIZE + 12] / 32768.0f, buffer_left[0]);
+		EXPECT_FLOAT_EQ(right[20 * TEST_BLOCK_SIZE + 15] / 32768.0f, buffer_right[3]);
+
+		// Mixed while reading
+		float mix[2];
+		EXPECT_EQ(2, file->readMixedSamples(2, std::vector<float> { 0.5f, 0.25f }, mix));
+		EXPECT_FLOAT_EQ((0.5f * left[20 * TEST_BLOCK_SIZE + 16] + 0.25f * right[20 * TEST_BLOCK_SIZE + 16]) / 32768.0f, mix[0]);
+
+		// Skipping past the end stops at the end
+		const size_t n_left = n_samples - (20 * TEST_BLOCK_SIZE + 18);
+		EXPECT_EQ(n_left, file->skipSamples(n_samples));
+		EXPECT_EQ(0, file->getNumSamplesRemaining());
+		EXPECT_EQ(0, file->readSamples(4, buffers));
+	}
+	boost::filesystem::remove(path);
+}
+
+
+/*! Parses handwritten frame headers with the parameters of a test file */
+class FrameHeaderParser : public FlacFile
+{
+public:
+	FrameHeaderParser(const std::string& fname) :
+		FlacFile(fname, 1)
+	{
+	}
+
+	bool parse(const std::vector<uint8_t>& header, const uint64_t first_sample, uint64_t* block_size)
+	{
+		// Subframes follow the header
+		compressed = header;
+		compressed.resize(header.size() + 16, 0);
+		Frame frame;
+		if (!parseFrameHeader(0, first_sample, &frame)) return false;
+		*block_size = frame.block_size;
+		return true;
+	}
+};
+
+
+/*! Header of a stereo frame of 16-bit samples with a block size stored in
+ *  16 bits after the number, which is coded like UTF-8 with a lead byte
+ */
+static std::vector<uint8_t> frameHeader(const bool is_variable, const uint8_t lead, const std::vector<uint8_t>& continuation, const uint32_t block_size)
+{
+	BitWriter bits;
+	bits.write(is_variable ? 0xfff9 : 0xfff8, 16);
+	bits.write(0x79, 8);
+	bits.write(1 << 4 | 4 << 1, 8);
+	bits.write(lead, 8);
+	for (size_t i = 0; i < continuation.size(); ++i) bits.write(continuation[i], 8);
+	bits.write(block_size - 1, 16);
+	bits.write(testCrc8(bits.bytes.data(), bits.bytes.size()), 8);
+	return bits.bytes;
+}
+
+
+TEST(FlacFile, FrameNumbers)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	std::vector<int32_t> left, right;
+	writeTestFlac(path.string(), TEST_BLOCK_SIZE, false, true, &left, &right);
+	FrameHeaderParser parser(path.string());
+	uint64_t block_size = 0;
+
+	// Sample numbers of variable block sizes have up to 36 bits, which takes
+	// a lead byte of 0xfe and six continuation bytes
+	const uint64_t first_sample = (uint64_t)0x9 << 32 | 0x87654321;
+	std::vector<uint8_t> continuation;
+	for (int shift = 30; shift >= 0; shift -= 6)
+	{
+		continuation.push_back((uint8_t)(0x80 | ((first_sample >> shift) & 0x3f)));
+	}
+	EXPECT_TRUE(parser.parse(frameHeader(true, 0xfe, continuation, 1000), first_sample, &block_size));
+	EXPECT_EQ(1000u, block_size);
+	EXPECT_FALSE(parser.parse(frameHeader(true, 0xfe, continuation, 1000), first_sample + 1, &block_size));
+
+	// Frame numbers have at most 31 bits, and 0xff is never a lead byte
+	EXPECT_FALSE(parser.parse(frameHeader(false, 0xfe, continuation, TEST_BLOCK_SIZE), first_sample, &block_size));
+	EXPECT_FALSE(parser.parse(frameHeader(true, 0xff, continuation, 1000), first_sample, &block_size));
+
+	// Two bytes, as in the test files
+	EXPECT_TRUE(parser.parse(frameHeader(false, 0xc2, std::vector<uint8_t> { 0x85 }, TEST_BLOCK_SIZE), 133 * TEST_BLOCK_SIZE, &block_size));
+	EXPECT_EQ((uint64_t)TEST_BLOCK_SIZE, block_size);
+	boost::filesystem::remove(path);
+}
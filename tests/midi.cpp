@@ -0,0 +1,93 @@
+#include "midi_fixture.h"
+
+#include <midi.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+
+TEST_F(MidiTest, MultiTrackMerge)
+{
+	// Conductor track: 120 BPM until beat 2, then 60 BPM
+	std::vector<uint8_t> conductor;
+	appendEvent(conductor, 0, { 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20 });
+	appendEvent(conductor, 960, { 0xff, 0x51, 0x03, 0x0f, 0x42, 0x40 });
+	appendEvent(conductor, 0, { 0xff, 0x2f, 0x00 });
+
+	// Running status, a zero-velocity note on and a sysex event
+	std::vector<uint8_t> melody;
+	appendEvent(melody, 0, { 0x90, 60, 100 });
+	appendEvent(melody, 480, { 62, 100 });
+	appendEvent(melody, 0, { 0xf0, 0x03, 0x7e, 0x01, 0xf7 });
+	appendEvent(melody, 480, { 0x90, 60, 0 });
+	appendEvent(melody, 480, { 0x80, 62, 64 });
+	appendEvent(melody, 0, { 0xff, 0x2f, 0x00 });
+
+	// Program change (one data byte) and a text meta event
+	std::vector<uint8_t> bass;
+	appendEvent(bass, 0, { 0xc1, 0x20 });
+	appendEvent(bass, 0, { 0xff, 0x01, 0x03, 'b', 'a', 's' });
+	appendEvent(bass, 240, { 0x91, 36, 90 });
+	appendEvent(bass, 1200, { 0x81, 36, 0 });
+	appendEvent(bass, 0, { 0xff, 0x2f, 0x00 });
+
+	MidiFile midi(writeMidiFile(1, 480, { conductor, melody, bass }));
+	EXPECT_EQ(1, midi.getFormat());
+	EXPECT_EQ(3, midi.getNumTracks());
+
+	const std::vector<MidiFile::NoteMessage>& msgs = midi.getMessages();
+	ASSERT_EQ(6, msgs.size());
+	const uint64_t expected_times[] = { 0, 240, 480, 960, 1440, 1440 };
+	const uint8_t expected_notes[] = { 60, 36, 62, 60, 62, 36 };
+	const bool expected_on[] = { true, true, true, false, false, false };
+	for (size_t i = 0; i < msgs.size(); ++i)
+	{
+		EXPECT_EQ(expected_times[i], msgs[i].abs_time);
+		EXPECT_EQ(expected_notes[i], msgs[i].note);
+		EXPECT_EQ(expected_on[i], msgs[i].is_note_on);
+	}
+	EXPECT_EQ(1, msgs[1].channel);
+	EXPECT_EQ(2, msgs[1].track);
+
+	// Two beats at 120 BPM take one second, then each beat takes a second
+	EXPECT_DOUBLE_EQ(0.5, midi.ticksToSeconds(480));
+	EXPECT_DOUBLE_EQ(1.0, midi.ticksToSeconds(960));
+	EXPECT_DOUBLE_EQ(2.0, midi.ticksToSeconds(1440));
+}
+
+
+TEST_F(MidiTest, Format2Sequences)
+{
+	std::vector<uint8_t> first;
+	appendEvent(first, 0, { 0x90, 60, 100 });
+	appendEvent(first, 100, { 0x80, 60, 0 });
+	appendEvent(first, 0, { 0xff, 0x2f, 0x00 });
+
+	std::vector<uint8_t> second;
+	appendEvent(second, 50, { 0x90, 64, 100 });
+	appendEvent(second, 0, { 0xff, 0x2f, 0x00 });
+
+	MidiFile midi(writeMidiFile(2, 96, { first, second }));
+	const std::vector<MidiFile::NoteMessage>& msgs = midi.getMessages();
+	ASSERT_EQ(3, msgs.size());
+	EXPECT_EQ(150, msgs[2].abs_time);
+	EXPECT_EQ(64, msgs[2].note);
+}
+
+
+TEST_F(MidiTest, InvalidFiles)
+{
+	const uint8_t not_midi[] = { 'R', 'I', 'F', 'F', 0, 0, 0, 0 };
+	EXPECT_THROW(MidiFile(not_midi, sizeof(not_midi)), std::runtime_error);
+
+	// Data bytes without any previous status byte
+	std::vector<uint8_t> track;
+	appendEvent(track, 0, { 60, 100 });
+	EXPECT_THROW(MidiFile(writeMidiFile(0, 96, { track })), std::runtime_error);
+
+	// Truncated message
+	std::vector<uint8_t> truncated;
+	appendEvent(truncated, 0, { 0x90, 60 });
+	EXPECT_THROW(MidiFile(writeMidiFile(0, 96, { truncated })), std::runtime_error);
+}
@@ -0,0 +1,70 @@
+#include "midi_fixture.h"
+
+#include <fstream>
+#include <stdio.h>
+
+
+void MidiTest::TearDown()
+{
+	for (size_t i = 0; i < fnames.size(); ++i)
+	{
+		remove(fnames[i].c_str());
+	}
+}
+
+
+static void write16be(std::ofstream& ost, const uint16_t value)
+{
+	const char bytes[2] = { (char)(value >> 8), (char)value };
+	ost.write(bytes, 2);
+}
+
+
+static void write32be(std::ofstream& ost, const uint32_t value)
+{
+	const char bytes[4] = { (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value };
+	ost.write(bytes, 4);
+}
+
+
+std::string MidiTest::writeMidiFile(const uint16_t format, const uint16_t division, const std::vector<std::vector<uint8_t> >& tracks)
+{
+	const ::testing::TestInfo* info = ::testing::UnitTest::GetInstance()->current_test_info();
+	std::string fname = std::string("test_") + info->name() + "_" + std::to_string(fnames.size()) + ".mid";
+	fnames.push_back(fname);
+
+	std::ofstream ost(fname, std::ios::binary);
+	ost.write("MThd", 4);
+	write32be(ost, 6);
+	write16be(ost, format);
+	write16be(ost, tracks.size());
+	write16be(ost, division);
+	for (size_t i = 0; i < tracks.size(); ++i)
+	{
+		ost.write("MTrk", 4);
+		write32be(ost, tracks[i].size());
+		ost.write(reinterpret_cast<const char*>(tracks[i].data()), tracks[i].size());
+	}
+	return fname;
+}
+
+
+void MidiTest::appendEvent(std::vector<uint8_t>& track, const uint32_t delta, const std::vector<uint8_t>& event)
+{
+	// Variable-length quantity, most significant group first
+	uint8_t groups[5];
+	size_t n_groups = 0;
+	uint32_t value = delta;
+	do
+	{
+		groups[n_groups++] = value & 0x7f;
+		value >>= 7;
+	}
+	while (value);
+	while (n_groups > 0)
+	{
+		--n_groups;
+		track.push_back(groups[n_groups] | (n_groups ? 0x80 : 0));
+	}
+	track.insert(track.end(), event.begin(), event.end());
+}
@@ -0,0 +1,31 @@
+#ifndef _TEST_MIDI_FIXTURE_H_
+#define _TEST_MIDI_FIXTURE_H_
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/*! Test fixture for everything MIDI; builds small MIDI files on disk */
+class MidiTest : public ::testing::Test
+{
+protected:
+	void TearDown() override;
+
+	/*! Write a MIDI file with the given tracks
+	 *    @param tracks: encoded events of each track (without the chunk header)
+	 *    @return path of the file
+	 */
+	std::string writeMidiFile(const uint16_t format, const uint16_t division, const std::vector<std::vector<uint8_t> >& tracks);
+
+	/*! Append a delta time and an event to a track */
+	static void appendEvent(std::vector<uint8_t>& track, const uint32_t delta, const std::vector<uint8_t>& event);
+
+protected:
+	std::vector<std::string> fnames;
+};
+
+
+#endif
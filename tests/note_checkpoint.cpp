@@ -0,0 +1,209 @@
+#include <note_checkpoint.h>
+#include <note_profile.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+
+/*! Stream of three blocks of notes with events */
+class NoteCheckpointTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+		for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+		{
+			timestamps.push_back(chunk * 100 + 50);
+			for (size_t note = 0; note < n_notes; ++note)
+			{
+				notes.push_back((float)((chunk * 31 + note * 7) % 17));
+			}
+		}
+	}
+
+	void TearDown() override
+	{
+		boost::filesystem::remove(path);
+	}
+
+	/*! Write the block of chunks [first, last) and an event at its start */
+	void writeBlock(NoteSink& sink, const size_t first, const size_t last)
+	{
+		sink.writeNotes(first, last - first, timestamps.data() + first, reinterpret_cast<const uint8_t*>(notes.data() + first * n_notes));
+		const NoteEvent event = { (uint32_t)first, 3, 1, 0.5f };
+		sink.writeEvents(&event, 1);
+	}
+
+	/*! Check that a profile has the chunks [0, n) of the stream */
+	void expectChunks(const NoteProfile& profile, const size_t n)
+	{
+		ASSERT_EQ(n, profile.getNumChunks());
+		for (size_t chunk = 0; chunk < n; ++chunk)
+		{
+			ASSERT_EQ(timestamps[chunk], profile.getTimestampByIndex(chunk));
+			for (size_t note = 0; note < n_notes; ++note)
+			{
+				ASSERT_EQ(notes[chunk * n_notes + note], profile.getNotesByIndex(chunk)[note]);
+			}
+		}
+	}
+
+protected:
+	const static size_t n_chunks = 30;
+	const static size_t n_notes = 6;
+	const NoteStreamInfo info = { 21, NOTE_PRECISION_FLOAT32, NOTE_LAYOUT_CHUNK_MAJOR, n_notes, 1000, 100, n_chunks };
+	boost::filesystem::path path;
+	std::vector<uint64_t> timestamps;
+	std::vector<float> notes;
+};
+
+
+TEST_F(NoteCheckpointTest, ResumeAfterLastCommit)
+{
+	// The process stops after the third block, before its commit
+	{
+		NoteProfile profile(21);
+		NoteCheckpoint checkpoint(path.string(), "test input", profile, 10);
+		checkpoint.begin(info);
+		EXPECT_EQ(0, checkpoint.getNumChunksComplete());
+		writeBlock(checkpoint, 0, 10);
+		EXPECT_FALSE(checkpoint.isCommitDue(6));
+		EXPECT_TRUE(checkpoint.isCommitDue(10));
+		checkpoint.commit(10, { 1, 2 });
+		writeBlock(checkpoint, 10, 20);
+		checkpoint.commit(20, { 3, 4 });
+		writeBlock(checkpoint, 20, 25);
+	}
+
+	// The committed blocks are passed on again and the stream continues
+	NoteProfile profile(21);
+	NoteCheckpoint checkpoint(path.string(), "test input", profile, 10);
+	checkpoint.begin(info);
+	ASSERT_EQ(20, checkpoint.getNumChunksComplete());
+	EXPECT_EQ(std::vector<float>({ 3, 4 }), checkpoint.getState());
+	expectChunks(profile, 20);
+	ASSERT_EQ(2, profile.getNumEvents());
+	EXPECT_EQ(10, profile.getEventByIndex(1)->chunk_index);
+
+	writeBlock(checkpoint, 20, 30);
+	checkpoint.commit(30, {});
+	checkpoint.end();
+	expectChunks(profile, 30);
+	EXPECT_EQ(3, profile.getNumEvents());
+
+	// A complete checkpoint replays the whole stream
+	NoteProfile replayed(21);
+	NoteCheckpoint replay(path.string(), "test input", replayed, 10);
+	replay.begin(info);
+	EXPECT_EQ(30, replay.getNumChunksComplete());
+	EXPECT_TRUE(replay.getState().empty());
+	expectChunks(replayed, 30);
+}
+
+
+TEST_F(NoteCheckpointTest, TornCommit)
+{
+	{
+		NoteProfile profile(21);
+		NoteCheckpoint checkpoint(path.string(), "test input", profile);
+		checkpoint.begin(info);
+		writeBlock(checkpoint, 0, 10);
+		checkpoint.commit(10, {});
+		writeBlock(checkpoint, 10, 20);
+		checkpoint.commit(20, {});
+	}
+
+	// A commit without its checksum is dropped with its blocks
+	boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+	{
+		NoteProfile profile(21);
+		NoteCheckpoint checkpoint(path.string(), "test input", profile);
+		checkpoint.begin(info);
+		EXPECT_EQ(10, checkpoint.getNumChunksComplete());
+		expectChunks(profile, 10);
+		writeBlock(checkpoint, 10, 20);
+		checkpoint.commit(20, {});
+	}
+
+	// The file continues after the last valid commit
+	NoteProfile profile(21);
+	NoteCheckpoint checkpoint(path.string(), "test input", profile);
+	checkpoint.begin(info);
+	EXPECT_EQ(20, checkpoint.getNumChunksComplete());
+	expectChunks(profile, 20);
+}
+
+
+TEST_F(NoteCheckpointTest, OtherKey)
+{
+	{
+		NoteProfile profile(21);
+		NoteCheckpoint checkpoint(path.string(), "test input", profile);
+		checkpoint.begin(info);
+		writeBlock(checkpoint, 0, 10);
+		checkpoint.commit(10, {});
+	}
+
+	// Another input or stream format starts over
+	NoteProfile profile(21);
+	NoteCheckpoint other_input(path.string(), "other input", profile);
+	other_input.begin(info);
+	EXPECT_EQ(0, other_input.getNumChunksComplete());
+	EXPECT_EQ(0, profile.getNumChunks());
+	writeBlock(other_input, 0, 10);
+	other_input.commit(10, {});
+	other_input.end();
+
+	NoteStreamInfo other_info = info;
+	other_info.n_samples_per_chunk = 200;
+	NoteCheckpoint other_format(path.string(), "other input", profile);
+	other_format.begin(other_info);
+	EXPECT_EQ(0, other_format.getNumChunksComplete());
+}
+
+
+TEST_F(NoteCheckpointTest, OtherFileOfSameLength)
+{
+	// Two recordings of the same format and length
+	const boost::filesystem::path input_a = path.string() + ".a";
+	const boost::filesystem::path input_b = path.string() + ".b";
+	{
+		std::ofstream ost_a(input_a.string(), std::ios::binary);
+		std::ofstream ost_b(input_b.string(), std::ios::binary);
+		for (size_t i = 0; i < 100000; ++i)
+		{
+			ost_a.put((char)(i % 251));
+			ost_b.put((char)(i % 241));
+		}
+	}
+	const std::string identity_a = NoteCheckpoint::getFileIdentity(input_a.string());
+	const std::string identity_b = NoteCheckpoint::getFileIdentity(input_b.string());
+	EXPECT_EQ(identity_a, NoteCheckpoint::getFileIdentity(input_a.string()));
+	EXPECT_NE(identity_a, identity_b);
+	EXPECT_THROW(NoteCheckpoint::getFileIdentity(path.string() + ".missing"), std::runtime_error);
+
+	{
+		NoteProfile profile(21);
+		NoteCheckpoint checkpoint(path.string(), identity_a + "; same configuration", profile);
+		checkpoint.begin(info);
+		writeBlock(checkpoint, 0, 10);
+		checkpoint.commit(10, {});
+	}
+
+	// The checkpoint of one file is not resumed for the other
+	NoteProfile profile(21);
+	NoteCheckpoint checkpoint(path.string(), identity_b + "; same configuration", profile);
+	checkpoint.begin(info);
+	EXPECT_EQ(0, checkpoint.getNumChunksComplete());
+	EXPECT_EQ(0, profile.getNumChunks());
+	EXPECT_EQ(0, profile.getNumEvents());
+	checkpoint.end();
+
+	boost::filesystem::remove(input_a);
+	boost::filesystem::remove(input_b);
+}
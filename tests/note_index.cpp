@@ -0,0 +1,278 @@
+#include <note_index.h>
+#include <note_profile.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <math.h>
+#include <vector>
+
+
+/*! Profile of random notes, with the chunks of another profile copied into a
+ *  range of it if given
+ */
+static void fillTestProfile(NoteProfile& profile, const size_t n_chunks, const size_t n_notes, const uint32_t seed, const NoteProfile* copy_from = nullptr, const size_t copy_first = 0, const size_t copy_offset = 0, const size_t n_copied = 0)
+{
+	const NoteStreamInfo info = { 21, NOTE_PRECISION_FLOAT32, NOTE_LAYOUT_CHUNK_MAJOR, n_notes, 44100, 441, n_chunks };
+	profile.begin(info);
+	std::vector<uint64_t> timestamps(n_chunks);
+	std::vector<float> notes(n_chunks * n_notes);
+	uint32_t state = seed;
+	for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+	{
+		timestamps[chunk] = chunk * 441;
+		for (size_t note = 0; note < n_notes; ++note)
+		{
+			state = state * 1664525 + 1013904223;
+			notes[chunk * n_notes + note] = (float)(state >> 8) / (1 << 24);
+		}
+		if (copy_from && chunk >= copy_first && chunk < copy_first + n_copied)
+		{
+			copy_from->readNotesByIndex(chunk - copy_first + copy_offset, notes.data() + chunk * n_notes);
+		}
+	}
+	profile.writeNotes(0, n_chunks, timestamps.data(), reinterpret_cast<const uint8_t*>(notes.data()));
+	profile.end();
+}
+
+
+TEST(NoteIndex, ChromaFeature)
+{
+	NoteProfile profile(0);
+	const NoteStreamInfo info = { 21, NOTE_PRECISION_FLOAT32, NOTE_LAYOUT_CHUNK_MAJOR, 24, 44100, 441, 1 };
+	profile.begin(info);
+	const uint64_t timestamp = 0;
+	std::vector<float> notes(24, 0.0f);
+	notes[0] = 4.0f;
+	notes[12] = 3.0f;
+	notes[3] = 2.0f;
+	profile.writeNotes(0, 1, &timestamp, reinterpret_cast<const uint8_t*>(notes.data()));
+
+	// A0 and A1 fold into pitch class A, C1 into C
+	NoteIndex index;
+	ASSERT_EQ(12, index.getDimension());
+	std::vector<float> vector(index.getPaddedDimension());
+	ASSERT_TRUE(index.getFeatureVector(profile, 0, vector.data()));
+	EXPECT_FLOAT_EQ(7.0f / sqrtf(53.0f), vector[9]);
+	EXPECT_FLOAT_EQ(2.0f / sqrtf(53.0f), vector[0]);
+	EXPECT_EQ(0.0f, vector[11]);
+	EXPECT_FALSE(index.getFeatureVector(profile, 1, vector.data()));
+}
+
+
+TEST(NoteIndex, FindsCopiedPassage)
+{
+	const size_t n_notes = 24;
+	NoteProfile original(0), copy(0);
+	fillTestProfile(original, 3000, n_notes, 1);
+	fillTestProfile(copy, 1000, n_notes, 2, &original, 400, 1700, 200);
+
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.feature = NOTE_INDEX_NOTES;
+	params.shingle_size = 4;
+	params.n_threads = 3;
+	params.n_ivf_lists = 32;
+	params.n_ivf_probes = 4;
+	const NoteIndexMode modes[] = { NOTE_INDEX_BRUTE_FORCE, NOTE_INDEX_LSH, NOTE_INDEX_IVF };
+	for (const NoteIndexMode mode : modes)
+	{
+		params.mode = mode;
+		NoteIndex index(params);
+		EXPECT_EQ(0, index.addProfile(original));
+		EXPECT_EQ(1, index.addProfile(copy));
+		ASSERT_EQ(n_notes * 4, index.getDimension());
+		ASSERT_EQ(2997 + 997, index.getNumVectors());
+		index.build();
+
+		// The copied passage matches itself and its source
+		std::vector<float> query(index.getPaddedDimension());
+		ASSERT_TRUE(index.getFeatureVector(copy, 450, query.data()));
+		const std::vector<NoteIndexMatch> matches = index.search(query.data(), 3);
+		ASSERT_EQ(3, matches.size()) << mode;
+		EXPECT_EQ(0, matches[0].profile_id) << mode;
+		EXPECT_EQ(1750, matches[0].chunk_index) << mode;
+		EXPECT_NEAR(1.0f, matches[0].similarity, 1e-5f) << mode;
+		EXPECT_EQ(1, matches[1].profile_id) << mode;
+		EXPECT_EQ(450, matches[1].chunk_index) << mode;
+		EXPECT_GE(matches[1].similarity, matches[2].similarity) << mode;
+	}
+}
+
+
+TEST(NoteIndex, MatchesScalarSearch)
+{
+	NoteProfile profile(0);
+	fillTestProfile(profile, 5000, 12, 3);
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.shingle_size = 2;
+	params.shingle_step = 3;
+	NoteIndex index(params);
+	index.addProfile(profile);
+	index.build();
+
+	const size_t n_queries = 20;
+	const size_t stride = index.getPaddedDimension();
+	std::vector<float> queries(n_queries * stride);
+	for (size_t i = 0; i < n_queries; ++i)
+	{
+		index.getFeatureVector(profile, i * 101, queries.data() + i * stride);
+	}
+	const std::vector<std::vector<NoteIndexMatch> > batch = index.searchBatch(queries.data(), n_queries, 5);
+	ASSERT_EQ(n_queries, batch.size());
+
+	std::vector<float> vector(stride);
+	for (size_t i = 0; i < n_queries; ++i)
+	{
+		// The best similarity of every vector
+		float best = -1;
+		for (size_t v = 0; v < index.getNumVectors(); ++v)
+		{
+			index.getFeatureVector(profile, index.getEntryByIndex(v)->chunk_index, vector.data());
+			float similarity = 0;
+			for (size_t j = 0; j < stride; ++j)
+			{
+				similarity += vector[j] * queries[i * stride + j];
+			}
+			best = similarity > best ? similarity : best;
+		}
+		ASSERT_EQ(5, batch[i].size());
+		EXPECT_NEAR(best, batch[i][0].similarity, 1e-5f);
+		EXPECT_EQ(0, batch[i][0].chunk_index % 3);
+		const std::vector<NoteIndexMatch> single = index.search(queries.data() + i * stride, 5);
+		EXPECT_EQ(single[4].chunk_index, batch[i][4].chunk_index);
+	}
+}
+
+
+TEST(NoteIndex, MappedFile)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteProfile profile(0);
+	fillTestProfile(profile, 2000, 36, 4);
+
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.mode = NOTE_INDEX_IVF;
+	params.n_ivf_lists = 16;
+	NoteIndex index(params);
+	index.addProfile(profile);
+	index.build();
+	index.save(path.string());
+
+	std::unique_ptr<NoteIndex> mapped = NoteIndex::open(path.string());
+	ASSERT_EQ(index.getNumVectors(), mapped->getNumVectors());
+	EXPECT_TRUE(mapped->isBuilt());
+	EXPECT_EQ(NOTE_INDEX_IVF, mapped->getParams().mode);
+	EXPECT_EQ(16, mapped->getParams().n_ivf_lists);
+	EXPECT_EQ(16, mapped->getNumLists());
+
+	std::vector<float> query(index.getPaddedDimension());
+	index.getFeatureVector(profile, 1234, query.data());
+	const std::vector<NoteIndexMatch> expected = index.search(query.data(), 10);
+	const std::vector<NoteIndexMatch> actual = mapped->search(query.data(), 10);
+	ASSERT_EQ(expected.size(), actual.size());
+	for (size_t i = 0; i < expected.size(); ++i)
+	{
+		EXPECT_EQ(expected[i].chunk_index, actual[i].chunk_index);
+		EXPECT_EQ(expected[i].similarity, actual[i].similarity);
+	}
+	EXPECT_EQ(1234, actual[0].chunk_index);
+	EXPECT_THROW(mapped->addProfile(profile), std::runtime_error);
+	mapped.reset();
+
+	// Cut off in the middle of the vectors
+	boost::filesystem::resize_file(path, 1000);
+	EXPECT_THROW(NoteIndex::open(path.string()), std::runtime_error);
+	boost::filesystem::remove(path);
+}
+
+
+TEST(NoteIndex, ListsOfSmallCorpus)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteProfile small(0), large(0);
+	fillTestProfile(small, 10, 36, 5);
+	fillTestProfile(large, 500, 36, 6);
+
+	// A corpus with fewer vectors than lists gets a list per vector, and the
+	// configuration is kept for later builds and in the file
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.mode = NOTE_INDEX_IVF;
+	params.n_ivf_lists = 32;
+	NoteIndex index(params);
+	index.addProfile(small);
+	index.build();
+	EXPECT_EQ(10, index.getNumLists());
+	EXPECT_EQ(32, index.getParams().n_ivf_lists);
+	index.save(path.string());
+	std::unique_ptr<NoteIndex> mapped = NoteIndex::open(path.string());
+	EXPECT_EQ(10, mapped->getNumLists());
+	EXPECT_EQ(32, mapped->getParams().n_ivf_lists);
+
+	index.addProfile(large);
+	index.build();
+	EXPECT_EQ(32, index.getNumLists());
+
+	std::vector<float> query(index.getPaddedDimension());
+	index.getFeatureVector(large, 123, query.data());
+	EXPECT_EQ(123, index.search(query.data(), 1)[0].chunk_index);
+	mapped.reset();
+	boost::filesystem::remove(path);
+}
+
+
+/*! Copy of a file with a value overwritten at an offset */
+template<typename T>
+static void writePatchedCopy(const std::string& fname, const std::string& copy_fname, const size_t offset, const T value)
+{
+	std::ifstream ist(fname, std::ios::binary);
+	std::vector<char> bytes((std::istreambuf_iterator<char>(ist)), std::istreambuf_iterator<char>());
+	std::copy(reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + sizeof(value), bytes.begin() + offset);
+	std::ofstream ost(copy_fname, std::ios::binary | std::ios::trunc);
+	ost.write(bytes.data(), bytes.size());
+}
+
+
+TEST(NoteIndex, CorruptedFile)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	const boost::filesystem::path copy_path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteProfile profile(0);
+	fillTestProfile(profile, 300, 36, 7);
+
+	NoteIndexParams params = NoteIndexParams::getDefault();
+	params.mode = NOTE_INDEX_IVF;
+	params.n_ivf_lists = 8;
+	NoteIndex index(params);
+	index.addProfile(profile);
+	index.build();
+	index.save(path.string());
+	EXPECT_NO_THROW(NoteIndex::open(path.string()));
+
+	// Offsets of the dimension, stride and number of vectors in the header
+	const size_t dimension_offset = 72;
+	const size_t stride_offset = 80;
+	const size_t n_vectors_offset = 88;
+
+	// Sizes of sections that overflow
+	writePatchedCopy(path.string(), copy_path.string(), n_vectors_offset, (uint64_t)1 << 62);
+	EXPECT_THROW(NoteIndex::open(copy_path.string()), std::runtime_error);
+
+	// Strides that are not the padded dimension
+	writePatchedCopy(path.string(), copy_path.string(), stride_offset, (uint64_t)0);
+	EXPECT_THROW(NoteIndex::open(copy_path.string()), std::runtime_error);
+	writePatchedCopy(path.string(), copy_path.string(), stride_offset, (uint64_t)index.getPaddedDimension() + 16);
+	EXPECT_THROW(NoteIndex::open(copy_path.string()), std::runtime_error);
+	writePatchedCopy(path.string(), copy_path.string(), dimension_offset, (uint64_t)-1);
+	EXPECT_THROW(NoteIndex::open(copy_path.string()), std::runtime_error);
+
+	// An id of a list beyond the vectors; the ids are the last section
+	const size_t file_size = boost::filesystem::file_size(path);
+	writePatchedCopy(path.string(), copy_path.string(), file_size - sizeof(uint32_t), (uint32_t)index.getNumVectors());
+	EXPECT_THROW(NoteIndex::open(copy_path.string()), std::runtime_error);
+
+	boost::filesystem::remove(path);
+	boost::filesystem::remove(copy_path);
+}
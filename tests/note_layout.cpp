@@ -0,0 +1,65 @@
+#include <note_layout.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+
+TEST(NoteLayout, IndexIsPermutation)
+{
+	const size_t n_notes = 108;
+	const NoteLayout layouts[] = { NOTE_LAYOUT_CHUNK_MAJOR, NOTE_LAYOUT_NOTE_MAJOR, NOTE_LAYOUT_TILED };
+	for (size_t n_chunks : { 1, 15, 16, 37 })
+	{
+		for (NoteLayout layout : layouts)
+		{
+			std::vector<int> seen(n_chunks * n_notes, 0);
+			for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+			{
+				for (size_t note = 0; note < n_notes; ++note)
+				{
+					const size_t index = getNoteLayoutIndex(layout, n_chunks, n_notes, chunk, note);
+					ASSERT_LT(index, seen.size());
+					++seen[index];
+				}
+			}
+			for (size_t i = 0; i < seen.size(); ++i)
+			{
+				ASSERT_EQ(1, seen[i]) << "layout " << layout << ", " << n_chunks << " chunks";
+			}
+		}
+	}
+
+	// Time series are contiguous in the note-major layouts
+	EXPECT_EQ(37 * 5 + 3, getNoteLayoutIndex(NOTE_LAYOUT_NOTE_MAJOR, 37, n_notes, 3, 5));
+	EXPECT_EQ(32 * n_notes + 5 * 5 + 3, getNoteLayoutIndex(NOTE_LAYOUT_TILED, 37, n_notes, 35, 5));
+}
+
+
+TEST(NoteLayout, Convert)
+{
+	const size_t n_chunks = 37;
+	const size_t n_notes = 12;
+	std::vector<uint16_t> chunk_major(n_chunks * n_notes);
+	for (size_t i = 0; i < chunk_major.size(); ++i)
+	{
+		chunk_major[i] = (uint16_t)i;
+	}
+
+	for (NoteLayout layout : { NOTE_LAYOUT_NOTE_MAJOR, NOTE_LAYOUT_TILED })
+	{
+		std::vector<uint16_t> converted(chunk_major.size());
+		convertNoteLayout(reinterpret_cast<const uint8_t*>(chunk_major.data()), NOTE_LAYOUT_CHUNK_MAJOR, reinterpret_cast<uint8_t*>(converted.data()), layout, n_chunks, n_notes, sizeof(uint16_t));
+		for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+		{
+			for (size_t note = 0; note < n_notes; ++note)
+			{
+				EXPECT_EQ(chunk * n_notes + note, converted[getNoteLayoutIndex(layout, n_chunks, n_notes, chunk, note)]);
+			}
+		}
+
+		std::vector<uint16_t> restored(chunk_major.size());
+		convertNoteLayout(reinterpret_cast<const uint8_t*>(converted.data()), layout, reinterpret_cast<uint8_t*>(restored.data()), NOTE_LAYOUT_CHUNK_MAJOR, n_chunks, n_notes, sizeof(uint16_t));
+		EXPECT_EQ(chunk_major, restored);
+	}
+}
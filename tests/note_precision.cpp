@@ -0,0 +1,81 @@
+#include <note_precision.h>
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdint.h>
+
+
+TEST(NotePrecision, HalfKnownValues)
+{
+	EXPECT_EQ(0x3c00, floatToHalf(1.0f));
+	EXPECT_EQ(0xc000, floatToHalf(-2.0f));
+	EXPECT_EQ(0x7bff, floatToHalf(65504.0f));
+	EXPECT_EQ(0x7c00, floatToHalf(1e6f));
+	EXPECT_EQ(0x0001, floatToHalf(powf(2, -24)));
+	EXPECT_EQ(0x0000, floatToHalf(powf(2, -26)));
+
+	EXPECT_EQ(1.0f, halfToFloat(0x3c00));
+	EXPECT_EQ(-2.0f, halfToFloat(0xc000));
+	EXPECT_EQ(powf(2, -24), halfToFloat(0x0001));
+	EXPECT_TRUE(isinf(halfToFloat(0x7c00)));
+	EXPECT_TRUE(isnan(halfToFloat(0x7e00)));
+}
+
+
+TEST(NotePrecision, HalfRoundTrip)
+{
+	// Every finite half survives a round trip exactly
+	for (uint32_t i = 0; i < 0x7c00; ++i)
+	{
+		EXPECT_EQ(i, floatToHalf(halfToFloat(i)));
+	}
+
+	// Floats are rounded to within half a unit in the last place
+	for (float x = 1e-4f; x < 60000; x *= 1.37f)
+	{
+		EXPECT_NEAR(x, halfToFloat(floatToHalf(x)), x / 2048);
+	}
+}
+
+
+TEST(NotePrecision, Log8RoundTrip)
+{
+	EXPECT_EQ(0, floatToLog8(0));
+	EXPECT_EQ(0, floatToLog8(-1));
+	EXPECT_EQ(0, floatToLog8(1e-15f));
+	EXPECT_EQ(0, log8ToFloat(0));
+	EXPECT_EQ(255, floatToLog8(1e3f));
+
+	// Powers within the range are reproduced within half a step in decibels
+	for (float x = 1e-12f; x < 1; x *= 1.9f)
+	{
+		float decibels = 10 * log10f(x);
+		float round_trip = 10 * log10f(log8ToFloat(floatToLog8(x)));
+		EXPECT_NEAR(decibels, round_trip, LOG8_DB_STEP / 2 + 1e-3f);
+	}
+}
+
+
+TEST(NotePrecision, WidenNarrowArrays)
+{
+	const size_t n_notes = 108;
+	float values[n_notes];
+	for (size_t i = 0; i < n_notes; ++i)
+	{
+		values[i] = powf(10, -(float)i / 36);
+	}
+
+	const NotePrecision precisions[] = { NOTE_PRECISION_FLOAT32, NOTE_PRECISION_FLOAT16, NOTE_PRECISION_LOG8 };
+	for (NotePrecision precision : precisions)
+	{
+		uint8_t packed[n_notes * sizeof(float)];
+		float widened[n_notes];
+		narrowNotes(values, n_notes, precision, packed);
+		widenNotes(packed, n_notes, precision, widened);
+		for (size_t i = 0; i < n_notes; ++i)
+		{
+			EXPECT_NEAR(values[i], widened[i], values[i] * 0.13f);
+		}
+	}
+}
@@ -0,0 +1,141 @@
+#include <note_profile.h>
+#include <note_pyramid.h>
+#include <note_sink.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <vector>
+
+
+/*! Power of a note in a chunk of the test profiles */
+static float getTestPower(const size_t chunk, const size_t note)
+{
+	return (float)((chunk * 7919 + note * 104729) % 1000) / 1000;
+}
+
+
+/*! Compare the range queries of a pyramid with a scan of every chunk */
+static void expectRangesMatch(const NotePyramid& pyramid, const size_t first, const size_t last)
+{
+	const size_t n_notes = pyramid.getNotesPerChunk();
+	std::vector<float> sum(n_notes), mean(n_notes), max(n_notes);
+	pyramid.getRangeSum(first, last, sum.data());
+	pyramid.getRangeMean(first, last, mean.data());
+	pyramid.getRangeMax(first, last, max.data());
+	for (size_t note = 0; note < n_notes; ++note)
+	{
+		double expected_sum = 0;
+		float expected_max = 0;
+		for (size_t chunk = first; chunk < last; ++chunk)
+		{
+			expected_sum += getTestPower(chunk, note);
+			expected_max = getTestPower(chunk, note) > expected_max ? getTestPower(chunk, note) : expected_max;
+		}
+		ASSERT_NEAR(expected_sum, sum[note], 1e-3) << first << ".." << last << ", note " << note;
+		ASSERT_NEAR(expected_sum / (last - first), mean[note], 1e-5) << first << ".." << last << ", note " << note;
+		ASSERT_EQ(expected_max, max[note]) << first << ".." << last << ", note " << note;
+	}
+}
+
+
+TEST(NotePyramid, RangeQueries)
+{
+	const size_t n_chunks = 1000;
+	const size_t n_notes = 5;
+	NotePyramid pyramid;
+	pyramid.clear(n_notes);
+	std::vector<float> notes(n_notes);
+	for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+	{
+		for (size_t note = 0; note < n_notes; ++note)
+		{
+			notes[note] = getTestPower(chunk, note);
+		}
+		pyramid.appendChunk(notes.data());
+	}
+
+	// Levels up to the largest span that fits
+	ASSERT_EQ(10, pyramid.getNumLevels());
+	EXPECT_EQ(500, pyramid.getNumSpans(1));
+	EXPECT_EQ(1, pyramid.getNumSpans(9));
+	EXPECT_EQ(nullptr, pyramid.getSpanMax(3, 125));
+	EXPECT_FLOAT_EQ(getTestPower(8, 2) + getTestPower(9, 2) + getTestPower(10, 2) + getTestPower(11, 2), pyramid.getSpanSum(2, 2)[2]);
+
+	expectRangesMatch(pyramid, 0, n_chunks);
+	expectRangesMatch(pyramid, 0, 1);
+	expectRangesMatch(pyramid, 999, 1000);
+	for (size_t i = 0; i < 50; ++i)
+	{
+		const size_t first = (i * 7919) % n_chunks;
+		const size_t last = first + 1 + (i * 104729) % (n_chunks - first);
+		expectRangesMatch(pyramid, first, last);
+	}
+
+	std::vector<float> output(n_notes);
+	EXPECT_THROW(pyramid.getRangeSum(10, 10, output.data()), std::runtime_error);
+	EXPECT_THROW(pyramid.getRangeMax(10, 1001, output.data()), std::runtime_error);
+}
+
+
+TEST(NotePyramid, SavedWithFile)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	const size_t n_chunks = 300;
+	const size_t n_notes = 4;
+
+	// Note-major blocks, as a device produces them for a series sink
+	{
+		NoteFileSink sink(path.string());
+		sink.setPyramid(true);
+		const NoteStreamInfo info = { 21, NOTE_PRECISION_FLOAT32, NOTE_LAYOUT_NOTE_MAJOR, n_notes, 22050, 100, n_chunks };
+		sink.begin(info);
+		const size_t block_size = 70;
+		std::vector<uint64_t> timestamps(block_size);
+		std::vector<float> notes(block_size * n_notes);
+		for (size_t first = 0; first < n_chunks; first += block_size)
+		{
+			const size_t n = n_chunks - first < block_size ? n_chunks - first : block_size;
+			for (size_t i = 0; i < n; ++i)
+			{
+				timestamps[i] = (first + i) * 100;
+				for (size_t note = 0; note < n_notes; ++note)
+				{
+					notes[note * n + i] = getTestPower(first + i, note);
+				}
+			}
+			sink.writeNotes(first, n, timestamps.data(), reinterpret_cast<const uint8_t*>(notes.data()));
+		}
+		sink.end();
+	}
+	const std::string pyramid_fname = NotePyramid::getFileName(path.string());
+	ASSERT_TRUE(boost::filesystem::exists(pyramid_fname));
+
+	NotePyramid loaded;
+	loaded.load(pyramid_fname);
+	ASSERT_EQ(n_chunks, loaded.getNumChunks());
+	expectRangesMatch(loaded, 3, 297);
+
+	// The profile takes the saved pyramid
+	NoteProfile profile(0);
+	profile.setPyramid(true);
+	profile.fromFile(path.string());
+	ASSERT_NE(nullptr, profile.getPyramid());
+	ASSERT_EQ(n_chunks, profile.getPyramid()->getNumChunks());
+	expectRangesMatch(*profile.getPyramid(), 17, 200);
+
+	// A pyramid that does not cover the file is built again
+	NotePyramid partial;
+	partial.clear(n_notes);
+	partial.appendChunk(profile.getNotesByIndex(0));
+	partial.save(pyramid_fname);
+	profile.fromFile(path.string());
+	ASSERT_EQ(n_chunks, profile.getPyramid()->getNumChunks());
+	expectRangesMatch(*profile.getPyramid(), 0, 300);
+
+	// Not a pyramid file
+	std::ofstream(pyramid_fname, std::ios::binary | std::ios::trunc) << "MFNP0000";
+	EXPECT_THROW(loaded.load(pyramid_fname), std::runtime_error);
+	boost::filesystem::remove(path);
+	boost::filesystem::remove(pyramid_fname);
+}
@@ -0,0 +1,128 @@
+#include <note_profile.h>
+#include <note_sink.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <vector>
+
+
+/*! Stream of two blocks of notes and a block of events */
+static void writeTestStream(NoteSink& sink)
+{
+	const NoteStreamInfo info = { 21, NOTE_PRECISION_FLOAT16, NOTE_LAYOUT_CHUNK_MAJOR, 4, 22050, 100, 3 };
+	sink.begin(info);
+
+	const uint64_t timestamps[] = { 50, 150, 250 };
+	std::vector<uint8_t> notes(3 * 4 * 2);
+	for (size_t i = 0; i < notes.size(); ++i)
+	{
+		notes[i] = (uint8_t)i;
+	}
+	sink.writeNotes(0, 2, timestamps, notes.data());
+	sink.writeNotes(2, 1, timestamps + 2, notes.data() + 2 * 4 * 2);
+
+	const NoteEvent events[] = { { 1, 3, 1, 0.5f }, { 2, 3, 0, 0.1f } };
+	sink.writeEvents(events, 2);
+	sink.end();
+}
+
+
+TEST(NoteSink, FileRoundTrip)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteFileSink file_sink(path.string());
+	writeTestStream(file_sink);
+
+	NoteProfile profile(0);
+	profile.fromFile(path.string());
+	boost::filesystem::remove(path);
+
+	EXPECT_EQ(21, profile.getBaseNoteId());
+	EXPECT_EQ(NOTE_PRECISION_FLOAT16, profile.getNotePrecision());
+	EXPECT_EQ(4, profile.getNotesPerChunk());
+	EXPECT_EQ(22050, profile.getSamplesPerSecond());
+	EXPECT_EQ(100, profile.getSamplesPerChunk());
+	ASSERT_EQ(3, profile.getNumChunks());
+	EXPECT_EQ(250, profile.getTimestampByIndex(2));
+	EXPECT_EQ(8, profile.getPackedNotesByIndex(1)[0]);
+	EXPECT_EQ(23, profile.getPackedNotesByIndex(2)[7]);
+	EXPECT_EQ(nullptr, profile.getPackedNotesByIndex(3));
+
+	ASSERT_EQ(2, profile.getNumEvents());
+	EXPECT_EQ(2, profile.getEventByIndex(1)->chunk_index);
+	EXPECT_EQ(0.5f, profile.getEventByIndex(0)->power);
+}
+
+
+TEST(NoteSink, NoteMajorProfile)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteFileSink file_sink(path.string());
+	writeTestStream(file_sink);
+
+	// Blocks are converted to the layout of the profile as they arrive
+	NoteProfile profile(0);
+	profile.setNoteLayout(NOTE_LAYOUT_NOTE_MAJOR);
+	profile.fromFile(path.string());
+	boost::filesystem::remove(path);
+
+	ASSERT_EQ(3, profile.getNumChunks());
+	EXPECT_EQ(nullptr, profile.getPackedNotesByIndex(0));
+	const uint8_t* series = profile.getPackedNoteSeries(1);
+	ASSERT_NE(nullptr, series);
+	for (size_t chunk = 0; chunk < 3; ++chunk)
+	{
+		EXPECT_EQ(chunk * 8 + 2, series[2 * chunk]);
+		EXPECT_EQ(chunk * 8 + 3, series[2 * chunk + 1]);
+	}
+	EXPECT_EQ(nullptr, profile.getPackedNoteSeries(4));
+	EXPECT_THROW(profile.setNoteLayout(NOTE_LAYOUT_TILED), std::runtime_error);
+}
+
+
+TEST(NoteSink, FileTruncated)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	NoteFileSink file_sink(path.string());
+	writeTestStream(file_sink);
+
+	// A block cut off by an interrupted writer is dropped
+	boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 1);
+	NoteProfile profile(0);
+	profile.fromFile(path.string());
+	EXPECT_EQ(3, profile.getNumChunks());
+	EXPECT_EQ(0, profile.getNumEvents());
+
+	// Not a note file
+	std::ofstream(path.string(), std::ios::binary | std::ios::trunc) << "RIFF0000WAVE";
+	EXPECT_THROW(profile.fromFile(path.string()), std::runtime_error);
+	boost::filesystem::remove(path);
+}
+
+
+TEST(NoteSink, Callback)
+{
+	std::vector<size_t> block_sizes;
+	size_t n_events = 0;
+	NoteCallbackSink sink(
+		[&](const NoteStreamInfo& info, const size_t first_chunk_index, const size_t n_chunks, const uint64_t* timestamps, const uint8_t* notes)
+		{
+			EXPECT_EQ(4, info.n_notes_per_chunk);
+			EXPECT_EQ(block_sizes.empty() ? 0 : 2, first_chunk_index);
+			EXPECT_EQ(50 + 100 * first_chunk_index, timestamps[0]);
+			EXPECT_EQ(first_chunk_index * 4 * 2, notes[0]);
+			block_sizes.push_back(n_chunks);
+		},
+		[&](const NoteStreamInfo&, const NoteEvent*, const size_t n)
+		{
+			n_events += n;
+		});
+	writeTestStream(sink);
+
+	ASSERT_EQ(2, block_sizes.size());
+	EXPECT_EQ(2, block_sizes[0]);
+	EXPECT_EQ(1, block_sizes[1]);
+	EXPECT_EQ(2, n_events);
+}
@@ -1,8 +1,11 @@
 #include "opencl_fixture.h"
 
+#include <analysis_plan.h>
 #include <ffthw.h>
+#include <fftsw.h>
 #include <midi.h>
 #include <note_profile.h>
+#include <note_sink.h>
 #include <opencl_mem.h>
 #include <wav.h>
 
@@ -11,6 +14,8 @@
 #include <math.h>
 #include <stdexcept>
 #include <stdio.h>
+#include <string>
+#include <thread>
 
 
 TEST_F(OpenCLTest, BasicContext)
@@ -19,6 +24,27 @@ TEST_F(OpenCLTest, BasicContext)
 }
 
 
+TEST_F(OpenCLTest, ProgramRegistry)
+{
+	// Kernels of the same source and options share a program
+	ctx->releasePrograms();
+	cl_kernel kernel_a = ctx->createKernel("vector_add", "../kernels/vector_add.cl", "");
+	cl_kernel kernel_b = ctx->createKernel("vector_add", "../kernels/vector_add.cl", "");
+	EXPECT_NE(kernel_a, kernel_b);
+	EXPECT_EQ(1, ctx->getNumPrograms());
+
+	cl_kernel kernel_c = ctx->createKernel("vector_add", "../kernels/vector_add.cl", "-D UNUSED");
+	EXPECT_EQ(2, ctx->getNumPrograms());
+
+	// Kernels outlive the registry
+	ctx->releasePrograms();
+	EXPECT_EQ(0, ctx->getNumPrograms());
+	EXPECT_EQ(CL_SUCCESS, clReleaseKernel(kernel_a));
+	EXPECT_EQ(CL_SUCCESS, clReleaseKernel(kernel_b));
+	EXPECT_EQ(CL_SUCCESS, clReleaseKernel(kernel_c));
+}
+
+
 TEST_F(OpenCLTest, DeviceInfo)
 {
 	std::vector<OpenCLDevice*> devices = ctx->getDevices();
@@ -28,6 +54,26 @@ TEST_F(OpenCLTest, DeviceInfo)
 }
 
 
+TEST_F(OpenCLTest, DeviceSelection)
+{
+	// Every device of the context, including CPU partitions, can run an
+	// analysis on its own
+	ASSERT_LT(0, ctx->getNumDevices());
+	for (size_t i = 0; i < ctx->getNumDevices(); ++i)
+	{
+		OpenCLDevice* device = ctx->getDevice(i);
+		std::cout << "Device " << i << ": " << device->getName() << (device->isSubDevice() ? " (partition)" : "") << std::endl;
+		MusicalFFT mfft(ctx, false, i);
+		std::vector<float> signal(4096, 0.0f);
+		EXPECT_NO_THROW(mfft.runFFT(22050, signal.size(), signal.data(), 256, 27.5f));
+	}
+	EXPECT_THROW(ctx->getDevice(ctx->getNumDevices()), std::runtime_error);
+
+	// The devices are fixed once the context exists
+	EXPECT_THROW(OpenCLContext::setDeviceSelection(DeviceSelection::getDefault()), std::runtime_error);
+}
+
+
 TEST_F(OpenCLTest, MemoryReadWrite)
 {
 	// Set up a buffer
@@ -113,6 +159,462 @@ TEST_F(OpenCLTest, MusicalFFT)
 }
 
 
+TEST_F(OpenCLTest, MusicalFFTMatchesSoftware)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+	const size_t samples_per_chunk = 441;
+	const float base_note_freq = 55;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440) + 0.5 * sin(i / data_freq * 2*M_PI * 1234);
+	}
+
+	MusicalFFT mfft(ctx);
+	mfft.runFFT(data_freq, n_data, data.data(), samples_per_chunk, base_note_freq);
+	size_t n_chunks, n_overtones_per_note;
+	const float* complete_output = mfft.readComplete(&n_chunks, &n_overtones_per_note);
+	ASSERT_EQ(FFT_SIZE / 2, n_overtones_per_note);
+
+	// Interpolate one wavelength of each note like the kernel and transform
+	// all of them in one batch on the host
+	const size_t chunk = 7;
+	const size_t n_notes = 12;
+	std::vector<float> points(FFT_SIZE * n_notes);
+	std::vector<complex_t> spectra(FFT_SIZE / 2 * n_notes);
+	for (size_t note = 0; note < n_notes; ++note)
+	{
+		const float samples_per_fft_slot = (float)(data_freq / base_note_freq / pow(2, note / 12.0) / FFT_SIZE);
+		const float note_offset = samples_per_fft_slot * samples_per_chunk / 2;
+		const float* chunk_data = data.data() + chunk * samples_per_chunk;
+		for (size_t i = 0; i < FFT_SIZE; ++i)
+		{
+			float rel_pos = i * samples_per_fft_slot;
+			float weight_hi = rel_pos - floor(rel_pos);
+			points[i * n_notes + note] = (1 - weight_hi) * chunk_data[(size_t)floor(rel_pos)] + weight_hi * chunk_data[(size_t)ceil(rel_pos)] + note_offset;
+		}
+	}
+	fft_sw_batch(points.data(), FFT_SIZE, n_notes, spectra.data());
+
+	for (size_t note = 0; note < n_notes; ++note)
+	{
+		const float* note_output = complete_output + chunk * FFT_SIZE * 6 + note * FFT_SIZE / 2;
+		for (size_t i = 0; i < FFT_SIZE / 2; ++i)
+		{
+			const float amplitude = std::abs(spectra[i * n_notes + note]) / FFT_SIZE;
+			EXPECT_NEAR(amplitude * amplitude, note_output[i], 1e-3 * amplitude * amplitude + 1e-7) << "note " << note << ", overtone " << i;
+		}
+	}
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTRange)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	MusicalFFT mfft(ctx);
+	mfft.runFFT(data_freq, n_data, data.data(), 441, 55);
+	size_t n_chunks, n_overtones_per_note;
+	const float* complete_output = mfft.readComplete(&n_chunks, &n_overtones_per_note);
+	std::vector<float> complete(complete_output, complete_output + n_chunks * 12 * n_overtones_per_note);
+
+	// Chunks 10 to 19, notes 3 to 7 and the first 32 overtones, with a gap
+	// between the rows of the output
+	const SpectrumRange range = { 10, 10, 3, 5, 0, 32 };
+	const size_t note_pitch = 40;
+	std::vector<float> output(10 * 5 * note_pitch, -1);
+	ASSERT_TRUE(mfft.readCompleteRangeTo(range, output.data(), output.size(), note_pitch));
+	for (size_t chunk = 0; chunk < range.n_chunks; ++chunk)
+	{
+		for (size_t note = 0; note < range.n_notes; ++note)
+		{
+			for (size_t overtone = 0; overtone < note_pitch; ++overtone)
+			{
+				const float value = output[(chunk * range.n_notes + note) * note_pitch + overtone];
+				if (overtone < range.n_overtones)
+				{
+					EXPECT_EQ(complete[((range.chunk_begin + chunk) * 12 + range.note_begin + note) * (FFT_SIZE / 2) + overtone], value);
+				}
+				else
+				{
+					EXPECT_EQ(-1, value);
+				}
+			}
+		}
+	}
+
+	const SpectrumRange outside = { n_chunks - 1, 2, 0, 12, 0, 32 };
+	EXPECT_THROW(mfft.readCompleteRangeTo(outside, output.data(), output.size()), std::runtime_error);
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTNoteLayout)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	MusicalFFT mfft(ctx);
+	mfft.runFFT(data_freq, n_data, data.data(), 441, 55);
+	size_t n_chunks, n_notes;
+	const float* notes_output = mfft.readNotes(&n_chunks, &n_notes);
+	std::vector<float> chunk_major(notes_output, notes_output + n_chunks * n_notes);
+
+	// The device writes the same values in the other layouts
+	for (NoteLayout layout : { NOTE_LAYOUT_NOTE_MAJOR, NOTE_LAYOUT_TILED })
+	{
+		mfft.setNoteLayout(layout);
+		notes_output = mfft.readNotes(nullptr, nullptr);
+		for (size_t chunk = 0; chunk < n_chunks; ++chunk)
+		{
+			for (size_t note = 0; note < n_notes; ++note)
+			{
+				ASSERT_EQ(chunk_major[chunk * n_notes + note], notes_output[getNoteLayoutIndex(layout, n_chunks, n_notes, chunk, note)]);
+			}
+		}
+	}
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTNotePrecision)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100 * 2;
+
+	float* data = new float[n_data];
+	for (int i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	MusicalFFT mfft(ctx);
+	mfft.runFFT(data_freq, n_data, data, 441, 55);
+
+	size_t n_chunks, n_notes;
+	const float* notes_output = mfft.readNotes(&n_chunks, &n_notes);
+	std::vector<float> reference(notes_output, notes_output + n_chunks * n_notes);
+
+	// Narrow outputs are converted on the device and widened on the host
+	const NotePrecision precisions[] = { NOTE_PRECISION_FLOAT16, NOTE_PRECISION_LOG8 };
+	for (NotePrecision precision : precisions)
+	{
+		mfft.setNotePrecision(precision);
+		const float* widened_output = mfft.readNotes(nullptr, nullptr);
+		for (size_t i = 0; i < reference.size(); ++i)
+		{
+			EXPECT_NEAR(reference[i], widened_output[i], reference[i] * 0.07f + 1e-12f);
+		}
+	}
+
+	delete[] data;
+	data = nullptr;
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTSharedPlan)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	// Instances with the same configuration share one plan
+	AnalysisPlan::clearCache();
+	MusicalFFT mfft_a(ctx);
+	MusicalFFT mfft_b(ctx);
+	mfft_a.runFFT(data_freq, n_data, data.data(), 441, 55);
+	mfft_b.runFFT(data_freq, n_data - 100, data.data(), 441, 55);
+	EXPECT_EQ(1, AnalysisPlan::getCacheSize());
+
+	size_t n_chunks_a, n_chunks_b, n_notes;
+	std::vector<float> notes_a;
+	const float* notes_output = mfft_a.readNotes(&n_chunks_a, &n_notes);
+	notes_a.assign(notes_output, notes_output + n_chunks_a * n_notes);
+	notes_output = mfft_b.readNotes(&n_chunks_b, &n_notes);
+	ASSERT_LE(n_chunks_b, n_chunks_a);
+	for (size_t i = 0; i < n_chunks_b * n_notes; ++i)
+	{
+		EXPECT_FLOAT_EQ(notes_a[i], notes_output[i]);
+	}
+
+	// Switching configurations keeps the previous plans cached
+	mfft_a.runFFT(data_freq, n_data, data.data(), 882, 55);
+	mfft_a.setNotePrecision(NOTE_PRECISION_FLOAT16);
+	EXPECT_EQ(3, AnalysisPlan::getCacheSize());
+	mfft_a.runFFT(data_freq, n_data, data.data(), 441, 55);
+	mfft_a.setNotePrecision(NOTE_PRECISION_FLOAT32);
+	EXPECT_EQ(4, AnalysisPlan::getCacheSize());
+
+	AnalysisPlan::setCacheCapacity(2);
+	EXPECT_EQ(2, AnalysisPlan::getCacheSize());
+	AnalysisPlan::setCacheCapacity(8);
+}
+
+
+TEST_F(OpenCLTest, AnalysisPlanConcurrentBuilds)
+{
+	// Threads that need a plan while it builds share the one build, and
+	// configurations build in parallel
+	AnalysisPlan::clearCache();
+	const AnalysisPlanKey keys[2] = {
+		{ 44100, 55, 441, NOTE_PRECISION_FLOAT32 },
+		{ 44100, 55, 882, NOTE_PRECISION_FLOAT32 }
+	};
+	std::vector<std::shared_ptr<const AnalysisPlan> > plans(8);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < plans.size(); ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			plans[i] = AnalysisPlan::get(ctx, keys[i % 2]);
+		}));
+	}
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		threads[i].join();
+	}
+
+	EXPECT_EQ(2, AnalysisPlan::getCacheSize());
+	for (size_t i = 2; i < plans.size(); ++i)
+	{
+		EXPECT_EQ(plans[i % 2], plans[i]);
+	}
+	EXPECT_NE(plans[0], plans[1]);
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTWarmUp)
+{
+	const float data_freq = 44100;
+	std::vector<float> data(44100);
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	// The plan built in the background is the one the analysis uses
+	AnalysisPlan::clearCache();
+	MusicalFFT mfft(ctx);
+	mfft.warmUp(data_freq, 441, 55);
+	EXPECT_LT(0, mfft.runFFT(data_freq, data.size(), data.data(), 441, 55));
+	EXPECT_EQ(1, AnalysisPlan::getCacheSize());
+
+	// Without a cache, the plan of the warm-up is still taken
+	AnalysisPlan::setCacheCapacity(0);
+	mfft.warmUp(data_freq, 882, 55);
+	EXPECT_LT(0, mfft.runFFT(data_freq, data.size(), data.data(), 882, 55));
+	EXPECT_EQ(0, AnalysisPlan::getCacheSize());
+	AnalysisPlan::setCacheCapacity(8);
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTHistory)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	MusicalFFT mfft_whole(ctx);
+	size_t n_chunks, n_notes;
+	mfft_whole.runFFT(data_freq, n_data, data.data(), 441, 55);
+	const float* notes_output = mfft_whole.readNotes(&n_chunks, &n_notes);
+	std::vector<float> notes_whole(notes_output, notes_output + n_chunks * n_notes);
+
+	// Appending small blocks makes the ring buffer wrap around
+	MusicalFFT mfft_history(ctx);
+	std::vector<float> notes_history;
+	for (uint32_t offset = 0; offset < n_data; offset += 1000)
+	{
+		const uint32_t n_block = n_data - offset < 1000 ? n_data - offset : 1000;
+		mfft_history.appendSignal(0, n_block, data.data() + offset);
+		if (mfft_history.getHistorySize(0) < 3 + (size_t)ceil(data_freq / 55)) continue;
+
+		size_t n_new_chunks = mfft_history.runFFTOnHistory(0, data_freq, 441, 55);
+		notes_output = mfft_history.readNotes(nullptr, nullptr);
+		notes_history.insert(notes_history.end(), notes_output, notes_output + n_new_chunks * n_notes);
+	}
+
+	ASSERT_EQ(notes_whole.size(), notes_history.size());
+	for (size_t i = 0; i < notes_whole.size(); ++i)
+	{
+		EXPECT_FLOAT_EQ(notes_whole[i], notes_history[i]);
+	}
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTRawSamples)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+	const size_t n_channels = 2;
+	const float channel_weights[] = { 0.25f, 0.75f };
+
+	// Interleaved 16-bit frames and their mix as floats
+	std::vector<int16_t> frames(n_data * n_channels);
+	std::vector<float> mix(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		frames[i * n_channels] = (int16_t)(16000 * sin(i / data_freq * 2*M_PI * 440));
+		frames[i * n_channels + 1] = (int16_t)(8000 * sin(i / data_freq * 2*M_PI * 660));
+		mix[i] = (channel_weights[0] * frames[i * n_channels] + channel_weights[1] * frames[i * n_channels + 1]) / 32768;
+	}
+
+	size_t n_chunks, n_notes;
+	MusicalFFT mfft_float(ctx);
+	mfft_float.runFFT(data_freq, n_data, mix.data(), 441, 55);
+	const float* notes_output = mfft_float.readNotes(&n_chunks, &n_notes);
+	std::vector<float> notes_float(notes_output, notes_output + n_chunks * n_notes);
+
+	MusicalFFT mfft_raw(ctx);
+	ASSERT_EQ(n_chunks, mfft_raw.runFFT(data_freq, n_data, frames.data(), n_channels, channel_weights, 441, 55));
+	notes_output = mfft_raw.readNotes(nullptr, nullptr);
+	for (size_t i = 0; i < notes_float.size(); ++i)
+	{
+		EXPECT_NEAR(notes_float[i], notes_output[i], 1e-4f * notes_float[i] + 1e-9f) << i;
+	}
+
+	// The raw history wraps around and analyzes the frames once per channel
+	// weight set before they are dropped
+	std::vector<float> notes_history;
+	for (uint32_t offset = 0; offset < n_data; offset += 1000)
+	{
+		const uint32_t n_block = n_data - offset < 1000 ? n_data - offset : 1000;
+		mfft_raw.appendRawSignal(n_block, frames.data() + offset * n_channels, n_channels);
+		if (mfft_raw.getRawHistorySize() < 3 + (size_t)ceil(data_freq / 55)) continue;
+
+		const size_t history_size = mfft_raw.getRawHistorySize();
+		const float left_only[] = { 1, 0 };
+		mfft_raw.runFFTOnRawHistory(left_only, data_freq, 441, 55, false);
+		ASSERT_EQ(history_size, mfft_raw.getRawHistorySize());
+
+		size_t n_new_chunks = mfft_raw.runFFTOnRawHistory(channel_weights, data_freq, 441, 55);
+		notes_output = mfft_raw.readNotes(nullptr, nullptr);
+		notes_history.insert(notes_history.end(), notes_output, notes_output + n_new_chunks * n_notes);
+	}
+	ASSERT_EQ(notes_float.size(), notes_history.size());
+	for (size_t i = 0; i < notes_float.size(); ++i)
+	{
+		EXPECT_NEAR(notes_float[i], notes_history[i], 1e-4f * notes_float[i] + 1e-9f) << i;
+	}
+	EXPECT_THROW(mfft_raw.appendRawSignal(1, frames.data(), 1), std::runtime_error);
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTConcurrent)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100;
+
+	std::vector<float> data(n_data);
+	for (uint32_t i = 0; i < n_data; ++i)
+	{
+		data[i] = sin(i / data_freq * 2*M_PI * 440);
+	}
+
+	size_t n_chunks, n_notes;
+	MusicalFFT reference_mfft(ctx);
+	reference_mfft.runFFT(data_freq, n_data, data.data(), 441, 55);
+	const float* notes_output = reference_mfft.readNotes(&n_chunks, &n_notes);
+	std::vector<float> reference(notes_output, notes_output + n_chunks * n_notes);
+
+	// Each thread drives its own instance on the same device
+	const size_t n_threads = 4;
+	std::vector<std::vector<float> > outputs(n_threads);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < n_threads; ++t)
+	{
+		threads.push_back(std::thread([&, t]()
+		{
+			MusicalFFT mfft(ctx, t % 2 == 1);
+			for (size_t repeat = 0; repeat < 4; ++repeat)
+			{
+				mfft.runFFT(data_freq, n_data, data.data(), 441, 55);
+				const float* thread_notes = mfft.readNotes(nullptr, nullptr);
+				outputs[t].assign(thread_notes, thread_notes + n_chunks * n_notes);
+			}
+		}));
+	}
+	for (size_t t = 0; t < n_threads; ++t)
+	{
+		threads[t].join();
+		ASSERT_EQ(reference.size(), outputs[t].size());
+		for (size_t i = 0; i < reference.size(); ++i)
+		{
+			EXPECT_FLOAT_EQ(reference[i], outputs[t][i]);
+		}
+	}
+}
+
+
+TEST_F(OpenCLTest, MusicalFFTNoteEvents)
+{
+	const float data_freq = 44100;
+	const uint32_t n_data = 44100 * 2;
+
+	// An A4 for one second followed by silence
+	float* data = new float[n_data];
+	for (int i = 0; i < n_data; ++i)
+	{
+		data[i] = i < data_freq ? sin(i / data_freq * 2*M_PI * 440) : 0;
+	}
+
+	MusicalFFT mfft(ctx);
+	mfft.runFFT(data_freq, n_data, data, 441, 55);
+
+	// The A4 is three octaves above the base note
+	const uint32_t a4_note = 36;
+	NoteEventThresholds thresholds = { 1e-2f, 1e-3f, 0 };
+	size_t n_events = 0;
+	const NoteEvent* events = mfft.readNoteEvents(thresholds, &n_events);
+
+	bool seen_on = false;
+	bool seen_off = false;
+	for (size_t i = 0; i < n_events; ++i)
+	{
+		if (events[i].note != a4_note) continue;
+		if (events[i].is_note_on)
+		{
+			EXPECT_FALSE(seen_off);
+			seen_on = true;
+		}
+		else
+		{
+			EXPECT_TRUE(seen_on);
+			EXPECT_GT(events[i].chunk_index, 90);
+			seen_off = true;
+		}
+	}
+	EXPECT_TRUE(seen_on);
+	EXPECT_TRUE(seen_off);
+
+	delete[] data;
+	data = nullptr;
+}
+
+
 TEST_F(OpenCLTest, MusicalFFTRecording)
 {
 	WavFile file("../data/english_suite_4.wav");
@@ -164,6 +666,96 @@ TEST_F(OpenCLTest, MusicalFFTCompleteFile)
 }
 
 
+TEST_F(OpenCLTest, NoteProfileSegments)
+{
+	NoteProfile serial(12);
+	serial.fromWav("../data/english_suite_4.wav", 440, 200);
+
+	// Overlapping segments are stitched into the serial result
+	NoteProfile segmented(12);
+	segmented.setNumSegments(4);
+	segmented.fromWav("../data/english_suite_4.wav", 440, 200);
+
+	ASSERT_EQ(serial.getNumChunks(), segmented.getNumChunks());
+	for (size_t i = 0; i < serial.getNumChunks(); ++i)
+	{
+		ASSERT_EQ(serial.getTimestampByIndex(i), segmented.getTimestampByIndex(i));
+		for (size_t note = 0; note < serial.getNotesPerChunk(); ++note)
+		{
+			ASSERT_FLOAT_EQ(serial.getNote(i, note), segmented.getNote(i, note)) << "chunk " << i << ", note " << note;
+		}
+	}
+}
+
+
+TEST_F(OpenCLTest, NoteProfileCheckpoint)
+{
+	const std::string checkpoint_fname = "note_profile_checkpoint.mfck";
+	std::remove(checkpoint_fname.c_str());
+	NoteEventThresholds thresholds = { 1e-3f, 5e-4f, 2.0f };
+
+	NoteProfile uninterrupted(12);
+	uninterrupted.eventsFromWav("../data/english_suite_4.wav", 440, 200, thresholds);
+
+	// Stop the analysis after a few blocks
+	NoteProfile interrupted(12);
+	interrupted.setCheckpoint(checkpoint_fname);
+	size_t n_blocks = 0;
+	NoteCallbackSink failing_sink([&](const NoteStreamInfo&, const size_t, const size_t, const uint64_t*, const uint8_t*)
+	{
+		if (++n_blocks == 3) throw std::runtime_error("Interrupted");
+	});
+	EXPECT_THROW(interrupted.streamWav("../data/english_suite_4.wav", 440, 200, failing_sink, &thresholds), std::runtime_error);
+
+	// The next run replays the committed chunks and continues after them
+	interrupted.eventsFromWav("../data/english_suite_4.wav", 440, 200, thresholds);
+	std::remove(checkpoint_fname.c_str());
+
+	ASSERT_EQ(uninterrupted.getNumChunks(), interrupted.getNumChunks());
+	ASSERT_EQ(uninterrupted.getNumEvents(), interrupted.getNumEvents());
+	for (size_t i = 0; i < uninterrupted.getNumEvents(); ++i)
+	{
+		const NoteEvent* expected = uninterrupted.getEventByIndex(i);
+		const NoteEvent* actual = interrupted.getEventByIndex(i);
+		ASSERT_EQ(expected->chunk_index, actual->chunk_index) << "event " << i;
+		ASSERT_EQ(expected->note, actual->note) << "event " << i;
+		ASSERT_EQ(expected->is_note_on, actual->is_note_on) << "event " << i;
+		ASSERT_FLOAT_EQ(expected->power, actual->power) << "event " << i;
+	}
+}
+
+
+TEST_F(OpenCLTest, NoteProfileDownmix)
+{
+	NoteProfile averaged(12);
+	averaged.fromWav("../data/english_suite_4.wav", 440, 200);
+
+	// Each channel on its own, mixed down while reading
+	NoteProfile left(12);
+	left.setDownmix(true, std::vector<float> { 1.0f, 0.0f });
+	left.fromWav("../data/english_suite_4.wav", 440, 200);
+	NoteProfile right(12);
+	right.setDownmix(true, std::vector<float> { 0.0f, 1.0f });
+	right.fromWav("../data/english_suite_4.wav", 440, 200);
+
+	// Averaging the notes of the channels matches the analysis of every
+	// channel
+	ASSERT_EQ(averaged.getNumChunks(), left.getNumChunks());
+	for (size_t i = 0; i < averaged.getNumChunks(); i += 97)
+	{
+		for (size_t note = 0; note < averaged.getNotesPerChunk(); ++note)
+		{
+			const float expected = averaged.getNote(i, note);
+			ASSERT_NEAR(expected, (left.getNote(i, note) + right.getNote(i, note)) / 2, 1e-4f * expected + 1e-9f) << "chunk " << i << ", note " << note;
+		}
+	}
+
+	NoteProfile wrong_weights(12);
+	wrong_weights.setDownmix(true, std::vector<float> { 1.0f });
+	EXPECT_THROW(wrong_weights.fromWav("../data/english_suite_4.wav", 440, 200), std::runtime_error);
+}
+
+
 TEST_F(OpenCLTest, MIDI)
 {
 	MidiFile("../data/english_suite_4_ms-reduced.mid");
@@ -0,0 +1,65 @@
+#include "midi_fixture.h"
+
+#include <midi.h>
+#include <piano_roll.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+
+TEST_F(MidiTest, PianoRollRasterize)
+{
+	// 480 ticks per beat at 120 BPM: one tick is 1/960 seconds
+	std::vector<uint8_t> track;
+	appendEvent(track, 0, { 0x90, 60, 100 });
+	appendEvent(track, 960, { 0x90, 64, 100 });
+	appendEvent(track, 960, { 0x80, 60, 0 });
+	appendEvent(track, 480, { 0x80, 64, 0 });
+	appendEvent(track, 0, { 0x90, 67, 100 });
+	MidiFile midi(writeMidiFile(0, 480, { track }));
+
+	// Frames every 0.25 seconds from the base note C4
+	PianoRoll roll(midi, 60, 12, 0, 0.25, 16);
+	ASSERT_EQ(16, roll.getNumFrames());
+	for (size_t i = 0; i < 16; ++i)
+	{
+		EXPECT_EQ(i < 8, roll.isActive(i, 0)) << i;
+		EXPECT_EQ(i >= 4 && i < 10, roll.isActive(i, 4)) << i;
+		EXPECT_EQ(i >= 10, roll.isActive(i, 7)) << i;
+		EXPECT_FALSE(roll.isActive(i, 1));
+	}
+}
+
+
+TEST(TranscriptionScore, MatchesScalarCount)
+{
+	const size_t n_frames = 1000;
+	const size_t n_notes = 108;
+	std::vector<float> notes(n_frames * n_notes);
+	std::vector<uint8_t> roll(n_frames * n_notes);
+	for (size_t i = 0; i < notes.size(); ++i)
+	{
+		notes[i] = (float)((i * 7919) % 1000) / 1000;
+		roll[i] = (i * 104729) % 3 == 0;
+	}
+
+	std::vector<float> thresholds { 0.1f, 0.5f, 0.9f };
+	std::vector<TranscriptionScore> scores = scoreTranscription(notes.data(), roll.data(), n_frames, n_notes, thresholds, 3);
+	ASSERT_EQ(thresholds.size(), scores.size());
+
+	for (size_t t = 0; t < thresholds.size(); ++t)
+	{
+		uint64_t tp = 0, fp = 0, fn = 0;
+		for (size_t i = 0; i < notes.size(); ++i)
+		{
+			bool detected = notes[i] > thresholds[t];
+			tp += detected && roll[i];
+			fp += detected && !roll[i];
+			fn += !detected && roll[i];
+		}
+		EXPECT_EQ(tp, scores[t].true_positives);
+		EXPECT_EQ(fp, scores[t].false_positives);
+		EXPECT_EQ(fn, scores[t].false_negatives);
+	}
+}
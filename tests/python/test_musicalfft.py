@@ -0,0 +1,271 @@
+"""Tests of the musicalfft extension module that run without an OpenCL device
+
+Run with the directory of the built module on the path, e.g. from the build
+directory: cmake --build . --target musicalfft-python-tests
+"""
+
+import array
+import os
+import shutil
+import struct
+import tempfile
+import unittest
+import wave
+
+import musicalfft
+
+
+NOTE_FILE_MAGIC = 0x504e464d
+NOTE_FILE_VERSION = 1
+NOTE_FILE_BLOCK_NOTES = 1
+NOTE_FILE_BLOCK_EVENTS = 2
+NOTE_FILE_BLOCK_TIMESTAMPS = 3
+LAYOUT_CHUNK_MAJOR = 0
+
+
+def write_wav(path, frames, sample_rate=8000):
+    """Write 16-bit frames, a list of tuples with a sample per channel"""
+    with wave.open(path, "wb") as output:
+        output.setnchannels(len(frames[0]))
+        output.setsampwidth(2)
+        output.setframerate(sample_rate)
+        output.writeframes(b"".join(struct.pack("<%dh" % len(frame), *frame) for frame in frames))
+
+
+def write_note_file(path, n_notes, timestamps, notes=None, events=()):
+    """Write a note file like a NoteFileSink with 32-bit float notes; without
+    notes, only the timestamps are written, as for an analysis of events
+    """
+    with open(path, "wb") as output:
+        output.write(struct.pack("<IIiIIIQQ", NOTE_FILE_MAGIC, NOTE_FILE_VERSION, 21, musicalfft.PRECISION_FLOAT32, n_notes, LAYOUT_CHUNK_MAJOR, 8000, 100))
+        block_type = NOTE_FILE_BLOCK_NOTES if notes is not None else NOTE_FILE_BLOCK_TIMESTAMPS
+        output.write(struct.pack("<IIQ", block_type, len(timestamps), 0))
+        output.write(struct.pack("<%dQ" % len(timestamps), *timestamps))
+        if notes is not None:
+            for row in notes:
+                output.write(struct.pack("<%df" % n_notes, *row))
+        if events:
+            output.write(struct.pack("<IIQ", NOTE_FILE_BLOCK_EVENTS, len(events), events[0][0]))
+            for event in events:
+                output.write(struct.pack("<IIIf", *event))
+
+
+class TempDirTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.directory)
+
+    def path(self, name):
+        return os.path.join(self.directory, name)
+
+
+class WavFileTest(TempDirTest):
+    def setUp(self):
+        super().setUp()
+        self.frames = [(i * 37 % 65536 - 32768, -i) for i in range(1000)]
+        self.fname = self.path("stereo.wav")
+        write_wav(self.fname, self.frames)
+
+    def test_read(self):
+        wav = musicalfft.WavFile(self.fname)
+        self.assertEqual(2, wav.n_channels)
+        self.assertEqual(8000, wav.sample_rate)
+
+        # One row per channel; the end of the file is shorter
+        first = memoryview(wav.read(600))
+        self.assertEqual((2, 600), first.shape)
+        self.assertEqual("f", first.format)
+        second = memoryview(wav.read(600))
+        self.assertEqual((2, 400), second.shape)
+        self.assertEqual(0, wav.samples_remaining)
+
+        for channel in range(2):
+            samples = first.tolist()[channel] + second.tolist()[channel]
+            self.assertEqual([frame[channel] / 32768 for frame in self.frames], samples)
+
+    def test_readinto(self):
+        wav = musicalfft.WavFile(self.fname)
+        self.assertEqual(100, wav.skip(100))
+        output = array.array("f", bytes(4 * 2 * 500))
+        self.assertEqual(500, wav.readinto(output))
+        self.assertEqual([frame[0] / 32768 for frame in self.frames[100:600]], output[:500].tolist())
+        self.assertEqual([frame[1] / 32768 for frame in self.frames[100:600]], output[500:].tolist())
+
+        # Only writable buffers of 32-bit floats are written to
+        with self.assertRaises(TypeError):
+            wav.readinto(array.array("d", bytes(8 * 2 * 10)))
+        with self.assertRaises(BufferError):
+            wav.readinto(array.array("f", bytes(8)).tobytes())
+
+
+class NoteProfileTest(TempDirTest):
+    def setUp(self):
+        super().setUp()
+        self.n_notes = 6
+        self.timestamps = [50 + 100 * i for i in range(5)]
+        self.notes = [[float(i * 10 + note) for note in range(self.n_notes)] for i in range(5)]
+        self.events = [(1, 3, 1, 0.5), (4, 3, 0, 0.25)]
+        self.fname = self.path("notes.mfnp")
+        write_note_file(self.fname, self.n_notes, self.timestamps, self.notes, self.events)
+
+    def test_arrays(self):
+        profile = musicalfft.NoteProfile(21)
+        profile.load_notes(self.fname)
+        self.assertEqual(5, profile.n_chunks)
+
+        notes = memoryview(profile.notes)
+        self.assertEqual((5, self.n_notes), notes.shape)
+        self.assertEqual((4 * self.n_notes, 4), notes.strides)
+        self.assertEqual("f", notes.format)
+        self.assertTrue(notes.readonly)
+        self.assertTrue(notes.c_contiguous)
+        self.assertEqual(self.notes, notes.tolist())
+        self.assertEqual((5, self.n_notes), profile.notes.shape)
+
+        timestamps = memoryview(profile.timestamps)
+        self.assertEqual("Q", timestamps.format)
+        self.assertEqual(self.timestamps, timestamps.tolist())
+
+        events = memoryview(profile.events)
+        self.assertEqual((2,), events.shape)
+        self.assertEqual("IIIf", events.format)
+        self.assertEqual(16, events.itemsize)
+        self.assertEqual(self.events, [struct.unpack("IIIf", bytes(events[i:i + 1])) for i in range(2)])
+
+        # Views of the profile are read-only
+        with self.assertRaises(TypeError):
+            notes[0, 0] = 1.0
+
+    def test_export_while_modifying(self):
+        profile = musicalfft.NoteProfile(21)
+        profile.load_notes(self.fname)
+        notes = memoryview(profile.notes)
+
+        # The memory cannot change while a view of it exists
+        with self.assertRaises(BufferError):
+            profile.set_resampling(False)
+        with self.assertRaises(BufferError):
+            profile.load_notes(self.fname)
+        with self.assertRaises(BufferError):
+            profile.__init__(21)
+        self.assertEqual(self.notes, notes.tolist())
+
+        notes.release()
+        profile.set_resampling(False)
+        profile.__init__(21)
+        self.assertEqual(0, profile.n_chunks)
+
+    def test_busy_guard(self):
+        profile = musicalfft.NoteProfile(21)
+        profile.load_notes(self.fname)
+        errors = []
+
+        def weights():
+            # The conversion of the weights runs while the profile is in use
+            for use in (lambda: profile.set_resampling(True), lambda: profile.__init__(21), lambda: profile.notes, lambda: profile.n_chunks, lambda: profile.load_notes(self.fname)):
+                try:
+                    use()
+                except RuntimeError as e:
+                    errors.append(str(e))
+            yield 1.0
+
+        profile.set_downmix(True, weights())
+        self.assertEqual(5, len(errors))
+        self.assertTrue(all("in use" in error for error in errors))
+
+        # The profile is usable again afterwards
+        self.assertEqual(5, profile.n_chunks)
+        profile.set_resampling(True)
+
+    def test_query_range(self):
+        profile = musicalfft.NoteProfile(21)
+        profile.set_pyramid(True)
+        profile.load_notes(self.fname)
+        self.assertEqual([sum(row[note] for row in self.notes[1:4]) for note in range(self.n_notes)], memoryview(profile.query_range(1, 4)).tolist())
+        self.assertEqual(self.notes[4], memoryview(profile.query_range(2, 5, "max")).tolist())
+        with self.assertRaises(IndexError):
+            profile.query_range(3, 3)
+
+        # Queries fail while the profile is in use
+        errors = []
+
+        def weights():
+            try:
+                profile.query_range(0, 5)
+            except RuntimeError as e:
+                errors.append(str(e))
+            yield 1.0
+
+        profile.set_downmix(True, weights())
+        self.assertEqual(1, len(errors))
+        self.assertIn("in use", errors[0])
+
+    def test_index_guard(self):
+        profile = musicalfft.NoteProfile(21)
+        profile.load_notes(self.fname)
+        index = musicalfft.NoteIndex(shingle_size=2)
+        errors = []
+
+        def weights():
+            # The index cannot read the profile while it is in use
+            for use in (lambda: index.add_profile(profile), lambda: index.search_chunk(profile, 0)):
+                try:
+                    use()
+                except RuntimeError as e:
+                    errors.append(str(e))
+            yield 1.0
+
+        profile.set_downmix(True, weights())
+        self.assertEqual(2, len(errors))
+        self.assertTrue(all("in use" in error for error in errors))
+
+        # Afterwards the profile is indexed and found
+        self.assertEqual(0, index.add_profile(profile))
+        index.build()
+        self.assertEqual((0, 1), index.search_chunk(profile, 1, 1)[0][:2])
+
+    def test_notes_of_events(self):
+        # An analysis of events has timestamps but no notes
+        fname = self.path("events.mfnp")
+        write_note_file(fname, self.n_notes, self.timestamps, None, self.events)
+        profile = musicalfft.NoteProfile(21)
+        profile.load_notes(fname)
+        self.assertEqual(5, profile.n_chunks)
+        self.assertEqual((0, self.n_notes), memoryview(profile.notes).shape)
+        self.assertEqual([], memoryview(profile.notes).tolist())
+        self.assertEqual(self.timestamps, memoryview(profile.timestamps).tolist())
+        self.assertEqual((2,), memoryview(profile.events).shape)
+
+        # A new profile has nothing
+        empty = musicalfft.NoteProfile(21)
+        self.assertEqual((0, empty.notes_per_chunk), memoryview(empty.notes).shape)
+        self.assertEqual((0,), memoryview(empty.timestamps).shape)
+        self.assertEqual((0,), memoryview(empty.events).shape)
+
+    def test_events_from_wav(self):
+        try:
+            musicalfft.MusicalFFT()
+        except RuntimeError:
+            self.skipTest("No OpenCL device")
+        fname = self.path("mono.wav")
+        write_wav(fname, [(int(8000 * ((i // 20) % 2 - 0.5)),) for i in range(44100)], 44100)
+        profile = musicalfft.NoteProfile(21)
+        profile.events_from_wav(fname, 440, 441, 1e-3, 5e-4, 2.0)
+        self.assertLess(0, profile.n_chunks)
+        self.assertEqual((0, profile.notes_per_chunk), memoryview(profile.notes).shape)
+
+    def test_invalid_note_file(self):
+        fname = self.path("invalid.mfnp")
+        with open(fname, "wb") as output:
+            output.write(b"not a note file" * 4)
+        profile = musicalfft.NoteProfile(21)
+        with self.assertRaises(RuntimeError):
+            profile.load_notes(fname)
+        with self.assertRaises(RuntimeError):
+            profile.load_notes(self.path("missing.mfnp"))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,171 @@
+#include "midi_fixture.h"
+
+#include <midi.h>
+#include <score_alignment.h>
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <vector>
+
+
+/*! Chroma of a sequence of segments: segment s sounds pitch classes s % 12 and
+ *  (s * 5) % 12; each segment of the score lasts score_length frames, and the
+ *  performance plays it for a varying number of frames
+ */
+static void makeWarpedSequences(const size_t n_segments, const size_t score_length, std::vector<float>* score, std::vector<float>* performance, std::vector<size_t>* performance_starts)
+{
+	score->clear();
+	performance->clear();
+	performance_starts->clear();
+	for (size_t s = 0; s < n_segments; ++s)
+	{
+		std::vector<float> chroma(12, 0.0f);
+		chroma[s % 12] = 1.0f;
+		chroma[(s * 5 + 3) % 12] += 0.5f;
+		for (size_t i = 0; i < score_length; ++i)
+		{
+			score->insert(score->end(), chroma.begin(), chroma.end());
+		}
+
+		// Between half and twice the length of the score
+		const size_t performance_length = score_length * (2 + (s * 7) % 7) / 4;
+		performance_starts->push_back(performance->size() / 12);
+		for (size_t i = 0; i < performance_length; ++i)
+		{
+			performance->insert(performance->end(), chroma.begin(), chroma.end());
+		}
+	}
+}
+
+
+/*! Full O(N * M) dynamic time warping for reference */
+static float alignFull(const std::vector<float>& score, const std::vector<float>& performance)
+{
+	const size_t n = score.size() / 12;
+	const size_t m = performance.size() / 12;
+	std::vector<float> costs((n + 1) * (m + 1), INFINITY);
+	costs[0] = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (size_t j = 0; j < m; ++j)
+		{
+			float dot = 0, norm_a = 0, norm_b = 0;
+			for (size_t k = 0; k < 12; ++k)
+			{
+				dot += score[i * 12 + k] * performance[j * 12 + k];
+				norm_a += score[i * 12 + k] * score[i * 12 + k];
+				norm_b += performance[j * 12 + k] * performance[j * 12 + k];
+			}
+			const float cost = 1 - dot / sqrtf(norm_a * norm_b);
+			const float best = std::min(costs[i * (m + 1) + j], std::min(costs[i * (m + 1) + j + 1], costs[(i + 1) * (m + 1) + j]));
+			costs[(i + 1) * (m + 1) + j + 1] = best + cost;
+		}
+	}
+	return costs[n * (m + 1) + m];
+}
+
+
+TEST(ScoreAlignment, MatchesFullDTW)
+{
+	std::vector<float> score, performance;
+	std::vector<size_t> starts;
+	makeWarpedSequences(13, 5, &score, &performance, &starts);
+
+	// A radius that covers the matrix leaves nothing out
+	AlignmentParams params = AlignmentParams::getDefault();
+	params.constraint = ALIGNMENT_SAKOE_CHIBA;
+	params.radius = performance.size();
+	float cost = 0;
+	const std::vector<AlignmentStep> path = alignSequences(score.data(), score.size() / 12, performance.data(), performance.size() / 12, 12, params, &cost);
+	EXPECT_NEAR(alignFull(score, performance), cost, 1e-4f);
+
+	ASSERT_FALSE(path.empty());
+	EXPECT_EQ(0, path.front().score_frame);
+	EXPECT_EQ(0, path.front().profile_chunk);
+	EXPECT_EQ(score.size() / 12 - 1, path.back().score_frame);
+	EXPECT_EQ(performance.size() / 12 - 1, path.back().profile_chunk);
+	for (size_t s = 1; s < path.size(); ++s)
+	{
+		const uint32_t score_step = path[s].score_frame - path[s - 1].score_frame;
+		const uint32_t profile_step = path[s].profile_chunk - path[s - 1].profile_chunk;
+		ASSERT_TRUE(score_step <= 1 && profile_step <= 1 && score_step + profile_step > 0) << s;
+	}
+}
+
+
+TEST(ScoreAlignment, MultiScaleFindsSegments)
+{
+	std::vector<float> score, performance;
+	std::vector<size_t> starts;
+	makeWarpedSequences(400, 8, &score, &performance, &starts);
+	const size_t n_score = score.size() / 12;
+	const size_t n_performance = performance.size() / 12;
+
+	const AlignmentConstraint constraints[] = { ALIGNMENT_MULTI_SCALE, ALIGNMENT_SAKOE_CHIBA };
+	for (const AlignmentConstraint constraint : constraints)
+	{
+		AlignmentParams params = AlignmentParams::getDefault();
+		params.constraint = constraint;
+		params.radius = constraint == ALIGNMENT_MULTI_SCALE ? 4 : 400;
+		const std::vector<AlignmentStep> path = alignSequences(score.data(), n_score, performance.data(), n_performance, 12, params);
+
+		// The first frame of every segment of the score meets the start of
+		// the segment in the performance
+		size_t n_misaligned = 0;
+		size_t step = 0;
+		for (size_t s = 0; s < starts.size(); ++s)
+		{
+			while (path[step].score_frame < s * 8) ++step;
+			n_misaligned += path[step].profile_chunk != starts[s];
+		}
+		EXPECT_EQ(0, n_misaligned) << constraint;
+	}
+}
+
+
+TEST_F(MidiTest, ScoreAlignmentOfProfile)
+{
+	// Quarter notes at 120 BPM that walk up the C major scale
+	const uint8_t scale[] = { 60, 62, 64, 65, 67, 69, 71, 72 };
+	std::vector<uint8_t> track;
+	for (size_t i = 0; i < 8; ++i)
+	{
+		appendEvent(track, 0, { 0x90, scale[i], 100 });
+		appendEvent(track, 480, { 0x80, scale[i], 0 });
+	}
+	MidiFile midi(writeMidiFile(0, 480, { track }));
+
+	// The performance holds the first four notes twice as long, with chunks
+	// of 0.1 seconds
+	NoteProfile profile(0);
+	const size_t n_notes = 24;
+	const NoteStreamInfo info = { 60, NOTE_PRECISION_FLOAT32, NOTE_LAYOUT_CHUNK_MAJOR, n_notes, 1000, 100, 0 };
+	profile.begin(info);
+	std::vector<uint64_t> timestamps;
+	std::vector<float> notes;
+	std::vector<size_t> starts;
+	for (size_t i = 0; i < 8; ++i)
+	{
+		starts.push_back(timestamps.size());
+		const size_t n_chunks = i < 4 ? 10 : 5;
+		for (size_t c = 0; c < n_chunks; ++c)
+		{
+			timestamps.push_back(timestamps.size() * 100);
+			std::vector<float> chunk(n_notes, 1e-4f);
+			chunk[scale[i] - 60] = 1.0f;
+			chunk[scale[i] - 48] = 0.25f;
+			notes.insert(notes.end(), chunk.begin(), chunk.end());
+		}
+	}
+	profile.writeNotes(0, timestamps.size(), timestamps.data(), reinterpret_cast<const uint8_t*>(notes.data()));
+	profile.end();
+
+	const ScoreAlignment alignment = alignScore(midi, profile);
+	EXPECT_DOUBLE_EQ(0.1, alignment.seconds_per_frame);
+	for (size_t i = 0; i < 8; ++i)
+	{
+		EXPECT_EQ(starts[i], alignment.getProfileChunk(i * 0.5)) << i;
+	}
+	EXPECT_EQ(profile.getNumChunks() - 1, alignment.path.back().profile_chunk);
+}
@@ -2,6 +2,9 @@
 
 #include <gtest/gtest.h>
 
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <math.h>
 #include <vector>
 
 
@@ -20,4 +23,76 @@ TEST(WavFile, BasicRead)
 	buffer_left = nullptr;
 	delete[] buffer_right;
 	buffer_right = nullptr;
-}
\ No newline at end of file
+}
+
+/*! Write a 16-bit stereo WAV file whose left samples count up from 0 and whose
+ *  right samples count down
+ */
+static void writeCountingWav(const std::string& fname, const int16_t n_samples)
+{
+	std::ofstream ost(fname, std::ios::binary);
+	const uint32_t data_size = n_samples * 4;
+	const uint32_t header[] = { 0x46464952, 36 + data_size, 0x45564157, 0x20746d66, 16, 0x00020001, 44100, 44100 * 4, 0x00100004, 0x61746164, data_size };
+	ost.write(reinterpret_cast<const char*>(header), sizeof(header));
+	for (int16_t i = 0; i < n_samples; ++i)
+	{
+		const int16_t frame[] = { i, (int16_t)-i };
+		ost.write(reinterpret_cast<const char*>(frame), sizeof(frame));
+	}
+}
+
+
+TEST(WavFile, Skip)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	writeCountingWav(path.string(), 1000);
+
+	WavFile file(path.string());
+	EXPECT_EQ(16, file.getBitsPerSample());
+	EXPECT_EQ(1000, file.getNumSamplesRemaining());
+	EXPECT_EQ(300, file.skipSamples(300));
+	EXPECT_EQ(700, file.getNumSamplesRemaining());
+
+	int16_t samples[4];
+	EXPECT_EQ(2, file.readRawSamples(2, samples));
+	EXPECT_EQ(300, samples[0]);
+	EXPECT_EQ(-301, samples[3]);
+
+	// Skipping past the end stops at the end
+	EXPECT_EQ(698, file.skipSamples(5000));
+	EXPECT_EQ(0, file.getNumSamplesRemaining());
+	EXPECT_EQ(0, file.readRawSamples(2, samples));
+	boost::filesystem::remove(path);
+}
+
+
+TEST(WavFile, ReadMixed)
+{
+	const boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	writeCountingWav(path.string(), 1000);
+
+	// Vectors and the samples after the last full vector
+	WavFile file(path.string());
+	EXPECT_EQ(3, file.skipSamples(3));
+	std::vector<float> mix(1000);
+	EXPECT_EQ(997, file.readMixedSamples(1000, std::vector<float> { 0.75f, 0.25f }, mix.data()));
+	size_t n_mismatches = 0;
+	for (size_t i = 0; i < 997; ++i)
+	{
+		n_mismatches += fabsf(mix[i] - 0.5f * (i + 3) / 32768.0f) > 1e-6f;
+	}
+	EXPECT_EQ(0, n_mismatches);
+	EXPECT_EQ(0, file.getNumSamplesRemaining());
+
+	// The fused mix agrees with mixing the converted channels
+	WavFile channel_file(path.string());
+	std::vector<float> left(1000), right(1000), channel_mix(1000);
+	std::vector<float*> channels { left.data(), right.data() };
+	EXPECT_EQ(1000, channel_file.readSamples(1000, channels));
+	AudioReader::mixChannels(1000, channels, std::vector<float> { 0.75f, 0.25f }, channel_mix.data());
+	EXPECT_FLOAT_EQ(channel_mix[3], mix[0]);
+	EXPECT_FLOAT_EQ(channel_mix[999], mix[996]);
+
+	EXPECT_THROW(file.readMixedSamples(1, std::vector<float> { 1.0f }, mix.data()), std::runtime_error);
+	boost::filesystem::remove(path);
+}